@@ -0,0 +1,151 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+#include "alloc.h"
+
+#include "metrics.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+
+using namespace std;
+
+Arena arena;
+
+bool Arena::Init(size_t size)
+{
+  void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+  if (p == MAP_FAILED) {
+    perror("arena mmap");
+    return false;
+  }
+  base_ = (uint8_t*)p;
+  size_ = size;
+  used_ = 0;
+  return true;
+}
+
+void* Arena::Alloc(size_t size, size_t align)
+{
+  size_t start = (used_ + align - 1) & ~(align - 1);
+  if (base_ == NULL || start + size > size_) {
+    fprintf(stderr, "arena: %zu bytes requested, %zu of %zu used\n", size, used_, size_);
+    return NULL;
+  }
+  used_ = start + size;
+  return base_ + start;
+}
+
+#ifdef ALLOC_GUARD
+
+#ifndef __GLIBC__
+#error "ALLOC_GUARD hooks the glibc allocator"
+#endif
+
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t nmemb, size_t size);
+extern "C" void* __libc_realloc(void* ptr, size_t size);
+extern "C" void  __libc_free(void* ptr);
+
+static std::atomic<int> guard_mode(ALLOC_GUARD_OFF);
+static __thread bool guarded = false;
+
+static void Check()
+{
+  if (!guarded) {
+    return;
+  }
+  int mode = guard_mode.load(memory_order_relaxed);
+  if (mode == ALLOC_GUARD_OFF) {
+    return;
+  }
+  Inc(metrics.heap_allocs);
+  if (mode == ALLOC_GUARD_ABORT) {
+    // No stdio, it may allocate
+    static const char msg[] = "alloc guard: heap allocation after init\n";
+    ssize_t ret = write(STDERR_FILENO, msg, sizeof(msg) - 1);
+    (void)ret;
+    abort();
+  }
+}
+
+extern "C" void* malloc(size_t size)
+{
+  Check();
+  return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t nmemb, size_t size)
+{
+  Check();
+  return __libc_calloc(nmemb, size);
+}
+
+extern "C" void* realloc(void* ptr, size_t size)
+{
+  Check();
+  return __libc_realloc(ptr, size);
+}
+
+extern "C" void free(void* ptr)
+{
+  __libc_free(ptr);
+}
+
+bool AllocGuardAvailable()
+{
+  return true;
+}
+
+void AllocGuardArm(AllocGuardMode_t mode)
+{
+  guarded = true;
+  guard_mode = mode;
+}
+
+void AllocGuardThread()
+{
+  guarded = true;
+}
+
+void AllocGuardDisarm()
+{
+  guard_mode = ALLOC_GUARD_OFF;
+}
+
+#else
+
+bool AllocGuardAvailable()
+{
+  return false;
+}
+
+void AllocGuardArm(AllocGuardMode_t mode)
+{
+}
+
+void AllocGuardThread()
+{
+}
+
+void AllocGuardDisarm()
+{
+}
+
+#endif
+
+uint64_t AllocGuardCount()
+{
+  return metrics.heap_allocs.load(memory_order_relaxed);
+}
@@ -0,0 +1,82 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+// Static allocation support.
+//
+// The arena is one block mapped and prefaulted at startup, sized from the
+// configuration, that holds everything whose size is only known then (the
+// frame queue). It is never freed and never grows.
+//
+// The allocation guard proves the steady state does not use the heap: once
+// armed, every malloc(), calloc(), realloc() and operator new from a guarded
+// thread (the event loop and the radio thread, not the metrics server) is
+// counted in metrics.heap_allocs or aborts the process. The hooks replace
+// the glibc entry points and are only built with -DALLOC_GUARD
+// (make ALLOC_GUARD=1); without it arming the guard does nothing.
+
+#ifndef _ALLOC_H
+#define _ALLOC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <new>
+
+class Arena
+{
+public:
+    Arena() : base_(NULL), size_(0), used_(0) {}
+
+    // Map and prefault size bytes, returns false on error
+    bool Init(size_t size);
+
+    // Carve out size bytes, NULL once the arena is exhausted
+    void* Alloc(size_t size, size_t align = 16);
+
+    template<class T>
+    T* New(size_t count)
+    {
+        void* p = Alloc(count * sizeof(T), alignof(T) > 16 ? alignof(T) : 16);
+        return p != NULL ? new (p) T[count] : NULL;
+    }
+
+    size_t size() const { return size_; }
+    size_t used() const { return used_; }
+
+private:
+    uint8_t* base_;
+    size_t size_;
+    size_t used_;
+};
+
+extern Arena arena;
+
+typedef enum {
+    ALLOC_GUARD_OFF,
+    ALLOC_GUARD_COUNT,    // count heap allocations after init
+    ALLOC_GUARD_ABORT     // abort on the first one
+} AllocGuardMode_t;
+
+// False when built without -DALLOC_GUARD
+bool AllocGuardAvailable();
+
+// Arm the guard and guard the calling thread
+void AllocGuardArm(AllocGuardMode_t mode);
+
+// Guard the calling thread as well
+void AllocGuardThread();
+
+void AllocGuardDisarm();
+
+// Guarded allocations so far
+uint64_t AllocGuardCount();
+
+#endif
@@ -0,0 +1,113 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+#include "backend.h"
+
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <cstdio>
+
+#define BACKEND_BACKOFF_MIN     1000    // ms
+#define BACKEND_BACKOFF_MAX     60000
+
+BackendThread::BackendThread(const char* name, const std::string& address, uint16_t port)
+  : address_(address), port_(port), stop_(false), ready_(false), name_(name), metrics_(NULL)
+{
+  wake_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+BackendThread::~BackendThread()
+{
+  Stop();
+  if (wake_ != -1) {
+    close(wake_);
+  }
+}
+
+bool BackendThread::StartThread()
+{
+  if (running() || wake_ == -1) {
+    return false;
+  }
+  stop_ = false;
+  thread_ = std::thread(&BackendThread::Run, this);
+  return true;
+}
+
+void BackendThread::Stop()
+{
+  if (!running()) {
+    return;
+  }
+  stop_ = true;
+  Wake();
+  thread_.join();
+}
+
+void BackendThread::Wake()
+{
+  uint64_t one = 1;
+  ssize_t ret = write(wake_, &one, sizeof(one));
+  (void)ret;
+}
+
+void BackendThread::ClearWake()
+{
+  uint64_t count;
+  ssize_t ret = read(wake_, &count, sizeof(count));
+  (void)ret;
+}
+
+void BackendThread::Count(Counter ServerMetrics::*field)
+{
+  ServerMetrics* server_metrics = metrics_.load();
+  if (server_metrics != NULL) {
+    Inc(server_metrics->*field);
+  }
+}
+
+bool BackendThread::Wait(int ms)
+{
+  struct pollfd pfd = { wake_, POLLIN, 0 };
+  while (!stop_ && poll(&pfd, 1, ms) == 1) {
+    ClearWake();
+  }
+  return !stop_;
+}
+
+void BackendThread::Run()
+{
+  int backoff = BACKEND_BACKOFF_MIN;
+  bool was_connected = false;
+  while (!stop_) {
+    if (Connect()) {
+      if (was_connected) {
+        Count(&ServerMetrics::reconnects);
+      }
+      was_connected = true;
+      backoff = BACKEND_BACKOFF_MIN;
+      Serve();
+      ready_ = false;
+      if (!stop_) {
+        printf("%s: connection to %s:%hu lost\n", name_, address_.c_str(), port_);
+        fflush(stdout);
+      }
+    }
+    Disconnect();
+    fflush(stderr);
+    if (stop_ || !Wait(backoff)) {
+      break;
+    }
+    backoff = backoff * 2 < BACKEND_BACKOFF_MAX ? backoff * 2 : BACKEND_BACKOFF_MAX;
+  }
+}
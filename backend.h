@@ -0,0 +1,148 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+// What the Basics Station and MQTT backends share: an I/O thread per
+// server that connects, serves the connection until it is lost, and
+// connects again after a backoff of 1 s doubling to 60 s.
+//
+// The event loop hands items over through a bounded queue that never
+// blocks or allocates: when it is full the item is dropped and counted.
+// Items arriving while the thread is not connected are dropped too, and so
+// is whatever is still queued when a new connection is made, a late uplink
+// is of no use to the network server.
+
+#ifndef _BACKEND_H
+#define _BACKEND_H
+
+#include "metrics.h"
+#include "ring.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <atomic>
+#include <new>
+#include <string>
+#include <thread>
+
+class BackendThread
+{
+public:
+    // Derived destructors call Stop(), the thread runs their Serve()
+    virtual ~BackendThread();
+
+    // Stop and join the I/O thread, waits for a connect in progress
+    void Stop();
+    bool running() const { return thread_.joinable(); }
+
+    // Counters of the server, set again when the server table changes
+    void SetMetrics(ServerMetrics* server_metrics) { metrics_.store(server_metrics); }
+
+    // Connected and taking items
+    bool connected() const { return ready_.load(std::memory_order_relaxed); }
+    const std::string& address() const { return address_; }
+    uint16_t port() const { return port_; }
+
+protected:
+    // name prefixes the log lines
+    BackendThread(const char* name, const std::string& address, uint16_t port);
+
+    // Start the I/O thread, false if it is already running
+    bool StartThread();
+
+    // One connection attempt, true when connected. Serve() then runs until
+    // the connection is lost or Stop(), setting ready_ once items can go
+    // out, and Disconnect() cleans up after every attempt.
+    virtual bool Connect() = 0;
+    virtual void Serve() = 0;
+    virtual void Disconnect() = 0;
+
+    // Sleep ms unless stopped, returns false when stopped
+    bool Wait(int ms);
+
+    // Event loop side: wake up the thread
+    void Wake();
+
+    // Thread side: wake_ was readable, reset it
+    void ClearWake();
+
+    void Count(Counter ServerMetrics::*field);
+
+    std::string address_;
+    uint16_t port_;
+    std::atomic<bool> stop_;
+    std::atomic<bool> ready_;
+    int wake_;                  // eventfd, items queued or Stop()
+
+private:
+    void Run();
+
+    const char* name_;
+    std::thread thread_;
+    std::atomic<ServerMetrics*> metrics_;
+};
+
+// A backend taking items of type T, depth of them queued at most
+template<class T>
+class Backend : public BackendThread
+{
+public:
+    // Event loop side: queue an item, false and counted when full
+    bool Queue(const T& item)
+    {
+        if (!ready_.load(std::memory_order_relaxed) || !queue_->Push(item)) {
+            Count(&ServerMetrics::send_errors);
+            return false;
+        }
+        Wake();
+        return true;
+    }
+
+protected:
+    Backend(const char* name, const std::string& address, uint16_t port, size_t depth)
+      : BackendThread(name, address, port)
+    {
+        slots_ = new T[depth];
+        // operator new only aligns to 16 before C++17, the ring wants 64
+        void* ring = NULL;
+        if (posix_memalign(&ring, alignof(SpscRing<T>), sizeof(SpscRing<T>)) != 0) {
+            delete[] slots_;
+            throw std::bad_alloc();
+        }
+        queue_ = new (ring) SpscRing<T>();
+        queue_->Init(slots_, depth);
+    }
+
+    ~Backend()
+    {
+        queue_->~SpscRing();
+        free(queue_);
+        delete[] slots_;
+    }
+
+    // Thread side, false when the queue is empty
+    bool Pop(T* p_item) { return queue_->Pop(p_item); }
+
+    // Drop what was queued before the connection, counted
+    void DropStale()
+    {
+        T item;
+        while (queue_->Pop(&item)) {
+            Count(&ServerMetrics::send_errors);
+        }
+    }
+
+private:
+    T* slots_;
+    SpscRing<T>* queue_;
+};
+
+#endif
@@ -0,0 +1,278 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+// Microbenchmarks of the uplink hot path, no radio needed.
+// Prints one JSON document on stdout, so runs can be diffed across commits:
+//   make bench_uplink && ./bench_uplink > bench.json
+
+#include "alloc.h"
+#include "base64.h"
+#include "uplink.h"
+
+#include <rapidjson/filewritestream.h>
+#include <rapidjson/prettywriter.h>
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#ifndef BENCH_REVISION
+#define BENCH_REVISION "unknown"
+#endif
+
+using namespace std;
+
+using namespace rapidjson;
+
+/*******************************************************************************
+ *
+ * Harness
+ *
+ *******************************************************************************/
+
+// Minimum measured time per kernel
+static const uint64_t MIN_TIME_NS = 200000000;
+
+struct Result
+{
+  const char* name;
+  int size;
+  uint64_t iterations;
+  double ns_per_op;
+  double allocs_per_op;
+};
+
+static vector<Result> results;
+
+// Keeps the compiler from dropping kernel results
+static volatile int sink;
+
+static uint64_t NanosNow()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Run f in batches, doubling them until one batch lasts MIN_TIME_NS
+template<class F>
+static void Run(const char* name, int size, F f)
+{
+  for (int i = 0; i < 16; i++) {
+    sink = f();
+  }
+
+  uint64_t iterations = 16;
+  for (;;) {
+    uint64_t a0 = AllocGuardCount();
+    uint64_t t0 = NanosNow();
+    for (uint64_t i = 0; i < iterations; i++) {
+      sink = f();
+    }
+    uint64_t elapsed = NanosNow() - t0;
+    uint64_t a = AllocGuardCount() - a0;
+
+    if (elapsed >= MIN_TIME_NS || iterations >= (1ULL << 40)) {
+      Result r = { name, size, iterations, (double)elapsed / iterations, (double)a / iterations };
+      results.push_back(r);
+      fprintf(stderr, "%-14s %4d %12.1f ns/op %8.2f allocs/op\n", name, size, r.ns_per_op, r.allocs_per_op);
+      return;
+    }
+    iterations *= 2;
+  }
+}
+
+/*******************************************************************************
+ *
+ * Loopback network server, drains what SendUdp sends
+ *
+ *******************************************************************************/
+
+static int sink_sock = -1;
+
+static uint16_t StartSink()
+{
+  sink_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (sink_sock == -1) {
+    perror("socket");
+    exit(EXIT_FAILURE);
+  }
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(addr);
+  if (bind(sink_sock, (struct sockaddr*)&addr, len) == -1 ||
+      getsockname(sink_sock, (struct sockaddr*)&addr, &len) == -1) {
+    perror("bind");
+    exit(EXIT_FAILURE);
+  }
+
+  thread([]() {
+    char buff[BUFLEN];
+    while (recv(sink_sock, buff, sizeof(buff), 0) >= 0) {
+    }
+  }).detach();
+
+  return ntohs(addr.sin_port);
+}
+
+/*******************************************************************************
+ *
+ * Kernels
+ *
+ *******************************************************************************/
+
+static const int b64_sizes[] = { 1, 16, 32, 51, 64, 128, 222, 255 };
+
+// Typical LoRaWAN uplinks: empty FRMPayload, 38 byte application, max SF7
+static const int rxpk_sizes[] = { 13, 51, 222 };
+
+int main(int argc, char** argv)
+{
+  const char* filter = argc > 1 ? argv[1] : NULL;
+  #define ENABLED(name) (filter == NULL || strstr(name, filter) != NULL)
+
+  // Kernels run on this thread, the guard counts what they allocate,
+  // getaddrinfo() and operator new included
+  AllocGuardArm(ALLOC_GUARD_COUNT);
+
+  uint8_t payload[255];
+  for (size_t i = 0; i < sizeof(payload); i++) {
+    payload[i] = (uint8_t)(i * 7 + 1);
+  }
+
+  if (ENABLED("bin_to_b64")) {
+    for (size_t i = 0; i < sizeof(b64_sizes) / sizeof(b64_sizes[0]); i++) {
+      int size = b64_sizes[i];
+      Run("bin_to_b64", size, [&]() {
+        char b64[BASE64_MAX_LENGTH];
+        return bin_to_b64(payload, size, b64, BASE64_MAX_LENGTH);
+      });
+    }
+  }
+
+  if (ENABLED("b64_to_bin")) {
+    for (size_t i = 0; i < sizeof(b64_sizes) / sizeof(b64_sizes[0]); i++) {
+      int size = b64_sizes[i];
+      char b64[BASE64_MAX_LENGTH];
+      int length = bin_to_b64(payload, size, b64, BASE64_MAX_LENGTH);
+      Run("b64_to_bin", size, [&]() {
+        uint8_t out[255];
+        return b64_to_bin(b64, length, out, sizeof(out));
+      });
+    }
+  }
+
+  Sx127xConf conf = {
+    MODU_LORA, 868100000, SF7, BW125, CR4_5,
+    50000, 25000, { 0xC1, 0x94, 0xC1 }, 3
+  };
+  Sx127xPktStatus status = { -57, -110, 9, CR4_5, true, false };
+
+  if (ENABLED("rxpk_json")) {
+    for (size_t i = 0; i < sizeof(rxpk_sizes) / sizeof(rxpk_sizes[0]); i++) {
+      RxPkt pkt = { 3512348611U, &conf, status, "4/5", payload, (uint8_t)rxpk_sizes[i] };
+      Run("rxpk_json", pkt.size, [&]() {
+        char out[TX_BUFF_SIZE];
+        return BuildRxpkJson(pkt, out, sizeof(out), NULL);
+      });
+    }
+  }
+
+  if (ENABLED("stat_json")) {
+    StatReport stat = {
+      "2026-10-18 12:00:00 GMT", 52.3740, 4.8897, 10,
+      120, 118, 118, 0, 0, 0,
+      "Single Channel Gateway", "contact@example.com", "Dragino Single Channel Gateway on RPI"
+    };
+    Run("stat_json", 0, [&]() {
+      char out[STATUS_SIZE];
+      return BuildStatJson(stat, out, sizeof(out));
+    });
+  }
+
+  // Numeric hosts short-cut the resolver, names go through nsswitch and
+  // /etc/hosts, which stands in for the local caching resolver
+  if (ENABLED("solve_hostname")) {
+    Run("solve_hostname_numeric", 0, []() {
+      struct sockaddr_in sin;
+      SolveHostname("127.0.0.1", 1700, &sin);
+      return (int)sin.sin_addr.s_addr;
+    });
+    Run("solve_hostname_hosts", 0, []() {
+      struct sockaddr_in sin;
+      SolveHostname("localhost", 1700, &sin);
+      return (int)sin.sin_addr.s_addr;
+    });
+  }
+
+  if (ENABLED("send_udp")) {
+    sock_up = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock_up == -1) {
+      perror("socket");
+      exit(EXIT_FAILURE);
+    }
+    Server_t server = Server_t();
+    server.address = "127.0.0.1";
+    server.port = StartSink();
+    server.enabled = true;
+    servers.push_back(server);
+    ResolveServers();
+
+    for (size_t i = 0; i < sizeof(rxpk_sizes) / sizeof(rxpk_sizes[0]); i++) {
+      char buff_up[TX_BUFF_SIZE];
+      RxPkt pkt = { 3512348611U, &conf, status, "4/5", payload, (uint8_t)rxpk_sizes[i] };
+      int length = 12 + BuildRxpkJson(pkt, buff_up + 12, TX_BUFF_SIZE - 12, NULL);
+      Run("send_udp", pkt.size, [&]() {
+        return SendUdp(buff_up, length, SERVERS_ALL, NULL);
+      });
+    }
+  }
+
+  // Report
+  char buffer[4096];
+  FileWriteStream os(stdout, buffer, sizeof(buffer));
+  PrettyWriter<FileWriteStream> writer(os);
+  writer.StartObject();
+  writer.String("revision");
+  writer.String(BENCH_REVISION);
+  writer.String("benchmarks");
+  writer.StartArray();
+  for (vector<Result>::iterator it = results.begin(); it != results.end(); ++it) {
+    writer.StartObject();
+    writer.String("name");
+    writer.String(it->name);
+    writer.String("size");
+    writer.Int(it->size);
+    writer.String("iterations");
+    writer.Uint64(it->iterations);
+    writer.String("ns_per_op");
+    writer.Double(it->ns_per_op);
+    writer.String("allocs_per_op");
+    writer.Double(it->allocs_per_op);
+    writer.EndObject();
+  }
+  writer.EndArray();
+  writer.EndObject();
+  os.Put('\n');
+  os.Flush();
+
+  return 0;
+}
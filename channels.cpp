@@ -0,0 +1,181 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+#include "channels.h"
+
+#include <cstdio>
+
+using namespace std;
+
+// Traffic every channel is assumed to carry on top of what was seen, in
+// frames per second, so silent channels still have a weight
+#define HOP_RATE_FLOOR  0.01
+
+ChannelPlan channel_plan;
+
+ChannelPlan::ChannelPlan()
+  : count_(0), current_(0), policy_(HOP_FIXED), dwell_(0), arrived_(0), rx_at_arrival_(0), hops_(0)
+{
+  for (int i = 0; i < CONFIG_MAX_CHANNELS; i++) {
+    stats_[i].freq = 0;
+    NoiseClear(&stats_[i].noise);
+    rate_[i] = -1;
+  }
+}
+
+void ChannelPlan::Init(const Config& conf, uint32_t now)
+{
+  Sx127xConf channels[CONFIG_MAX_CHANNELS];
+  int count = 0;
+  if (conf.channel_count == 0) {
+    channels[count++] = conf.sx127x;
+  }
+  for (int i = 0; i < conf.channel_count; i++) {
+    Sx127xConf& channel = channels[count++];
+    channel = conf.sx127x;
+    channel.freq = conf.channels[i].freq;
+    if (conf.channels[i].sf != 0) {
+      channel.sf = conf.channels[i].sf;
+    }
+    if (conf.channels[i].bw != 0) {
+      channel.bw = conf.channels[i].bw;
+    }
+  }
+
+  bool same = count == count_;
+  for (int i = 0; same && i < count; i++) {
+    same = channels[i].freq == channels_[i].freq;
+  }
+
+  for (int i = 0; i < count; i++) {
+    channels_[i] = channels[i];
+  }
+  count_ = count;
+  policy_ = conf.hop_policy;
+  dwell_ = conf.hop_dwell;
+
+  if (!same) {
+    current_ = 0;
+    for (int i = 0; i < CONFIG_MAX_CHANNELS; i++) {
+      stats_[i].freq = i < count_ ? channels_[i].freq : 0;
+      stats_[i].rx = 0;
+      stats_[i].ok = 0;
+      stats_[i].crc_error = 0;
+      NoiseClear(&stats_[i].noise);
+      rate_[i] = -1;
+    }
+  }
+
+  tuned_ = channels_[current_];
+  arrived_ = now;
+  rx_at_arrival_ = stats_[current_].rx;
+}
+
+uint32_t ChannelPlan::Dwell() const
+{
+  if (count_ <= 1) {
+    return 0;
+  }
+  if (policy_ == HOP_FIXED) {
+    return dwell_;
+  }
+
+  // Channels not visited yet count as average
+  double seen = 0;
+  int visited = 0;
+  for (int i = 0; i < count_; i++) {
+    if (rate_[i] >= 0) {
+      seen += rate_[i];
+      visited++;
+    }
+  }
+  double mean = visited != 0 ? seen / visited : 0;
+  double total = 0;
+  for (int i = 0; i < count_; i++) {
+    total += (rate_[i] >= 0 ? rate_[i] : mean) + HOP_RATE_FLOOR;
+  }
+  double rate = (rate_[current_] >= 0 ? rate_[current_] : mean) + HOP_RATE_FLOOR;
+
+  double dwell = (double)dwell_ * count_ * rate / total;
+  if (dwell < dwell_ / 4) {
+    dwell = dwell_ / 4;
+  }
+  return (uint32_t)dwell;
+}
+
+int ChannelPlan::Hop(uint32_t now)
+{
+  if (count_ > 1) {
+    uint32_t elapsed = now - arrived_;
+    if (elapsed != 0) {
+      double sample = (stats_[current_].rx - rx_at_arrival_) * 1000.0 / elapsed;
+      rate_[current_] = rate_[current_] < 0 ? sample : 0.75 * rate_[current_] + 0.25 * sample;
+    }
+    current_ = (current_ + 1) % count_;
+    tuned_ = channels_[current_];
+    hops_++;
+  }
+  arrived_ = now;
+  rx_at_arrival_ = stats_[current_].rx;
+  return current_;
+}
+
+static void RenderChannelCounter(string& out, const char* name, const char* help, Counter ChannelStats::*field)
+{
+  char line[256];
+  snprintf(line, sizeof(line), "# HELP lora_pkt_fwd_%s %s\n# TYPE lora_pkt_fwd_%s counter\n", name, help, name);
+  out += line;
+  for (int i = 0; i < CONFIG_MAX_CHANNELS; i++) {
+    ChannelStats& stats = channel_plan.stats(i);
+    uint32_t freq = stats.freq;
+    if (freq != 0) {
+      snprintf(line, sizeof(line), "lora_pkt_fwd_%s{chan=\"%d\",freq=\"%u\"} %llu\n", name, i, freq,
+               (unsigned long long)(stats.*field).load(memory_order_relaxed));
+      out += line;
+    }
+  }
+}
+
+void ChannelRenderMetrics(string& out)
+{
+  RenderChannelCounter(out, "channel_rx_total", "Frames received per channel, CRC errors included", &ChannelStats::rx);
+  RenderChannelCounter(out, "channel_rx_ok_total", "Frames received per channel with a valid CRC", &ChannelStats::ok);
+  RenderChannelCounter(out, "channel_crc_error_total", "Frames received per channel with a CRC error", &ChannelStats::crc_error);
+
+  char line[512];
+  out += "# HELP lora_pkt_fwd_channel_noise_samples_total RSSI samples taken between frames per channel\n"
+         "# TYPE lora_pkt_fwd_channel_noise_samples_total counter\n";
+  for (int i = 0; i < CONFIG_MAX_CHANNELS; i++) {
+    ChannelStats& stats = channel_plan.stats(i);
+    uint32_t freq = stats.freq;
+    if (freq != 0) {
+      snprintf(line, sizeof(line), "lora_pkt_fwd_channel_noise_samples_total{chan=\"%d\",freq=\"%u\"} %llu\n", i, freq,
+               (unsigned long long)stats.noise.samples.load(memory_order_relaxed));
+      out += line;
+    }
+  }
+
+  out += "# HELP lora_pkt_fwd_channel_noise_dbm Channel RSSI between frames per channel, recent samples\n"
+         "# TYPE lora_pkt_fwd_channel_noise_dbm gauge\n";
+  for (int i = 0; i < CONFIG_MAX_CHANNELS; i++) {
+    ChannelStats& stats = channel_plan.stats(i);
+    uint32_t freq = stats.freq;
+    NoiseFloor floor;
+    if (freq != 0 && NoiseFloorGet(stats.noise, &floor)) {
+      snprintf(line, sizeof(line),
+               "lora_pkt_fwd_channel_noise_dbm{chan=\"%d\",freq=\"%u\",quantile=\"0.1\"} %d\n"
+               "lora_pkt_fwd_channel_noise_dbm{chan=\"%d\",freq=\"%u\",quantile=\"0.5\"} %d\n"
+               "lora_pkt_fwd_channel_noise_dbm{chan=\"%d\",freq=\"%u\",quantile=\"0.9\"} %d\n",
+               i, freq, floor.p10, i, freq, floor.p50, i, freq, floor.p90);
+      out += line;
+    }
+  }
+}
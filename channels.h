@@ -0,0 +1,95 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+// Channel plan and hopping scheduler.
+//
+// The receiver listens on one frequency and spreading factor at a time.
+// With a "channels" list in SX127x_conf it is rotated across the plan,
+// round robin: every channel for hop_dwell ms ("fixed"), or for a share of
+// hop_dwell x channels proportional to the traffic it carried on earlier
+// visits ("adaptive"), never less than a quarter of hop_dwell so quiet
+// channels are still sampled. Without a list the plan is the single
+// freq/spread_factor channel and the radio never hops.
+//
+// Hop() only moves the plan, the caller retunes the radio to Tuned() with
+// Sx127x::Reconfigure(), under the radio lock, and defers the hop while a
+// frame is being received.
+
+#ifndef _CHANNELS_H
+#define _CHANNELS_H
+
+#include "config.h"
+#include "metrics.h"
+#include "noise.h"
+#include "sx127x.h"
+
+#include <atomic>
+#include <stdint.h>
+#include <string>
+
+// Counted on the radio side, per channel
+struct ChannelStats
+{
+    std::atomic<uint32_t> freq;     // 0 for a channel not in the plan
+    Counter rx;                     // CRC errors included
+    Counter ok;
+    Counter crc_error;
+    NoiseHistogram noise;           // RSSI between frames, while scanning
+};
+
+class ChannelPlan
+{
+public:
+    ChannelPlan();
+
+    // Build the plan from conf.sx127x and conf.channels. The statistics
+    // and the current channel are kept if the frequencies are unchanged.
+    void Init(const Config& conf, uint32_t now);
+
+    int count() const { return count_; }
+    int current() const { return current_; }
+    const Sx127xConf& Channel(int chan) const { return channels_[chan]; }
+    ChannelStats& stats(int chan) { return stats_[chan]; }
+
+    // What the radio is tuned to, at a fixed address for the watchdog
+    const Sx127xConf* Tuned() const { return &tuned_; }
+
+    // Time to spend on the current channel, in ms, 0 to never hop
+    uint32_t Dwell() const;
+
+    // Move to the next channel, returns it
+    int Hop(uint32_t now);
+
+    uint64_t hops() const { return hops_; }
+
+private:
+    Sx127xConf channels_[CONFIG_MAX_CHANNELS];
+    int count_;
+    int current_;
+    HopPolicy_t policy_;
+    uint32_t dwell_;
+    Sx127xConf tuned_;
+    ChannelStats stats_[CONFIG_MAX_CHANNELS];
+
+    // Adaptive policy: frames per second seen on each channel, a moving
+    // average over the visits
+    double rate_[CONFIG_MAX_CHANNELS];
+    uint32_t arrived_;              // when the current visit started
+    uint64_t rx_at_arrival_;
+    uint64_t hops_;
+};
+
+extern ChannelPlan channel_plan;
+
+// Prometheus per-channel counters and noise floor, for MetricsAddRenderer()
+void ChannelRenderMetrics(std::string& out);
+
+#endif
@@ -0,0 +1,864 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+#include "config.h"
+
+#include <rapidjson/error/en.h>
+#include <rapidjson/reader.h>
+
+#include <errno.h>
+#include <stdarg.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+using namespace std;
+
+using namespace rapidjson;
+
+/*******************************************************************************
+ *
+ * Schema
+ *
+ *******************************************************************************/
+
+typedef enum ConfigTypes
+{
+    CONF_BOOL,
+    CONF_INT,           // any integer member, range checked
+    CONF_DOUBLE,
+    CONF_STRING,        // char array, length checked
+    CONF_ENUM,          // string converted by parse()
+    CONF_SECTION,       // object of fields
+    CONF_LIST           // array of objects, or a single one
+} ConfigType_t;
+
+struct ConfigField
+{
+    const char* key;
+    ConfigType_t type;
+    size_t offset;                      // from the start of the enclosing object
+    size_t size;
+    double min;
+    double max;
+    bool (*check)(int64_t value);       // CONF_INT constraint besides the range
+    bool (*parse)(const char* str, void* dest);  // CONF_ENUM
+    const char* hint;                   // what is accepted, for errors
+    const ConfigField* fields;          // CONF_SECTION and CONF_LIST members
+    size_t count_offset;                // CONF_LIST element count, an int
+};
+
+#define MEMBER_SIZE(type, member) sizeof(((type*)0)->member)
+
+#define FIELD_BOOL(type, key, member) \
+  { key, CONF_BOOL, offsetof(type, member), MEMBER_SIZE(type, member), 0, 0, NULL, NULL, NULL, NULL, 0 }
+#define FIELD_INT(type, key, member, min, max) \
+  { key, CONF_INT, offsetof(type, member), MEMBER_SIZE(type, member), min, max, NULL, NULL, NULL, NULL, 0 }
+#define FIELD_INT_CHECK(type, key, member, min, max, check, hint) \
+  { key, CONF_INT, offsetof(type, member), MEMBER_SIZE(type, member), min, max, check, NULL, hint, NULL, 0 }
+#define FIELD_DOUBLE(type, key, member, min, max) \
+  { key, CONF_DOUBLE, offsetof(type, member), MEMBER_SIZE(type, member), min, max, NULL, NULL, NULL, NULL, 0 }
+#define FIELD_STRING(type, key, member) \
+  { key, CONF_STRING, offsetof(type, member), MEMBER_SIZE(type, member), 0, 0, NULL, NULL, NULL, NULL, 0 }
+#define FIELD_ENUM(type, key, member, parse, hint) \
+  { key, CONF_ENUM, offsetof(type, member), MEMBER_SIZE(type, member), 0, 0, NULL, parse, hint, NULL, 0 }
+#define FIELD_LIST(type, key, member, count, fields) \
+  { key, CONF_LIST, offsetof(type, member), MEMBER_SIZE(type, member[0]), 0, \
+    sizeof(((type*)0)->member) / sizeof(((type*)0)->member[0]), NULL, NULL, NULL, fields, offsetof(type, count) }
+#define FIELD_SECTION(key, fields) \
+  { key, CONF_SECTION, 0, 0, 0, 0, NULL, NULL, NULL, fields, 0 }
+#define FIELD_END \
+  { NULL, CONF_BOOL, 0, 0, 0, 0, NULL, NULL, NULL, NULL, 0 }
+
+static bool ParseModulation(const char* str, void* dest)
+{
+  if (strcmp(str, "LORA") == 0) {
+    *(Modulation_t*)dest = MODU_LORA;
+  } else if (strcmp(str, "FSK") == 0) {
+    *(Modulation_t*)dest = MODU_FSK;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static bool ParseCodingRate(const char* str, void* dest)
+{
+  for (CodingRate_t cr = CR4_5; cr <= CR4_8; cr = (CodingRate_t)(cr + 1)) {
+    if (strcmp(str, CodingRateName(cr)) == 0) {
+      *(CodingRate_t*)dest = cr;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Hex string, most significant byte first, e.g. "C194C1"
+static bool ParseSyncWord(const char* str, void* dest)
+{
+  Sx127xConf* conf = (Sx127xConf*)dest;
+  size_t length = strlen(str);
+  if (length % 2 != 0 || length < 2 || length > 2 * FSK_SYNC_WORD_MAX_LENGTH ||
+      strspn(str, "0123456789abcdefABCDEF") != length) {
+    return false;
+  }
+  for (size_t i = 0; i < length / 2; i++) {
+    char byte[3] = { str[2 * i], str[2 * i + 1], '\0' };
+    conf->fsk_sync_word[i] = (uint8_t)strtoul(byte, NULL, 16);
+  }
+  conf->fsk_sync_word_size = (uint8_t)(length / 2);
+  return true;
+}
+
+// 16 hex digits, as in the Semtech configuration, e.g. "B827EBFFFE123456"
+static bool ParseGatewayId(const char* str, void* dest)
+{
+  if (strlen(str) != 16 || strspn(str, "0123456789abcdefABCDEF") != 16) {
+    return false;
+  }
+  *(uint64_t*)dest = strtoull(str, NULL, 16);
+  return true;
+}
+
+static bool ParseAllocGuard(const char* str, void* dest)
+{
+  if (strcmp(str, "off") == 0) {
+    *(AllocGuardMode_t*)dest = ALLOC_GUARD_OFF;
+  } else if (strcmp(str, "count") == 0) {
+    *(AllocGuardMode_t*)dest = ALLOC_GUARD_COUNT;
+  } else if (strcmp(str, "abort") == 0) {
+    *(AllocGuardMode_t*)dest = ALLOC_GUARD_ABORT;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static bool ParseHopPolicy(const char* str, void* dest)
+{
+  if (strcmp(str, "fixed") == 0) {
+    *(HopPolicy_t*)dest = HOP_FIXED;
+  } else if (strcmp(str, "adaptive") == 0) {
+    *(HopPolicy_t*)dest = HOP_ADAPTIVE;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static bool ParseBackend(const char* str, void* dest)
+{
+  if (strcmp(str, "semtech") == 0) {
+    *(ServerBackend_t*)dest = BACKEND_SEMTECH;
+  } else if (strcmp(str, "station") == 0) {
+    *(ServerBackend_t*)dest = BACKEND_STATION;
+  } else if (strcmp(str, "mqtt") == 0) {
+    *(ServerBackend_t*)dest = BACKEND_MQTT;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static bool ParseMqttPayload(const char* str, void* dest)
+{
+  if (strcmp(str, "json") == 0) {
+    *(MqttPayload_t*)dest = MQTT_PAYLOAD_JSON;
+  } else if (strcmp(str, "binary") == 0) {
+    *(MqttPayload_t*)dest = MQTT_PAYLOAD_BINARY;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static bool ParseRuleFrames(const char* str, void* dest)
+{
+  static const struct { const char* name; uint8_t frames; } names[] = {
+    { "join", RULE_JOIN }, { "data", RULE_DATA }, { "confirmed", RULE_CONFIRMED },
+    { "unconfirmed", RULE_UNCONFIRMED }, { "proprietary", RULE_PROPRIETARY }
+  };
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    if (strcmp(str, names[i].name) == 0) {
+      *(uint8_t*)dest = names[i].frames;
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool IsHex(const char* str, size_t length)
+{
+  return strlen(str) >= length && strspn(str, "0123456789abcdefABCDEF") >= length;
+}
+
+// The first length hex digits of str
+static uint64_t ParseHex(const char* str, size_t length)
+{
+  uint64_t value = 0;
+  for (size_t i = 0; i < length; i++) {
+    char digit[2] = { str[i], '\0' };
+    value = value << 4 | strtoul(digit, NULL, 16);
+  }
+  return value;
+}
+
+// 6 hex digits, e.g. "000013". The 3 top bits are the NetID type, which
+// sets how many of the low bits (NwkID) follow the type prefix in its
+// DevAddrs (LoRaWAN Backend Interfaces 1.0, 13.1), "000013" is 26000000/7.
+static bool ParseNetId(const char* str, void* dest)
+{
+  static const uint8_t nwk_id_bits[8] = { 6, 6, 9, 11, 12, 13, 15, 17 };
+  if (strlen(str) != 6 || !IsHex(str, 6)) {
+    return false;
+  }
+  uint32_t net_id = (uint32_t)ParseHex(str, 6);
+  int type = net_id >> 21;
+  int bits = type + 1 + nwk_id_bits[type];
+  ConfigPrefix* prefix = (ConfigPrefix*)dest;
+  prefix->devaddr = (uint32_t)((0xfe << (7 - type)) & 0xff) << 24 |
+                    (net_id & ((1 << nwk_id_bits[type]) - 1)) << (32 - bits);
+  prefix->bits = (uint8_t)bits;
+  return true;
+}
+
+// 8 hex digits and an optional prefix length, e.g. "26000000/7"
+static bool ParseDevAddrPrefix(const char* str, void* dest)
+{
+  int bits = 32;
+  if (!IsHex(str, 8) || (str[8] != '\0' && str[8] != '/')) {
+    return false;
+  }
+  if (str[8] == '/') {
+    char* end;
+    bits = (int)strtol(str + 9, &end, 10);
+    if (end == str + 9 || *end != '\0' || bits < 1 || bits > 32) {
+      return false;
+    }
+  }
+  ConfigPrefix* prefix = (ConfigPrefix*)dest;
+  prefix->devaddr = (uint32_t)ParseHex(str, 8) & (uint32_t)(0xffffffffull << (32 - bits));
+  prefix->bits = (uint8_t)bits;
+  return true;
+}
+
+// One EUI, or the first and last of a range, as 16 hex digits each
+static bool ParseEuiRange(const char* str, void* dest)
+{
+  size_t length = strlen(str);
+  if (!IsHex(str, 16) || (length != 16 && (length != 33 || str[16] != '-' || !IsHex(str + 17, 16)))) {
+    return false;
+  }
+  ConfigRange* range = (ConfigRange*)dest;
+  range->min = ParseHex(str, 16);
+  range->max = length == 16 ? range->min : ParseHex(str + 17, 16);
+  range->set = true;
+  return range->min <= range->max;
+}
+
+static bool IsBandwidth(int64_t value)
+{
+  return value == BW125 || value == BW250 || value == BW500;
+}
+
+static bool IsPowerOfTwo(int64_t value)
+{
+  return value > 0 && (value & (value - 1)) == 0;
+}
+
+static const ConfigField channel_fields[] = {
+  FIELD_INT(ConfigChannel, "freq", freq, 137000000, 1020000000),
+  FIELD_INT(ConfigChannel, "spread_factor", sf, SF7, SF12),
+  FIELD_INT_CHECK(ConfigChannel, "bandwidth", bw, BW125, BW500, IsBandwidth, "125, 250 or 500"),
+  FIELD_END
+};
+
+static const ConfigField sx127x_fields[] = {
+  FIELD_INT(Config, "freq", sx127x.freq, 137000000, 1020000000),
+  FIELD_ENUM(Config, "modulation", sx127x.modu, ParseModulation, "LORA or FSK"),
+  FIELD_INT(Config, "spread_factor", sx127x.sf, SF7, SF12),
+  FIELD_INT_CHECK(Config, "bandwidth", sx127x.bw, BW125, BW500, IsBandwidth, "125, 250 or 500"),
+  FIELD_ENUM(Config, "coding_rate", sx127x.cr, ParseCodingRate, "4/5, 4/6, 4/7 or 4/8"),
+  FIELD_INT(Config, "watchdog_interval", watchdog_interval, 0, UINT32_MAX),
+  FIELD_INT(Config, "fsk_bitrate", sx127x.fsk_bitrate, 1200, 300000),
+  FIELD_INT(Config, "fsk_fdev", sx127x.fsk_fdev, 0, 200000),
+  FIELD_ENUM(Config, "fsk_sync_word", sx127x, ParseSyncWord, "1 to 8 hex bytes, e.g. \"C194C1\""),
+  FIELD_INT(Config, "pin_nss", pin_nss, 0, 0xff),
+  FIELD_INT(Config, "pin_dio0", pin_dio0, 0, 0xff),
+  FIELD_INT(Config, "pin_dio1", pin_dio1, 0, 0xff),
+  FIELD_INT(Config, "pin_rst", pin_rst, 0, 0xff),
+  FIELD_INT(Config, "pin_led1", pin_led1, 0, 0xff),
+  FIELD_LIST(Config, "channels", channels, channel_count, channel_fields),
+  FIELD_ENUM(Config, "hop_policy", hop_policy, ParseHopPolicy, "fixed or adaptive"),
+  FIELD_INT(Config, "hop_dwell", hop_dwell, 10, 3600000),
+  FIELD_INT(Config, "noise_scan_interval", noise_scan_interval, 0, 3600000),
+  FIELD_END
+};
+
+static const ConfigField rule_fields[] = {
+  FIELD_ENUM(ConfigRule, "frames", frames, ParseRuleFrames, "join, data, confirmed, unconfirmed or proprietary"),
+  FIELD_ENUM(ConfigRule, "net_id", net_id, ParseNetId, "6 hex digits, e.g. \"000013\""),
+  FIELD_ENUM(ConfigRule, "devaddr", devaddr, ParseDevAddrPrefix, "8 hex digits and a prefix length, e.g. \"26000000/7\""),
+  FIELD_ENUM(ConfigRule, "join_eui", join_eui, ParseEuiRange,
+             "16 hex digits, or a range, e.g. \"70B3D57ED0000000-70B3D57ED0FFFFFF\""),
+  FIELD_END
+};
+
+static const ConfigField server_fields[] = {
+  FIELD_STRING(ConfigServer, "address", address),
+  FIELD_INT(ConfigServer, "port", port, 1, 65535),
+  FIELD_ENUM(ConfigServer, "backend", backend, ParseBackend, "semtech, station or mqtt"),
+  FIELD_INT(ConfigServer, "protocol_version", protocol_version, 1, 2),
+  FIELD_BOOL(ConfigServer, "enabled", enabled),
+  FIELD_LIST(ConfigServer, "rules", rules, rule_count, rule_fields),
+  FIELD_STRING(ConfigServer, "topic_up", topic_up),
+  FIELD_STRING(ConfigServer, "topic_down", topic_down),
+  FIELD_STRING(ConfigServer, "username", username),
+  FIELD_STRING(ConfigServer, "password", password),
+  FIELD_ENUM(ConfigServer, "payload", payload, ParseMqttPayload, "json or binary"),
+  FIELD_INT(ConfigServer, "qos", qos, 0, 1),
+  FIELD_INT(ConfigServer, "max_inflight", max_inflight, 1, 64),
+  FIELD_INT(ConfigServer, "keepalive", keepalive, 1, 65535),
+  FIELD_END
+};
+
+static const ConfigField gateway_fields[] = {
+  FIELD_ENUM(Config, "gateway_ID", gateway_id, ParseGatewayId, "16 hex digits, e.g. \"B827EBFFFE123456\""),
+  FIELD_STRING(Config, "interface", interface_name),
+  FIELD_DOUBLE(Config, "ref_latitude", ref_latitude, -90, 90),
+  FIELD_DOUBLE(Config, "ref_longitude", ref_longitude, -180, 180),
+  FIELD_INT(Config, "ref_altitude", ref_altitude, -100000, 100000),
+  FIELD_STRING(Config, "name", name),
+  FIELD_STRING(Config, "email", email),
+  FIELD_STRING(Config, "desc", desc),
+  FIELD_BOOL(Config, "forward_crc_error", forward_crc_error),
+  FIELD_BOOL(Config, "forward_crc_disabled", forward_crc_disabled),
+  FIELD_INT(Config, "metrics_port", metrics_port, 0, 65535),
+  FIELD_STRING(Config, "trace_capture_file", trace_capture_file),
+  FIELD_INT(Config, "trace_capture_seconds", trace_capture_seconds, 0, UINT32_MAX),
+  FIELD_BOOL(Config, "realtime", realtime),
+  FIELD_INT(Config, "realtime_priority", realtime_priority, 1, 99),
+  FIELD_INT(Config, "realtime_cpu", realtime_cpu, -1, 1023),
+  FIELD_INT_CHECK(Config, "rx_queue_depth", rx_queue_depth, 1, 65536, IsPowerOfTwo, "a power of two up to 65536"),
+  FIELD_INT(Config, "uplink_queue_depth", uplink_queue_depth, 1, 4096),
+  FIELD_INT(Config, "uplink_max_age_join", uplink_max_age[0], 0, 3600000),
+  FIELD_INT(Config, "uplink_max_age_confirmed", uplink_max_age[1], 0, 3600000),
+  FIELD_INT(Config, "uplink_max_age_unconfirmed", uplink_max_age[2], 0, 3600000),
+  FIELD_INT(Config, "uplink_max_age_proprietary", uplink_max_age[3], 0, 3600000),
+  FIELD_ENUM(Config, "alloc_guard", alloc_guard, ParseAllocGuard, "off, count or abort"),
+  FIELD_INT(Config, "dns_refresh_interval", dns_refresh_interval, 0, UINT32_MAX),
+  FIELD_INT(Config, "keepalive_interval", keepalive_interval, 0, UINT32_MAX),
+  FIELD_BOOL(Config, "config_watch", config_watch),
+  FIELD_STRING(Config, "control_socket", control_socket),
+  FIELD_STRING(Config, "packet_feed", packet_feed),
+  FIELD_INT_CHECK(Config, "packet_feed_slots", packet_feed_slots, 1, 65536, IsPowerOfTwo, "a power of two up to 65536"),
+  FIELD_LIST(Config, "servers", servers, server_count, server_fields),
+  FIELD_END
+};
+
+static const ConfigField root_fields[] = {
+  FIELD_SECTION("SX127x_conf", sx127x_fields),
+  FIELD_SECTION("gateway_conf", gateway_fields),
+  FIELD_END
+};
+
+void ConfigDefaults(Config* conf)
+{
+  memset(conf, 0, sizeof(*conf));
+
+  conf->sx127x.modu = MODU_LORA;
+  conf->sx127x.freq = 868100000;  // 868.1 Mhz
+  conf->sx127x.sf = SF7;
+  conf->sx127x.bw = BW125;
+  conf->sx127x.cr = CR4_5;
+
+  // LoRaWAN FSK channel
+  conf->sx127x.fsk_bitrate = 50000;
+  conf->sx127x.fsk_fdev = 25000;
+  conf->sx127x.fsk_sync_word[0] = 0xC1;
+  conf->sx127x.fsk_sync_word[1] = 0x94;
+  conf->sx127x.fsk_sync_word[2] = 0xC1;
+  conf->sx127x.fsk_sync_word_size = 3;
+
+  conf->watchdog_interval = 10;
+  conf->pin_nss = 0xff;
+  conf->pin_dio0 = 0xff;
+  conf->pin_dio1 = 0xff;
+  conf->pin_rst = 0xff;
+  conf->pin_led1 = 0xff;
+  conf->hop_policy = HOP_FIXED;
+  conf->hop_dwell = 2000;
+
+  conf->trace_capture_seconds = 60;
+  conf->realtime_priority = 50;
+  conf->realtime_cpu = -1;
+  conf->rx_queue_depth = 32;
+
+  // Join accepts go out 5 s after the JoinRequest, class A downlinks 1 or
+  // 2 s after the uplink; telemetry is still worth something a while later
+  conf->uplink_queue_depth = 64;
+  conf->uplink_max_age[0] = 5000;
+  conf->uplink_max_age[1] = 2000;
+  conf->uplink_max_age[2] = 10000;
+  conf->uplink_max_age[3] = 10000;
+  conf->alloc_guard = ALLOC_GUARD_OFF;
+  conf->dns_refresh_interval = 60;
+  conf->packet_feed_slots = 1024;
+}
+
+/*******************************************************************************
+ *
+ * SAX handler
+ *
+ *******************************************************************************/
+
+#define CONFIG_MAX_DEPTH  8
+
+class ConfigHandler : public BaseReaderHandler<UTF8<>, ConfigHandler>
+{
+public:
+  ConfigHandler(Config* conf, const char* path)
+    : conf_(conf), path_(path), depth_(0), skip_(0)
+  {
+    message_[0] = '\0';
+  }
+
+  const char* message() const { return message_; }
+
+  bool Null() { return Scalar("null"); }
+
+  bool Bool(bool b)
+  {
+    const ConfigField* field;
+    char* dest;
+    if (!Target(&field, &dest)) {
+      return message_[0] == '\0';
+    }
+    if (field->type != CONF_BOOL) {
+      return Mismatch(field, "a boolean");
+    }
+    *(bool*)dest = b;
+    return true;
+  }
+
+  bool Int(int i) { return Integer(i); }
+  bool Uint(unsigned u) { return Integer(u); }
+  bool Int64(int64_t i) { return Integer(i); }
+  bool Uint64(uint64_t u) { return Integer(u > (uint64_t)INT64_MAX ? INT64_MAX : (int64_t)u); }
+
+  bool Double(double d)
+  {
+    const ConfigField* field;
+    char* dest;
+    if (!Target(&field, &dest)) {
+      return message_[0] == '\0';
+    }
+    if (field->type == CONF_INT) {
+      return Mismatch(field, "a floating point number");
+    }
+    return Real(field, dest, d);
+  }
+
+  bool String(const char* str, SizeType length, bool copy)
+  {
+    const ConfigField* field;
+    char* dest;
+    if (!Target(&field, &dest)) {
+      return message_[0] == '\0';
+    }
+    if (field->type == CONF_STRING) {
+      if (length >= field->size || strlen(str) != length) {
+        return Error("longer than %u characters", (unsigned)field->size - 1);
+      }
+      memcpy(dest, str, length + 1);
+      return true;
+    }
+    if (field->type == CONF_ENUM) {
+      if (!field->parse(str, dest)) {
+        return Error("unsupported \"%s\", use %s", str, field->hint);
+      }
+      return true;
+    }
+    return Mismatch(field, "a string");
+  }
+
+  bool StartObject()
+  {
+    if (skip_ > 0) {
+      skip_++;
+      return true;
+    }
+    if (depth_ == 0) {
+      return Push(root_fields, (char*)conf_, false);
+    }
+    const ConfigField* field;
+    char* dest;
+    if (!Target(&field, &dest)) {
+      if (message_[0] == '\0') {
+        skip_ = 1;
+        return true;
+      }
+      return false;
+    }
+    if (field->type == CONF_SECTION) {
+      return Push(field->fields, dest, false);
+    }
+    if (field->type == CONF_LIST) {
+      // A single object, or one array element
+      int* count = (int*)(dest - field->offset + field->count_offset);
+      if (!frames_[depth_ - 1].array) {
+        *count = 0;
+      }
+      if (*count == (int)field->max) {
+        return Error("more than %d %s", (int)field->max, field->key);
+      }
+      char* element = dest + (*count)++ * field->size;
+      memset(element, 0, field->size);
+      return Push(field->fields, element, false);
+    }
+    return Mismatch(field, "an object");
+  }
+
+  bool Key(const char* str, SizeType length, bool copy)
+  {
+    if (skip_ > 0) {
+      return true;
+    }
+    Frame& frame = frames_[depth_ - 1];
+    snprintf(frame.key, sizeof(frame.key), "%s", str);
+    frame.field = NULL;
+    for (const ConfigField* field = frame.fields; field->key != NULL; field++) {
+      if (strcmp(field->key, str) == 0) {
+        frame.field = field;
+        return true;
+      }
+    }
+    // Other Semtech sections are expected, a typo in ours is not
+    if (depth_ > 1) {
+      char buff[128];
+      fprintf(stderr, "%s: %s: unknown key, ignored\n", path_, Path(buff, sizeof(buff)));
+    }
+    return true;
+  }
+
+  bool EndObject(SizeType memberCount)
+  {
+    if (skip_ > 0) {
+      skip_--;
+      return true;
+    }
+    const Frame& frame = frames_[--depth_];
+    if (frame.fields == server_fields) {
+      const ConfigServer* server = (const ConfigServer*)frame.base;
+      if (server->address[0] == '\0') {
+        return Error("server without an address");
+      }
+      if (server->port == 0) {
+        return Error("server without a port");
+      }
+      if (server->backend != BACKEND_SEMTECH && server->protocol_version != 0) {
+        return Error("protocol_version is a semtech backend key");
+      }
+      if (server->backend != BACKEND_MQTT &&
+          (server->topic_up[0] != '\0' || server->topic_down[0] != '\0' || server->username[0] != '\0')) {
+        return Error("topic_up, topic_down and username are mqtt backend keys");
+      }
+    }
+    if (frame.fields == rule_fields) {
+      const ConfigRule* rule = (const ConfigRule*)frame.base;
+      bool devaddr = rule->net_id.bits != 0 || rule->devaddr.bits != 0;
+      if (rule->net_id.bits != 0 && rule->devaddr.bits != 0) {
+        return Error("rule with both a net_id and a devaddr");
+      }
+      if (devaddr && rule->join_eui.set) {
+        return Error("rule with a join_eui and a net_id or devaddr, which never match the same frame");
+      }
+      if ((devaddr && (rule->frames & ~RULE_DATA) != 0) || (rule->join_eui.set && (rule->frames & ~RULE_JOIN) != 0)) {
+        return Error("net_id and devaddr only match data frames, join_eui only joins");
+      }
+    }
+    if (frame.fields == channel_fields && ((const ConfigChannel*)frame.base)->freq == 0) {
+      return Error("channel without a freq");
+    }
+    return true;
+  }
+
+  bool StartArray()
+  {
+    if (skip_ > 0) {
+      skip_++;
+      return true;
+    }
+    if (depth_ == 0) {
+      return Error("expected an object, got an array");
+    }
+    const ConfigField* field;
+    char* dest;
+    if (!Target(&field, &dest)) {
+      if (message_[0] == '\0') {
+        skip_ = 1;
+        return true;
+      }
+      return false;
+    }
+    if (field->type != CONF_LIST || frames_[depth_ - 1].array) {
+      return Mismatch(field, "an array");
+    }
+    // The list replaces the one of a previous layer. Elements are found
+    // from the enclosing object, like a single object would be.
+    char* base = dest - field->offset;
+    *(int*)(base + field->count_offset) = 0;
+    if (!Push(NULL, base, true)) {
+      return false;
+    }
+    frames_[depth_ - 1].field = field;
+    return true;
+  }
+
+  bool EndArray(SizeType elementCount)
+  {
+    if (skip_ > 0) {
+      skip_--;
+    } else {
+      depth_--;
+    }
+    return true;
+  }
+
+private:
+  struct Frame
+  {
+    const ConfigField* fields;  // members of this object, NULL for an array
+    const ConfigField* field;   // the one being parsed, NULL if unknown
+    char* base;
+    bool array;
+    int index;                  // current element of an array
+    char key[32];
+  };
+
+  Config* conf_;
+  const char* path_;
+  Frame frames_[CONFIG_MAX_DEPTH];
+  int depth_;
+  int skip_;                    // nesting level inside an ignored value
+  char message_[CONFIG_ERROR_SIZE];
+
+  bool Push(const ConfigField* fields, char* base, bool array)
+  {
+    if (depth_ == CONFIG_MAX_DEPTH) {
+      return Error("nested too deep");
+    }
+    Frame& frame = frames_[depth_++];
+    frame.fields = fields;
+    frame.field = NULL;
+    frame.base = base;
+    frame.array = array;
+    frame.index = -1;
+    frame.key[0] = '\0';
+    return true;
+  }
+
+  // Field and storage the next value is for. False either to ignore it
+  // (message_ empty) or on error.
+  bool Target(const ConfigField** field, char** dest)
+  {
+    if (skip_ > 0) {
+      return false;
+    }
+    if (depth_ == 0) {
+      Error("expected an object");
+      return false;
+    }
+    Frame& frame = frames_[depth_ - 1];
+    if (frame.array) {
+      frame.index++;
+    }
+    if (frame.field == NULL) {
+      return false;
+    }
+    *field = frame.field;
+    *dest = frame.base + frame.field->offset;
+    return true;
+  }
+
+  bool Scalar(const char* got)
+  {
+    const ConfigField* field;
+    char* dest;
+    if (!Target(&field, &dest)) {
+      return message_[0] == '\0';
+    }
+    return Mismatch(field, got);
+  }
+
+  bool Integer(int64_t value)
+  {
+    const ConfigField* field;
+    char* dest;
+    if (!Target(&field, &dest)) {
+      return message_[0] == '\0';
+    }
+    if (field->type == CONF_DOUBLE) {
+      return Real(field, dest, (double)value);
+    }
+    if (field->type != CONF_INT) {
+      return Mismatch(field, "a number");
+    }
+    if (value < field->min || value > field->max ||
+        (field->check != NULL && !field->check(value))) {
+      return Mismatch(field, NULL);
+    }
+    // Two's complement truncation to the member size
+    switch (field->size) {
+      case 1: { uint8_t v = (uint8_t)value; memcpy(dest, &v, 1); break; }
+      case 2: { uint16_t v = (uint16_t)value; memcpy(dest, &v, 2); break; }
+      case 4: { uint32_t v = (uint32_t)value; memcpy(dest, &v, 4); break; }
+      default: memcpy(dest, &value, 8); break;
+    }
+    return true;
+  }
+
+  bool Real(const ConfigField* field, char* dest, double value)
+  {
+    if (field->type != CONF_DOUBLE) {
+      return Mismatch(field, "a number");
+    }
+    if (value < field->min || value > field->max) {
+      return Mismatch(field, NULL);
+    }
+    *(double*)dest = value;
+    return true;
+  }
+
+  // Expected type (and range) of field, and what was found if it is the
+  // type that is wrong
+  bool Mismatch(const ConfigField* field, const char* got)
+  {
+    char expected[96];
+    switch (field->type) {
+      case CONF_BOOL: snprintf(expected, sizeof(expected), "true or false"); break;
+      case CONF_INT:
+        if (field->hint != NULL) {
+          snprintf(expected, sizeof(expected), "%s", field->hint);
+        } else {
+          snprintf(expected, sizeof(expected), "an integer %.0f to %.0f", field->min, field->max);
+        }
+        break;
+      case CONF_DOUBLE: snprintf(expected, sizeof(expected), "a number %g to %g", field->min, field->max); break;
+      case CONF_STRING: snprintf(expected, sizeof(expected), "a string"); break;
+      case CONF_ENUM: snprintf(expected, sizeof(expected), "%s", field->hint); break;
+      case CONF_SECTION: snprintf(expected, sizeof(expected), "an object"); break;
+      case CONF_LIST: snprintf(expected, sizeof(expected), "an array of objects"); break;
+    }
+    if (got == NULL) {
+      return Error("expected %s", expected);
+    }
+    return Error("expected %s, got %s", expected, got);
+  }
+
+  // Always false, to stop the parse
+  bool Error(const char* format, ...)
+  {
+    char buff[128];
+    int length = snprintf(message_, sizeof(message_), "%s: ", Path(buff, sizeof(buff)));
+    if (buff[0] == '\0') {
+      length = 0;
+    }
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message_ + length, sizeof(message_) - length, format, args);
+    va_end(args);
+    return false;
+  }
+
+  // e.g. gateway_conf.servers[1].port
+  const char* Path(char* buff, size_t size)
+  {
+    size_t length = 0;
+    buff[0] = '\0';
+    for (int i = 0; i < depth_ && length < size; i++) {
+      const Frame& frame = frames_[i];
+      if (frame.array) {
+        length += snprintf(buff + length, size - length, "[%d]", frame.index);
+      } else if (frame.key[0] != '\0') {
+        length += snprintf(buff + length, size - length, "%s%s", length != 0 ? "." : "", frame.key);
+      }
+    }
+    return buff;
+  }
+};
+
+/*******************************************************************************
+ *
+ * Files
+ *
+ *******************************************************************************/
+
+bool ConfigLoad(const char* path, Config* conf, char* error, size_t size)
+{
+  FILE* p_file = fopen(path, "r");
+  if (p_file == NULL) {
+    snprintf(error, size, "%s: %s", path, strerror(errno));
+    return false;
+  }
+  vector<char> text;
+  char buff[4096];
+  size_t n;
+  while ((n = fread(buff, 1, sizeof(buff), p_file)) > 0) {
+    text.insert(text.end(), buff, buff + n);
+  }
+  bool failed = ferror(p_file) != 0;
+  fclose(p_file);
+  if (failed) {
+    snprintf(error, size, "%s: read error", path);
+    return false;
+  }
+  text.push_back('\0');
+
+  ConfigHandler handler(conf, path);
+  Reader reader;
+  StringStream is(&text[0]);
+  reader.Parse(is, handler);
+  if (!reader.HasParseError()) {
+    return true;
+  }
+
+  size_t offset = reader.GetErrorOffset();
+  int line = 1;
+  int column = 1;
+  for (size_t i = 0; i < offset && i < text.size(); i++) {
+    if (text[i] == '\n') {
+      line++;
+      column = 1;
+    } else {
+      column++;
+    }
+  }
+  const char* message = handler.message()[0] != '\0' ? handler.message() :
+                        GetParseError_En(reader.GetParseErrorCode());
+  snprintf(error, size, "%s:%d:%d: %s", path, line, column, message);
+  return false;
+}
+
+bool ConfigLoadLayered(Config* conf, char* error, size_t size)
+{
+  ConfigDefaults(conf);
+  if (!ConfigLoad("global_conf.json", conf, error, size)) {
+    return false;
+  }
+  if (access("local_conf.json", F_OK) == 0) {
+    return ConfigLoad("local_conf.json", conf, error, size);
+  }
+  return true;
+}
@@ -0,0 +1,177 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+// Configuration files.
+//
+// Like the Semtech packet forwarder, global_conf.json is read first and
+// local_conf.json, when present, is layered on top: every key it sets
+// overrides the global one, a "servers" or "channels" list replaces the
+// global list.
+//
+// Each file is parsed in one pass with the rapidjson SAX Reader, checked
+// against a schema of the SX127x_conf and gateway_conf keys as it goes and
+// stored straight into a Config. Any error names the file, line, column and
+// key path, e.g.
+//   global_conf.json:12:20: gateway_conf.servers[1].port: expected an integer 1 to 65535, got a string
+// Unknown sections are skipped (Semtech configurations carry many), unknown
+// keys in a known section only draw a warning.
+
+#ifndef _CONFIG_H
+#define _CONFIG_H
+
+#include "alloc.h"
+#include "sx127x.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CONFIG_MAX_SERVERS  4
+#define CONFIG_MAX_CHANNELS 8
+#define CONFIG_MAX_RULES    8     // per server
+#define CONFIG_ERROR_SIZE   512
+
+// ConfigRule.frames, one bit per UplinkClass_t
+#define RULE_JOIN           0x01
+#define RULE_CONFIRMED      0x02
+#define RULE_UNCONFIRMED    0x04
+#define RULE_DATA           (RULE_CONFIRMED | RULE_UNCONFIRMED)
+#define RULE_PROPRIETARY    0x08
+
+// DevAddr block, bits 0 when not set
+struct ConfigPrefix
+{
+    uint32_t devaddr;
+    uint8_t bits;
+};
+
+// Inclusive EUI range
+struct ConfigRange
+{
+    uint64_t min;
+    uint64_t max;
+    bool set;
+};
+
+// Frames a server gets, every key that is set has to match. A NetID or
+// DevAddr prefix only matches data frames, a JoinEUI range only joins.
+struct ConfigRule
+{
+    uint8_t frames;                 // RULE_* bits, 0 for any
+    ConfigPrefix net_id;            // the block of a NetID, by its type
+    ConfigPrefix devaddr;
+    ConfigRange join_eui;
+};
+
+typedef enum ServerBackends
+{
+    BACKEND_SEMTECH,                // Semtech UDP
+    BACKEND_STATION,                // LoRa Basics Station LNS, over websocket
+    BACKEND_MQTT                    // MQTT 3.1.1 broker
+} ServerBackend_t;
+
+typedef enum MqttPayloads
+{
+    MQTT_PAYLOAD_JSON,              // {"rxpk":[...]}, as in PUSH_DATA
+    MQTT_PAYLOAD_BINARY             // the record of mqtt.h
+} MqttPayload_t;
+
+struct ConfigServer
+{
+    char address[128];
+    uint16_t port;
+    ServerBackend_t backend;
+    uint8_t protocol_version;       // 0 when not set, for version 1
+    bool enabled;
+    ConfigRule rules[CONFIG_MAX_RULES];  // none to get every frame
+    int rule_count;
+
+    // mqtt backend, {eui} in a topic is replaced by the gateway EUI
+    char topic_up[96];              // empty for gateway/{eui}/up
+    char topic_down[96];            // empty for gateway/{eui}/down
+    char username[64];              // empty to connect without
+    char password[64];
+    MqttPayload_t payload;
+    uint8_t qos;                    // of uplinks, 0 or 1
+    uint8_t max_inflight;           // QoS 1 uplinks awaiting a PUBACK, 0 for 16
+    uint16_t keepalive;             // s, 0 for 30
+};
+
+struct ConfigChannel
+{
+    uint32_t freq;                  // in Hz
+    SpreadingFactor_t sf;           // 0 for the SX127x_conf one
+    Bandwidth_t bw;                 // 0 for the SX127x_conf one
+};
+
+typedef enum HopPolicies
+{
+    HOP_FIXED,                      // the same dwell on every channel
+    HOP_ADAPTIVE                    // dwell weighted by observed traffic
+} HopPolicy_t;
+
+struct Config
+{
+    // SX127x_conf
+    Sx127xConf sx127x;
+    uint32_t watchdog_interval;     // seconds, 0 disables the watchdog
+    int pin_nss;
+    int pin_dio0;
+    int pin_dio1;                   // FSK FifoLevel, 0xff when not wired
+    int pin_rst;
+    int pin_led1;                   // 0xff when there is no LED
+    ConfigChannel channels[CONFIG_MAX_CHANNELS];  // none to stay on freq
+    int channel_count;
+    HopPolicy_t hop_policy;
+    uint32_t hop_dwell;             // ms per channel, on average
+    uint32_t noise_scan_interval;   // ms between RSSI samples, 0 for none
+
+    // gateway_conf
+    uint64_t gateway_id;            // 0 to derive it from a MAC address
+    char interface_name[16];        // empty for the first one with a MAC
+    double ref_latitude;
+    double ref_longitude;
+    int ref_altitude;
+    char name[24];
+    char email[40];
+    char desc[64];
+    bool forward_crc_error;         // frames failing their CRC, as stat -1
+    bool forward_crc_disabled;      // frames without a CRC, as stat 0
+    uint16_t metrics_port;          // 0 disables the endpoint
+    char trace_capture_file[256];   // empty for no capture
+    uint32_t trace_capture_seconds;
+    bool realtime;
+    int realtime_priority;
+    int realtime_cpu;               // -1 for any
+    uint32_t rx_queue_depth;        // a power of two
+    uint32_t uplink_queue_depth;    // frames waiting for the servers
+    uint32_t uplink_max_age[4];     // ms per UplinkClass_t, 0 for no limit
+    AllocGuardMode_t alloc_guard;
+    uint32_t dns_refresh_interval;  // seconds, 0 resolves once
+    uint32_t keepalive_interval;    // seconds, 0 disables keepalives
+    bool config_watch;              // reload when the files change
+    char control_socket[108];       // Unix socket path, empty for none
+    char packet_feed[64];           // shared memory object, empty for none
+    uint32_t packet_feed_slots;     // a power of two
+    ConfigServer servers[CONFIG_MAX_SERVERS];
+    int server_count;
+};
+
+// Built-in values of every key
+void ConfigDefaults(Config* conf);
+
+// Parse one file over conf. Returns false with the reason in error, conf
+// may then be partly updated.
+bool ConfigLoad(const char* path, Config* conf, char* error, size_t size);
+
+// Defaults, then global_conf.json, then local_conf.json if it exists
+bool ConfigLoadLayered(Config* conf, char* error, size_t size);
+
+#endif
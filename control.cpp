@@ -0,0 +1,318 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+#include "control.h"
+
+#include <rapidjson/error/en.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+using namespace rapidjson;
+
+// A request line holds at most one value per two bytes, "[0,0,...]". At
+// worst they are all on the parser stack at once, and all end up in the
+// pool, which falls back to malloc() when either runs out. The stack grows
+// as soon as it is full, hence one spare, and the header is the pool's own.
+#define PARSE_MAX_VALUES    (CONTROL_LINE_SIZE / 2 + 1)
+#define PARSE_POOL_HEADER   64
+#define PARSE_POOL_SIZE     (PARSE_MAX_VALUES * sizeof(Value) + PARSE_POOL_HEADER)
+#define PARSE_STACK_CAPACITY (PARSE_MAX_VALUES * sizeof(Value) + sizeof(Value))
+#define PARSE_STACK_SIZE    (PARSE_STACK_CAPACITY + PARSE_POOL_HEADER)
+
+// Room for the nesting levels of a reply, and the pool header
+#define REPLY_STACK_SIZE    512
+#define REPLY_LEVEL_DEPTH   8
+
+typedef GenericDocument<UTF8<>, MemoryPoolAllocator<>, MemoryPoolAllocator<> > ControlDocument;
+
+struct ControlEntry
+{
+  const char* cmd;
+  ControlCommand command;
+};
+
+struct ControlClient
+{
+  int fd;
+  int length;
+  char line[CONTROL_LINE_SIZE];
+};
+
+static ControlEntry commands[CONTROL_MAX_COMMANDS];
+static int command_count = 0;
+
+static ControlClient clients[CONTROL_MAX_CLIENTS];
+
+static Reactor* control_reactor = NULL;
+static int listener = -1;
+static char socket_path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+
+void ControlAdd(const char* cmd, ControlCommand command)
+{
+  if (command_count == CONTROL_MAX_COMMANDS) {
+    fprintf(stderr, "control: more than %d commands\n", CONTROL_MAX_COMMANDS);
+    return;
+  }
+  commands[command_count].cmd = cmd;
+  commands[command_count].command = command;
+  command_count++;
+}
+
+// Built in, lists the commands
+static const char* Help(const Value& request, FixedWriter& writer)
+{
+  writer.String("commands");
+  writer.StartArray();
+  writer.String("help");
+  for (int i = 0; i < command_count; i++) {
+    writer.String(commands[i].cmd);
+  }
+  writer.EndArray();
+  return NULL;
+}
+
+static ControlCommand FindCommand(const char* cmd)
+{
+  if (strcmp(cmd, "help") == 0) {
+    return Help;
+  }
+  for (int i = 0; i < command_count; i++) {
+    if (strcmp(commands[i].cmd, cmd) == 0) {
+      return commands[i].command;
+    }
+  }
+  return NULL;
+}
+
+// Run the command in line, parsed in place, and write the reply line.
+// Returns its length.
+static int Execute(char* line, char* reply)
+{
+  char pool[PARSE_POOL_SIZE];
+  char stack[PARSE_STACK_SIZE];
+  MemoryPoolAllocator<> value_allocator(pool, sizeof(pool));
+  MemoryPoolAllocator<> stack_allocator(stack, sizeof(stack));
+  ControlDocument request(&value_allocator, PARSE_STACK_CAPACITY, &stack_allocator);
+
+  char message[128];
+  const char* error = NULL;
+  ControlCommand command = NULL;
+  request.ParseInsitu(line);
+  if (request.HasParseError()) {
+    snprintf(message, sizeof(message), "column %u: %s", (unsigned)request.GetErrorOffset() + 1,
+             GetParseError_En(request.GetParseError()));
+    error = message;
+  } else if (!request.IsObject() || !request.HasMember("cmd") || !request["cmd"].IsString()) {
+    error = "expected an object with a \"cmd\" string";
+  } else {
+    command = FindCommand(request["cmd"].GetString());
+    if (command == NULL) {
+      snprintf(message, sizeof(message), "unknown command %.64s, try help", request["cmd"].GetString());
+      error = message;
+    }
+  }
+
+  // One byte left for the newline
+  int length = -1;
+  if (error == NULL) {
+    char writer_stack[REPLY_STACK_SIZE];
+    WriterAllocator allocator(writer_stack, sizeof(writer_stack));
+    FixedStream os(reply, CONTROL_REPLY_SIZE - 1);
+    FixedWriter writer(os, &allocator, REPLY_LEVEL_DEPTH);
+    writer.StartObject();
+    writer.String("ok");
+    writer.Bool(true);
+    error = command(request, writer);
+    if (error == NULL) {
+      writer.EndObject();
+      length = os.Finish();
+      if (length < 0) {
+        error = "reply too long";
+      }
+    }
+  }
+  if (error != NULL) {
+    char writer_stack[REPLY_STACK_SIZE];
+    WriterAllocator allocator(writer_stack, sizeof(writer_stack));
+    FixedStream os(reply, CONTROL_REPLY_SIZE - 1);
+    FixedWriter writer(os, &allocator, REPLY_LEVEL_DEPTH);
+    writer.StartObject();
+    writer.String("ok");
+    writer.Bool(false);
+    writer.String("error");
+    writer.String(error);
+    writer.EndObject();
+    length = os.Finish();
+  }
+
+  reply[length++] = '\n';
+  return length;
+}
+
+static void CloseClient(ControlClient* client)
+{
+  control_reactor->Remove(client->fd);
+  close(client->fd);
+  client->fd = -1;
+}
+
+// Returns false if the client could not take the reply and was closed
+static bool Reply(ControlClient* client, const char* reply, int length)
+{
+  if (send(client->fd, reply, length, MSG_DONTWAIT | MSG_NOSIGNAL) != length) {
+    CloseClient(client);
+    return false;
+  }
+  return true;
+}
+
+static void OnClient(int fd, uint32_t events, void* ctx)
+{
+  ControlClient* client = (ControlClient*)ctx;
+  char reply[CONTROL_REPLY_SIZE];
+
+  for (;;) {
+    ssize_t n = recv(fd, client->line + client->length, CONTROL_LINE_SIZE - 1 - client->length, MSG_DONTWAIT);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
+    }
+    if (n <= 0) {
+      CloseClient(client);
+      return;
+    }
+    client->length += n;
+
+    // Every complete line is a command
+    char* start = client->line;
+    char* end;
+    while ((end = (char*)memchr(start, '\n', client->line + client->length - start)) != NULL) {
+      *end = '\0';
+      if (end > start && end[-1] == '\r') {
+        end[-1] = '\0';
+      }
+      if (*start != '\0' && !Reply(client, reply, Execute(start, reply))) {
+        return;
+      }
+      start = end + 1;
+    }
+    client->length -= start - client->line;
+    memmove(client->line, start, client->length);
+
+    if (client->length == CONTROL_LINE_SIZE - 1) {
+      static const char too_long[] = "{\"ok\":false,\"error\":\"line too long\"}\n";
+      if (Reply(client, too_long, sizeof(too_long) - 1)) {
+        CloseClient(client);
+      }
+      return;
+    }
+  }
+}
+
+static void OnAccept(int fd, uint32_t events, void* ctx)
+{
+  int client_fd;
+  while ((client_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+    ControlClient* client = NULL;
+    for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+      if (clients[i].fd == -1) {
+        client = &clients[i];
+        break;
+      }
+    }
+    if (client == NULL || !control_reactor->Add(client_fd, EPOLLIN, OnClient, client)) {
+      static const char busy[] = "{\"ok\":false,\"error\":\"too many clients\"}\n";
+      ssize_t ret = send(client_fd, busy, sizeof(busy) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+      (void)ret;
+      close(client_fd);
+      continue;
+    }
+    client->fd = client_fd;
+    client->length = 0;
+  }
+}
+
+bool ControlStart(Reactor& reactor, const char* path)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "control: socket path too long: %s\n", path);
+    return false;
+  }
+  strcpy(addr.sun_path, path);
+
+  // Left behind by a previous run, but never remove anything else
+  struct stat st;
+  if (lstat(path, &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) {
+      fprintf(stderr, "control: %s exists and is not a socket\n", path);
+      return false;
+    }
+    unlink(path);
+  }
+
+  listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listener == -1) {
+    perror("control: socket");
+    return false;
+  }
+
+  // Commands retune the radio, owner and group only
+  mode_t mask = umask(0117);
+  int ret = bind(listener, (struct sockaddr*)&addr, sizeof(addr));
+  umask(mask);
+  if (ret == -1 || listen(listener, CONTROL_MAX_CLIENTS) == -1) {
+    fprintf(stderr, "control: %s: %s\n", path, strerror(errno));
+    close(listener);
+    listener = -1;
+    return false;
+  }
+
+  for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+    clients[i].fd = -1;
+  }
+  control_reactor = &reactor;
+  if (!reactor.Add(listener, EPOLLIN, OnAccept, NULL)) {
+    close(listener);
+    listener = -1;
+    unlink(path);
+    return false;
+  }
+  strcpy(socket_path, path);
+  return true;
+}
+
+void ControlStop()
+{
+  if (listener == -1) {
+    return;
+  }
+  for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+    if (clients[i].fd != -1) {
+      CloseClient(&clients[i]);
+    }
+  }
+  control_reactor->Remove(listener);
+  close(listener);
+  listener = -1;
+  unlink(socket_path);
+}
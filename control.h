@@ -0,0 +1,46 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+// Runtime control socket, a Unix stream socket served by the event loop.
+// Every line a client sends is a JSON command, and gets one line of compact
+// JSON back:
+//   {"cmd":"radio","sf":9}   ->  {"ok":true,...}
+//   {"cmd":"nope"}           ->  {"ok":false,"error":"unknown command nope"}
+// Requests are parsed and replies written in fixed buffers, so serving a
+// command does not touch the heap.
+
+#ifndef _CONTROL_H
+#define _CONTROL_H
+
+#include "jsonwriter.h"
+#include "reactor.h"
+
+#include <rapidjson/document.h>
+
+#define CONTROL_MAX_CLIENTS   4
+#define CONTROL_MAX_COMMANDS  16
+#define CONTROL_LINE_SIZE     512
+#define CONTROL_REPLY_SIZE    4096
+
+// Add the reply members to writer, after "ok":true, or return the error
+// message. request is the whole command object.
+typedef const char* (*ControlCommand)(const rapidjson::Value& request, FixedWriter& writer);
+
+// Register cmd, before or after ControlStart()
+void ControlAdd(const char* cmd, ControlCommand command);
+
+// Listen on path, replacing a stale socket, and serve from reactor
+bool ControlStart(Reactor& reactor, const char* path);
+
+// Close every connection and remove the socket
+void ControlStop();
+
+#endif
@@ -0,0 +1,238 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+#include "feed.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+static FeedHeader* feed_header = NULL;
+static FeedSlot* feed_slots = NULL;
+static size_t feed_size = 0;
+static uint32_t feed_mask = 0;
+
+size_t FeedSize(uint32_t slots)
+{
+  return sizeof(FeedHeader) + (size_t)slots * sizeof(FeedSlot);
+}
+
+// A header that is ours and laid out for slots slots
+static bool FeedHeaderMatches(const FeedHeader* header, uint32_t slots)
+{
+  return header->magic == FEED_MAGIC && header->version == FEED_VERSION &&
+         header->slot_size == sizeof(FeedSlot) && header->slots == slots;
+}
+
+// The object name if it is a feed of slots slots, NULL if there is none.
+// Any other object of that name is retired, readers see its magic cleared,
+// and unlinked: shrinking it in place would SIGBUS the readers that have it
+// mapped, they keep the old one until they open the name again.
+static void* FeedTakeOver(const char* name, uint32_t slots)
+{
+  int fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+  if (fd == -1) {
+    return NULL;
+  }
+  size_t length = FeedSize(slots);
+  struct stat st;
+  size_t existing = fstat(fd, &st) == 0 ? (size_t)st.st_size : 0;
+  void* p = MAP_FAILED;
+  if (existing == length) {
+    p = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+    if (p != MAP_FAILED && FeedHeaderMatches((FeedHeader*)p, slots)) {
+      close(fd);
+      return p;
+    }
+  } else if (existing >= sizeof(FeedHeader)) {
+    p = mmap(NULL, sizeof(FeedHeader), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (p != MAP_FAILED) {
+    ((FeedHeader*)p)->magic = 0;
+    munmap(p, existing == length ? length : sizeof(FeedHeader));
+  }
+  shm_unlink(name);
+  return NULL;
+}
+
+bool FeedOpen(const char* name, uint32_t slots, char* error, size_t size)
+{
+  if (slots == 0 || (slots & (slots - 1)) != 0) {
+    snprintf(error, size, "%s: %u slots, not a power of two", name, slots);
+    return false;
+  }
+  FeedClose();
+  size_t length = FeedSize(slots);
+  void* p = FeedTakeOver(name, slots);
+  if (p == NULL) {
+    // A new object, no reader has it mapped before it has its size
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd == -1 || ftruncate(fd, length) == -1) {
+      snprintf(error, size, "%s: %s", name, strerror(errno));
+      if (fd != -1) {
+        close(fd);
+        shm_unlink(name);
+      }
+      return false;
+    }
+    p = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+      snprintf(error, size, "%s: %s", name, strerror(errno));
+      shm_unlink(name);
+      return false;
+    }
+    // Zero filled by ftruncate, readers check the magic last
+    FeedHeader* header = (FeedHeader*)p;
+    header->version = FEED_VERSION;
+    header->slot_size = sizeof(FeedSlot);
+    header->slots = slots;
+    std::atomic_thread_fence(std::memory_order_release);
+    header->magic = FEED_MAGIC;
+  }
+  FeedHeader* header = (FeedHeader*)p;
+  feed_header = header;
+  feed_slots = (FeedSlot*)((uint8_t*)p + sizeof(FeedHeader));
+  feed_size = length;
+  feed_mask = slots - 1;
+  return true;
+}
+
+bool FeedIsOpen()
+{
+  return feed_header != NULL;
+}
+
+void FeedPublish(const FeedRecord& record)
+{
+  if (feed_header == NULL) {
+    return;
+  }
+  uint32_t n = feed_header->head.load(std::memory_order_relaxed);
+  FeedSlot& slot = feed_slots[n & feed_mask];
+  // Odd while the record changes, seen by a reader before any of it
+  slot.seq.store(2 * n + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  memcpy(&slot.record, &record, offsetof(FeedRecord, payload) + record.size);
+  slot.seq.store(2 * n + 2, std::memory_order_release);
+  feed_header->head.store(n + 1, std::memory_order_release);
+}
+
+uint32_t FeedCount()
+{
+  return feed_header != NULL ? feed_header->head.load(std::memory_order_relaxed) : 0;
+}
+
+void FeedClose()
+{
+  if (feed_header != NULL) {
+    munmap(feed_header, feed_size);
+    feed_header = NULL;
+    feed_slots = NULL;
+  }
+}
+
+bool FeedReader::Open(const char* name, char* error, size_t size)
+{
+  Close();
+  int fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+  if (fd == -1) {
+    snprintf(error, size, "%s: %s", name, strerror(errno));
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(FeedHeader)) {
+    snprintf(error, size, "%s: not a packet feed", name);
+    close(fd);
+    return false;
+  }
+  void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    snprintf(error, size, "%s: %s", name, strerror(errno));
+    return false;
+  }
+  const FeedHeader* header = (const FeedHeader*)p;
+  uint32_t slots = header->slots;
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (header->magic != FEED_MAGIC || header->version != FEED_VERSION || header->slot_size != sizeof(FeedSlot) ||
+      slots == 0 || (slots & (slots - 1)) != 0 || FeedSize(slots) != (size_t)st.st_size) {
+    snprintf(error, size, "%s: not a version %d packet feed", name, FEED_VERSION);
+    munmap(p, st.st_size);
+    return false;
+  }
+  header_ = header;
+  slots_ = (const FeedSlot*)((const uint8_t*)p + sizeof(FeedHeader));
+  size_ = st.st_size;
+  mask_ = slots - 1;
+  cursor_ = header->head.load(std::memory_order_acquire);
+  overruns_ = 0;
+  stale_ = false;
+  return true;
+}
+
+void FeedReader::Close()
+{
+  if (header_ != NULL) {
+    munmap((void*)header_, size_);
+    header_ = NULL;
+    slots_ = NULL;
+  }
+}
+
+bool FeedReader::Read(FeedRecord* out)
+{
+  if (header_ == NULL || stale_) {
+    return false;
+  }
+  // Retired by a forwarder started with another layout
+  if (header_->magic != FEED_MAGIC || header_->slots != mask_ + 1) {
+    stale_ = true;
+    return false;
+  }
+  for (;;) {
+    uint32_t head = header_->head.load(std::memory_order_acquire);
+    uint32_t behind = head - cursor_;
+    if (behind == 0) {
+      return false;
+    }
+    if (behind > UINT32_MAX / 2) {
+      // Ahead of the writer, its count went back: start over from it
+      cursor_ = head;
+      return false;
+    }
+    if (behind > mask_ + 1) {
+      overruns_ += behind - (mask_ + 1);
+      cursor_ = head - (mask_ + 1);
+    }
+
+    // The slot may be rewritten while it is copied, then the sequence
+    // number has moved on
+    const FeedSlot& slot = slots_[cursor_ & mask_];
+    uint32_t expected = 2 * cursor_ + 2;
+    if (slot.seq.load(std::memory_order_acquire) == expected) {
+      memcpy(out, &slot.record, sizeof(*out));
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (slot.seq.load(std::memory_order_relaxed) == expected) {
+        cursor_++;
+        return true;
+      }
+    }
+    overruns_++;
+    cursor_++;
+  }
+}
@@ -0,0 +1,127 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+// Packet feed: every received frame, as a raw record in a shared memory
+// ring, for readers on the same host.
+//
+// The ring is a POSIX shared memory object ("packet_feed", e.g.
+// "/scpf-feed", that is /dev/shm/scpf-feed) of a header and a power of two
+// of slots. The forwarder is the only writer and never waits for readers:
+// record n goes to slot n % slots, so a reader that falls more than a ring
+// behind loses the oldest records. Every slot has a sequence number, odd
+// while the record is written and 2 * (n + 1) once record n is in it, and
+// the header has the count of records written. Readers keep their own
+// cursor and overrun count, take records with a copy out of the slot and
+// check the sequence number before and after, so nothing is locked and no
+// system call is made per record.
+//
+// The object is kept when the forwarder exits. Started again with the same
+// number of slots, it goes on from the count it finds, so readers keep
+// their mapping and cursor. Started with another number of slots, it
+// clears the magic of the old object and unlinks it, then makes a new one:
+// readers keep the old mapping, find it stale and open the name again.
+
+#ifndef _FEED_H
+#define _FEED_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#define FEED_MAGIC      0x46504353      // "SCPF"
+#define FEED_VERSION    1
+
+// 32 bit atomics are lock-free everywhere, 64 bit ones not on every Pi
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "the feed needs lock-free 32 bit atomics");
+
+// One frame, little endian as the Pi is
+struct FeedRecord
+{
+    uint64_t time_us;           // UTC at reception, microseconds since the epoch
+    uint32_t tmst;              // as in rxpk, microseconds
+    uint32_t freq;              // Hz
+    uint16_t bw;                // kHz, 0 for FSK
+    int16_t rssi;               // packet RSSI, dBm
+    int8_t snr;                 // dB
+    uint8_t sf;                 // 0 for FSK
+    uint8_t chan;               // channel of the plan
+    int8_t stat;                // CRC as in rxpk: 1 good, 0 none, -1 failed
+    uint8_t size;
+    uint8_t payload[255];
+};
+
+struct alignas(64) FeedSlot
+{
+    std::atomic<uint32_t> seq;
+    FeedRecord record;
+};
+
+struct FeedHeader
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t slot_size;         // sizeof(FeedSlot)
+    uint32_t slots;             // a power of two
+    alignas(64) std::atomic<uint32_t> head;  // records written, wraps
+};
+
+// Size of the object with slots slots
+size_t FeedSize(uint32_t slots);
+
+// Writer side. Create or take over the object name with slots slots,
+// false with the reason in error. The mapping is populated, nothing is
+// allocated afterwards.
+bool FeedOpen(const char* name, uint32_t slots, char* error, size_t size);
+bool FeedIsOpen();
+
+// Write a record into the next slot, nothing when the feed is not open
+void FeedPublish(const FeedRecord& record);
+
+// Records written since the object was created
+uint32_t FeedCount();
+
+void FeedClose();
+
+// Reader side, in the reading process
+class FeedReader
+{
+public:
+    FeedReader() : header_(NULL), slots_(NULL), size_(0), mask_(0), cursor_(0), overruns_(0), stale_(false) {}
+    ~FeedReader() { Close(); }
+
+    // Map the object name read-only and start at its newest record, false
+    // with the reason in error
+    bool Open(const char* name, char* error, size_t size);
+    void Close();
+
+    // Copy the next record to out, false when there is none yet. Records
+    // overwritten before they were read are added to overruns().
+    bool Read(FeedRecord* out);
+
+    // The forwarder replaced the object, nothing more will be read from
+    // this mapping: Open() the name again
+    bool stale() const { return stale_; }
+
+    uint32_t cursor() const { return cursor_; }
+    uint64_t overruns() const { return overruns_; }
+
+private:
+    const FeedHeader* header_;
+    const FeedSlot* slots_;
+    size_t size_;
+    uint32_t mask_;
+    uint32_t cursor_;
+    uint64_t overruns_;
+    bool stale_;
+};
+
+#endif
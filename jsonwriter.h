@@ -0,0 +1,59 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+// rapidjson Writer into a fixed buffer, for JSON built on the hot path
+
+#ifndef _JSONWRITER_H
+#define _JSONWRITER_H
+
+#include <rapidjson/allocators.h>
+#include <rapidjson/writer.h>
+
+// rapidjson output stream writing straight into a caller buffer. With
+// the writer stack in a pool on the C stack, building JSON never touches
+// the heap.
+class FixedStream
+{
+public:
+  typedef char Ch;
+
+  FixedStream(char* buffer, int size)
+    : begin_(buffer), cur_(buffer), end_(buffer + size - 1), overflow_(false) {}
+
+  void Put(char c)
+  {
+    if (cur_ < end_) {
+      *cur_++ = c;
+    } else {
+      overflow_ = true;
+    }
+  }
+
+  void Flush() {}
+
+  // Null terminate, returns the length or -1 if it did not fit
+  int Finish()
+  {
+    *cur_ = '\0';
+    return overflow_ ? -1 : (int)(cur_ - begin_);
+  }
+
+private:
+  char* begin_;
+  char* cur_;
+  char* end_;
+  bool overflow_;
+};
+
+typedef rapidjson::MemoryPoolAllocator<> WriterAllocator;
+typedef rapidjson::Writer<FixedStream, rapidjson::UTF8<>, rapidjson::UTF8<>, WriterAllocator> FixedWriter;
+
+#endif
@@ -0,0 +1,241 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+#include "metrics.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <thread>
+
+#define METRICS_PREFIX "lora_pkt_fwd_"
+#define METRICS_CLIENT_TIMEOUT_MS   1000    // per recv()/send(), a stuck scraper only stalls this long
+#define METRICS_ACCEPT_BACKOFF_MS   100     // out of descriptors or memory
+
+using namespace std;
+
+Metrics metrics;
+
+static mutex server_names_lock;
+static string server_names[METRICS_MAX_SERVERS];
+static unsigned int server_count = 0;
+
+#define METRICS_MAX_RENDERERS   4
+static void (*renderers[METRICS_MAX_RENDERERS])(string& out);
+static unsigned int renderer_count = 0;
+
+uint32_t MicrosNow()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t)((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+void MetricsSetServerNames(const vector<string>& names)
+{
+  lock_guard<mutex> guard(server_names_lock);
+  server_count = 0;
+  for (size_t i = 0; i < names.size() && i < METRICS_MAX_SERVERS; i++) {
+    server_names[server_count++] = names[i];
+  }
+}
+
+static uint64_t Load(const Counter& counter)
+{
+  return counter.load(memory_order_relaxed);
+}
+
+static void RenderCounter(string& out, const char* name, const char* help, const Counter& counter)
+{
+  char line[256];
+  snprintf(line, sizeof(line), "# HELP " METRICS_PREFIX "%s %s\n# TYPE " METRICS_PREFIX "%s counter\n"
+           METRICS_PREFIX "%s %llu\n", name, help, name, name, (unsigned long long)Load(counter));
+  out += line;
+}
+
+static void RenderServerCounter(string& out, const char* name, const char* help, Counter ServerMetrics::*field)
+{
+  char line[256];
+  snprintf(line, sizeof(line), "# HELP " METRICS_PREFIX "%s %s\n# TYPE " METRICS_PREFIX "%s counter\n",
+           name, help, name);
+  out += line;
+  lock_guard<mutex> guard(server_names_lock);
+  for (unsigned int i = 0; i < server_count; i++) {
+    snprintf(line, sizeof(line), METRICS_PREFIX "%s{server=\"%s\"} %llu\n", name, server_names[i].c_str(),
+             (unsigned long long)Load(metrics.servers[i].*field));
+    out += line;
+  }
+}
+
+static void RenderSfCounter(string& out, const char* name, const char* help, Counter SfMetrics::*field)
+{
+  char line[256];
+  snprintf(line, sizeof(line), "# HELP " METRICS_PREFIX "%s %s\n# TYPE " METRICS_PREFIX "%s counter\n",
+           name, help, name);
+  out += line;
+  for (int i = 0; i < METRICS_SF_COUNT; i++) {
+    snprintf(line, sizeof(line), METRICS_PREFIX "%s{sf=\"%d\"} %llu\n", name, METRICS_SF_MIN + i,
+             (unsigned long long)Load(metrics.sf[i].*field));
+    out += line;
+  }
+}
+
+static void RenderHistogram(string& out, const char* name, const char* help, const Histogram& histogram)
+{
+  char line[256];
+  snprintf(line, sizeof(line), "# HELP " METRICS_PREFIX "%s %s\n# TYPE " METRICS_PREFIX "%s histogram\n",
+           name, help, name);
+  out += line;
+
+  uint64_t cumulative = 0;
+  for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    cumulative += Load(histogram.buckets[i]);
+    if (i < HISTOGRAM_BUCKETS - 1) {
+      snprintf(line, sizeof(line), METRICS_PREFIX "%s_bucket{le=\"%g\"} %llu\n", name,
+               histogram_bounds_us[i] / 1e6, (unsigned long long)cumulative);
+    } else {
+      snprintf(line, sizeof(line), METRICS_PREFIX "%s_bucket{le=\"+Inf\"} %llu\n", name,
+               (unsigned long long)cumulative);
+    }
+    out += line;
+  }
+  snprintf(line, sizeof(line), METRICS_PREFIX "%s_sum %g\n" METRICS_PREFIX "%s_count %llu\n",
+           name, Load(histogram.sum_us) / 1e6, name, (unsigned long long)Load(histogram.count));
+  out += line;
+}
+
+void MetricsAddRenderer(void (*render)(string& out))
+{
+  if (renderer_count < METRICS_MAX_RENDERERS) {
+    renderers[renderer_count++] = render;
+  }
+}
+
+string MetricsRender()
+{
+  string out;
+  out.reserve(8192);
+
+  RenderCounter(out, "rx_received_total", "Frames received by the radio, CRC errors included", metrics.rx_received);
+  RenderCounter(out, "rx_crc_error_total", "Frames received with a CRC error", metrics.rx_crc_error);
+  RenderCounter(out, "rx_no_crc_total", "Frames received without a payload CRC", metrics.rx_no_crc);
+  RenderCounter(out, "rx_valid_header_total", "LoRa headers the modem accepted, frames completed or not", metrics.rx_valid_header);
+  RenderCounter(out, "up_forwarded_total", "Uplinks sent to at least one server", metrics.up_forwarded);
+  RenderCounter(out, "up_dropped_total", "Uplinks that no server accepted", metrics.up_dropped);
+  RenderCounter(out, "up_unrouted_total", "Uplinks that no server has a rule for", metrics.up_unrouted);
+  RenderCounter(out, "radio_recoveries_total", "Radio reinitializations by the watchdog", metrics.radio_recoveries);
+  RenderCounter(out, "rx_queue_overflow_total", "Frames dropped because the forwarding queue was full", metrics.rx_queue_overflow);
+  RenderCounter(out, "heap_allocs_total", "Heap allocations by the receive path after init (alloc guard builds)", metrics.heap_allocs);
+
+  RenderServerCounter(out, "server_sent_total", "PUSH_DATA datagrams, or Basics Station and MQTT uplink messages, sent", &ServerMetrics::sent);
+  RenderServerCounter(out, "server_acked_total", "PUSH_ACK datagrams, or MQTT PUBACKs, received", &ServerMetrics::acked);
+  RenderServerCounter(out, "server_send_errors_total", "Failed sendto() calls, or uplinks a Basics Station or MQTT queue dropped", &ServerMetrics::send_errors);
+  RenderServerCounter(out, "server_filtered_total", "Uplinks the routing rules of the server did not match", &ServerMetrics::filtered);
+  RenderServerCounter(out, "server_reconnects_total", "Basics Station and MQTT connections lost", &ServerMetrics::reconnects);
+  RenderServerCounter(out, "server_downlinks_total", "Basics Station and MQTT downlinks received, none sent", &ServerMetrics::downlinks);
+
+  RenderSfCounter(out, "sf_rx_total", "Frames received per spreading factor, CRC errors included", &SfMetrics::rx);
+  RenderSfCounter(out, "sf_crc_error_total", "Frames received per spreading factor with a CRC error", &SfMetrics::crc_error);
+  RenderSfCounter(out, "sf_no_crc_total", "Frames received per spreading factor without a payload CRC", &SfMetrics::no_crc);
+  RenderSfCounter(out, "sf_valid_header_total", "LoRa headers accepted per spreading factor, frames completed or not", &SfMetrics::valid_header);
+
+  RenderHistogram(out, "irq_to_send_seconds", "DIO0 edge to last uplink datagram sent", metrics.irq_to_send);
+  RenderHistogram(out, "spi_read_seconds", "SPI time to read a frame and its status", metrics.spi_read);
+  RenderHistogram(out, "json_build_seconds", "Time to encode and build an rxpk", metrics.json_build);
+  RenderHistogram(out, "dns_seconds", "Server hostname resolution time", metrics.dns);
+  RenderHistogram(out, "radio_wakeup_seconds", "DIO0 interrupt to the radio loop running", metrics.radio_wakeup);
+  RenderHistogram(out, "radio_handoff_seconds", "Radio thread to forwarding thread queueing delay", metrics.radio_handoff);
+
+  for (unsigned int i = 0; i < renderer_count; i++) {
+    renderers[i](out);
+  }
+
+  return out;
+}
+
+static void Serve(int listener)
+{
+  char request[1024];
+
+  const struct timeval timeout = { METRICS_CLIENT_TIMEOUT_MS / 1000, (METRICS_CLIENT_TIMEOUT_MS % 1000) * 1000 };
+  while (true) {
+    int client = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+    if (client < 0) {
+      // EMFILE and friends fail again right away until something is closed
+      if (errno != EINTR && errno != ECONNABORTED) {
+        this_thread::sleep_for(chrono::milliseconds(METRICS_ACCEPT_BACKOFF_MS));
+      }
+      continue;
+    }
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    // Only the request line matters, headers and body are ignored
+    ssize_t n = recv(client, request, sizeof(request) - 1, 0);
+    if (n > 0) {
+      request[n] = '\0';
+
+      string body;
+      const char* status;
+      if (strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET / ", 6) == 0) {
+        status = "200 OK";
+        body = MetricsRender();
+      } else {
+        status = "404 Not Found";
+        body = "not found\n";
+      }
+
+      char header[160];
+      int header_len = snprintf(header, sizeof(header),
+                                "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                "Content-Length: %zu\r\nConnection: close\r\n\r\n", status, body.size());
+      send(client, header, header_len, MSG_NOSIGNAL);
+      send(client, body.data(), body.size(), MSG_NOSIGNAL);
+    }
+    close(client);
+  }
+}
+
+bool MetricsStart(uint16_t port)
+{
+  int listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listener < 0) {
+    perror("metrics socket");
+    return false;
+  }
+
+  int on = 1;
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+
+  if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listener, 4) < 0) {
+    perror("metrics bind");
+    close(listener);
+    return false;
+  }
+
+  thread(Serve, listener).detach();
+  return true;
+}
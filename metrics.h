@@ -0,0 +1,145 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+// Monotonic counters and latency histograms, served in the Prometheus text
+// format on http://127.0.0.1:<metrics_port>/metrics by a thread of its own.
+//
+// Everything the receive path touches is a relaxed std::atomic, so updating
+// a metric costs one uncontended atomic add and never takes a lock.
+
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#include <atomic>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#define METRICS_MAX_SERVERS     8
+
+// Uplink queue classes, see UplinkClass_t
+#define METRICS_UPLINK_CLASSES  4
+
+// txpk outcomes, see TxError_t
+#define METRICS_TX_ERRORS       8
+
+// LoRa spreading factors SF7 to SF12
+#define METRICS_SF_MIN          7
+#define METRICS_SF_COUNT        6
+
+// Bucket upper bounds in microseconds, +Inf is implicit
+static constexpr uint32_t histogram_bounds_us[] = {
+    10, 25, 50, 100, 250, 500,
+    1000, 2500, 5000, 10000, 25000, 50000,
+    100000, 250000, 1000000
+};
+#define HISTOGRAM_BUCKETS  (sizeof(histogram_bounds_us) / sizeof(histogram_bounds_us[0]) + 1)
+
+typedef std::atomic<uint64_t> Counter;
+
+static inline void Inc(Counter& counter, uint64_t n = 1)
+{
+    counter.fetch_add(n, std::memory_order_relaxed);
+}
+
+struct Histogram
+{
+    Counter buckets[HISTOGRAM_BUCKETS];
+    Counter sum_us;
+    Counter count;
+
+    void Observe(uint32_t us)
+    {
+        size_t i = 0;
+        while (i < HISTOGRAM_BUCKETS - 1 && us > histogram_bounds_us[i]) {
+            i++;
+        }
+        Inc(buckets[i]);
+        Inc(sum_us, us);
+        Inc(count);
+    }
+};
+
+struct ServerMetrics
+{
+    Counter sent;
+    Counter acked;
+    Counter send_errors;
+    Counter filtered;           // frames its rules did not match
+    Counter reconnects;         // Basics Station and MQTT: connections lost
+    Counter downlinks;          // Basics Station and MQTT: received, not sent
+};
+
+// LoRa frames per spreading factor, to tell collisions from coverage: a
+// header the modem accepted without a frame completing after it was most
+// likely run over by another transmission
+struct SfMetrics
+{
+    Counter rx;                 // CRC errors included
+    Counter crc_error;
+    Counter no_crc;
+    Counter valid_header;       // frames completed or not
+};
+
+struct UplinkClassMetrics
+{
+    std::atomic<uint32_t> depth;    // frames queued now
+    Counter sent;
+    Counter expired;            // older than the class allows
+    Counter full;               // made room for a frame of the same or a higher class
+};
+
+struct Metrics
+{
+    Counter rx_received;        // frames out of the radio, CRC errors included
+    Counter rx_crc_error;
+    Counter rx_no_crc;          // frames sent without a payload CRC
+    Counter rx_valid_header;    // LoRa headers accepted, frames completed or not
+    Counter up_forwarded;       // rxpk datagrams handed to at least one server
+    Counter up_dropped;         // rxpk datagrams no server accepted
+    Counter up_unrouted;        // frames no server has a rule for
+    Counter radio_recoveries;
+    Counter rx_queue_overflow;  // frames the radio thread could not queue
+    Counter heap_allocs;        // heap allocations after init, see alloc.h
+
+    ServerMetrics servers[METRICS_MAX_SERVERS];
+    SfMetrics sf[METRICS_SF_COUNT];
+    UplinkClassMetrics uplink[METRICS_UPLINK_CLASSES];
+    Counter txpk[METRICS_TX_ERRORS];    // PULL_RESPs per txpk_ack.error
+    Counter txpk_invalid;               // PULL_RESPs without a usable txpk
+
+    Histogram irq_to_send;      // DIO0 seen high to last sendto() returned
+    Histogram spi_read;         // IRQ flags, FIFO and packet status
+    Histogram json_build;       // base64 and rxpk JSON
+    Histogram dns;              // getaddrinfo() per server resolution
+    Histogram radio_wakeup;     // DIO0 interrupt to the radio loop running
+    Histogram radio_handoff;    // queued by the radio thread to picked up
+};
+
+extern Metrics metrics;
+
+// Microseconds from a monotonic clock, wraps every ~71 minutes
+uint32_t MicrosNow();
+
+// Labels under which the servers are exported, by index. Can be called
+// again while the endpoint runs, when the server list is reloaded.
+void MetricsSetServerNames(const std::vector<std::string>& names);
+
+// Render all metrics in the Prometheus text exposition format
+std::string MetricsRender();
+
+// Append the output of another module to MetricsRender()
+void MetricsAddRenderer(void (*render)(std::string& out));
+
+// Serve /metrics on 127.0.0.1:port from a background thread
+bool MetricsStart(uint16_t port);
+
+#endif
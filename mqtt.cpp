@@ -0,0 +1,461 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+#include "mqtt.h"
+
+#include "uplink.h"
+#include "websocket.h"
+
+#include <poll.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#define MQTT_CONNECT_TIMEOUT    3000    // ms, TCP connect
+#define MQTT_REPLY_TIMEOUT      5000    // ms, CONNACK
+#define MQTT_KEEPALIVE          30      // s, unless set, PINGREQ after half of it idle
+#define MQTT_RX_SIZE            4096    // downlinks are small
+#define MQTT_TX_SIZE            16384   // PUBLISH batch, about a dozen JSON uplinks
+
+// Control packet types, with the flags MQTT 3.1.1 requires
+#define MQTT_CONNECT            0x10
+#define MQTT_CONNACK            0x20
+#define MQTT_PUBLISH            0x30
+#define MQTT_PUBACK             0x40
+#define MQTT_SUBSCRIBE          0x82
+#define MQTT_SUBACK             0x90
+#define MQTT_PINGREQ            0xC0
+#define MQTT_PINGRESP           0xD0
+#define MQTT_DISCONNECT         0xE0
+
+#define MQTT_PUBLISH_QOS_SHIFT  1
+
+#define MQTT_CONNECT_CLEAN      0x02
+#define MQTT_CONNECT_PASSWORD   0x40
+#define MQTT_CONNECT_USERNAME   0x80
+
+// Remaining Length, 1 to 4 bytes of 7 bits
+static size_t PutLength(uint8_t* p, size_t length)
+{
+  size_t n = 0;
+  do {
+    p[n] = length & 0x7f;
+    length >>= 7;
+    if (length != 0) {
+      p[n] |= 0x80;
+    }
+    n++;
+  } while (length != 0);
+  return n;
+}
+
+static size_t PutString(uint8_t* p, const char* str, size_t length)
+{
+  p[0] = (uint8_t)(length >> 8);
+  p[1] = (uint8_t)length;
+  memcpy(p + 2, str, length);
+  return 2 + length;
+}
+
+// Fixed header at p: 1 when complete, with the header and remaining
+// lengths, 0 when more bytes are needed, -1 when malformed
+static int ParseHeader(const uint8_t* p, size_t used, size_t* p_header, size_t* p_length)
+{
+  size_t length = 0;
+  for (size_t i = 1; i < 5; i++) {
+    if (i >= used) {
+      return 0;
+    }
+    length |= (size_t)(p[i] & 0x7f) << (7 * (i - 1));
+    if ((p[i] & 0x80) == 0) {
+      *p_header = i + 1;
+      *p_length = length;
+      return 1;
+    }
+  }
+  return -1;
+}
+
+// topic with every {eui} replaced
+static std::string ExpandTopic(const char* topic, const char* fallback, const char* eui)
+{
+  std::string expanded = topic[0] != '\0' ? topic : fallback;
+  size_t pos;
+  while ((pos = expanded.find("{eui}")) != std::string::npos) {
+    expanded.replace(pos, 5, eui);
+  }
+  return expanded;
+}
+
+size_t MqttPackRecord(const RxPkt& pkt, uint8_t* out)
+{
+  bool lora = pkt.conf->modu == MODU_LORA;
+  out[0] = MQTT_RECORD_VERSION;
+  out[1] = pkt.chan;
+  for (int i = 0; i < 4; i++) {
+    out[2 + i] = (uint8_t)(pkt.tmst >> (8 * i));
+    out[6 + i] = (uint8_t)(pkt.conf->freq >> (8 * i));
+  }
+  out[10] = lora ? (uint8_t)pkt.conf->sf : 0;
+  out[11] = lora ? (uint8_t)pkt.conf->bw : 0;
+  out[12] = lora ? (uint8_t)(pkt.conf->bw >> 8) : 0;
+  out[13] = (uint8_t)pkt.status.rssi;
+  out[14] = (uint8_t)((uint16_t)pkt.status.rssi >> 8);
+  out[15] = (uint8_t)pkt.status.snr;
+  out[16] = pkt.status.crc_error ? 0xff : pkt.status.crc_on ? 1 : 0;
+  out[17] = pkt.size;
+  memcpy(out + MQTT_RECORD_HEADER, pkt.payload, pkt.size);
+  return MQTT_RECORD_HEADER + pkt.size;
+}
+
+Mqtt::Mqtt(const ConfigServer& settings)
+  : Backend<MqttMessage>("mqtt", settings.address, settings.port, MQTT_QUEUE_DEPTH), settings_(settings),
+    max_inflight_(settings.max_inflight != 0 ? settings.max_inflight : 16),
+    keepalive_(settings.keepalive != 0 ? settings.keepalive : MQTT_KEEPALIVE), fd_(-1), next_id_(0), rx_used_(0),
+    tx_used_(0), last_rx_(0), last_tx_(0), last_ping_(0), inflight_count_(0)
+{
+  rx_ = new uint8_t[MQTT_RX_SIZE];
+  tx_ = new uint8_t[MQTT_TX_SIZE];
+  inflight_ = new MqttMessage[MQTT_MAX_INFLIGHT];
+  for (int i = 0; i < MQTT_MAX_INFLIGHT; i++) {
+    inflight_[i].packet_id = 0;
+  }
+}
+
+Mqtt::~Mqtt()
+{
+  Stop();
+  delete[] inflight_;
+  delete[] tx_;
+  delete[] rx_;
+}
+
+bool Mqtt::Start(uint64_t eui)
+{
+  if (running()) {
+    return false;
+  }
+  char hex[17];
+  snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)eui);
+  topic_up_ = ExpandTopic(settings_.topic_up, "gateway/{eui}/up", hex);
+  topic_down_ = ExpandTopic(settings_.topic_down, "gateway/{eui}/down", hex);
+  // 23 characters at most, as every broker takes
+  client_id_ = std::string("scpf-") + hex;
+  return StartThread();
+}
+
+bool Mqtt::Queue(const uint8_t* data, size_t length)
+{
+  MqttMessage message;
+  if (length > sizeof(message.data)) {
+    Count(&ServerMetrics::send_errors);
+    return false;
+  }
+  message.packet_id = 0;
+  message.length = (uint16_t)length;
+  memcpy(message.data, data, length);
+  return Backend<MqttMessage>::Queue(message);
+}
+
+bool Mqtt::Handshake(char* error, size_t size)
+{
+  const char* username = settings_.username;
+  const char* password = settings_.password;
+  uint8_t body[512];
+  size_t n = PutString(body, "MQTT", 4);
+  body[n++] = 4;                // protocol level, 3.1.1
+  body[n++] = MQTT_CONNECT_CLEAN | (username[0] != '\0' ? MQTT_CONNECT_USERNAME : 0) |
+              (username[0] != '\0' && password[0] != '\0' ? MQTT_CONNECT_PASSWORD : 0);
+  body[n++] = (uint8_t)(keepalive_ >> 8);
+  body[n++] = (uint8_t)keepalive_;
+  n += PutString(body + n, client_id_.c_str(), client_id_.size());
+  if (username[0] != '\0') {
+    n += PutString(body + n, username, strlen(username));
+    if (password[0] != '\0') {
+      n += PutString(body + n, password, strlen(password));
+    }
+  }
+  uint8_t packet[520];
+  packet[0] = MQTT_CONNECT;
+  size_t header = 1 + PutLength(packet + 1, n);
+  memcpy(packet + header, body, n);
+  if (!WriteAll(fd_, packet, header + n)) {
+    snprintf(error, size, "sending CONNECT failed");
+    return false;
+  }
+
+  // CONNACK: session present, return code
+  rx_used_ = 0;
+  while (rx_used_ < 4) {
+    struct pollfd pfd = { fd_, POLLIN, 0 };
+    ssize_t got = 0;
+    if (poll(&pfd, 1, MQTT_REPLY_TIMEOUT) == 1) {
+      got = read(fd_, rx_ + rx_used_, MQTT_RX_SIZE - rx_used_);
+    }
+    if (got <= 0) {
+      snprintf(error, size, "no CONNACK");
+      return false;
+    }
+    rx_used_ += got;
+  }
+  if (rx_[0] != MQTT_CONNACK || rx_[1] != 2) {
+    snprintf(error, size, "expected a CONNACK");
+    return false;
+  }
+  if (rx_[3] != 0) {
+    static const char* const reasons[] = {
+      "", "unacceptable protocol version", "client ID rejected", "server unavailable",
+      "bad user name or password", "not authorized"
+    };
+    snprintf(error, size, "connection refused: %s", rx_[3] < 6 ? reasons[rx_[3]] : "unknown reason");
+    return false;
+  }
+  memmove(rx_, rx_ + 4, rx_used_ - 4);
+  rx_used_ -= 4;
+
+  // Downlinks at QoS 1, the SUBACK is checked with the other packets
+  n = 0;
+  if (++next_id_ == 0) {
+    next_id_ = 1;
+  }
+  body[n++] = (uint8_t)(next_id_ >> 8);
+  body[n++] = (uint8_t)next_id_;
+  n += PutString(body + n, topic_down_.c_str(), topic_down_.size());
+  body[n++] = 1;
+  packet[0] = MQTT_SUBSCRIBE;
+  header = 1 + PutLength(packet + 1, n);
+  memcpy(packet + header, body, n);
+  if (!WriteAll(fd_, packet, header + n)) {
+    snprintf(error, size, "sending SUBSCRIBE failed");
+    return false;
+  }
+  last_rx_ = last_tx_ = MillisNow();
+  last_ping_ = 0;
+  return true;
+}
+
+bool Mqtt::AddPublish(const MqttMessage& message)
+{
+  uint8_t qos = settings_.qos;
+  size_t remaining = 2 + topic_up_.size() + (qos != 0 ? 2 : 0) + message.length;
+  size_t size = 1 + 4 + remaining;
+  if (tx_used_ + size > MQTT_TX_SIZE && !Flush()) {
+    return false;
+  }
+  uint8_t* p = tx_ + tx_used_;
+  size_t n = 0;
+  p[n++] = MQTT_PUBLISH | qos << MQTT_PUBLISH_QOS_SHIFT;
+  n += PutLength(p + n, remaining);
+  n += PutString(p + n, topic_up_.c_str(), topic_up_.size());
+  if (qos != 0) {
+    p[n++] = (uint8_t)(message.packet_id >> 8);
+    p[n++] = (uint8_t)message.packet_id;
+  }
+  memcpy(p + n, message.data, message.length);
+  tx_used_ += n + message.length;
+  return true;
+}
+
+bool Mqtt::Flush()
+{
+  if (tx_used_ == 0) {
+    return true;
+  }
+  bool ok = WriteAll(fd_, tx_, tx_used_);
+  tx_used_ = 0;
+  last_tx_ = MillisNow();
+  return ok;
+}
+
+bool Mqtt::Publish()
+{
+  MqttMessage message;
+  while (settings_.qos == 0 || inflight_count_ < max_inflight_) {
+    if (!Pop(&message)) {
+      break;
+    }
+    if (settings_.qos != 0) {
+      do {
+        next_id_++;
+      } while (next_id_ == 0);
+      message.packet_id = next_id_;
+      int slot = 0;
+      while (inflight_[slot].packet_id != 0) {
+        slot++;
+      }
+      inflight_[slot] = message;
+      inflight_count_++;
+    }
+    if (!AddPublish(message)) {
+      return false;
+    }
+    Count(&ServerMetrics::sent);
+  }
+  return Flush();
+}
+
+void Mqtt::HandleDownlink(const uint8_t* topic, size_t topic_length, uint8_t* payload, size_t length)
+{
+  Count(&ServerMetrics::downlinks);
+  char json[MQTT_RX_SIZE + 1];
+  memcpy(json, payload, length);
+  json[length] = '\0';
+  int error = CheckTxpk(json, TmstNow());
+  if (error < 0) {
+    Inc(metrics.txpk_invalid);
+  } else {
+    Inc(metrics.txpk[error]);
+  }
+  printf("mqtt: downlink on %.*s: %s, not sent: no transmit path\n", (int)topic_length, (const char*)topic,
+         error < 0 ? "not a txpk" : tx_error_names[error]);
+  fflush(stdout);
+}
+
+bool Mqtt::HandlePackets()
+{
+  for (;;) {
+    size_t header, length;
+    int complete = ParseHeader(rx_, rx_used_, &header, &length);
+    if (complete < 0 || header + length > MQTT_RX_SIZE) {
+      fprintf(stderr, "mqtt: %s:%hu: packet malformed or over %d bytes\n", settings_.address, settings_.port,
+              MQTT_RX_SIZE);
+      return false;
+    }
+    if (complete == 0 || rx_used_ < header + length) {
+      return true;
+    }
+    uint8_t type = rx_[0] & 0xf0;
+    uint8_t* body = rx_ + header;
+    if (type == MQTT_PUBACK && length >= 2) {
+      uint16_t id = body[0] << 8 | body[1];
+      for (int i = 0; i < MQTT_MAX_INFLIGHT; i++) {
+        if (inflight_[i].packet_id == id) {
+          inflight_[i].packet_id = 0;
+          inflight_count_--;
+          Count(&ServerMetrics::acked);
+          break;
+        }
+      }
+    } else if (type == MQTT_PUBLISH && length >= 2) {
+      uint8_t qos = (rx_[0] >> MQTT_PUBLISH_QOS_SHIFT) & 0x03;
+      size_t topic_length = body[0] << 8 | body[1];
+      size_t offset = 2 + topic_length + (qos != 0 ? 2 : 0);
+      if (offset <= length) {
+        HandleDownlink(body + 2, topic_length, body + offset, length - offset);
+        if (qos != 0) {
+          uint8_t puback[4] = { MQTT_PUBACK, 2, body[2 + topic_length], body[3 + topic_length] };
+          if (!WriteAll(fd_, puback, sizeof(puback))) {
+            return false;
+          }
+        }
+      }
+    } else if (type == MQTT_SUBACK && length >= 3 && body[2] == 0x80) {
+      fprintf(stderr, "mqtt: %s:%hu: subscription to %s refused\n", settings_.address, settings_.port,
+              topic_down_.c_str());
+    }
+    memmove(rx_, rx_ + header + length, rx_used_ - header - length);
+    rx_used_ -= header + length;
+  }
+}
+
+void Mqtt::Serve()
+{
+  DropStale();
+  // The new session knows nothing of the window, publish it again
+  for (int i = 0; i < MQTT_MAX_INFLIGHT; i++) {
+    if (inflight_[i].packet_id != 0 && !AddPublish(inflight_[i])) {
+      return;
+    }
+  }
+  if (!Flush()) {
+    return;
+  }
+  ready_ = true;
+
+  // A PINGREQ keeps the broker from timing us out when we have nothing to
+  // send, and gets an answer when it has nothing to send, as at QoS 0
+  const int64_t ping_interval = keepalive_ * 1000 / 2;
+  const int64_t rx_timeout = keepalive_ * 1500;
+  struct pollfd pfds[2] = { { fd_, POLLIN, 0 }, { wake_, POLLIN, 0 } };
+  while (!stop_) {
+    int64_t now = MillisNow();
+    if (now - last_rx_ > rx_timeout) {
+      fprintf(stderr, "mqtt: %s:%hu: keepalive timeout\n", settings_.address, settings_.port);
+      break;
+    }
+    bool ping_answered = last_ping_ <= last_rx_;
+    if (now - last_tx_ >= ping_interval || (ping_answered && now - last_rx_ >= ping_interval)) {
+      uint8_t ping[2] = { MQTT_PINGREQ, 0 };
+      if (!WriteAll(fd_, ping, sizeof(ping))) {
+        break;
+      }
+      last_tx_ = last_ping_ = now;
+      ping_answered = false;
+    }
+    // Next PINGREQ, or the timeout while one is unanswered
+    int64_t next = last_tx_ + ping_interval;
+    int64_t rx_next = ping_answered ? last_rx_ + ping_interval : last_rx_ + rx_timeout + 1;
+    int timeout = (int)((rx_next < next ? rx_next : next) - now);
+    if (poll(pfds, 2, timeout > 0 ? timeout : 0) < 0 && errno != EINTR) {
+      break;
+    }
+    if (pfds[0].revents != 0) {
+      ssize_t n = read(fd_, rx_ + rx_used_, MQTT_RX_SIZE - rx_used_);
+      if (n <= 0) {
+        break;
+      }
+      rx_used_ += n;
+      last_rx_ = MillisNow();
+      if (!HandlePackets()) {
+        break;
+      }
+    }
+    if (pfds[1].revents & POLLIN) {
+      ClearWake();
+    }
+    // PUBACKs may have opened the window as well
+    if (!Publish()) {
+      break;
+    }
+  }
+  if (stop_) {
+    uint8_t disconnect[2] = { MQTT_DISCONNECT, 0 };
+    WriteAll(fd_, disconnect, sizeof(disconnect));
+  }
+}
+
+bool Mqtt::Connect()
+{
+  char error[256];
+  fd_ = TcpConnect(settings_.address, settings_.port, MQTT_CONNECT_TIMEOUT, error, sizeof(error));
+  if (fd_ == -1) {
+    fprintf(stderr, "mqtt: %s\n", error);
+    return false;
+  }
+  if (!Handshake(error, sizeof(error))) {
+    fprintf(stderr, "mqtt: %s:%hu: %s\n", settings_.address, settings_.port, error);
+    return false;
+  }
+  printf("mqtt: connected to %s:%hu, publishing to %s\n", settings_.address, settings_.port, topic_up_.c_str());
+  fflush(stdout);
+  return true;
+}
+
+void Mqtt::Disconnect()
+{
+  if (fd_ != -1) {
+    close(fd_);
+    fd_ = -1;
+  }
+  tx_used_ = 0;
+}
@@ -0,0 +1,133 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+// MQTT backend: uplinks published to an MQTT 3.1.1 broker, for a server
+// with "backend": "mqtt".
+//
+// Each such server gets an Mqtt client, a Backend with an I/O thread of
+// its own (see backend.h). It connects with a clean session, subscribes to topic_down and publishes
+// every frame to topic_up, either as the {"rxpk":[...]} JSON of PUSH_DATA
+// or as the binary record below. Whatever is queued when the thread wakes
+// up goes out in one write, so under load publishes are batched into as
+// few TCP segments as fit. QoS 1 uplinks stay in an in-flight window of
+// max_inflight messages until their PUBACK; with the window full nothing
+// more is taken from the queue. After a reconnect, the messages still in
+// the window are published again.
+//
+// Downlinks published to topic_down are PULL_RESP txpk objects. There is no
+// transmit path: they are checked as a PULL_RESP would be, counted and
+// logged, never sent.
+//
+// Binary record, little endian:
+//   offset  size
+//   0       1     format, MQTT_RECORD_VERSION
+//   1       1     channel of the plan
+//   2       4     tmst, in microseconds
+//   6       4     frequency, in Hz
+//   10      1     spreading factor, 0 for FSK
+//   11      2     bandwidth in kHz, 0 for FSK
+//   13      2     packet RSSI, in dBm, signed
+//   15      1     SNR, in dB, signed
+//   16      1     CRC: 1 good, 0 none, 0xff failed (rxpk stat)
+//   17      1     payload size
+//   18      size  payload
+
+#ifndef _MQTT_H
+#define _MQTT_H
+
+#include "backend.h"
+#include "config.h"
+#include "uplink.h"
+
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+
+#define MQTT_QUEUE_DEPTH        64      // messages, a power of two
+#define MQTT_MAX_INFLIGHT       64      // QoS 1 window, max_inflight is up to this
+#define MQTT_MAX_MESSAGE        1024    // rxpk of a 255 byte frame is about 600
+#define MQTT_RECORD_VERSION     1
+#define MQTT_RECORD_HEADER      18
+
+// A PUBLISH payload waiting for the I/O thread
+struct MqttMessage
+{
+    uint16_t packet_id;         // QoS 1, once published
+    uint16_t length;
+    uint8_t data[MQTT_MAX_MESSAGE];
+};
+
+// Pack a frame into the binary record at out, which has room for
+// MQTT_RECORD_HEADER and 255 bytes. Returns the record length.
+size_t MqttPackRecord(const RxPkt& pkt, uint8_t* out);
+
+class Mqtt : public Backend<MqttMessage>
+{
+public:
+    explicit Mqtt(const ConfigServer& settings);
+    ~Mqtt();
+
+    // Start the I/O thread, with topics and client ID for gateway eui.
+    // False if it is already running.
+    bool Start(uint64_t eui);
+
+    // Event loop side: queue a PUBLISH payload, false and counted when full
+    bool Queue(const uint8_t* data, size_t length);
+
+    const ConfigServer& settings() const { return settings_; }
+    int inflight() const { return inflight_count_.load(std::memory_order_relaxed); }
+
+private:
+    // TCP connection and Handshake()
+    bool Connect();
+
+    // CONNECT and CONNACK, then SUBSCRIBE to topic_down
+    bool Handshake(char* error, size_t size);
+
+    // Connected: publish and take packets until the connection is lost or
+    // Stop()
+    void Serve();
+    void Disconnect();
+
+    // Publish what is queued, as far as the QoS 1 window allows
+    bool Publish();
+
+    // Packets in rx_, false on a protocol error
+    bool HandlePackets();
+    void HandleDownlink(const uint8_t* topic, size_t topic_length, uint8_t* payload, size_t length);
+
+    // Append a PUBLISH of message to the write batch
+    bool AddPublish(const MqttMessage& message);
+    bool Flush();
+
+    ConfigServer settings_;
+    std::string topic_up_;
+    std::string topic_down_;
+    std::string client_id_;
+    int max_inflight_;
+    int keepalive_;             // s
+    int fd_;
+    uint16_t next_id_;
+
+    uint8_t* rx_;               // bytes read, not parsed yet
+    size_t rx_used_;
+    uint8_t* tx_;               // PUBLISH batch
+    size_t tx_used_;
+    int64_t last_rx_;           // ms, for the keepalive
+    int64_t last_tx_;
+    int64_t last_ping_;         // PINGREQ, answered once last_rx_ passes it
+
+    MqttMessage* inflight_;     // QoS 1, waiting for a PUBACK
+    std::atomic<int> inflight_count_;
+};
+
+#endif
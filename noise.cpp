@@ -0,0 +1,80 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+#include "noise.h"
+
+using namespace std;
+
+void NoiseClear(NoiseHistogram* histogram)
+{
+  for (int i = 0; i < NOISE_BINS; i++) {
+    histogram->bins[i].store(0, memory_order_relaxed);
+  }
+  histogram->total.store(0, memory_order_relaxed);
+  histogram->samples.store(0, memory_order_relaxed);
+}
+
+void NoiseAdd(NoiseHistogram* histogram, int rssi)
+{
+  uint32_t total = histogram->total.load(memory_order_relaxed);
+  if (total >= NOISE_WINDOW) {
+    total = 0;
+    for (int i = 0; i < NOISE_BINS; i++) {
+      uint32_t count = histogram->bins[i].load(memory_order_relaxed) / 2;
+      histogram->bins[i].store(count, memory_order_relaxed);
+      total += count;
+    }
+  }
+
+  int bin = rssi - NOISE_MIN_DBM;
+  if (bin < 0) {
+    bin = 0;
+  } else if (bin >= NOISE_BINS) {
+    bin = NOISE_BINS - 1;
+  }
+  histogram->bins[bin].fetch_add(1, memory_order_relaxed);
+  histogram->total.store(total + 1, memory_order_relaxed);
+  Inc(histogram->samples);
+}
+
+bool NoiseFloorGet(const NoiseHistogram& histogram, NoiseFloor* p_floor)
+{
+  uint32_t bins[NOISE_BINS];
+  uint32_t total = 0;
+  for (int i = 0; i < NOISE_BINS; i++) {
+    bins[i] = histogram.bins[i].load(memory_order_relaxed);
+    total += bins[i];
+  }
+  if (total == 0) {
+    return false;
+  }
+
+  // Lowest bin with at least that share of the samples at or below it
+  uint32_t p10 = (total + 9) / 10;
+  uint32_t p50 = (total + 1) / 2;
+  uint32_t p90 = (total * 9 + 9) / 10;
+  uint32_t seen = 0;
+  for (int i = 0; i < NOISE_BINS; i++) {
+    uint32_t below = seen;
+    seen += bins[i];
+    int dbm = NOISE_MIN_DBM + i;
+    if (below < p10 && seen >= p10) {
+      p_floor->p10 = dbm;
+    }
+    if (below < p50 && seen >= p50) {
+      p_floor->p50 = dbm;
+    }
+    if (below < p90 && seen >= p90) {
+      p_floor->p90 = dbm;
+    }
+  }
+  return true;
+}
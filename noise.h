@@ -0,0 +1,55 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+// Noise floor histograms.
+//
+// The RSSI of a channel while no frame is on it, sampled between frames,
+// in 1 dB bins from NOISE_MIN_DBM. Once NOISE_WINDOW samples are in, every
+// bin is halved, so the percentiles follow the last few thousand samples
+// and a site that gets noisier shows it.
+//
+// Samples are added by the event loop only. The bins are atomic for the
+// metrics thread, which may see a histogram in the middle of halving.
+
+#ifndef _NOISE_H
+#define _NOISE_H
+
+#include "metrics.h"
+
+#include <atomic>
+#include <stdint.h>
+
+#define NOISE_MIN_DBM   -160
+#define NOISE_BINS      128     // up to -33 dBm, anything stronger is a frame
+#define NOISE_WINDOW    4096
+
+struct NoiseHistogram
+{
+    std::atomic<uint32_t> bins[NOISE_BINS];
+    std::atomic<uint32_t> total;    // in the bins, less after halving
+    Counter samples;                // since the histogram was cleared
+};
+
+// Percentiles of the samples, in dBm
+struct NoiseFloor
+{
+    int p10;
+    int p50;                        // the noise floor
+    int p90;                        // interference shows here first
+};
+
+void NoiseClear(NoiseHistogram* histogram);
+void NoiseAdd(NoiseHistogram* histogram, int rssi);
+
+// False while there are no samples
+bool NoiseFloorGet(const NoiseHistogram& histogram, NoiseFloor* p_floor);
+
+#endif
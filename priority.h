@@ -0,0 +1,105 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+// Strict priority queue over a few FIFO classes, class 0 first, sharing one
+// capacity. Each class is a ring over caller provided slots (see Arena)
+// large enough to hold the whole capacity, so a burst of one class never
+// has to wait for room in another. Single threaded.
+
+#ifndef _PRIORITY_H
+#define _PRIORITY_H
+
+#include <stddef.h>
+
+template<class T, int Classes>
+class PriorityQueue
+{
+public:
+    PriorityQueue() : slots_(NULL), capacity_(0), size_(0)
+    {
+        for (int i = 0; i < Classes; i++) {
+            head_[i] = 0;
+            count_[i] = 0;
+        }
+    }
+
+    // slots holds Classes x capacity items
+    bool Init(T* slots, size_t capacity)
+    {
+        if (slots == NULL || capacity == 0) {
+            return false;
+        }
+        slots_ = slots;
+        capacity_ = capacity;
+        return true;
+    }
+
+    // Queue item at the back of cls. When full, the oldest item of the
+    // lowest priority class at or below cls makes room, or item is not
+    // queued if every queued item has a higher priority. Returns the class
+    // that lost an item, -1 if none did.
+    int Push(int cls, const T& item)
+    {
+        int shed = -1;
+        if (size_ == capacity_) {
+            shed = Classes - 1;
+            while (shed > cls && count_[shed] == 0) {
+                shed--;
+            }
+            if (count_[shed] == 0) {
+                return cls;
+            }
+            Pop(shed);
+        }
+        slots_[cls * capacity_ + (head_[cls] + count_[cls]) % capacity_] = item;
+        count_[cls]++;
+        size_++;
+        return shed;
+    }
+
+    // Oldest item of cls, NULL when the class is empty
+    T* Front(int cls)
+    {
+        return count_[cls] != 0 ? &slots_[cls * capacity_ + head_[cls]] : NULL;
+    }
+
+    // Oldest item of the highest priority class, NULL when empty
+    T* Front(int* p_cls)
+    {
+        for (int cls = 0; cls < Classes; cls++) {
+            if (count_[cls] != 0) {
+                *p_cls = cls;
+                return Front(cls);
+            }
+        }
+        return NULL;
+    }
+
+    // Drop the oldest item of cls, which must not be empty
+    void Pop(int cls)
+    {
+        head_[cls] = (head_[cls] + 1) % capacity_;
+        count_[cls]--;
+        size_--;
+    }
+
+    size_t depth(int cls) const { return count_[cls]; }
+    size_t size() const { return size_; }
+
+private:
+    T* slots_;
+    size_t capacity_;
+    size_t size_;
+    size_t head_[Classes];
+    size_t count_[Classes];
+};
+
+#endif
@@ -0,0 +1,138 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+#include "reactor.h"
+
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+Reactor::Reactor()
+  : running_(false)
+{
+  epfd_ = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd_ == -1) {
+    perror("epoll_create1");
+  }
+  for (int i = 0; i < REACTOR_MAX_HANDLERS; i++) {
+    handlers_[i].fd = -1;
+  }
+}
+
+Reactor::~Reactor()
+{
+  if (epfd_ != -1) {
+    close(epfd_);
+  }
+}
+
+bool Reactor::Add(int fd, uint32_t events, ReactorHandler handler, void* ctx)
+{
+  for (int i = 0; i < REACTOR_MAX_HANDLERS; i++) {
+    if (handlers_[i].fd == -1) {
+      struct epoll_event ev;
+      memset(&ev, 0, sizeof(ev));
+      ev.events = events;
+      ev.data.ptr = &handlers_[i];
+      if (epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        perror("epoll_ctl");
+        return false;
+      }
+      handlers_[i].fd = fd;
+      handlers_[i].handler = handler;
+      handlers_[i].ctx = ctx;
+      return true;
+    }
+  }
+  fprintf(stderr, "reactor: more than %d handlers\n", REACTOR_MAX_HANDLERS);
+  return false;
+}
+
+void Reactor::Remove(int fd)
+{
+  for (int i = 0; i < REACTOR_MAX_HANDLERS; i++) {
+    if (handlers_[i].fd == fd) {
+      epoll_ctl(epfd_, EPOLL_CTL_DEL, fd, NULL);
+      handlers_[i].fd = -1;
+    }
+  }
+}
+
+void Reactor::Run()
+{
+  struct epoll_event events[REACTOR_MAX_HANDLERS];
+
+  running_ = true;
+  while (running_) {
+    int n = epoll_wait(epfd_, events, REACTOR_MAX_HANDLERS, -1);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("epoll_wait");
+      return;
+    }
+    for (int i = 0; i < n && running_; i++) {
+      Handler* h = (Handler*)events[i].data.ptr;
+      // Removed by an earlier handler of this batch
+      if (h->fd != -1) {
+        h->handler(h->fd, events[i].events, h->ctx);
+      }
+    }
+  }
+}
+
+int TimerCreate()
+{
+  int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (fd == -1) {
+    perror("timerfd_create");
+  }
+  return fd;
+}
+
+void TimerArm(int fd, uint32_t ms, bool periodic)
+{
+  struct itimerspec its;
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = ms / 1000;
+  its.it_value.tv_nsec = (long)(ms % 1000) * 1000000;
+  if (periodic) {
+    its.it_interval = its.it_value;
+  }
+  timerfd_settime(fd, 0, &its, NULL);
+}
+
+uint64_t TimerRead(int fd)
+{
+  uint64_t expirations = 0;
+  if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+    return 0;
+  }
+  return expirations;
+}
+
+int SignalCreate(const sigset_t* mask)
+{
+  if (sigprocmask(SIG_BLOCK, mask, NULL) == -1) {
+    perror("sigprocmask");
+    return -1;
+  }
+  int fd = signalfd(-1, mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (fd == -1) {
+    perror("signalfd");
+  }
+  return fd;
+}
@@ -0,0 +1,68 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+// Single threaded epoll event loop. Everything the main loop waits on is a
+// file descriptor: the DIO0 edge, timerfds, the UDP socket and a signalfd,
+// so the process sleeps in epoll_wait() until one of them is ready.
+
+#ifndef _REACTOR_H
+#define _REACTOR_H
+
+#include <signal.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+
+#define REACTOR_MAX_HANDLERS 24
+
+// Called with the ready events of fd
+typedef void (*ReactorHandler)(int fd, uint32_t events, void* ctx);
+
+class Reactor
+{
+public:
+    Reactor();
+    ~Reactor();
+
+    // Watch fd for events (EPOLLIN, EPOLLPRI...), returns false on error
+    bool Add(int fd, uint32_t events, ReactorHandler handler, void* ctx);
+    void Remove(int fd);
+
+    // Dispatch events until Stop() is called from a handler
+    void Run();
+    void Stop() { running_ = false; }
+
+private:
+    struct Handler
+    {
+        int fd;
+        ReactorHandler handler;
+        void* ctx;
+    };
+
+    int epfd_;
+    bool running_;
+    Handler handlers_[REACTOR_MAX_HANDLERS];
+};
+
+// Monotonic timerfd, disarmed. Returns -1 on error.
+int TimerCreate();
+
+// Expire in ms milliseconds, then every ms milliseconds if periodic.
+// 0 disarms the timer.
+void TimerArm(int fd, uint32_t ms, bool periodic);
+
+// Acknowledge expirations, returns how many happened since the last call
+uint64_t TimerRead(int fd);
+
+// Block the signals in mask and return a signalfd delivering them
+int SignalCreate(const sigset_t* mask);
+
+#endif
@@ -0,0 +1,152 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+#include "resolver.h"
+
+#include "metrics.h"
+#include "uplink.h"
+
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+struct ResolverName
+{
+  string address;
+  uint16_t port;
+  bool ok;
+  struct sockaddr_in addr;
+};
+
+static Reactor* resolver_reactor = NULL;
+static thread resolver_thread;
+static int request_event = -1;  // event loop -> thread, names handed over or stop
+static int done_event = -1;     // thread -> event loop, addresses in
+static atomic<bool> stopping(false);
+
+// Owned by the thread while busy, by the event loop otherwise
+static vector<ResolverName> names;
+static atomic<bool> busy(false);
+
+static void Signal(int fd)
+{
+  uint64_t one = 1;
+  ssize_t ret = write(fd, &one, sizeof(one));
+  (void)ret;
+}
+
+static void Acknowledge(int fd)
+{
+  uint64_t count;
+  ssize_t ret = read(fd, &count, sizeof(count));
+  (void)ret;
+}
+
+static void Run()
+{
+  struct pollfd pfd = { request_event, POLLIN, 0 };
+  while (!stopping) {
+    if (poll(&pfd, 1, -1) <= 0) {
+      continue;
+    }
+    Acknowledge(request_event);
+    if (stopping) {
+      break;
+    }
+    for (vector<ResolverName>::iterator it = names.begin(); it != names.end(); ++it) {
+      memset(&it->addr, 0, sizeof(it->addr));
+      it->addr.sin_family = AF_INET;
+      it->addr.sin_port = htons(it->port);
+      uint32_t start = MicrosNow();
+      it->ok = SolveHostname(it->address.c_str(), it->port, &it->addr);
+      metrics.dns.Observe(MicrosNow() - start);
+    }
+    Signal(done_event);
+  }
+}
+
+// Event loop: the thread is done, copy what resolved into the table
+static void OnResolved(int fd, uint32_t events, void* ctx)
+{
+  Acknowledge(fd);
+  for (vector<ResolverName>::const_iterator name = names.begin(); name != names.end(); ++name) {
+    if (!name->ok) {
+      continue;
+    }
+    for (vector<Server_t>::iterator it = servers.begin(); it != servers.end(); ++it) {
+      if (it->station == NULL && it->mqtt == NULL && it->address == name->address && it->port == name->port) {
+        it->addr = name->addr;
+        it->resolved = true;
+      }
+    }
+  }
+  busy.store(false, memory_order_release);
+}
+
+bool ResolverStart(Reactor& reactor)
+{
+  request_event = eventfd(0, EFD_CLOEXEC);
+  done_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (request_event == -1 || done_event == -1 || !reactor.Add(done_event, EPOLLIN, OnResolved, NULL)) {
+    perror("resolver");
+    return false;
+  }
+  resolver_reactor = &reactor;
+  stopping = false;
+  resolver_thread = thread(Run);
+  return true;
+}
+
+void ResolverRequest()
+{
+  if (resolver_reactor == NULL || busy.load(memory_order_acquire)) {
+    return;
+  }
+  names.clear();
+  for (vector<Server_t>::const_iterator it = servers.begin(); it != servers.end(); ++it) {
+    if (it->enabled && it->station == NULL && it->mqtt == NULL) {
+      ResolverName name;
+      name.address = it->address;
+      name.port = it->port;
+      name.ok = false;
+      names.push_back(name);
+    }
+  }
+  if (names.empty()) {
+    return;
+  }
+  busy.store(true, memory_order_release);
+  Signal(request_event);
+}
+
+void ResolverStop()
+{
+  if (resolver_reactor == NULL) {
+    return;
+  }
+  stopping = true;
+  Signal(request_event);
+  resolver_thread.join();
+  resolver_reactor->Remove(done_event);
+  resolver_reactor = NULL;
+  close(request_event);
+  close(done_event);
+  request_event = done_event = -1;
+}
@@ -0,0 +1,37 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+// Periodic server name refresh, off the event loop.
+//
+// getaddrinfo() blocks for the resolver timeout when the name server is
+// out of reach, e.g. with the backhaul down, and the event loop may be the
+// one draining the radio. So the refresh runs on a thread of its own:
+// ResolverRequest() hands it the names of the Semtech UDP servers, and once
+// they are resolved the event loop copies the addresses into the server
+// table. Servers removed in the meantime are skipped, and servers that do
+// not resolve keep their last good address, as with ResolveServers().
+
+#ifndef _RESOLVER_H
+#define _RESOLVER_H
+
+#include "reactor.h"
+
+// Start the thread, results are applied from reactor
+bool ResolverStart(Reactor& reactor);
+
+// Resolve the enabled Semtech UDP servers again, nothing while the last
+// refresh is still running
+void ResolverRequest();
+
+// Stop and join the thread, waits for a getaddrinfo() in progress
+void ResolverStop();
+
+#endif
@@ -0,0 +1,70 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+// Fixed size single producer, single consumer queue over caller provided
+// slots (see Arena), so nothing is allocated and neither side ever blocks
+// or takes a lock.
+
+#ifndef _RING_H
+#define _RING_H
+
+#include <atomic>
+#include <stddef.h>
+
+template<class T>
+class SpscRing
+{
+public:
+    SpscRing() : slots_(NULL), mask_(0), head_(0), tail_(0) {}
+
+    // capacity must be a power of two
+    bool Init(T* slots, size_t capacity)
+    {
+        if (slots == NULL || capacity == 0 || (capacity & (capacity - 1)) != 0) {
+            return false;
+        }
+        slots_ = slots;
+        mask_ = capacity - 1;
+        return true;
+    }
+
+    // Producer side, returns false when full
+    bool Push(const T& item)
+    {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head - tail_.load(std::memory_order_acquire) > mask_) {
+            return false;
+        }
+        slots_[head & mask_] = item;
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side, returns false when empty
+    bool Pop(T* p_item)
+    {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        if (head_.load(std::memory_order_acquire) == tail) {
+            return false;
+        }
+        *p_item = slots_[tail & mask_];
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    T* slots_;
+    size_t mask_;
+    alignas(64) std::atomic<size_t> head_;   // own cache lines, no false sharing
+    alignas(64) std::atomic<size_t> tail_;
+};
+
+#endif
@@ -0,0 +1,166 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+#include "routing.h"
+
+#include <algorithm>
+
+using namespace std;
+
+// Servers are packed one byte per class: bit cls * 8 + i is servers[i]
+// wanting frames of class cls
+#define ROUTE_CLASS_BITS  8
+#define ROUTE_MAX_RULES   (CONFIG_MAX_SERVERS * CONFIG_MAX_RULES)
+#define ROUTE_MAX_RANGES  (2 * ROUTE_MAX_RULES + 1)
+
+static_assert(CONFIG_MAX_SERVERS <= ROUTE_CLASS_BITS, "a server bit per class");
+static_assert(UPLINK_CLASSES * ROUTE_CLASS_BITS <= 32, "the classes pack into 32 bits");
+static_assert(ROUTE_MAX_RANGES <= 256, "range indexes fit a byte");
+
+struct RouteTable
+{
+    int count;
+    int shift;                              // key width - 8, to the top byte
+    uint64_t start[ROUTE_MAX_RANGES];       // first key of each range, start[0] is 0
+    uint32_t servers[ROUTE_MAX_RANGES];     // packed, see ROUTE_CLASS_BITS
+    uint8_t first[256];                     // range of the first key of each top byte
+};
+
+// Inclusive key range of one rule
+struct RouteSpan
+{
+    uint64_t min;
+    uint64_t max;
+    uint32_t servers;
+};
+
+static uint32_t route_any;                  // servers whatever the address
+static RouteTable route_devaddr;
+static RouteTable route_join_eui;
+
+// Bits of server for the classes in frames, RULE_* bits or 0 for all
+static uint32_t Pack(uint8_t frames, int server)
+{
+  uint32_t packed = 0;
+  for (int cls = 0; cls < UPLINK_CLASSES; cls++) {
+    if (frames == 0 || (frames & (1 << cls)) != 0) {
+      packed |= 1u << (cls * ROUTE_CLASS_BITS + server);
+    }
+  }
+  return packed;
+}
+
+static void Build(RouteTable* table, const RouteSpan* spans, int count, int width)
+{
+  uint64_t last = width == 64 ? UINT64_MAX : (1ull << width) - 1;
+
+  // Cut the key space at every span edge
+  uint64_t* start = table->start;
+  int ranges = 0;
+  start[ranges++] = 0;
+  for (int i = 0; i < count; i++) {
+    start[ranges++] = spans[i].min;
+    if (spans[i].max != last) {
+      start[ranges++] = spans[i].max + 1;
+    }
+  }
+  sort(start, start + ranges);
+  ranges = unique(start, start + ranges) - start;
+
+  for (int r = 0; r < ranges; r++) {
+    table->servers[r] = 0;
+    for (int i = 0; i < count; i++) {
+      if (spans[i].min <= start[r] && start[r] <= spans[i].max) {
+        table->servers[r] |= spans[i].servers;
+      }
+    }
+  }
+  table->count = ranges;
+  table->shift = width - 8;
+
+  int r = 0;
+  for (int byte = 0; byte < 256; byte++) {
+    uint64_t key = (uint64_t)byte << table->shift;
+    while (r + 1 < ranges && start[r + 1] <= key) {
+      r++;
+    }
+    table->first[byte] = (uint8_t)r;
+  }
+}
+
+static uint32_t Find(const RouteTable& table, uint64_t key)
+{
+  int r = table.first[key >> table.shift];
+  while (r + 1 < table.count && table.start[r + 1] <= key) {
+    r++;
+  }
+  return table.servers[r];
+}
+
+void RouteCompile(const Config& conf)
+{
+  RouteSpan devaddr[ROUTE_MAX_RULES];
+  RouteSpan join_eui[ROUTE_MAX_RULES];
+  int devaddr_count = 0;
+  int join_eui_count = 0;
+
+  route_any = 0;
+  for (int i = 0; i < conf.server_count; i++) {
+    const ConfigServer& server = conf.servers[i];
+    if (server.rule_count == 0) {
+      route_any |= Pack(0, i);
+    }
+    for (int j = 0; j < server.rule_count; j++) {
+      const ConfigRule& rule = server.rules[j];
+      const ConfigPrefix& prefix = rule.net_id.bits != 0 ? rule.net_id : rule.devaddr;
+      if (prefix.bits != 0) {
+        RouteSpan& span = devaddr[devaddr_count++];
+        span.min = prefix.devaddr;
+        span.max = prefix.devaddr | (uint32_t)(0xffffffffull >> prefix.bits);
+        span.servers = Pack(rule.frames != 0 ? rule.frames : RULE_DATA, i);
+      } else if (rule.join_eui.set) {
+        RouteSpan& span = join_eui[join_eui_count++];
+        span.min = rule.join_eui.min;
+        span.max = rule.join_eui.max;
+        span.servers = Pack(RULE_JOIN, i);
+      } else {
+        route_any |= Pack(rule.frames, i);
+      }
+    }
+  }
+  Build(&route_devaddr, devaddr, devaddr_count, 32);
+  Build(&route_join_eui, join_eui, join_eui_count, 64);
+}
+
+static uint64_t ReadLe(const uint8_t* p, int size)
+{
+  uint64_t value = 0;
+  for (int i = size - 1; i >= 0; i--) {
+    value = value << 8 | p[i];
+  }
+  return value;
+}
+
+uint32_t RouteServers(UplinkClass_t cls, const uint8_t* payload, uint8_t size)
+{
+  uint32_t packed = route_any;
+  if (cls == UPLINK_CONFIRMED || cls == UPLINK_UNCONFIRMED) {
+    packed |= Find(route_devaddr, ReadLe(payload + 1, 4));
+  } else if (cls == UPLINK_JOIN) {
+    // JoinRequest, or RejoinRequest type 1; types 0 and 2 carry no JoinEUI
+    if (payload[0] >> MHDR_MTYPE_SHIFT == MTYPE_JOIN_REQUEST) {
+      packed |= Find(route_join_eui, ReadLe(payload + 1, 8));
+    } else if (size == REJOIN_TYPE1_SIZE && payload[1] == 1) {
+      packed |= Find(route_join_eui, ReadLe(payload + 2, 8));
+    }
+  }
+  return packed >> (cls * ROUTE_CLASS_BITS) & ((1u << ROUTE_CLASS_BITS) - 1);
+}
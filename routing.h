@@ -0,0 +1,38 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+// Uplink routing: which servers get a frame, from the "rules" of each
+// server in gateway_conf.servers. A server without rules gets everything.
+//
+// The rules are compiled once per configuration into a table per key,
+// DevAddr for data frames and JoinEUI for joins: the key space is cut at
+// every rule boundary into disjoint ranges, each holding the servers that
+// want it as a bitset per uplink class, and a 256-entry index by the top
+// key byte points at the first range of that byte. A lookup reads the
+// index, steps over the ranges that byte is split into, none unless rules
+// cut it, and ORs in the servers whose rules do not look at the address.
+// Single threaded, like the server table.
+
+#ifndef _ROUTING_H
+#define _ROUTING_H
+
+#include "config.h"
+#include "uplink.h"
+
+#include <stdint.h>
+
+// Servers wanting a frame of class cls, bit i for servers[i]
+uint32_t RouteServers(UplinkClass_t cls, const uint8_t* payload, uint8_t size);
+
+// Compile the rules of conf.servers, in the order SetServers() keeps them
+void RouteCompile(const Config& conf);
+
+#endif
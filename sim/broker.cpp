@@ -0,0 +1,461 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+// MQTT 3.1.1 broker stand-in, for a forwarder with a "backend": "mqtt"
+// server. Takes CONNECT, SUBSCRIBE, PUBLISH at QoS 0 and 1 and PINGREQ,
+// prints every PUBLISH it gets, topic and size, one per line on stdout,
+// and closes sessions silent for 1.5 times their keepalive, as a broker
+// does. A summary per session goes to stderr on SIGINT or SIGTERM.
+//
+//   ./broker [-p port] [-a] [-s] [-c n]
+//     -p  port to listen on (default 1883)
+//     -a  leave QoS 1 PUBLISHes unacknowledged, to fill the window
+//     -s  leave PINGREQs unanswered, to test the client's keepalive timeout
+//     -c  close the connection after every n PUBLISHes, to test reconnects
+//
+// With -t it tests the keepalive instead: runs the forwarder built with
+// the simulated radio against itself with a QoS 0 and a QoS 1 server, and
+// fails unless both sessions stay up for the whole run. Uplinks alone
+// keep the broker from timing a client out, but at QoS 0 nothing comes
+// back, so the client must ping to know the broker is still there.
+//
+//   ./broker -t seconds [-k keepalive] [-r rate] [-x forwarder] [-v]
+//     -k  keepalive of both servers, in s (default 4)
+//     -r  frames/s the simulated radio receives (default 10)
+//     -x  forwarder (default ./single_chan_pkt_fwd_sim)
+//     -v  keep the forwarder output
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+using namespace std;
+
+#define BROKER_MAX_CLIENTS  8
+#define BROKER_BUFFER_SIZE  8192
+#define BROKER_MAX_SESSIONS 64
+
+// Control packet types, flags masked off
+#define MQTT_CONNECT        0x10
+#define MQTT_CONNACK        0x20
+#define MQTT_PUBLISH        0x30
+#define MQTT_PUBACK         0x40
+#define MQTT_SUBSCRIBE      0x80
+#define MQTT_SUBACK         0x90
+#define MQTT_PINGREQ        0xC0
+#define MQTT_PINGRESP       0xD0
+#define MQTT_DISCONNECT     0xE0
+
+// Every connection, for the summary
+struct Session
+{
+  char client_id[64];
+  int keepalive;                // s
+  int qos;                      // highest of its PUBLISHes, -1 for none
+  unsigned long publishes;
+  unsigned long pings;
+  bool open;
+  const char* closed;           // why, once closed
+};
+
+struct Client
+{
+  int fd;
+  Session* session;
+  uint64_t last_rx;             // ms
+  size_t used;
+  uint8_t buff[BROKER_BUFFER_SIZE];
+};
+
+static Client clients[BROKER_MAX_CLIENTS];
+static Session sessions[BROKER_MAX_SESSIONS];
+static int session_count = 0;
+static uint16_t port = 1883;
+static bool no_puback = false;
+static bool silent = false;
+static int close_every = 0;
+static bool quiet = false;
+static volatile sig_atomic_t stop = 0;
+
+// Keepalive test, see -t
+static const char* forwarder = "./single_chan_pkt_fwd_sim";
+static int test_seconds = 0;
+static int test_keepalive = 4;
+static double test_rate = 10;
+static bool verbose = false;
+
+static void OnSignal(int signo)
+{
+  stop = 1;
+}
+
+static uint64_t MonotonicMillis()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void Drop(Client& client, const char* why)
+{
+  if (client.session != NULL && client.session->open) {
+    client.session->open = false;
+    client.session->closed = why;
+  }
+  close(client.fd);
+  client.fd = -1;
+}
+
+// Replies are a few bytes, a one byte Remaining Length
+static bool Send(Client& client, uint8_t type, const uint8_t* body, size_t length)
+{
+  uint8_t packet[8] = { type, (uint8_t)length };
+  if (length > 0) {
+    memcpy(packet + 2, body, length);
+  }
+  return send(client.fd, packet, 2 + length, MSG_NOSIGNAL) == (ssize_t)(2 + length);
+}
+
+// CONNECT: protocol name, level, flags, keepalive, client ID
+static bool HandleConnect(Client& client, const uint8_t* body, size_t length)
+{
+  if (client.session != NULL || length < 12 || session_count == BROKER_MAX_SESSIONS) {
+    return false;
+  }
+  Session& session = sessions[session_count++];
+  memset(&session, 0, sizeof(session));
+  session.keepalive = body[8] << 8 | body[9];
+  session.qos = -1;
+  session.open = true;
+  size_t id_length = body[10] << 8 | body[11];
+  snprintf(session.client_id, sizeof(session.client_id), "%.*s",
+           (int)(id_length < length - 12 ? id_length : length - 12), (const char*)body + 12);
+  client.session = &session;
+  uint8_t connack[2] = { 0, 0 };
+  return Send(client, MQTT_CONNACK, connack, sizeof(connack));
+}
+
+// One packet, false to close the connection
+static bool HandlePacket(Client& client, uint8_t flags, uint8_t* body, size_t length)
+{
+  uint8_t type = flags & 0xf0;
+  if (type == MQTT_CONNECT) {
+    return HandleConnect(client, body, length);
+  }
+  if (client.session == NULL) {
+    return false;               // CONNECT comes first
+  }
+  Session& session = *client.session;
+  if (type == MQTT_SUBSCRIBE && length >= 2) {
+    uint8_t suback[3] = { body[0], body[1], 1 };
+    return Send(client, MQTT_SUBACK, suback, sizeof(suback));
+  }
+  if (type == MQTT_PINGREQ) {
+    session.pings++;
+    return silent || Send(client, MQTT_PINGRESP, NULL, 0);
+  }
+  if (type == MQTT_DISCONNECT) {
+    Drop(client, "disconnect");
+    return true;
+  }
+  if (type != MQTT_PUBLISH || length < 2) {
+    return false;
+  }
+  int qos = (flags >> 1) & 0x03;
+  size_t topic_length = body[0] << 8 | body[1];
+  size_t offset = 2 + topic_length + (qos != 0 ? 2 : 0);
+  if (offset > length) {
+    return false;
+  }
+  session.publishes++;
+  if (qos > session.qos) {
+    session.qos = qos;
+  }
+  if (!quiet) {
+    printf("%.*s %zu\n", (int)topic_length, (const char*)body + 2, length - offset);
+    fflush(stdout);
+  }
+  if (qos != 0 && !no_puback && !Send(client, MQTT_PUBACK, body + 2 + topic_length, 2)) {
+    return false;
+  }
+  if (close_every != 0 && session.publishes % close_every == 0) {
+    Drop(client, "closed, -c");
+  }
+  return true;
+}
+
+// Complete packets in the buffer, false to close the connection
+static bool HandlePackets(Client& client)
+{
+  for (;;) {
+    size_t length = 0;
+    size_t header = 0;
+    for (size_t i = 1; i < 5 && header == 0; i++) {
+      if (i >= client.used) {
+        return true;
+      }
+      length |= (size_t)(client.buff[i] & 0x7f) << (7 * (i - 1));
+      if ((client.buff[i] & 0x80) == 0) {
+        header = i + 1;
+      }
+    }
+    if (header == 0 || header + length > sizeof(client.buff)) {
+      return false;
+    }
+    if (client.used < header + length) {
+      return true;
+    }
+    uint8_t packet[BROKER_BUFFER_SIZE];
+    memcpy(packet, client.buff, header + length);
+    memmove(client.buff, client.buff + header + length, client.used - header - length);
+    client.used -= header + length;
+    if (!HandlePacket(client, packet[0], packet + header, length)) {
+      return false;
+    }
+    if (client.fd == -1) {
+      return true;
+    }
+  }
+}
+
+static int Listen()
+{
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  int one = 1;
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(addr);
+  if (bind(listener, (struct sockaddr*)&addr, len) == -1 || listen(listener, 8) == -1 ||
+      getsockname(listener, (struct sockaddr*)&addr, &len) == -1) {
+    perror("broker: bind");
+    exit(EXIT_FAILURE);
+  }
+  port = ntohs(addr.sin_port);
+  return listener;
+}
+
+// Serve until stop, or until the deadline when there is one
+static void Serve(int listener, uint64_t deadline)
+{
+  while (!stop && (deadline == 0 || MonotonicMillis() < deadline)) {
+    struct pollfd pfds[BROKER_MAX_CLIENTS + 1];
+    pfds[0].fd = listener;
+    pfds[0].events = POLLIN;
+    for (int i = 0; i < BROKER_MAX_CLIENTS; i++) {
+      pfds[i + 1].fd = clients[i].fd;
+      pfds[i + 1].events = POLLIN;
+    }
+    poll(pfds, BROKER_MAX_CLIENTS + 1, 100);
+    uint64_t now = MonotonicMillis();
+    if (pfds[0].revents & POLLIN) {
+      int fd = accept(listener, NULL, NULL);
+      int i = 0;
+      while (i < BROKER_MAX_CLIENTS && clients[i].fd != -1) {
+        i++;
+      }
+      if (i == BROKER_MAX_CLIENTS) {
+        close(fd);
+      } else if (fd != -1) {
+        clients[i].fd = fd;
+        clients[i].session = NULL;
+        clients[i].last_rx = now;
+        clients[i].used = 0;
+      }
+    }
+    for (int i = 0; i < BROKER_MAX_CLIENTS; i++) {
+      Client& client = clients[i];
+      if (client.fd == -1) {
+        continue;
+      }
+      Session* session = client.session;
+      if (session != NULL && session->keepalive != 0 && now - client.last_rx > session->keepalive * 1500u) {
+        Drop(client, "keepalive timeout");
+        continue;
+      }
+      if (pfds[i + 1].fd != client.fd || pfds[i + 1].revents == 0) {
+        continue;
+      }
+      ssize_t n = read(client.fd, client.buff + client.used, sizeof(client.buff) - client.used);
+      if (n <= 0) {
+        Drop(client, "closed by the client");
+        continue;
+      }
+      client.last_rx = now;
+      client.used += n;
+      if (!HandlePackets(client) && client.fd != -1) {
+        Drop(client, "protocol error");
+      }
+    }
+  }
+}
+
+static void Summary()
+{
+  fprintf(stderr, "{\"sessions\":[");
+  for (int i = 0; i < session_count; i++) {
+    const Session& session = sessions[i];
+    fprintf(stderr, "%s\n  {\"client_id\":\"%s\",\"keepalive\":%d,\"qos\":%d,\"publish\":%lu,\"pingreq\":%lu,"
+            "\"open\":%s,\"closed\":\"%s\"}", i == 0 ? "" : ",", session.client_id, session.keepalive,
+            session.qos, session.publishes, session.pings, session.open ? "true" : "false",
+            session.open ? "" : session.closed);
+  }
+  fprintf(stderr, "]}\n");
+}
+
+// -t: the forwarder with a QoS 0 and a QoS 1 server on this broker, both
+// sessions must last the whole run
+static int TestKeepalive(int listener)
+{
+  char dir[] = "/tmp/broker.XXXXXX";
+  if (mkdtemp(dir) == NULL) {
+    perror("mkdtemp");
+    return EXIT_FAILURE;
+  }
+  string work_dir = dir;
+  string conf = work_dir + "/global_conf.json";
+  FILE* p_file = fopen(conf.c_str(), "w");
+  if (p_file == NULL) {
+    perror(conf.c_str());
+    return EXIT_FAILURE;
+  }
+  fprintf(p_file,
+          "{\n"
+          "  \"SX127x_conf\": {\n"
+          "    \"freq\": 868100000, \"spread_factor\": 7,\n"
+          "    \"pin_nss\": 6, \"pin_dio0\": 7, \"pin_rst\": 0,\n"
+          "    \"watchdog_interval\": 0\n"
+          "  },\n"
+          "  \"gateway_conf\": {\n"
+          "    \"name\": \"broker\", \"email\": \"\", \"desc\": \"\",\n"
+          "    \"servers\": [\n"
+          "      { \"address\": \"127.0.0.1\", \"port\": %hu, \"backend\": \"mqtt\", \"enabled\": true,\n"
+          "        \"qos\": 0, \"keepalive\": %d, \"topic_up\": \"qos0/{eui}/up\" },\n"
+          "      { \"address\": \"127.0.0.1\", \"port\": %hu, \"backend\": \"mqtt\", \"enabled\": true,\n"
+          "        \"qos\": 1, \"keepalive\": %d, \"topic_up\": \"qos1/{eui}/up\" }\n"
+          "    ]\n"
+          "  }\n"
+          "}\n", port, test_keepalive, port, test_keepalive);
+  fclose(p_file);
+
+  // Resolve the forwarder before moving to its configuration directory
+  char path[4096];
+  if (realpath(forwarder, path) == NULL) {
+    perror(forwarder);
+    return EXIT_FAILURE;
+  }
+  pid_t pid = fork();
+  if (pid == -1) {
+    perror("fork");
+    return EXIT_FAILURE;
+  }
+  if (pid == 0) {
+    char rate[32];
+    snprintf(rate, sizeof(rate), "%g", test_rate);
+    setenv("SIM_RATE", rate, 1);
+    setenv("SIM_COUNT", "0", 1);
+    if (chdir(work_dir.c_str()) == -1) {
+      perror(work_dir.c_str());
+      _exit(EXIT_FAILURE);
+    }
+    if (!verbose) {
+      int fd = open("/dev/null", O_WRONLY);
+      dup2(fd, STDOUT_FILENO);
+      dup2(fd, STDERR_FILENO);
+      close(fd);
+    }
+    execl(path, path, (char*)NULL);
+    perror(path);
+    _exit(EXIT_FAILURE);
+  }
+
+  fprintf(stderr, "broker: %d s with a keepalive of %d s, %g frames/s\n", test_seconds, test_keepalive,
+          test_rate);
+  Serve(listener, MonotonicMillis() + test_seconds * 1000u);
+
+  // Judge the sessions before the forwarder disconnects them
+  bool qos0 = false;
+  bool qos1 = false;
+  bool ok = session_count == 2;
+  for (int i = 0; i < session_count; i++) {
+    ok = ok && sessions[i].open && sessions[i].publishes > 0;
+    qos0 = qos0 || sessions[i].qos == 0;
+    qos1 = qos1 || sessions[i].qos == 1;
+  }
+  ok = ok && qos0 && qos1;
+
+  int status = 0;
+  kill(pid, SIGTERM);
+  waitpid(pid, &status, 0);
+  bool exited = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  Summary();
+  fprintf(stderr, "keepalive test %s: %d sessions, forwarder %s\n", ok && exited ? "passed" : "failed",
+          session_count, exited ? "exited cleanly" : "did not exit cleanly");
+
+  unlink(conf.c_str());
+  rmdir(work_dir.c_str());
+  return ok && exited ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int main(int argc, char** argv)
+{
+  int opt;
+  while ((opt = getopt(argc, argv, "p:asc:t:k:r:x:v")) != -1) {
+    switch (opt) {
+      case 'p': port = (uint16_t)atoi(optarg); break;
+      case 'a': no_puback = true; break;
+      case 's': silent = true; break;
+      case 'c': close_every = atoi(optarg); break;
+      case 't': test_seconds = atoi(optarg); break;
+      case 'k': test_keepalive = atoi(optarg); break;
+      case 'r': test_rate = atof(optarg); break;
+      case 'x': forwarder = optarg; break;
+      case 'v': verbose = true; break;
+      default:
+        fprintf(stderr, "usage: %s [-p port] [-a] [-s] [-c n]\n"
+                "       %s -t seconds [-k keepalive] [-r rate] [-x forwarder] [-v]\n", argv[0], argv[0]);
+        return 2;
+    }
+  }
+
+  signal(SIGINT, OnSignal);
+  signal(SIGTERM, OnSignal);
+  for (int i = 0; i < BROKER_MAX_CLIENTS; i++) {
+    clients[i].fd = -1;
+  }
+
+  // Any free port for the test
+  if (test_seconds > 0) {
+    port = 0;
+    quiet = true;
+    return TestKeepalive(Listen());
+  }
+
+  int listener = Listen();
+  fprintf(stderr, "broker: listening on 127.0.0.1:%hu\n", port);
+  Serve(listener, 0);
+  Summary();
+  return 0;
+}
@@ -0,0 +1,96 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+// Packet feed reader, for a forwarder with "packet_feed" set. Prints every
+// record from the newest on, one per line on stdout, and the records read
+// and overrun to stderr on SIGINT or SIGTERM. Also a template for local
+// consumers: a FeedReader, polled while the feed is idle and opened again
+// when the forwarder replaces it.
+//
+//   ./feedcat [-f name] [-q] [-i us]
+//     -f  shared memory object (default /scpf-feed)
+//     -q  count records, print nothing per record
+//     -i  idle poll interval in microseconds (default 1000)
+
+#include "../feed.h"
+
+#include <signal.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+
+static volatile sig_atomic_t stop = 0;
+
+static void OnSignal(int signo)
+{
+  stop = 1;
+}
+
+int main(int argc, char** argv)
+{
+  const char* name = "/scpf-feed";
+  bool quiet = false;
+  int interval = 1000;
+  int opt;
+  while ((opt = getopt(argc, argv, "f:qi:")) != -1) {
+    switch (opt) {
+      case 'f': name = optarg; break;
+      case 'q': quiet = true; break;
+      case 'i': interval = atoi(optarg); break;
+      default:
+        fprintf(stderr, "usage: %s [-f name] [-q] [-i us]\n", argv[0]);
+        return 2;
+    }
+  }
+
+  FeedReader reader;
+  char error[256];
+  if (!reader.Open(name, error, sizeof(error))) {
+    fprintf(stderr, "feedcat: %s\n", error);
+    return 1;
+  }
+  signal(SIGINT, OnSignal);
+  signal(SIGTERM, OnSignal);
+
+  unsigned long records = 0;
+  FeedRecord record;
+  while (!stop) {
+    if (reader.stale() && reader.Open(name, error, sizeof(error))) {
+      fprintf(stderr, "feedcat: %s made again, reopened\n", name);
+    }
+    if (!reader.Read(&record)) {
+      usleep(interval);
+      continue;
+    }
+    records++;
+    if (quiet) {
+      continue;
+    }
+    printf("%llu.%06u tmst %u freq %u", (unsigned long long)(record.time_us / 1000000),
+           (unsigned)(record.time_us % 1000000), record.tmst, record.freq);
+    if (record.sf != 0) {
+      printf(" SF%uBW%u", record.sf, record.bw);
+    } else {
+      printf(" FSK");
+    }
+    printf(" chan %u rssi %d snr %d stat %d size %u ", record.chan, record.rssi, record.snr, record.stat,
+           record.size);
+    for (int i = 0; i < record.size; i++) {
+      printf("%02x", record.payload[i]);
+    }
+    printf("\n");
+  }
+  fflush(stdout);
+
+  fprintf(stderr, "{\"records\":%lu,\"overruns\":%llu}\n", records, (unsigned long long)reader.overruns());
+  return 0;
+}
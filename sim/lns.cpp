@@ -0,0 +1,328 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+// Basics Station LNS stand-in, for a forwarder with a "backend": "station"
+// server. Answers /router-info with a muxs URI on the same port, answers
+// the version message there with an EU868 router_config and prints every
+// message a station sends, one per line on stdout. The counts per msgtype
+// go to stderr on SIGINT or SIGTERM.
+//
+//   ./lns [-p port] [-d] [-c n] [-s]
+//     -p  port to listen on (default 6090)
+//     -d  answer every jreq with a dnmsg
+//     -c  close the muxs connection after every n uplinks, to test reconnects
+//     -s  leave pings unanswered, to test the station's liveness check
+
+#include "../websocket.h"
+
+#include <rapidjson/document.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+using namespace rapidjson;
+
+#define LNS_MAX_CLIENTS   8
+#define LNS_BUFFER_SIZE   (WEBSOCKET_MAX_MESSAGE + 16)
+
+static const char router_config[] =
+  "{\"msgtype\":\"router_config\",\"region\":\"EU863\",\"hwspec\":\"sx1301/1\","
+  "\"freq_range\":[863000000,870000000],\"NetID\":[19],\"JoinEui\":[],"
+  "\"DRs\":[[12,125,0],[11,125,0],[10,125,0],[9,125,0],[8,125,0],[7,125,0],[7,250,0],[0,0,0],"
+  "[-1,0,0],[-1,0,0],[-1,0,0],[-1,0,0],[-1,0,0],[-1,0,0],[-1,0,0],[-1,0,0]],"
+  "\"sx1301_conf\":[{}],\"nocca\":true,\"nodc\":true,\"nodwell\":true}";
+
+struct Client
+{
+  int fd;
+  bool upgraded;
+  bool muxs;                    // /traffic, not /router-info
+  int uplinks;
+  size_t used;
+  uint8_t buff[LNS_BUFFER_SIZE];
+};
+
+static Client clients[LNS_MAX_CLIENTS];
+static uint16_t port = 6090;
+static bool dnmsg = false;
+static int close_every = 0;
+static bool silent = false;
+static volatile sig_atomic_t stop = 0;
+
+static unsigned long count_version, count_updf, count_jreq, count_propdf, count_other, count_dnmsg, connections;
+
+static void OnSignal(int signo)
+{
+  stop = 1;
+}
+
+static void Drop(Client& client)
+{
+  close(client.fd);
+  client.fd = -1;
+}
+
+// Server frames are not masked
+static bool SendFrame(Client& client, uint8_t opcode, const char* text, size_t length)
+{
+  uint8_t header[4];
+  size_t header_length = 2;
+  header[0] = 0x80 | opcode;
+  if (length < 126) {
+    header[1] = (uint8_t)length;
+  } else {
+    header[1] = 126;
+    header[2] = (uint8_t)(length >> 8);
+    header[3] = (uint8_t)length;
+    header_length = 4;
+  }
+  return send(client.fd, header, header_length, MSG_NOSIGNAL) == (ssize_t)header_length &&
+         send(client.fd, text, length, MSG_NOSIGNAL) == (ssize_t)length;
+}
+
+static bool SendText(Client& client, const char* text)
+{
+  return SendFrame(client, 0x1, text, strlen(text));
+}
+
+static bool Upgrade(Client& client)
+{
+  char* request = (char*)client.buff;
+  char* end = strstr(request, "\r\n\r\n");
+  if (end == NULL) {
+    return true;                // not all there yet
+  }
+  *end = '\0';
+  char path[256];
+  const char* key = strcasestr(request, "\r\nSec-WebSocket-Key:");
+  if (sscanf(request, "GET %255s HTTP/1.1", path) != 1 || key == NULL) {
+    return false;
+  }
+  key += strlen("\r\nSec-WebSocket-Key:");
+  key += strspn(key, " ");
+  char key_copy[64];
+  snprintf(key_copy, sizeof(key_copy), "%.*s", (int)strcspn(key, "\r"), key);
+  char accept[32];
+  WebSocketAccept(key_copy, accept, sizeof(accept));
+
+  char response[256];
+  int length = snprintf(response, sizeof(response),
+                        "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                        "Sec-WebSocket-Accept: %s\r\n\r\n", accept);
+  if (send(client.fd, response, length, MSG_NOSIGNAL) != length) {
+    return false;
+  }
+  client.upgraded = true;
+  client.muxs = strncmp(path, "/traffic/", 9) == 0;
+  if (client.muxs) {
+    connections++;
+  }
+  size_t header_length = end + 4 - request;
+  memmove(client.buff, client.buff + header_length, client.used - header_length);
+  client.used -= header_length;
+  return true;
+}
+
+// One text message from a station, false to close the connection
+static bool HandleMessage(Client& client, char* text)
+{
+  if (!client.muxs) {
+    // {"router":"b827:ebff:fe12:3456"}
+    Document request;
+    request.Parse(text);
+    Value::ConstMemberIterator router = request.IsObject() ? request.FindMember("router") : request.MemberEnd();
+    if (router == request.MemberEnd() || !router->value.IsString()) {
+      SendText(client, "{\"error\":\"no router\"}");
+      return false;
+    }
+    char reply[256];
+    snprintf(reply, sizeof(reply), "{\"router\":\"%s\",\"muxs\":\"muxs-::0\",\"uri\":\"ws://127.0.0.1:%hu/traffic/%s\"}",
+             router->value.GetString(), port, router->value.GetString());
+    SendText(client, reply);
+    return false;
+  }
+
+  printf("%s\n", text);
+  fflush(stdout);
+  Document message;
+  message.Parse(text);
+  Value::ConstMemberIterator msgtype = message.IsObject() ? message.FindMember("msgtype") : message.MemberEnd();
+  const char* type = msgtype != message.MemberEnd() && msgtype->value.IsString() ? msgtype->value.GetString() : "";
+  if (strcmp(type, "version") == 0) {
+    count_version++;
+    return SendText(client, router_config);
+  }
+  if (strcmp(type, "updf") == 0) {
+    count_updf++;
+  } else if (strcmp(type, "jreq") == 0) {
+    count_jreq++;
+    Value::ConstMemberIterator dev_eui = message.FindMember("DevEui");
+    if (dnmsg && dev_eui != message.MemberEnd() && dev_eui->value.IsString()) {
+      char reply[512];
+      snprintf(reply, sizeof(reply),
+               "{\"msgtype\":\"dnmsg\",\"DevEui\":\"%s\",\"dC\":0,\"diid\":%lu,\"pdu\":\"20\","
+               "\"RxDelay\":5,\"RX1DR\":5,\"RX1Freq\":868100000,\"RX2DR\":0,\"RX2Freq\":869525000,"
+               "\"priority\":0,\"xtime\":0,\"rctx\":0}", dev_eui->value.GetString(), count_jreq);
+      SendText(client, reply);
+      count_dnmsg++;
+    }
+  } else if (strcmp(type, "propdf") == 0) {
+    count_propdf++;
+  } else {
+    count_other++;
+  }
+  client.uplinks++;
+  return close_every == 0 || client.uplinks % close_every != 0;
+}
+
+// Complete frames in the buffer, false to close the connection
+static bool HandleFrames(Client& client)
+{
+  for (;;) {
+    uint8_t* p = client.buff;
+    if (client.used < 2) {
+      return true;
+    }
+    uint8_t opcode = p[0] & 0x0f;
+    size_t length = p[1] & 0x7f;
+    size_t header = 2;
+    if (length == 126) {
+      if (client.used < 4) {
+        return true;
+      }
+      length = p[2] << 8 | p[3];
+      header = 4;
+    } else if (length == 127) {
+      return false;
+    }
+    if ((p[1] & 0x80) == 0 || (p[0] & 0x80) == 0) {
+      return false;             // stations mask and do not fragment
+    }
+    header += 4;
+    if (client.used < header + length) {
+      return true;
+    }
+    uint8_t* mask = p + header - 4;
+    char text[LNS_BUFFER_SIZE];
+    for (size_t i = 0; i < length; i++) {
+      text[i] = p[header + i] ^ mask[i % 4];
+    }
+    text[length] = '\0';
+    memmove(client.buff, client.buff + header + length, client.used - header - length);
+    client.used -= header + length;
+    if (opcode == 0x8) {
+      return false;
+    }
+    if (opcode == 0x9 && !silent && !SendFrame(client, 0xA, text, length)) {
+      return false;
+    }
+    if (opcode == 0x1 && !HandleMessage(client, text)) {
+      return false;
+    }
+  }
+}
+
+int main(int argc, char** argv)
+{
+  int opt;
+  while ((opt = getopt(argc, argv, "p:dc:s")) != -1) {
+    switch (opt) {
+      case 'p': port = (uint16_t)atoi(optarg); break;
+      case 'd': dnmsg = true; break;
+      case 'c': close_every = atoi(optarg); break;
+      case 's': silent = true; break;
+      default:
+        fprintf(stderr, "usage: %s [-p port] [-d] [-c n] [-s]\n", argv[0]);
+        return 2;
+    }
+  }
+
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  int one = 1;
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(listener, 8) == -1) {
+    perror("lns: bind");
+    return 1;
+  }
+  signal(SIGINT, OnSignal);
+  signal(SIGTERM, OnSignal);
+  for (int i = 0; i < LNS_MAX_CLIENTS; i++) {
+    clients[i].fd = -1;
+  }
+  fprintf(stderr, "lns: listening on ws://127.0.0.1:%hu/router-info\n", port);
+
+  while (!stop) {
+    struct pollfd pfds[LNS_MAX_CLIENTS + 1];
+    pfds[0].fd = listener;
+    pfds[0].events = POLLIN;
+    for (int i = 0; i < LNS_MAX_CLIENTS; i++) {
+      pfds[i + 1].fd = clients[i].fd;
+      pfds[i + 1].events = POLLIN;
+    }
+    if (poll(pfds, LNS_MAX_CLIENTS + 1, 1000) <= 0) {
+      continue;
+    }
+    if (pfds[0].revents & POLLIN) {
+      int fd = accept(listener, NULL, NULL);
+      int i = 0;
+      while (i < LNS_MAX_CLIENTS && clients[i].fd != -1) {
+        i++;
+      }
+      if (i == LNS_MAX_CLIENTS) {
+        close(fd);
+      } else if (fd != -1) {
+        clients[i].fd = fd;
+        clients[i].upgraded = false;
+        clients[i].muxs = false;
+        clients[i].uplinks = 0;
+        clients[i].used = 0;
+      }
+    }
+    for (int i = 0; i < LNS_MAX_CLIENTS; i++) {
+      Client& client = clients[i];
+      if (client.fd == -1 || pfds[i + 1].fd != client.fd || pfds[i + 1].revents == 0) {
+        continue;
+      }
+      ssize_t n = read(client.fd, client.buff + client.used, sizeof(client.buff) - client.used - 1);
+      if (n <= 0) {
+        Drop(client);
+        continue;
+      }
+      client.used += n;
+      client.buff[client.used] = '\0';
+      bool keep = client.upgraded || Upgrade(client);
+      if (keep && client.upgraded) {
+        keep = HandleFrames(client);
+      }
+      if (!keep) {
+        Drop(client);
+      }
+    }
+  }
+
+  fprintf(stderr, "{\"connections\":%lu,\"version\":%lu,\"updf\":%lu,\"jreq\":%lu,\"propdf\":%lu,"
+          "\"other\":%lu,\"dnmsg\":%lu}\n", connections, count_version, count_updf, count_jreq,
+          count_propdf, count_other, count_dnmsg);
+  return 0;
+}
@@ -0,0 +1,627 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+// End-to-end load test. Runs the forwarder built against the simulated
+// radio (single_chan_pkt_fwd_sim) with a loopback Semtech network server
+// stand-in, stepping the injected frame rate up until the forwarder
+// saturates. The stand-in ACKs every PUSH_DATA, can send PULL_RESPs, and
+// measures received rate, loss, reorder and injection-to-server latency.
+//
+// Per-step results go to stderr, the full report as JSON to stdout.
+//
+// With -n it soaks instead: one step of n frames at the -r rate, failing
+// unless the forwarder exits cleanly with loss under the -l limit. Combined with
+// -a, any heap allocation after startup aborts the forwarder, and once it
+// is up the soak also sends it maximum-length control socket requests.
+
+#include "../base64.h"
+#include "../control.h"
+#include "../uplink.h"
+
+#include <rapidjson/document.h>
+#include <rapidjson/filewritestream.h>
+#include <rapidjson/prettywriter.h>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+using namespace rapidjson;
+
+#define SIM_HEADER_SIZE 12
+
+// Sweep settings, see Usage()
+static const char* forwarder = "./single_chan_pkt_fwd_sim";
+static double start_rate = 10;
+static double max_rate = 10000;
+static double duration = 5;
+static int size_min = 12;
+static int size_max = 51;
+static int pull_resp_every = 0;
+static double loss_limit = 1.0;
+static double latency_limit_ms = 100;
+static int refine_steps = 3;
+static bool verbose = false;
+static bool realtime = false;
+static uint32_t soak_frames = 0;
+static bool alloc_guard = false;
+
+static int sock_ns = -1;
+static uint16_t port_ns;
+static string work_dir;
+
+struct StepResult
+{
+  double rate;
+  uint32_t offered;
+  uint32_t injected;
+  uint32_t overruns;
+  uint32_t received;
+  uint32_t duplicates;
+  uint32_t reordered;
+  uint32_t acked;
+  uint32_t pull_resps;
+  double rx_rate;
+  uint32_t latency_p50_us;
+  uint32_t latency_p99_us;
+  uint32_t latency_max_us;
+  double loss_pct;
+  uint32_t control_failures;
+  bool exited;
+  bool saturated;
+};
+
+static vector<StepResult> steps;
+
+static uint64_t MonotonicMicros()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void Usage()
+{
+  fprintf(stderr,
+          "Usage: loadgen [options]\n"
+          "  -x path      forwarder built with the simulated radio (%s)\n"
+          "  -r rate      first step, frames/s (%g)\n"
+          "  -R rate      highest step, frames/s (%g)\n"
+          "  -d seconds   duration of a step (%g)\n"
+          "  -s min[-max] payload size distribution, uniform (%d-%d)\n"
+          "  -p n         send a PULL_RESP every n PUSH_DATA, 0 for none (%d)\n"
+          "  -l percent   loss above which the forwarder is saturated (%g)\n"
+          "  -L ms        p99 latency above which it is saturated (%g)\n"
+          "  -b steps     bisection steps to refine the knee (%d)\n"
+          "  -t           run the forwarder in real-time mode\n"
+          "  -n frames    soak, a single step of that many frames at the -r rate\n"
+          "  -a           abort the forwarder on any heap allocation after startup,\n"
+          "               and send it maximum-length control requests\n"
+          "  -v           keep the forwarder output\n",
+          forwarder, start_rate, max_rate, duration, size_min, size_max,
+          pull_resp_every, loss_limit, latency_limit_ms, refine_steps);
+  exit(EXIT_FAILURE);
+}
+
+static void WriteConfiguration()
+{
+  char dir[] = "/tmp/loadgen.XXXXXX";
+  if (mkdtemp(dir) == NULL) {
+    perror("mkdtemp");
+    exit(EXIT_FAILURE);
+  }
+  work_dir = dir;
+
+  FILE* p_file = fopen((work_dir + "/global_conf.json").c_str(), "w");
+  if (p_file == NULL) {
+    perror("global_conf.json");
+    exit(EXIT_FAILURE);
+  }
+  fprintf(p_file,
+          "{\n"
+          "  \"SX127x_conf\": {\n"
+          "    \"freq\": 868100000, \"spread_factor\": 7,\n"
+          "    \"pin_nss\": 6, \"pin_dio0\": 7, \"pin_rst\": 0,\n"
+          "    \"watchdog_interval\": 0\n"
+          "  },\n"
+          "  \"gateway_conf\": {\n"
+          "    \"name\": \"loadgen\", \"email\": \"\", \"desc\": \"\",\n"
+          "    \"realtime\": %s,\n"
+          "    \"alloc_guard\": \"%s\",\n"
+          "    \"control_socket\": \"%s\",\n"
+          "    \"servers\": [ { \"address\": \"127.0.0.1\", \"port\": %hu, \"enabled\": true } ]\n"
+          "  }\n"
+          "}\n", realtime ? "true" : "false", alloc_guard ? "abort" : "off",
+          alloc_guard ? (work_dir + "/ctl.sock").c_str() : "", port_ns);
+  fclose(p_file);
+}
+
+static void StartServer()
+{
+  sock_ns = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (sock_ns == -1) {
+    perror("socket");
+    exit(EXIT_FAILURE);
+  }
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(addr);
+  if (bind(sock_ns, (struct sockaddr*)&addr, len) == -1 ||
+      getsockname(sock_ns, (struct sockaddr*)&addr, &len) == -1) {
+    perror("bind");
+    exit(EXIT_FAILURE);
+  }
+  port_ns = ntohs(addr.sin_port);
+
+  // Deep enough to not be the bottleneck ourselves
+  int rcvbuf = 4 * 1024 * 1024;
+  setsockopt(sock_ns, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+}
+
+static pid_t StartForwarder(double rate, uint32_t count, const string& stats)
+{
+  pid_t pid = fork();
+  if (pid == -1) {
+    perror("fork");
+    exit(EXIT_FAILURE);
+  }
+  if (pid != 0) {
+    return pid;
+  }
+
+  char buff[32];
+  snprintf(buff, sizeof(buff), "%g", rate);
+  setenv("SIM_RATE", buff, 1);
+  snprintf(buff, sizeof(buff), "%u", count);
+  setenv("SIM_COUNT", buff, 1);
+  snprintf(buff, sizeof(buff), "%d", size_min);
+  setenv("SIM_SIZE_MIN", buff, 1);
+  snprintf(buff, sizeof(buff), "%d", size_max);
+  setenv("SIM_SIZE_MAX", buff, 1);
+  setenv("SIM_STATS", stats.c_str(), 1);
+
+  // Resolve the forwarder before moving to its configuration directory
+  char path[4096];
+  if (realpath(forwarder, path) == NULL) {
+    perror(forwarder);
+    _exit(EXIT_FAILURE);
+  }
+  if (chdir(work_dir.c_str()) == -1) {
+    perror(work_dir.c_str());
+    _exit(EXIT_FAILURE);
+  }
+  if (!verbose) {
+    int fd = open("/dev/null", O_WRONLY);
+    dup2(fd, STDOUT_FILENO);
+    dup2(fd, STDERR_FILENO);
+    close(fd);
+  }
+
+  execl(path, path, (char*)NULL);
+  perror(path);
+  _exit(EXIT_FAILURE);
+}
+
+static bool ReadSimStats(const string& stats, uint32_t* p_injected, uint32_t* p_overruns)
+{
+  FILE* p_file = fopen(stats.c_str(), "r");
+  if (p_file == NULL) {
+    return false;
+  }
+  char buff[256];
+  size_t n = fread(buff, 1, sizeof(buff) - 1, p_file);
+  fclose(p_file);
+  buff[n] = '\0';
+
+  Document document;
+  document.Parse(buff);
+  if (document.HasParseError() || !document.IsObject() ||
+      !document.HasMember("injected") || !document.HasMember("overruns")) {
+    return false;
+  }
+  *p_injected = document["injected"].GetUint();
+  *p_overruns = document["overruns"].GetUint();
+  return true;
+}
+
+static void SendPullResp(const struct sockaddr_in& to)
+{
+  static const char txpk[] =
+      "{\"txpk\":{\"imme\":true,\"freq\":869.525,\"rfch\":0,\"powe\":14,\"modu\":\"LORA\","
+      "\"datr\":\"SF9BW125\",\"codr\":\"4/5\",\"ipol\":true,\"size\":12,\"data\":\"YAQDAgGgAAABAQEB\"}}";
+  char buff[4 + sizeof(txpk)];
+  buff[0] = PROTOCOL_VERSION;
+  buff[1] = (char)rand();
+  buff[2] = (char)rand();
+  buff[3] = PKT_PULL_RESP;
+  memcpy(buff + 4, txpk, sizeof(txpk) - 1);
+  sendto(sock_ns, buff, 4 + sizeof(txpk) - 1, 0, (const struct sockaddr*)&to, sizeof(to));
+}
+
+// Copies of item, separated by commas, between head and tail, as
+// many as fit a control request line
+static string FillLine(const string& head, const string& item, const string& tail)
+{
+  string line = head + item;
+  while (line.size() + 1 + item.size() + tail.size() < CONTROL_LINE_SIZE - 1) {
+    line += "," + item;
+  }
+  return line + tail;
+}
+
+// Send control requests of the longest line the forwarder takes, shaped
+// for the most parsed values. Each must get a reply, whether the command
+// is valid or not. Returns how many did not.
+static uint32_t ProbeControl()
+{
+  vector<string> lines;
+  lines.push_back(FillLine("{\"cmd\":\"help\",\"x\":[", "0", "]}"));
+  lines.push_back(FillLine("{\"cmd\":\"help\",\"x\":[", "{}", "]}"));
+  lines.push_back(FillLine("{\"cmd\":\"help\",\"x\":[", "\"\"", "]}"));
+  lines.push_back(FillLine("{\"cmd\":\"help\"", "\"\":0", "}"));
+  lines.push_back(string(CONTROL_LINE_SIZE / 2 - 1, '[') + string(CONTROL_LINE_SIZE / 2 - 1, ']'));
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/ctl.sock", work_dir.c_str());
+
+  uint32_t failures = 0;
+  for (vector<string>::iterator it = lines.begin(); it != lines.end(); ++it) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    string request = *it + "\n";
+    char reply[CONTROL_REPLY_SIZE];
+    ssize_t n = -1;
+    if (fd != -1 && connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0 &&
+        send(fd, request.data(), request.size(), MSG_NOSIGNAL) == (ssize_t)request.size()) {
+      struct pollfd pfd = { fd, POLLIN, 0 };
+      if (poll(&pfd, 1, 2000) == 1) {
+        n = recv(fd, reply, sizeof(reply) - 1, 0);
+      }
+    }
+    if (n <= 0 || strncmp(reply, "{\"ok\":", 6) != 0) {
+      fprintf(stderr, "control request of %zu bytes got no reply\n", request.size());
+      failures++;
+    }
+    if (fd != -1) {
+      close(fd);
+    }
+  }
+  return failures;
+}
+
+static StepResult RunStep(double rate)
+{
+  StepResult r;
+  memset(&r, 0, sizeof(r));
+  r.rate = rate;
+  r.offered = soak_frames != 0 ? soak_frames : (uint32_t)max(1.0, rate * duration);
+
+  // Leftovers of the previous step
+  char buff[BUFLEN + 1];
+  while (recv(sock_ns, buff, BUFLEN, MSG_DONTWAIT) >= 0) {
+  }
+
+  string stats = work_dir + "/sim_stats.json";
+  unlink(stats.c_str());
+
+  vector<bool> seen(r.offered, false);
+  vector<uint32_t> latencies;
+  latencies.reserve(r.offered);
+  int64_t last_seq = -1;
+  uint32_t pushes = 0;
+  uint64_t first_us = 0;
+  uint64_t last_us = 0;
+
+  pid_t pid = StartForwarder(rate, r.offered, stats);
+
+  // Startup, the whole step, then drain until the simulator reports or
+  // the server has been idle for a second
+  uint64_t start_us = MonotonicMicros();
+  uint64_t deadline_us = start_us + (uint64_t)((10 + duration * 2) * 1e6);
+  uint64_t idle_us = start_us;
+  bool sim_done = false;
+  bool probed = false;
+
+  while (r.received < r.offered) {
+    uint64_t now = MonotonicMicros();
+    if (now > deadline_us) {
+      break;
+    }
+    if (!sim_done) {
+      sim_done = ReadSimStats(stats, &r.injected, &r.overruns);
+    }
+    if (sim_done && now - idle_us > 1000000) {
+      break;
+    }
+
+    struct pollfd pfd = { sock_ns, POLLIN, 0 };
+    if (poll(&pfd, 1, 100) <= 0) {
+      continue;
+    }
+
+    struct sockaddr_in from;
+    socklen_t fromlen = sizeof(from);
+    int n = recvfrom(sock_ns, buff, BUFLEN, 0, (struct sockaddr*)&from, &fromlen);
+    now = MonotonicMicros();
+    if (n < 12 || buff[0] != PROTOCOL_VERSION || buff[3] != PKT_PUSH_DATA) {
+      continue;
+    }
+    idle_us = now;
+
+    // PUSH_ACK echoes the token
+    char ack[4] = { PROTOCOL_VERSION, buff[1], buff[2], PKT_PUSH_ACK };
+    sendto(sock_ns, ack, sizeof(ack), 0, (struct sockaddr*)&from, fromlen);
+    r.acked++;
+    pushes++;
+    if (pull_resp_every > 0 && pushes % pull_resp_every == 0) {
+      SendPullResp(from);
+      r.pull_resps++;
+    }
+
+    buff[n] = '\0';
+    Document document;
+    document.ParseInsitu(buff + 12);
+    if (document.HasParseError() || !document.IsObject() || !document.HasMember("rxpk")) {
+      continue;  // stat
+    }
+    const Value& rxpk = document["rxpk"];
+    for (SizeType i = 0; rxpk.IsArray() && i < rxpk.Size(); i++) {
+      if (!rxpk[i].HasMember("data") || !rxpk[i]["data"].IsString()) {
+        continue;
+      }
+      uint8_t payload[256];
+      const Value& data = rxpk[i]["data"];
+      int size = b64_to_bin(data.GetString(), data.GetStringLength(), payload, sizeof(payload));
+      if (size < SIM_HEADER_SIZE) {
+        continue;
+      }
+      uint32_t seq = 0;
+      uint64_t injected_us = 0;
+      for (int b = 0; b < 4; b++) {
+        seq |= (uint32_t)payload[b] << (8 * b);
+      }
+      for (int b = 0; b < 8; b++) {
+        injected_us |= (uint64_t)payload[4 + b] << (8 * b);
+      }
+      if (seq >= r.offered) {
+        continue;
+      }
+      if (seen[seq]) {
+        r.duplicates++;
+        continue;
+      }
+      seen[seq] = true;
+      r.received++;
+      if ((int64_t)seq < last_seq) {
+        r.reordered++;
+      }
+      last_seq = max(last_seq, (int64_t)seq);
+      latencies.push_back((uint32_t)(now - injected_us));
+      if (first_us == 0) {
+        first_us = now;
+      }
+      last_us = now;
+    }
+
+    // Up and forwarding, so the control socket is listening too
+    if (alloc_guard && !probed) {
+      probed = true;
+      r.control_failures = ProbeControl();
+    }
+  }
+
+  // Still running unless it crashed, it must shut down cleanly
+  int status = 0;
+  kill(pid, SIGTERM);
+  waitpid(pid, &status, 0);
+  r.exited = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  if (!r.exited) {
+    if (WIFSIGNALED(status)) {
+      fprintf(stderr, "forwarder killed by signal %d\n", WTERMSIG(status));
+    } else {
+      fprintf(stderr, "forwarder exited with %d\n", WEXITSTATUS(status));
+    }
+  }
+  if (!sim_done) {
+    sim_done = ReadSimStats(stats, &r.injected, &r.overruns);
+  }
+  if (!sim_done) {
+    r.injected = r.offered;
+  }
+
+  r.loss_pct = 100.0 * (r.offered - r.received) / r.offered;
+  if (r.received > 1 && last_us > first_us) {
+    r.rx_rate = (r.received - 1) * 1e6 / (last_us - first_us);
+  } else {
+    r.rx_rate = r.received / duration;
+  }
+  if (!latencies.empty()) {
+    sort(latencies.begin(), latencies.end());
+    r.latency_p50_us = latencies[latencies.size() / 2];
+    r.latency_p99_us = latencies[min(latencies.size() - 1, latencies.size() * 99 / 100)];
+    r.latency_max_us = latencies.back();
+  }
+  r.saturated = r.loss_pct > loss_limit || r.latency_p99_us > latency_limit_ms * 1000 || !r.exited;
+
+  fprintf(stderr, "%9.1f %8u %8u %8u %8u %6.2f%% %6u %9.1f %8u %8u %8u %s\n",
+          r.rate, r.offered, r.injected, r.received, r.overruns, r.loss_pct, r.reordered,
+          r.rx_rate, r.latency_p50_us, r.latency_p99_us, r.latency_max_us,
+          r.saturated ? "saturated" : "ok");
+  steps.push_back(r);
+  return r;
+}
+
+static void Report(double knee)
+{
+  char buffer[4096];
+  FileWriteStream os(stdout, buffer, sizeof(buffer));
+  PrettyWriter<FileWriteStream> writer(os);
+  writer.StartObject();
+  writer.String("size_min");
+  writer.Int(size_min);
+  writer.String("size_max");
+  writer.Int(size_max);
+  writer.String("duration_s");
+  writer.Double(duration);
+  writer.String("knee_rate");
+  writer.Double(knee);
+  writer.String("steps");
+  writer.StartArray();
+  for (vector<StepResult>::iterator it = steps.begin(); it != steps.end(); ++it) {
+    writer.StartObject();
+    writer.String("rate");
+    writer.Double(it->rate);
+    writer.String("offered");
+    writer.Uint(it->offered);
+    writer.String("injected");
+    writer.Uint(it->injected);
+    writer.String("radio_overruns");
+    writer.Uint(it->overruns);
+    writer.String("received");
+    writer.Uint(it->received);
+    writer.String("duplicates");
+    writer.Uint(it->duplicates);
+    writer.String("reordered");
+    writer.Uint(it->reordered);
+    writer.String("acked");
+    writer.Uint(it->acked);
+    writer.String("pull_resp");
+    writer.Uint(it->pull_resps);
+    writer.String("loss_pct");
+    writer.Double(it->loss_pct);
+    writer.String("rx_rate");
+    writer.Double(it->rx_rate);
+    writer.String("latency_p50_us");
+    writer.Uint(it->latency_p50_us);
+    writer.String("latency_p99_us");
+    writer.Uint(it->latency_p99_us);
+    writer.String("latency_max_us");
+    writer.Uint(it->latency_max_us);
+    if (alloc_guard) {
+      writer.String("control_failures");
+      writer.Uint(it->control_failures);
+    }
+    writer.String("clean_exit");
+    writer.Bool(it->exited);
+    writer.String("saturated");
+    writer.Bool(it->saturated);
+    writer.EndObject();
+  }
+  writer.EndArray();
+  writer.EndObject();
+  os.Put('\n');
+  os.Flush();
+}
+
+int main(int argc, char** argv)
+{
+  int opt;
+  while ((opt = getopt(argc, argv, "x:r:R:d:s:p:l:L:b:tn:av")) != -1) {
+    switch (opt) {
+      case 'x': forwarder = optarg; break;
+      case 'r': start_rate = atof(optarg); break;
+      case 'R': max_rate = atof(optarg); break;
+      case 'd': duration = atof(optarg); break;
+      case 's':
+        if (sscanf(optarg, "%d-%d", &size_min, &size_max) == 1) {
+          size_max = size_min;
+        }
+        break;
+      case 'p': pull_resp_every = atoi(optarg); break;
+      case 'l': loss_limit = atof(optarg); break;
+      case 'L': latency_limit_ms = atof(optarg); break;
+      case 'b': refine_steps = atoi(optarg); break;
+      case 't': realtime = true; break;
+      case 'n': soak_frames = strtoul(optarg, NULL, 10); break;
+      case 'a': alloc_guard = true; break;
+      case 'v': verbose = true; break;
+      default: Usage();
+    }
+  }
+  if (start_rate <= 0 || max_rate < start_rate || duration <= 0 ||
+      size_min < SIM_HEADER_SIZE || size_max < size_min || size_max > 255) {
+    Usage();
+  }
+
+  StartServer();
+  WriteConfiguration();
+
+  if (soak_frames != 0) {
+    duration = soak_frames / start_rate;
+  }
+
+  fprintf(stderr, "     rate  offered injected received overruns   loss  reord   rx rate  p50 (us)  p99 (us)  max (us)\n");
+
+  // A clean exit, no duplicates and loss under the -l limit, or it failed.
+  // An allocation guard abort shows up as the forwarder killed by SIGABRT.
+  if (soak_frames != 0) {
+    StepResult r = RunStep(start_rate);
+    bool ok = r.exited && r.duplicates == 0 && r.loss_pct <= loss_limit && r.control_failures == 0;
+    fprintf(stderr, "soak %s: %u of %u frames, %u radio overruns\n",
+            ok ? "passed" : "failed", r.received, r.offered, r.overruns);
+    Report(ok ? start_rate : 0);
+    unlink((work_dir + "/global_conf.json").c_str());
+    unlink((work_dir + "/sim_stats.json").c_str());
+    rmdir(work_dir.c_str());
+    return ok ? 0 : 1;
+  }
+
+  // Double the rate until the forwarder saturates, then bisect
+  double good = 0;
+  double bad = 0;
+  for (double rate = start_rate; rate <= max_rate; rate *= 2) {
+    if (RunStep(rate).saturated) {
+      bad = rate;
+      break;
+    }
+    good = rate;
+  }
+  for (int i = 0; bad != 0 && i < refine_steps; i++) {
+    double rate = (good + bad) / 2;
+    if (RunStep(rate).saturated) {
+      bad = rate;
+    } else {
+      good = rate;
+    }
+  }
+
+  if (bad == 0) {
+    fprintf(stderr, "not saturated up to %g frames/s\n", good);
+  } else {
+    fprintf(stderr, "knee at %.1f frames/s\n", good);
+  }
+  Report(good);
+
+  unlink((work_dir + "/global_conf.json").c_str());
+  unlink((work_dir + "/sim_stats.json").c_str());
+  rmdir(work_dir.c_str());
+  return 0;
+}
@@ -0,0 +1,64 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+// Simulated backhaul congestion. The simulated forwarder is linked with
+// -Wl,--wrap=sendto, so every datagram it sends goes through here first.
+//
+// Configured from the environment:
+//   SIM_UPLINK_RATE  datagrams per second the link takes, in bursts of up
+//                    to a tenth of a second; past that sendto() fails with
+//                    EAGAIN as on a full socket buffer (default no limit)
+
+#include <sys/socket.h>
+#include <time.h>
+
+#include <cerrno>
+#include <cstdlib>
+
+extern "C" ssize_t __real_sendto(int fd, const void* buf, size_t len, int flags,
+                                 const struct sockaddr* addr, socklen_t addrlen);
+
+static double TokenClock()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+extern "C" ssize_t __wrap_sendto(int fd, const void* buf, size_t len, int flags,
+                                 const struct sockaddr* addr, socklen_t addrlen)
+{
+  static double rate = -1;
+  static double tokens = 0;
+  static double last = 0;
+
+  if (rate < 0) {
+    const char* str = getenv("SIM_UPLINK_RATE");
+    rate = str != NULL ? atof(str) : 0;
+    last = TokenClock();
+    tokens = 1 + rate / 10;
+  }
+
+  if (rate > 0) {
+    double now = TokenClock();
+    tokens += (now - last) * rate;
+    last = now;
+    if (tokens > 1 + rate / 10) {
+      tokens = 1 + rate / 10;
+    }
+    if (tokens < 1) {
+      errno = EAGAIN;
+      return -1;
+    }
+    tokens -= 1;
+  }
+  return __real_sendto(fd, buf, len, flags, addr, addrlen);
+}
@@ -0,0 +1,571 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+// Simulated SX1276 behind the wiringPi API, so the unmodified forwarder
+// runs without a radio. Once the forwarder puts the radio in RX continuous,
+// a generator thread injects LoRa frames into the FIFO and raises DIO0,
+// calling the wiringPiISR() handler on its rising edge. In FSK mode each
+// frame is streamed into the 64-byte FIFO at the programmed bitrate, with
+// FifoLevel on DIO1 and PayloadReady on DIO0.
+//
+// Configured from the environment:
+//   SIM_RATE      frames per second (default 1)
+//   SIM_COUNT     frames to inject, 0 for no limit (default 0)
+//   SIM_SIZE_MIN  smallest payload, at least 12 bytes (default 12)
+//   SIM_SIZE_MAX  largest payload, sizes are uniform in between (default 51)
+//   SIM_SEED      size distribution seed (default 1)
+//   SIM_CHANNELS  frequencies the frames are spread over, in Hz with a
+//                 relative weight each, e.g. "868100000:3,868300000:1".
+//                 Frames on another frequency than the radio is tuned to
+//                 are missed. By default every frame is heard. A third
+//                 field sets the noise floor of the channel in dBm,
+//                 e.g. "868500000:1:-95" (default -110).
+//   SIM_CRC_ERRORS   percentage of frames with a bad payload CRC
+//   SIM_NO_CRC       percentage of frames sent without a payload CRC
+//   SIM_HEADER_ONLY  percentage of frames lost after their header, as in
+//                    a collision: counted in RegRxHeaderCntValue, no RxDone
+//   SIM_STATS     file to write {"injected":n,"overruns":n,"missed":n} to
+//                 when done
+//   SIM_DIO1_PIN  wiringPi pin of DIO1 (default 4), other interrupt pins
+//                 are DIO0
+//
+// Each payload starts with a little endian sequence number (4 bytes) and
+// the CLOCK_MONOTONIC injection time in microseconds (8 bytes).
+
+#include "wiringPi.h"
+#include "wiringPiSPI.h"
+
+#include "../sx127x.h"
+
+#include <time.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
+
+using namespace std;
+
+#define SIM_HEADER_SIZE   12
+
+static mutex sim_lock;
+static uint8_t regs[SX127X_REG_COUNT];
+static uint8_t fifo[256];
+static uint8_t fifo_ptr;
+
+static double rate = 1;
+static uint32_t count = 0;
+static int size_min = SIM_HEADER_SIZE;
+static int size_max = 51;
+static unsigned int seed = 1;
+static const char* stats_file = NULL;
+static int crc_errors = 0;
+static int no_crc = 0;
+static int header_only = 0;
+static unsigned int error_seed = 1;
+
+#define SIM_MAX_CHANNELS  16
+static uint32_t channel_freqs[SIM_MAX_CHANNELS];
+static uint32_t channel_weights[SIM_MAX_CHANNELS];
+static int channel_noise[SIM_MAX_CHANNELS];
+static int channel_count = 0;
+static uint32_t weight_total = 0;
+static unsigned int channel_seed = 1;
+static unsigned int noise_seed = 1;
+
+static void (*dio0_isr)(void) = NULL;
+static void (*dio1_isr)(void) = NULL;
+static int dio1_pin = 4;
+
+// FSK FIFO, filled by the generator while a frame is on air
+#define SIM_FSK_FIFO_SIZE 64
+static uint8_t fsk_fifo[SIM_FSK_FIFO_SIZE];
+static int fsk_fifo_head = 0;
+static int fsk_fifo_count = 0;
+
+static bool generating = false;
+static uint32_t injected = 0;
+static uint32_t overruns = 0;
+static uint32_t missed = 0;
+
+static struct timespec epoch;
+
+static uint64_t MonotonicMicros()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Frequency the frame goes out on, 0 for whatever the radio listens to
+static uint32_t PickChannel()
+{
+  if (channel_count == 0) {
+    return 0;
+  }
+  uint32_t pick = rand_r(&channel_seed) % weight_total;
+  int i = 0;
+  while (pick >= channel_weights[i]) {
+    pick -= channel_weights[i++];
+  }
+  return channel_freqs[i];
+}
+
+static uint32_t TunedFreq()
+{
+  uint32_t frf = (uint32_t)regs[REG_FRF_MSB] << 16 | (uint32_t)regs[REG_FRF_MID] << 8 | regs[REG_FRF_LSB];
+  return (uint32_t)(((uint64_t)frf * SX127X_XTAL_FREQ) >> 19);
+}
+
+// Within one FRF step of the frequency the radio is tuned to, in RX
+static bool Listening(uint32_t freq)
+{
+  if (regs[REG_OPMODE] != SX72_MODE_RX_CONTINUOS && regs[REG_OPMODE] != SX72_MODE_FSK_RX) {
+    return false;
+  }
+  if (freq == 0) {
+    return true;
+  }
+  uint32_t tuned = TunedFreq();
+  return tuned + 62 >= freq && tuned <= freq + 62;
+}
+
+// RegRssiValue: the noise floor of the channel the radio is tuned to,
+// with up to 6 dB of jitter
+static uint8_t NoiseRssi()
+{
+  int dbm = -110;
+  uint32_t tuned = TunedFreq();
+  for (int i = 0; i < channel_count; i++) {
+    if (tuned + 62 >= channel_freqs[i] && tuned <= channel_freqs[i] + 62) {
+      dbm = channel_noise[i];
+    }
+  }
+  dbm += rand_r(&noise_seed) % 7;
+  return (uint8_t)(157 + dbm);
+}
+
+// Put one frame in the FIFO the way the modem does at RxDone, returns
+// true on a DIO0 rising edge
+static bool Inject(uint32_t seq, int size, uint32_t freq)
+{
+  if (!Listening(freq)) {
+    missed++;
+    return false;
+  }
+
+  // The modem counts every valid header, frame completed or not
+  uint16_t headers = (uint16_t)(regs[REG_RX_HEADER_CNT_MSB] << 8 | regs[REG_RX_HEADER_CNT_LSB]) + 1;
+  regs[REG_RX_HEADER_CNT_MSB] = (uint8_t)(headers >> 8);
+  regs[REG_RX_HEADER_CNT_LSB] = (uint8_t)headers;
+  int error = rand_r(&error_seed) % 100;
+  if (error < header_only) {
+    injected++;
+    return false;
+  }
+  error -= header_only;
+
+  uint64_t now = MonotonicMicros();
+  uint8_t base = regs[REG_FIFO_RX_BASE_AD];
+
+  for (int i = 0; i < 4; i++) {
+    fifo[(uint8_t)(base + i)] = (uint8_t)(seq >> (8 * i));
+  }
+  for (int i = 0; i < 8; i++) {
+    fifo[(uint8_t)(base + 4 + i)] = (uint8_t)(now >> (8 * i));
+  }
+  for (int i = SIM_HEADER_SIZE; i < size; i++) {
+    fifo[(uint8_t)(base + i)] = (uint8_t)(seq + i);
+  }
+
+  // Frame still unread, the modem overwrites it
+  bool edge = true;
+  if (regs[REG_IRQ_FLAGS] & IRQ_LORA_RXDONE_MASK) {
+    overruns++;
+    edge = false;
+  }
+
+  regs[REG_FIFO_RX_CURRENT_ADDR] = base;
+  regs[REG_RX_NB_BYTES] = (uint8_t)size;
+  regs[REG_MODEM_STAT] = (uint8_t)(CR4_5 << MODEM_STAT_RX_CR_SHIFT);
+  regs[REG_PKT_SNR_VALUE] = (uint8_t)(9 * 4);
+  regs[REG_PKT_RSSI_VALUE] = 157 - 60;   // -60 dBm, SX1276 HF port offset
+  regs[REG_HOP_CHANNEL] = error < crc_errors + no_crc && error >= crc_errors ? 0 : HOP_CHANNEL_CRC_ON_PAYLOAD;
+  regs[REG_IRQ_FLAGS] |= IRQ_LORA_RXDONE_MASK | (error < crc_errors ? IRQ_LORA_CRCERR_MASK : 0);
+  injected++;
+  return edge;
+}
+
+static void FskFlush()
+{
+  fsk_fifo_head = 0;
+  fsk_fifo_count = 0;
+  regs[REG_IRQ_FLAGS1] = 0;
+  regs[REG_IRQ_FLAGS2] = 0;
+}
+
+// Recompute FifoLevel, returns true on its rising edge
+static bool FskFifoLevel()
+{
+  bool was = (regs[REG_IRQ_FLAGS2] & IRQ2_FSK_FIFO_LEVEL) != 0;
+  bool level = fsk_fifo_count > (regs[REG_FIFO_THRESH] & 0x3f);
+  regs[REG_IRQ_FLAGS2] = (regs[REG_IRQ_FLAGS2] & ~IRQ2_FSK_FIFO_LEVEL) | (level ? IRQ2_FSK_FIFO_LEVEL : 0);
+  return level && !was;
+}
+
+// Stream one FSK frame, length byte first, into the FIFO as the modem
+// would receive it, calling the DIO0 and DIO1 handlers on their edges
+static void InjectFsk(uint32_t seq, int size, uint32_t freq)
+{
+  uint8_t frame[256];
+  uint32_t bitrate;
+  bool crc_ok;
+  {
+    lock_guard<mutex> guard(sim_lock);
+    if (!Listening(freq) || (regs[REG_IRQ_FLAGS1] & IRQ1_FSK_SYNC_ADDRESS_MATCH)) {
+      missed++;
+      return;
+    }
+    uint16_t reg = (uint16_t)(regs[REG_BITRATE_MSB] << 8 | regs[REG_BITRATE_LSB]);
+    bitrate = reg != 0 ? SX127X_XTAL_FREQ / reg : 50000;
+    crc_ok = (int)(rand_r(&error_seed) % 100) >= crc_errors;
+    regs[REG_IRQ_FLAGS1] |= IRQ1_FSK_PREAMBLE_DETECT | IRQ1_FSK_SYNC_ADDRESS_MATCH;
+    regs[REG_FSK_RSSI_VALUE] = 120;     // -60 dBm
+  }
+
+  uint64_t now = MonotonicMicros();
+  frame[0] = (uint8_t)size;
+  for (int i = 0; i < 4; i++) {
+    frame[1 + i] = (uint8_t)(seq >> (8 * i));
+  }
+  for (int i = 0; i < 8; i++) {
+    frame[5 + i] = (uint8_t)(now >> (8 * i));
+  }
+  for (int i = SIM_HEADER_SIZE; i < size; i++) {
+    frame[1 + i] = (uint8_t)(seq + i);
+  }
+
+  // Four bytes at a time, then the CRC, on an absolute schedule so the
+  // airtime does not drift with the sleeps
+  uint64_t byte_ns = 8000000000ull / bitrate;
+  struct timespec at;
+  clock_gettime(CLOCK_MONOTONIC, &at);
+  for (int sent = 0; sent <= size + 1; ) {
+    int chunk = size + 1 - sent < 4 ? size + 1 - sent : 4;
+    uint64_t ns = at.tv_nsec + byte_ns * (chunk != 0 ? chunk : 2);
+    at.tv_sec += ns / 1000000000;
+    at.tv_nsec = ns % 1000000000;
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &at, NULL);
+    bool level_edge = false;
+    bool ready_edge = false;
+    void (*isr0)(void);
+    void (*isr1)(void);
+    {
+      lock_guard<mutex> guard(sim_lock);
+      if ((regs[REG_IRQ_FLAGS1] & IRQ1_FSK_SYNC_ADDRESS_MATCH) == 0 || regs[REG_OPMODE] != SX72_MODE_FSK_RX) {
+        // Receiver restarted under the frame
+        overruns++;
+        return;
+      }
+      for (int i = 0; i < chunk; i++) {
+        if (fsk_fifo_count == SIM_FSK_FIFO_SIZE) {
+          regs[REG_IRQ_FLAGS2] |= IRQ2_FSK_FIFO_OVERRUN;
+          overruns++;
+          return;
+        }
+        fsk_fifo[(fsk_fifo_head + fsk_fifo_count++) % SIM_FSK_FIFO_SIZE] = frame[sent + i];
+      }
+      sent += chunk;
+      level_edge = FskFifoLevel();
+      if (chunk == 0) {
+        regs[REG_IRQ_FLAGS2] |= IRQ2_FSK_PAYLOAD_READY | (crc_ok ? IRQ2_FSK_CRC_OK : 0);
+        ready_edge = true;
+        sent++;
+        injected++;
+      }
+      isr0 = dio0_isr;
+      isr1 = dio1_isr;
+    }
+    if (level_edge && isr1 != NULL) {
+      isr1();
+    }
+    if (ready_edge && isr0 != NULL) {
+      isr0();
+    }
+  }
+}
+
+static void Generate()
+{
+  struct timespec next;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  uint64_t period_ns = (uint64_t)(1e9 / rate);
+
+  for (uint32_t seq = 0; count == 0 || seq < count; seq++) {
+    int size = size_min + (size_max > size_min ? rand_r(&seed) % (size_max - size_min + 1) : 0);
+    uint32_t freq = PickChannel();
+
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    bool fsk;
+    {
+      lock_guard<mutex> guard(sim_lock);
+      fsk = regs[REG_OPMODE] == SX72_MODE_FSK_RX;
+    }
+    if (fsk) {
+      InjectFsk(seq, size, freq);
+      uint64_t ns = next.tv_nsec + period_ns;
+      next.tv_sec += ns / 1000000000;
+      next.tv_nsec = ns % 1000000000;
+      continue;
+    }
+    bool edge;
+    void (*isr)(void);
+    {
+      lock_guard<mutex> guard(sim_lock);
+      edge = Inject(seq, size, freq);
+      isr = dio0_isr;
+    }
+    if (edge && isr != NULL) {
+      isr();
+    }
+
+    uint64_t ns = next.tv_nsec + period_ns;
+    next.tv_sec += ns / 1000000000;
+    next.tv_nsec = ns % 1000000000;
+  }
+
+  // Give the forwarder time to pick up the last frame
+  struct timespec grace = { 0, 500000000 };
+  nanosleep(&grace, NULL);
+
+  lock_guard<mutex> guard(sim_lock);
+  if (regs[REG_IRQ_FLAGS] & IRQ_LORA_RXDONE_MASK) {
+    overruns++;
+  }
+  if (stats_file != NULL) {
+    FILE* p_file = fopen(stats_file, "w");
+    if (p_file != NULL) {
+      fprintf(p_file, "{\"injected\":%u,\"overruns\":%u,\"missed\":%u}\n", injected, overruns, missed);
+      fclose(p_file);
+    }
+  }
+}
+
+static uint8_t RegRead(uint8_t addr)
+{
+  if (addr == REG_FIFO && regs[REG_OPMODE] == SX72_MODE_FSK_RX) {
+    if (fsk_fifo_count == 0) {
+      return 0;
+    }
+    uint8_t value = fsk_fifo[fsk_fifo_head];
+    fsk_fifo_head = (fsk_fifo_head + 1) % SIM_FSK_FIFO_SIZE;
+    fsk_fifo_count--;
+    FskFifoLevel();
+    // PayloadReady goes with the last byte read, then AutoRestartRx
+    if (fsk_fifo_count == 0 && (regs[REG_IRQ_FLAGS2] & IRQ2_FSK_PAYLOAD_READY)) {
+      FskFlush();
+    }
+    return value;
+  }
+  if (addr == REG_FIFO) {
+    return fifo[fifo_ptr++];
+  }
+  if (addr == REG_RSSI_VALUE) {
+    return NoiseRssi();
+  }
+  return regs[addr];
+}
+
+static void RegWrite(uint8_t addr, uint8_t value)
+{
+  switch (addr) {
+    case REG_FIFO:
+      fifo[fifo_ptr++] = value;
+      break;
+    case REG_FIFO_ADDR_PTR:
+      regs[addr] = value;
+      fifo_ptr = value;
+      break;
+    case REG_IRQ_FLAGS:
+      // Write one to clear
+      if (regs[REG_OPMODE] & 0x80) {
+        regs[addr] &= ~value;
+      } else {
+        regs[addr] = value;
+      }
+      break;
+    case REG_IRQ_FLAGS2:
+      // FSK: FifoOverrun is write one to clear, and clears the FIFO
+      if ((regs[REG_OPMODE] & 0x80) != 0) {
+        regs[addr] = value;
+      } else if (value & IRQ2_FSK_FIFO_OVERRUN) {
+        FskFlush();
+      }
+      break;
+    case REG_VERSION:
+      break;
+    case REG_OPMODE:
+      regs[addr] = value;
+      // Leaving FSK receive drops the frame and the FIFO
+      if (value != SX72_MODE_FSK_RX && (value & 0x80) == 0) {
+        FskFlush();
+      }
+      // Sleep clears the header counter
+      if (value == SX72_MODE_SLEEP) {
+        regs[REG_RX_HEADER_CNT_MSB] = 0;
+        regs[REG_RX_HEADER_CNT_LSB] = 0;
+      }
+      if ((value == SX72_MODE_RX_CONTINUOS || value == SX72_MODE_FSK_RX) && !generating) {
+        generating = true;
+        thread(Generate).detach();
+      }
+      break;
+    default:
+      regs[addr] = value;
+      break;
+  }
+}
+
+static int EnvInt(const char* name, int value)
+{
+  const char* str = getenv(name);
+  return str != NULL ? atoi(str) : value;
+}
+
+int wiringPiSetup(void)
+{
+  clock_gettime(CLOCK_MONOTONIC, &epoch);
+
+  const char* str = getenv("SIM_RATE");
+  if (str != NULL && atof(str) > 0) {
+    rate = atof(str);
+  }
+  count = EnvInt("SIM_COUNT", count);
+  size_min = EnvInt("SIM_SIZE_MIN", size_min);
+  size_max = EnvInt("SIM_SIZE_MAX", size_max);
+  seed = EnvInt("SIM_SEED", seed);
+  stats_file = getenv("SIM_STATS");
+  crc_errors = EnvInt("SIM_CRC_ERRORS", crc_errors);
+  no_crc = EnvInt("SIM_NO_CRC", no_crc);
+  header_only = EnvInt("SIM_HEADER_ONLY", header_only);
+  dio1_pin = EnvInt("SIM_DIO1_PIN", dio1_pin);
+
+  str = getenv("SIM_CHANNELS");
+  while (str != NULL && *str != '\0' && channel_count < SIM_MAX_CHANNELS) {
+    char* end;
+    uint32_t freq = strtoul(str, &end, 10);
+    uint32_t weight = 1;
+    int noise = -110;
+    if (*end == ':') {
+      weight = strtoul(end + 1, &end, 10);
+    }
+    if (*end == ':') {
+      noise = strtol(end + 1, &end, 10);
+    }
+    if (freq != 0 && weight != 0) {
+      channel_freqs[channel_count] = freq;
+      channel_noise[channel_count] = noise;
+      channel_weights[channel_count++] = weight;
+      weight_total += weight;
+    }
+    str = *end == ',' ? end + 1 : NULL;
+  }
+
+  if (size_min < SIM_HEADER_SIZE) {
+    size_min = SIM_HEADER_SIZE;
+  }
+  if (size_max > 255) {
+    size_max = 255;
+  }
+  if (size_max < size_min) {
+    size_max = size_min;
+  }
+
+  memset(regs, 0, sizeof(regs));
+  regs[REG_VERSION] = 0x12;  // SX1276
+  return 0;
+}
+
+void pinMode(int pin, int mode)
+{
+}
+
+void digitalWrite(int pin, int value)
+{
+}
+
+// DIO0 is mapped to RxDone or PayloadReady, DIO1 to FifoLevel, every
+// other input reads low
+int digitalRead(int pin)
+{
+  lock_guard<mutex> guard(sim_lock);
+  if (regs[REG_OPMODE] == SX72_MODE_FSK_RX) {
+    return (regs[REG_IRQ_FLAGS2] & (pin == dio1_pin ? IRQ2_FSK_FIFO_LEVEL : IRQ2_FSK_PAYLOAD_READY)) ? HIGH : LOW;
+  }
+  return pin != dio1_pin && (regs[REG_IRQ_FLAGS] & IRQ_LORA_RXDONE_MASK) ? HIGH : LOW;
+}
+
+// DIO1 on SIM_DIO1_PIN, any other pin is DIO0
+int wiringPiISR(int pin, int mode, void (*function)(void))
+{
+  lock_guard<mutex> guard(sim_lock);
+  if (pin == dio1_pin) {
+    dio1_isr = function;
+  } else {
+    dio0_isr = function;
+  }
+  return 0;
+}
+
+void delay(unsigned int howLong)
+{
+  struct timespec ts = { (time_t)(howLong / 1000), (long)(howLong % 1000) * 1000000 };
+  nanosleep(&ts, NULL);
+}
+
+void delayMicroseconds(unsigned int howLong)
+{
+  struct timespec ts = { (time_t)(howLong / 1000000), (long)(howLong % 1000000) * 1000 };
+  nanosleep(&ts, NULL);
+}
+
+unsigned int millis(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned int)((ts.tv_sec - epoch.tv_sec) * 1000 + (ts.tv_nsec - epoch.tv_nsec) / 1000000);
+}
+
+int wiringPiSPISetup(int channel, int speed)
+{
+  return 0;
+}
+
+// Register address first, then a burst that auto-increments except on the FIFO
+int wiringPiSPIDataRW(int channel, unsigned char* data, int len)
+{
+  lock_guard<mutex> guard(sim_lock);
+
+  uint8_t addr = data[0] & 0x7F;
+  bool write = (data[0] & 0x80) != 0;
+  for (int i = 1; i < len; i++) {
+    if (write) {
+      RegWrite(addr, data[i]);
+    } else {
+      data[i] = RegRead(addr);
+    }
+    if (addr != REG_FIFO) {
+      addr = (addr + 1) & 0x7F;
+    }
+  }
+  return len;
+}
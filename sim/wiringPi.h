@@ -0,0 +1,45 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+// The part of wiringPi the forwarder uses, implemented by sim_radio.cpp
+
+#ifndef _SIM_WIRINGPI_H
+#define _SIM_WIRINGPI_H
+
+#define LOW     0
+#define HIGH    1
+
+#define INPUT   0
+#define OUTPUT  1
+
+#define INT_EDGE_SETUP    0
+#define INT_EDGE_FALLING  1
+#define INT_EDGE_RISING   2
+#define INT_EDGE_BOTH     3
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern int wiringPiSetup(void);
+extern void pinMode(int pin, int mode);
+extern void digitalWrite(int pin, int value);
+extern int digitalRead(int pin);
+extern void delay(unsigned int howLong);
+extern void delayMicroseconds(unsigned int howLong);
+extern unsigned int millis(void);
+extern int wiringPiISR(int pin, int mode, void (*function)(void));
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
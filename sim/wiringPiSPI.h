@@ -0,0 +1,28 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+// The part of wiringPiSPI the forwarder uses, implemented by sim_radio.cpp
+
+#ifndef _SIM_WIRINGPISPI_H
+#define _SIM_WIRINGPISPI_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern int wiringPiSPISetup(int channel, int speed);
+extern int wiringPiSPIDataRW(int channel, unsigned char* data, int len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -43,6 +43,7 @@
 // http://wiki.dragino.com/index.php?title=Lora/GPS_HAT
 //    "pin_nss": 6,
 //    "pin_dio0": 7,
+//    "pin_dio1": 4,
 //    "pin_rst": 0
 //
 // For LoRasPi
@@ -53,180 +54,149 @@
 //    "pin_led1":4
 
 
+#include "alloc.h"
 #include "base64.h"
-
-#include <rapidjson/document.h>
-#include <rapidjson/filereadstream.h>
-#include <rapidjson/stringbuffer.h>
-#include <rapidjson/writer.h>
+#include "channels.h"
+#include "config.h"
+#include "control.h"
+#include "feed.h"
+#include "metrics.h"
+#include "mqtt.h"
+#include "reactor.h"
+#include "resolver.h"
+#include "priority.h"
+#include "ring.h"
+#include "routing.h"
+#include "station.h"
+#include "sx127x.h"
+#include "trace.h"
+#include "uplink.h"
+#include "watchdog.h"
 
 #include <wiringPi.h>
 #include <wiringPiSPI.h>
 
 #include <arpa/inet.h>
 #include <net/if.h>
-#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
-#include <netdb.h>
-
+#include <malloc.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
 #include <cstdlib>
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
 #include <iostream>
 #include <string>
+#include <thread>
 #include <vector>
 
 using namespace std;
 
-using namespace rapidjson;
-
-#define BASE64_MAX_LENGTH 341
-
 static const int SPI_CHANNEL = 0;
 
-bool sx1272 = true;
-
-struct sockaddr_in si_other;
-int s;
-int slen = sizeof(si_other);
-struct ifreq ifr;
-
-uint32_t cp_nb_rx_rcv;
-uint32_t cp_nb_rx_ok;
-uint32_t cp_nb_rx_ok_tot;
-uint32_t cp_nb_rx_bad;
-uint32_t cp_nb_rx_nocrc;
-uint32_t cp_up_pkt_fwd;
-
-typedef enum SpreadingFactors
+Sx127x* radio = NULL;
+RadioWatchdog watchdog;
+
+// Gateway EUI and where it came from, an interface name or gateway_ID
+uint64_t gateway_eui = 0;
+char gateway_eui_source[IFNAMSIZ + 16];
+
+// Event loop, see reactor.h
+Reactor reactor;
+int dio0_event = -1;  // eventfd written by the DIO0 and DIO1 interrupts
+int radio_fd = -1;    // dio0_event, or the FSK poll timer without DIO1
+int led_timer = -1;
+int led_blinks = 0;       // LED toggles left of the startup blink
+int keepalive_timer = -1;  // disarmed when keepalives are off
+int config_watch = -1;     // inotify on the configuration directory
+int hop_timer = -1;        // next channel of the plan, disarmed with one
+int uplink_timer = -1;     // retries a full socket, disarmed otherwise
+int hop_deferrals = 0;     // hop retries while a frame was being received
+int noise_timer = -1;      // next noise floor sample, disarmed when off
+bool backends_started = false;  // Basics Station and MQTT threads, once the EUI is known
+atomic<uint32_t> dio0_time(0);  // MicrosNow() of the last interrupt
+
+// MicrosNow() when main() started, and how long network setup took
+uint32_t start_time;
+uint32_t network_setup_time;
+
+// A frame in progress delays a hop by HOP_RETRY_MS steps, up to the
+// longest LoRa frame (255 bytes at SF12 BW125 take 2.8 s)
+#define HOP_RETRY_MS        5
+#define HOP_MAX_DEFERRALS   600
+
+// A full socket buffer is retried this often, frames waiting meanwhile in
+// uplink_queue
+#define UPLINK_RETRY_MS     10
+
+// A frame read out of the radio, waiting to be forwarded
+struct RxFrame
 {
-    SF7 = 7,
-    SF8,
-    SF9,
-    SF10,
-    SF11,
-    SF12
-} SpreadingFactor_t;
-
-typedef struct Server
+  PacketTrace trace;
+  uint32_t tmst;
+  uint32_t received;  // MicrosNow() when read out of the radio
+  uint32_t queued;  // MicrosNow() when handed to the forwarding side
+  uint8_t chan;     // channel of the plan it was received on
+  Sx127xPktStatus status;
+  uint8_t length;
+  char payload[256];
+};
+
+// Real-time mode: the radio is serviced by a SCHED_FIFO thread of its own
+// that queues frames for the event loop, which does everything else at
+// normal priority. Radio register access from either side goes through
+// radio_mutex, which has priority inheritance.
+pthread_mutex_t radio_mutex;
+pthread_t radio_thread;
+atomic<bool> radio_thread_running(false);
+int rx_ready_event = -1;  // eventfd, frames queued in rx_queue
+SpscRing<RxFrame> rx_queue;
+
+// Frames waiting for the servers, by UplinkClass_t
+PriorityQueue<RxFrame, UPLINK_CLASSES> uplink_queue;
+
+class RadioLock
 {
-    string address;
-    uint16_t port;
-    bool enabled;
-} Server_t;
-
-/*******************************************************************************
- *
- * Default values, configure them in global_conf.json
- *
- *******************************************************************************/
-
-// SX1272 - Raspberry connections
-// Put them in global_conf.json
-int ssPin = 0xff;
-int dio0  = 0xff;
-int RST   = 0xff;
-int Led1  = 0xff;
-
-// Set location in global_conf.json
-float lat =  0.0;
-float lon =  0.0;
-int   alt =  0;
-
-/* Informal status fields */
-char platform[24] ;    /* platform definition */
-char email[40] ;       /* used for contact email */
-char description[64] ; /* used for free form description */
-
-// Set spreading factor (SF7 - SF12), &nd  center frequency
-// Overwritten by the ones set in global_conf.json
-SpreadingFactor_t sf = SF7;
-uint16_t bw = 125;
-uint32_t freq = 868100000; // in Mhz! (868.1)
+public:
+    RadioLock() { pthread_mutex_lock(&radio_mutex); }
+    ~RadioLock() { pthread_mutex_unlock(&radio_mutex); }
+};
+
+// Counted by the radio thread, reset by the stat timer
+atomic<uint32_t> cp_nb_rx_rcv(0);
+atomic<uint32_t> cp_nb_rx_ok(0);
+atomic<uint32_t> cp_nb_rx_ok_tot(0);
+atomic<uint32_t> cp_nb_rx_bad(0);
+atomic<uint32_t> cp_nb_rx_nocrc(0);
+atomic<uint32_t> cp_nb_rx_header(0);  // valid LoRa headers, frames completed or not
+uint32_t cp_up_pkt_fwd;
 
+// Settings from global_conf.json and local_conf.json, see config.h for
+// the defaults
+Config conf;
 
-// Servers
-vector<Server_t> servers;
+static_assert(sizeof(conf.uplink_max_age) / sizeof(conf.uplink_max_age[0]) == UPLINK_CLASSES,
+              "an uplink_max_age per uplink class");
 
 // #############################################
 // #############################################
 
-#define REG_FIFO                    0x00
-#define REG_FIFO_ADDR_PTR           0x0D
-#define REG_FIFO_TX_BASE_AD         0x0E
-#define REG_FIFO_RX_BASE_AD         0x0F
-#define REG_RX_NB_BYTES             0x13
-#define REG_OPMODE                  0x01
-#define REG_FIFO_RX_CURRENT_ADDR    0x10
-#define REG_IRQ_FLAGS               0x12
-#define REG_DIO_MAPPING_1           0x40
-#define REG_DIO_MAPPING_2           0x41
-#define REG_MODEM_CONFIG            0x1D
-#define REG_MODEM_CONFIG2           0x1E
-#define REG_MODEM_CONFIG3           0x26
-#define REG_SYMB_TIMEOUT_LSB        0x1F
-#define REG_PKT_SNR_VALUE           0x19
-#define REG_PAYLOAD_LENGTH          0x22
-#define REG_IRQ_FLAGS_MASK          0x11
-#define REG_MAX_PAYLOAD_LENGTH      0x23
-#define REG_HOP_PERIOD              0x24
-#define REG_SYNC_WORD               0x39
-#define REG_VERSION                 0x42
-
-#define SX72_MODE_RX_CONTINUOS      0x85
-#define SX72_MODE_TX                0x83
-#define SX72_MODE_SLEEP             0x80
-#define SX72_MODE_STANDBY           0x81
-
-
-#define PAYLOAD_LENGTH              0x40
-
-// LOW NOISE AMPLIFIER
-#define REG_LNA                     0x0C
-#define LNA_MAX_GAIN                0x23
-#define LNA_OFF_GAIN                0x00
-#define LNA_LOW_GAIN                0x20
-
-// CONF REG
-#define REG1                        0x0A
-#define REG2                        0x84
-
-#define SX72_MC2_FSK                0x00
-#define SX72_MC2_SF7                0x70
-#define SX72_MC2_SF8                0x80
-#define SX72_MC2_SF9                0x90
-#define SX72_MC2_SF10               0xA0
-#define SX72_MC2_SF11               0xB0
-#define SX72_MC2_SF12               0xC0
-
-#define SX72_MC1_LOW_DATA_RATE_OPTIMIZE  0x01 // mandated for SF11 and SF12
-
-// FRF
-#define REG_FRF_MSB              0x06
-#define REG_FRF_MID              0x07
-#define REG_FRF_LSB              0x08
-
-#define FRF_MSB                  0xD9 // 868.1 Mhz
-#define FRF_MID                  0x06
-#define FRF_LSB                  0x66
-
-#define BUFLEN 2048  //Max length of buffer
-
-#define PROTOCOL_VERSION  1
-#define PKT_PUSH_DATA 0
-#define PKT_PUSH_ACK  1
-#define PKT_PULL_DATA 2
-
-#define PKT_PULL_RESP 3
-#define PKT_PULL_ACK  4
-
-#define TX_BUFF_SIZE    2048
-#define STATUS_SIZE     1024
-
-void LoadConfiguration(string filename);
+void LoadConfiguration();
+void AdjustConfiguration(Config* next);
+void SetServers(const Config& next);
+void UpdateBackends();
 void PrintConfiguration();
 
 void Die(const char *s)
@@ -237,12 +207,12 @@ void Die(const char *s)
 
 void SelectReceiver()
 {
-  digitalWrite(ssPin, LOW);
+  digitalWrite(conf.pin_nss, LOW);
 }
 
 void UnselectReceiver()
 {
-  digitalWrite(ssPin, HIGH);
+  digitalWrite(conf.pin_nss, HIGH);
 }
 
 uint8_t ReadRegister(uint8_t addr)
@@ -269,35 +239,143 @@ void WriteRegister(uint8_t addr, uint8_t value)
   UnselectReceiver();
 }
 
-bool ReceivePkt(char* payload, uint8_t* p_length)
+void ReadBurst(uint8_t addr, uint8_t* data, uint8_t length)
 {
-  // clear rxDone
-  WriteRegister(REG_IRQ_FLAGS, 0x40);
+  uint8_t spibuf[256];
+  spibuf[0] = addr & 0x7F;
+  memset(spibuf + 1, 0, length);
 
-  int irqflags = ReadRegister(REG_IRQ_FLAGS);
+  SelectReceiver();
+  wiringPiSPIDataRW(SPI_CHANNEL, spibuf, length + 1);
+  UnselectReceiver();
+
+  memcpy(data, spibuf + 1, length);
+}
+
+void WriteBurst(uint8_t addr, const uint8_t* data, uint8_t length)
+{
+  uint8_t spibuf[256];
+  spibuf[0] = addr | 0x80;
+  memcpy(spibuf + 1, data, length);
+
+  SelectReceiver();
+  wiringPiSPIDataRW(SPI_CHANNEL, spibuf, length + 1);
+  UnselectReceiver();
+}
+
+// LoRa counters of the spreading factor the radio is tuned to, NULL for FSK
+SfMetrics* TunedSfMetrics()
+{
+  const Sx127xConf& tuned = *channel_plan.Tuned();
+  if (tuned.modu != MODU_LORA) {
+    return NULL;
+  }
+  return &metrics.sf[tuned.sf - METRICS_SF_MIN];
+}
+
+// Valid headers the modem counted since the last call, see
+// Sx127x::TakeValidHeaders(). Call with the radio lock held.
+void CountHeaders(uint32_t headers)
+{
+  SfMetrics* sf_metrics = TunedSfMetrics();
+  if (headers == 0 || sf_metrics == NULL) {
+    return;
+  }
+  cp_nb_rx_header += headers;
+  Inc(metrics.rx_valid_header, headers);
+  Inc(sf_metrics->valid_header, headers);
+}
+
+// Count a frame out of the radio and tell whether it goes to the servers:
+// frames failing their CRC, or without one, only when asked for
+bool CountFrame(const Sx127xPktStatus& status, ChannelStats& chan_stats)
+{
+  SfMetrics* sf_metrics = TunedSfMetrics();
 
   cp_nb_rx_rcv++;
+  Inc(metrics.rx_received);
+  Inc(chan_stats.rx);
+  if (sf_metrics != NULL) {
+    Inc(sf_metrics->rx);
+  }
 
-  //  payload crc: 0x20
-  if((irqflags & 0x20) == 0x20) {
-    printf("CRC error\n");
-    WriteRegister(REG_IRQ_FLAGS, 0x20);
-    return false;
+  if (status.crc_error) {
+    cp_nb_rx_bad++;
+    Inc(metrics.rx_crc_error);
+    Inc(chan_stats.crc_error);
+    if (sf_metrics != NULL) {
+      Inc(sf_metrics->crc_error);
+    }
+    if (!conf.forward_crc_error) {
+      printf("CRC error\n");
+      return false;
+    }
+    return true;
+  }
 
-  } else {
-    cp_nb_rx_ok++;
-    cp_nb_rx_ok_tot++;
+  if (!status.crc_on) {
+    cp_nb_rx_nocrc++;
+    Inc(metrics.rx_no_crc);
+    if (sf_metrics != NULL) {
+      Inc(sf_metrics->no_crc);
+    }
+    if (!conf.forward_crc_disabled) {
+      printf("No CRC\n");
+      return false;
+    }
+    return true;
+  }
 
-    uint8_t currentAddr = ReadRegister(REG_FIFO_RX_CURRENT_ADDR);
-    uint8_t receivedCount = ReadRegister(REG_RX_NB_BYTES);
-    *p_length = receivedCount;
+  cp_nb_rx_ok++;
+  cp_nb_rx_ok_tot++;
+  Inc(chan_stats.ok);
+  return true;
+}
 
-    WriteRegister(REG_FIFO_ADDR_PTR, currentAddr);
+bool ReceivePkt(char* payload, uint8_t* p_length, Sx127xPktStatus* p_status, PacketTrace* trace)
+{
+  ChannelStats& chan_stats = channel_plan.stats(channel_plan.current());
 
-    for(int i = 0; i < receivedCount; i++) {
-      payload[i] = ReadRegister(REG_FIFO);
+  if (conf.sx127x.modu == MODU_FSK) {
+    RxResult_t result = radio->ReceiveFsk(payload, p_length, p_status);
+    if (result == RX_NONE) {
+      return false;
     }
+    TracePoint(trace, TRACE_IRQ_FLAGS);
+    TracePoint(trace, TRACE_FIFO);
+
+    watchdog.PacketReceived(millis());
+    return CountFrame(*p_status, chan_stats);
   }
+
+  // RegFifoRxCurrentAddr to RegRxHeaderCntValue: FIFO position, IRQ flags,
+  // length and the header count in one burst
+  uint8_t regs[REG_RX_HEADER_CNT_LSB - REG_FIFO_RX_CURRENT_ADDR + 1];
+  ReadBurst(REG_FIFO_RX_CURRENT_ADDR, regs, sizeof(regs));
+  uint8_t irqflags = regs[REG_IRQ_FLAGS - REG_FIFO_RX_CURRENT_ADDR];
+
+  // clear rxDone, and the payload CRC error
+  WriteRegister(REG_IRQ_FLAGS, IRQ_LORA_RXDONE_MASK | IRQ_LORA_CRCERR_MASK);
+  TracePoint(trace, TRACE_IRQ_FLAGS);
+
+  CountHeaders(radio->TakeValidHeaders((uint16_t)(regs[REG_RX_HEADER_CNT_MSB - REG_FIFO_RX_CURRENT_ADDR] << 8 |
+                                                  regs[REG_RX_HEADER_CNT_LSB - REG_FIFO_RX_CURRENT_ADDR])));
+  watchdog.PacketReceived(millis());
+
+  radio->ReadPktStatus(p_status);
+  p_status->crc_error = (irqflags & IRQ_LORA_CRCERR_MASK) != 0;
+  if (!CountFrame(*p_status, chan_stats)) {
+    return false;
+  }
+
+  uint8_t currentAddr = regs[0];
+  uint8_t receivedCount = regs[REG_RX_NB_BYTES - REG_FIFO_RX_CURRENT_ADDR];
+  *p_length = receivedCount;
+
+  WriteRegister(REG_FIFO_ADDR_PTR, currentAddr);
+
+  ReadBurst(REG_FIFO, (uint8_t*)payload, receivedCount);
+  TracePoint(trace, TRACE_FIFO);
   return true;
 }
 
@@ -314,530 +392,1471 @@ void SetupLoRa()
   char buff[16];
 
   printf("Trying to detect module with ");
-  printf("NSS=%s "  , PinName(ssPin, buff));
-  printf("DIO0=%s " , PinName(dio0 , buff));
-  printf("Reset=%s ", PinName(RST  , buff));
-  printf("Led1=%s\n", PinName(Led1 , buff));
+  printf("NSS=%s "  , PinName(conf.pin_nss, buff));
+  printf("DIO0=%s " , PinName(conf.pin_dio0, buff));
+  printf("DIO1=%s " , PinName(conf.pin_dio1, buff));
+  printf("Reset=%s ", PinName(conf.pin_rst, buff));
+  printf("Led1=%s\n", PinName(conf.pin_led1, buff));
   
   // check basic 
-  if (ssPin == 0xff || dio0 == 0xff) {
+  if (conf.pin_nss == 0xff || conf.pin_dio0 == 0xff) {
     Die("Bad pin configuration ssPin and dio0 need at least to be defined");
   }
 
-  digitalWrite(RST, HIGH);
-  delay(100);
-  digitalWrite(RST, LOW);
-  delay(100);
+  uint8_t version;
+  radio = DetectSx127x(conf.pin_rst, &version);
+  if (radio == NULL) {
+    printf("Transceiver version 0x%02X\n", version);
+    Die("Unrecognized transceiver");
+  }
+  printf("%s detected, starting.\n", radio->Name());
+
+  channel_plan.Init(conf, millis());
+  radio->Setup(*channel_plan.Tuned());
+  watchdog.Start(radio, channel_plan.Tuned(), conf.watchdog_interval * 1000, millis());
+}
+
+void SendStat()
+{
+  static char status_report[STATUS_SIZE]; /* status report as a JSON object */
+  char stat_timestamp[24];
 
-  uint8_t version = ReadRegister(REG_VERSION);
+  int stat_index = 0;
+
+  /* start composing datagram with the header */
+  WriteHeader(status_report, PKT_PUSH_DATA);
+  stat_index = HEADER_SIZE;
 
-  if (version == 0x22) {
-    // sx1272
-    printf("SX1272 detected, starting.\n");
-    sx1272 = true;
+  /* get timestamp for statistics */
+  time_t t = time(NULL);
+  strftime(stat_timestamp, sizeof stat_timestamp, "%F %T %Z", gmtime(&t));
+
+  StatReport stat;
+  stat.time = stat_timestamp;
+  stat.lati = conf.ref_latitude;
+  stat.longi = conf.ref_longitude;
+  stat.alti = conf.ref_altitude;
+  stat.rxnb = cp_nb_rx_rcv;
+  stat.rxok = cp_nb_rx_ok;
+  stat.rxfw = cp_up_pkt_fwd;
+  stat.ackr = 0;
+  stat.dwnb = 0;
+  stat.txnb = 0;
+  stat.pfrm = conf.name;
+  stat.mail = conf.email;
+  stat.desc = conf.desc;
+  int json_size = BuildStatJson(stat, status_report + stat_index, STATUS_SIZE - stat_index);
+  //printf("stat update: %s\n", status_report + stat_index);
+  printf("stat update: %s", stat_timestamp);
+  if (cp_nb_rx_ok_tot==0) {
+    printf(" no packet received yet\n");
   } else {
-    // sx1276?
-    digitalWrite(RST, LOW);
-    delay(100);
-    digitalWrite(RST, HIGH);
-    delay(100);
-    version = ReadRegister(REG_VERSION);
-    if (version == 0x12) {
-      // sx1276
-      printf("SX1276 detected, starting.\n");
-      sx1272 = false;
-    } else {
-      printf("Transceiver version 0x%02X\n", version);
-      Die("Unrecognized transceiver");
+    printf(" %u packet%sreceived\n", cp_nb_rx_ok_tot.load(), cp_nb_rx_ok_tot>1?"s ":" ");
+    TracePrintSummary();
+  }
+  if (cp_nb_rx_rcv != 0 || cp_nb_rx_header != 0) {
+    printf("interval: %u frames, %u CRC errors, %u without CRC", cp_nb_rx_rcv.load(), cp_nb_rx_bad.load(),
+           cp_nb_rx_nocrc.load());
+    if (conf.sx127x.modu == MODU_LORA) {
+      uint32_t headers = cp_nb_rx_header;
+      uint32_t frames = cp_nb_rx_rcv;
+      printf(", %u valid headers, %u without a frame", headers, headers > frames ? headers - frames : 0);
     }
+    printf("\n");
+  }
+  for (int i = 0; i < channel_plan.count(); i++) {
+    NoiseFloor floor;
+    if (NoiseFloorGet(channel_plan.stats(i).noise, &floor)) {
+      printf("noise floor: %.6lf Mhz p10 %d p50 %d p90 %d dBm\n", (double)channel_plan.Channel(i).freq/1000000,
+             floor.p10, floor.p50, floor.p90);
+    }
+  }
+  if (watchdog.recoveries() != 0) {
+    printf("radio watchdog: %u recoveries (%u register, %u silence)\n", watchdog.recoveries(),
+           watchdog.register_faults(), watchdog.silence_faults());
   }
 
-  WriteRegister(REG_OPMODE, SX72_MODE_SLEEP);
+  // Send message.
+  if (json_size > 0) {
+    SendUdp(status_report, stat_index + json_size, SERVERS_ALL, NULL);
+  }
+}
 
-  // set frequency
-  uint64_t frf = ((uint64_t)freq << 19) / 32000000;
-  WriteRegister(REG_FRF_MSB, (uint8_t)(frf >> 16) );
-  WriteRegister(REG_FRF_MID, (uint8_t)(frf >> 8) );
-  WriteRegister(REG_FRF_LSB, (uint8_t)(frf >> 0) );
+void SendKeepalive()
+{
+  char pull_data[HEADER_SIZE];
 
-  WriteRegister(REG_SYNC_WORD, 0x34); // LoRaWAN public sync word
+  WriteHeader(pull_data, PKT_PULL_DATA);
 
-  if (sx1272) {
-    if (sf == SF11 || sf == SF12) {
-      WriteRegister(REG_MODEM_CONFIG, 0x0B);
-    } else {
-      WriteRegister(REG_MODEM_CONFIG, 0x0A);
+  SendUdp(pull_data, sizeof(pull_data), SERVERS_ALL, NULL);
+}
+
+// Radio side: read the next frame out of the radio, if there is one.
+// Call with the radio lock held.
+bool ReadFrame(RxFrame* frame)
+{
+  // FSK frames longer than the FIFO have to be drained while they arrive,
+  // so the FSK receiver is polled rather than waiting for PayloadReady
+  if (digitalRead(conf.pin_dio0) == 1 || conf.sx127x.modu == MODU_FSK) {
+    // LoRa: RxDone raised DIO0 at the last interrupt, so the trace covers
+    // the wakeup too. FSK frames span many edges, they start at readout.
+    TraceBegin(&frame->trace, conf.sx127x.modu == MODU_LORA ? dio0_time.load() : MicrosNow());
+    frame->length = 0;
+    frame->chan = channel_plan.current();
+    if (ReceivePkt(frame->payload, &frame->length, &frame->status, &frame->trace)) {
+      frame->received = MicrosNow();
+      // TODO: tmst can jump is time is (re)set, not good.
+      frame->tmst = TmstNow();
+      return true;
     }
-    WriteRegister(REG_MODEM_CONFIG2, (sf << 4) | 0x04);
-  } else {
-    if (sf == SF11 || sf == SF12) {
-      WriteRegister(REG_MODEM_CONFIG3, 0x0C);
-    } else {
-      WriteRegister(REG_MODEM_CONFIG3, 0x04);
+  }
+  return false;
+}
+
+// Hand a frame to the Basics Station and MQTT servers in server_mask,
+// returns how many took it. json is its rxpk, for MQTT servers that
+// publish JSON.
+int QueueBackends(const RxFrame& frame, const RxPkt& pkt, const char* json, int json_size, uint32_t server_mask)
+{
+  StationFrame station_frame;
+  bool station_built = false;
+  uint8_t record[MQTT_RECORD_HEADER + 256];
+  size_t record_size = 0;
+  int queued = 0;
+  for (vector<Server_t>::iterator it = servers.begin(); it != servers.end(); ++it) {
+    if ((it->station == NULL && it->mqtt == NULL) || !it->enabled || it->paused) {
+      continue;
+    }
+    ServerMetrics& server_metrics = metrics.servers[(it - servers.begin()) % METRICS_MAX_SERVERS];
+    // Basics Station has no way to report a CRC error
+    if ((server_mask & 1u << (it - servers.begin())) == 0 || (it->station != NULL && frame.status.crc_error)) {
+      Inc(server_metrics.filtered);
+      continue;
+    }
+    if (it->station != NULL) {
+      if (!station_built) {
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        station_frame.tmst = frame.tmst;
+        station_frame.rxtime = now.tv_sec + now.tv_usec / 1e6 - (MicrosNow() - frame.received) / 1e6;
+        station_frame.freq = pkt.conf->freq;
+        station_frame.sf = pkt.conf->modu == MODU_LORA ? pkt.conf->sf : 0;
+        station_frame.bw = pkt.conf->modu == MODU_LORA ? pkt.conf->bw : 0;
+        station_frame.rssi = frame.status.rssi;
+        station_frame.snr = frame.status.snr;
+        station_frame.size = frame.length;
+        memcpy(station_frame.payload, frame.payload, frame.length);
+        station_built = true;
+      }
+      if (it->station->Queue(station_frame)) {
+        queued++;
+      }
+    } else if (it->mqtt->settings().payload == MQTT_PAYLOAD_BINARY) {
+      if (record_size == 0) {
+        record_size = MqttPackRecord(pkt, record);
+      }
+      if (it->mqtt->Queue(record, record_size)) {
+        queued++;
+      }
+    } else if (json_size > 0 && it->mqtt->Queue((const uint8_t*)json, json_size)) {
+      queued++;
     }
-    WriteRegister(REG_MODEM_CONFIG, 0x72);
-    WriteRegister(REG_MODEM_CONFIG2, (sf << 4) | 0x04);
   }
+  return queued;
+}
 
-  if (sf == SF10 || sf == SF11 || sf == SF12) {
-    WriteRegister(REG_SYMB_TIMEOUT_LSB, 0x05);
+// Network side: send a frame of class cls to the servers its rules route
+// it to and log it. Returns false, without logging, when the socket is full
+// and it has to be sent later.
+bool ForwardFrame(RxFrame& frame, UplinkClass_t cls)
+{
+  const Sx127xPktStatus& status = frame.status;
+  uint8_t length = frame.length;
+  char* message = frame.payload;
+  // A reload may have shrunk the plan since
+  uint8_t chan = frame.chan < channel_plan.count() ? frame.chan : 0;
+  const Sx127xConf& channel = channel_plan.Channel(chan);
+
+  // Header coding rate, fall back on the configured one if unreadable
+  const char* codr = CodingRateName(status.cr);
+  if (codr == NULL) {
+    codr = CodingRateName(channel.cr);
+  }
+
+  char buff_up[TX_BUFF_SIZE]; /* buffer to compose the upstream packet */
+  int buff_index = 0;
+
+  /* start composing datagram with the header */
+  WriteHeader(buff_up, PKT_PUSH_DATA);
+  buff_index = HEADER_SIZE;
+
+  RxPkt pkt;
+  pkt.tmst = frame.tmst;
+  pkt.conf = &channel;
+  pkt.chan = chan;
+  pkt.status = status;
+  pkt.codr = codr;
+  pkt.payload = (uint8_t*)message;
+  pkt.size = length;
+  int json_size = BuildRxpkJson(pkt, buff_up + buff_index, TX_BUFF_SIZE - buff_index, &frame.trace);
+
+  // Send message.
+  uint32_t server_mask = RouteServers(cls, pkt.payload, length);
+  int sent = json_size > 0 && server_mask != 0 ? SendUdp(buff_up, buff_index + json_size, server_mask, &frame.trace) : 0;
+  if (sent < 0) {
+    return false;
+  }
+  sent += QueueBackends(frame, pkt, buff_up + buff_index, json_size, server_mask);
+  if (server_mask == 0) {
+    Inc(metrics.up_unrouted);
+  } else if (sent > 0) {
+    cp_up_pkt_fwd++;
+    Inc(metrics.up_forwarded);
   } else {
-    WriteRegister(REG_SYMB_TIMEOUT_LSB, 0x08);
+    Inc(metrics.up_dropped);
+  }
+  TraceEnd(&frame.trace);
+
+  if (channel_plan.count() > 1) {
+    printf("Channel: %u, ", chan);
+  }
+  if (status.crc_error) {
+    printf("CRC error, ");
+  } else if (!status.crc_on) {
+    printf("No CRC, ");
+  }
+  printf("Packet RSSI: %d, ", status.rssi);
+  printf("RSSI: %d, ", status.current_rssi);
+  if (conf.sx127x.modu == MODU_LORA) {
+    printf("SNR: %d, ", status.snr);
+    printf("CR: %s, ", codr);
+  }
+  printf("Length: %hhu Message:'", length);
+  for (int i=0; i<length; i++) {
+    char c = (char) message[i];
+    printf("%c",isprint(c)?c:'.');
   }
-  WriteRegister(REG_MAX_PAYLOAD_LENGTH, 0x80);
-  WriteRegister(REG_PAYLOAD_LENGTH, PAYLOAD_LENGTH);
-  WriteRegister(REG_HOP_PERIOD, 0xFF);
-  WriteRegister(REG_FIFO_ADDR_PTR, ReadRegister(REG_FIFO_RX_BASE_AD));
+  printf("'\n");
 
-  // Set Continous Receive Mode
-  WriteRegister(REG_LNA, LNA_MAX_GAIN);  // max lna gain
-  WriteRegister(REG_OPMODE, SX72_MODE_RX_CONTINUOS);
+  printf("rxpk %s: %s\n", server_mask != 0 ? "update" : "not routed", buff_up + buff_index);
+
+  static bool first_frame = true;
+  if (first_frame) {
+    first_frame = false;
+    printf("First frame %.1f ms after start\n", (MicrosNow() - start_time) / 1000.0);
+  }
+
+  fflush(stdout);
+
+  // Led ON, off again when led_timer expires
+  if (conf.pin_led1 != 0xff) {
+    led_blinks = 0;
+    digitalWrite(conf.pin_led1, 1);
+    TimerArm(led_timer, 250, false);
+  }
+  return true;
 }
 
-void SolveHostname(const char* p_hostname, uint16_t port, struct sockaddr_in* p_sin)
+static void UpdateQueueDepths()
 {
-  struct addrinfo hints;
-  memset(&hints, 0, sizeof(struct addrinfo));
-  hints.ai_family = AF_INET;
-  hints.ai_socktype = SOCK_DGRAM;
-  hints.ai_protocol = IPPROTO_UDP;
+  for (int i = 0; i < UPLINK_CLASSES; i++) {
+    metrics.uplink[i].depth.store(uplink_queue.depth(i), memory_order_relaxed);
+  }
+}
 
-  char service[6] = { '\0' };
-  snprintf(service, 6, "%hu", port);
+// Write a frame to the packet feed, as soon as the event loop has it
+void PublishFrame(const RxFrame& frame)
+{
+  uint8_t chan = frame.chan < channel_plan.count() ? frame.chan : 0;
+  const Sx127xConf& channel = channel_plan.Channel(chan);
+  bool lora = channel.modu == MODU_LORA;
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  FeedRecord record;
+  record.time_us = (uint64_t)now.tv_sec * 1000000 + now.tv_usec - (MicrosNow() - frame.received);
+  record.tmst = frame.tmst;
+  record.freq = channel.freq;
+  record.bw = lora ? channel.bw : 0;
+  record.rssi = frame.status.rssi;
+  record.snr = frame.status.snr;
+  record.sf = lora ? channel.sf : 0;
+  record.chan = chan;
+  record.stat = frame.status.crc_error ? -1 : frame.status.crc_on ? 1 : 0;
+  record.size = frame.length;
+  memcpy(record.payload, frame.payload, frame.length);
+  FeedPublish(record);
+}
 
-  struct addrinfo* p_result = NULL;
+// Queue a frame for the servers by class. Frames failing their CRC have
+// no MHDR to trust and go last.
+void QueueFrame(const RxFrame& frame)
+{
+  if (FeedIsOpen()) {
+    PublishFrame(frame);
+  }
+  int cls = frame.status.crc_error ? UPLINK_PROPRIETARY : ClassifyUplink((const uint8_t*)frame.payload, frame.length);
+  int shed = uplink_queue.Push(cls, frame);
+  if (shed >= 0) {
+    Inc(metrics.uplink[shed].full);
+  }
+}
 
-  // Resolve the domain name into a list of addresses
-  int error = getaddrinfo(p_hostname, service, &hints, &p_result);
-  if (error != 0) {
-      fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(error));
-      exit(EXIT_FAILURE);
+// Send what the servers can take, highest class first, oldest first within
+// a class. Frames older than their class allows are dropped on the way,
+// a full socket is retried every UPLINK_RETRY_MS.
+void DrainUplinks()
+{
+  uint32_t now = MicrosNow();
+  for (int cls = 0; cls < UPLINK_CLASSES; cls++) {
+    uint32_t max_age = conf.uplink_max_age[cls];
+    RxFrame* frame;
+    while (max_age != 0 && (frame = uplink_queue.Front(cls)) != NULL && now - frame->received > max_age * 1000) {
+      uplink_queue.Pop(cls);
+      Inc(metrics.uplink[cls].expired);
+    }
   }
 
-  // Loop over all returned results
-  for (struct addrinfo* p_rp = p_result; p_rp != NULL; p_rp = p_rp->ai_next) {
-    struct sockaddr_in* p_saddr = (struct sockaddr_in*)p_rp->ai_addr;
-    //printf("%s solved to %s\n", p_hostname, inet_ntoa(p_saddr->sin_addr));
-    p_sin->sin_addr = p_saddr->sin_addr;
+  int cls;
+  RxFrame* frame;
+  bool blocked = false;
+  while ((frame = uplink_queue.Front(&cls)) != NULL) {
+    if (!ForwardFrame(*frame, (UplinkClass_t)cls)) {
+      blocked = true;
+      break;
+    }
+    uplink_queue.Pop(cls);
+    Inc(metrics.uplink[cls].sent);
   }
+  TimerArm(uplink_timer, blocked ? UPLINK_RETRY_MS : 0, false);
+  UpdateQueueDepths();
+}
 
-  freeaddrinfo(p_result);
+void OnUplinkTimer(int fd, uint32_t events, void* ctx)
+{
+  TimerRead(fd);
+  DrainUplinks();
 }
 
-void SendUdp(char *msg, int length)
+// Runs on the wiringPi interrupt thread, only wakes up the event loop
+void DioInterrupt()
 {
-  for (vector<Server_t>::iterator it = servers.begin(); it != servers.end(); ++it) {
-    if (it->enabled) {
-      si_other.sin_port = htons(it->port);
+  dio0_time = MicrosNow();
+  uint64_t one = 1;
+  ssize_t ret = write(dio0_event, &one, sizeof(one));
+  (void)ret;
+}
+
+// DIO0 or DIO1 edge, or the FSK poll timer
+void OnRadio(int fd, uint32_t events, void* ctx)
+{
+  uint64_t value;
+  ssize_t ret = read(fd, &value, sizeof(value));
+  (void)ret;
+  if (fd == dio0_event) {
+    metrics.radio_wakeup.Observe(MicrosNow() - dio0_time);
+  }
 
-      SolveHostname(it->address.c_str(), it->port, &si_other);
-      if (sendto(s, (char *)msg, length, 0 , (struct sockaddr *) &si_other, slen)==-1) {
-        Die("sendto()");
+  // Drain everything the radio has, a frame may have landed meanwhile
+  RxFrame frame;
+  for (;;) {
+    {
+      RadioLock lock;
+      if (!ReadFrame(&frame)) {
+        break;
       }
     }
+    QueueFrame(frame);
   }
+  DrainUplinks();
 }
 
-void SendStat()
+// Real-time radio loop, only reads frames and queues them
+void* RadioThread(void* arg)
 {
-  static char status_report[STATUS_SIZE]; /* status report as a JSON object */
-  char stat_timestamp[24];
+  // Fault the stack in now rather than on the first frame
+  volatile char stack[64 * 1024];
+  memset((char*)stack, 0, sizeof(stack));
+  AllocGuardThread();
+
+  struct pollfd pfd = { radio_fd, POLLIN, 0 };
+  while (radio_thread_running) {
+    if (poll(&pfd, 1, -1) <= 0) {
+      continue;
+    }
+    uint64_t value;
+    ssize_t ret = read(radio_fd, &value, sizeof(value));
+    (void)ret;
+    if (radio_fd == dio0_event) {
+      metrics.radio_wakeup.Observe(MicrosNow() - dio0_time);
+    }
 
-  int stat_index = 0;
+    bool queued = false;
+    {
+      RadioLock lock;
+      RxFrame frame;
+      while (ReadFrame(&frame)) {
+        frame.queued = MicrosNow();
+        if (rx_queue.Push(frame)) {
+          queued = true;
+        } else {
+          Inc(metrics.rx_queue_overflow);
+        }
+      }
+    }
+    if (queued) {
+      uint64_t one = 1;
+      ret = write(rx_ready_event, &one, sizeof(one));
+    }
+  }
+  return NULL;
+}
 
-  /* pre-fill the data buffer with fixed fields */
-  status_report[0] = PROTOCOL_VERSION;
-  status_report[3] = PKT_PUSH_DATA;
+// Frames queued by the radio thread
+void OnRxReady(int fd, uint32_t events, void* ctx)
+{
+  uint64_t value;
+  ssize_t ret = read(fd, &value, sizeof(value));
+  (void)ret;
+
+  RxFrame frame;
+  while (rx_queue.Pop(&frame)) {
+    metrics.radio_handoff.Observe(MicrosNow() - frame.queued);
+    QueueFrame(frame);
+  }
+  DrainUplinks();
+}
 
-  status_report[4] = (unsigned char)ifr.ifr_hwaddr.sa_data[0];
-  status_report[5] = (unsigned char)ifr.ifr_hwaddr.sa_data[1];
-  status_report[6] = (unsigned char)ifr.ifr_hwaddr.sa_data[2];
-  status_report[7] = 0xFF;
-  status_report[8] = 0xFF;
-  status_report[9] = (unsigned char)ifr.ifr_hwaddr.sa_data[3];
-  status_report[10] = (unsigned char)ifr.ifr_hwaddr.sa_data[4];
-  status_report[11] = (unsigned char)ifr.ifr_hwaddr.sa_data[5];
+// Lock memory and start the SCHED_FIFO radio thread
+void StartRadioThread()
+{
+  if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
+    perror("mlockall");
+  }
+#ifdef __GLIBC__
+  // Keep freed heap mapped and locked instead of handing it back
+  mallopt(M_TRIM_THRESHOLD, -1);
+  mallopt(M_MMAP_MAX, 0);
+#endif
+  rx_ready_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (rx_ready_event == -1) {
+    Die("eventfd");
+  }
+  reactor.Add(rx_ready_event, EPOLLIN, OnRxReady, NULL);
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, 256 * 1024);
+  pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+  pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+  struct sched_param param;
+  memset(&param, 0, sizeof(param));
+  param.sched_priority = conf.realtime_priority;
+  pthread_attr_setschedparam(&attr, &param);
+  if (conf.realtime_cpu >= 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(conf.realtime_cpu, &cpus);
+    pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+  }
 
-  /* start composing datagram with the header */
-  uint8_t token_h = (uint8_t)rand(); /* random token */
-  uint8_t token_l = (uint8_t)rand(); /* random token */
-  status_report[1] = token_h;
-  status_report[2] = token_l;
-  stat_index = 12; /* 12-byte header */
+  radio_thread_running = true;
+  int err = pthread_create(&radio_thread, &attr, RadioThread, NULL);
+  if (err == EPERM) {
+    // No CAP_SYS_NICE or RLIMIT_RTPRIO, run the radio loop at normal priority
+    fprintf(stderr, "realtime: not permitted to use SCHED_FIFO, radio thread at normal priority\n");
+    pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+    err = pthread_create(&radio_thread, &attr, RadioThread, NULL);
+  }
+  pthread_attr_destroy(&attr);
+  if (err != 0) {
+    errno = err;
+    Die("pthread_create");
+  }
 
-  /* get timestamp for statistics */
-  time_t t = time(NULL);
-  strftime(stat_timestamp, sizeof stat_timestamp, "%F %T %Z", gmtime(&t));
+  printf("Real-time radio thread: SCHED_FIFO priority %d, CPU %s\n", conf.realtime_priority,
+         conf.realtime_cpu >= 0 ? to_string(conf.realtime_cpu).c_str() : "any");
+}
+
+void StopRadioThread()
+{
+  radio_thread_running = false;
+  // Wake it up, the FSK poll timer does on its own
+  if (dio0_event != -1) {
+    uint64_t one = 1;
+    ssize_t ret = write(dio0_event, &one, sizeof(one));
+    (void)ret;
+  }
+  pthread_join(radio_thread, NULL);
+}
+
+void OnLedTimer(int fd, uint32_t events, void* ctx)
+{
+  TimerRead(fd);
+  if (led_blinks > 0) {
+    led_blinks--;
+    digitalWrite(conf.pin_led1, led_blinks % 2);
+    if (led_blinks == 0) {
+      TimerArm(fd, 0, false);
+    }
+  } else {
+    digitalWrite(conf.pin_led1, 0);
+  }
+}
+
+// Socket, gateway ID and server addresses, alongside the radio reset
+void SetupNetwork()
+{
+  uint32_t start = MicrosNow();
+
+  if ((sock_up = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) {
+    Die("socket");
+  }
 
-  // Build JSON object.
-  StringBuffer sb;
-  Writer<StringBuffer> writer(sb);
+  // Computed once, every datagram copies it from the header template
+  if (conf.gateway_id != 0) {
+    gateway_eui = conf.gateway_id;
+    snprintf(gateway_eui_source, sizeof(gateway_eui_source), "gateway_ID");
+  } else if (!InterfaceEui(sock_up, conf.interface_name, &gateway_eui,
+                           gateway_eui_source, sizeof(gateway_eui_source))) {
+    gateway_eui_source[0] = '\0';
+  }
+  SetGatewayEui(gateway_eui);
+
+  ResolveServers();
+
+  network_setup_time = MicrosNow() - start;
+}
+
+// Send the stat report and start a new interval
+void ReportStat()
+{
+  {
+    RadioLock lock;
+    CountHeaders(radio->TakeValidHeaders());
+  }
+  SendStat();
+  cp_nb_rx_rcv = 0;
+  cp_nb_rx_ok = 0;
+  cp_nb_rx_bad = 0;
+  cp_nb_rx_nocrc = 0;
+  cp_nb_rx_header = 0;
+  cp_up_pkt_fwd = 0;
+}
+
+void OnStatTimer(int fd, uint32_t events, void* ctx)
+{
+  TimerRead(fd);
+  ReportStat();
+}
+
+// Control socket commands, see control.h
+
+static void WriteCounter(FixedWriter& writer, const char* name, uint64_t value)
+{
+  writer.String(name);
+  writer.Uint64(value);
+}
+
+static const char* BackendName(const Server_t& server)
+{
+  return server.station != NULL ? "station" : server.mqtt != NULL ? "mqtt" : "semtech";
+}
+
+// {"cmd":"counters"}: totals since start, the current stat interval and
+// the state of every server
+static const char* CmdCounters(const rapidjson::Value& request, FixedWriter& writer)
+{
+  WriteCounter(writer, "uptime", millis() / 1000);
+  WriteCounter(writer, "rx_received", metrics.rx_received);
+  WriteCounter(writer, "rx_ok", cp_nb_rx_ok_tot);
+  WriteCounter(writer, "rx_crc_error", metrics.rx_crc_error);
+  WriteCounter(writer, "rx_no_crc", metrics.rx_no_crc);
+  WriteCounter(writer, "rx_valid_header", metrics.rx_valid_header);
+  WriteCounter(writer, "up_forwarded", metrics.up_forwarded);
+  WriteCounter(writer, "up_dropped", metrics.up_dropped);
+  WriteCounter(writer, "up_unrouted", metrics.up_unrouted);
+  WriteCounter(writer, "radio_recoveries", metrics.radio_recoveries);
+  WriteCounter(writer, "rx_queue_overflow", metrics.rx_queue_overflow);
+  WriteCounter(writer, "heap_allocs", metrics.heap_allocs);
+
+  writer.String("interval");
   writer.StartObject();
-  writer.String("stat");
+  WriteCounter(writer, "rxnb", cp_nb_rx_rcv);
+  WriteCounter(writer, "rxok", cp_nb_rx_ok);
+  WriteCounter(writer, "rxbad", cp_nb_rx_bad);
+  WriteCounter(writer, "rxnocrc", cp_nb_rx_nocrc);
+  WriteCounter(writer, "headers", cp_nb_rx_header);
+  WriteCounter(writer, "rxfw", cp_up_pkt_fwd);
+  writer.EndObject();
+
+  writer.String("channel");
+  writer.Int(channel_plan.current());
+  WriteCounter(writer, "hops", channel_plan.hops());
+  writer.String("channels");
+  writer.StartArray();
+  for (int i = 0; i < channel_plan.count(); i++) {
+    const Sx127xConf& channel = channel_plan.Channel(i);
+    ChannelStats& chan_stats = channel_plan.stats(i);
+    writer.StartObject();
+    writer.String("freq");
+    writer.Uint(channel.freq);
+    if (channel.modu == MODU_LORA) {
+      writer.String("sf");
+      writer.Uint(channel.sf);
+      writer.String("bw");
+      writer.Uint(channel.bw);
+    }
+    WriteCounter(writer, "rx", chan_stats.rx);
+    WriteCounter(writer, "ok", chan_stats.ok);
+    WriteCounter(writer, "crc_error", chan_stats.crc_error);
+    NoiseFloor floor;
+    if (NoiseFloorGet(chan_stats.noise, &floor)) {
+      writer.String("noise");
+      writer.StartObject();
+      writer.String("p10");
+      writer.Int(floor.p10);
+      writer.String("p50");
+      writer.Int(floor.p50);
+      writer.String("p90");
+      writer.Int(floor.p90);
+      WriteCounter(writer, "samples", chan_stats.noise.samples);
+      writer.EndObject();
+    }
+    writer.EndObject();
+  }
+  writer.EndArray();
+
+  writer.String("sf");
   writer.StartObject();
-  writer.String("time");
-  writer.String(stat_timestamp);
-  writer.String("lati");
-  writer.Double(lat);
-  writer.String("long");
-  writer.Double(lon);
-  writer.String("alti");
-  writer.Int(alt);
-  writer.String("rxnb");
-  writer.Uint(cp_nb_rx_rcv);
-  writer.String("rxok");
-  writer.Uint(cp_nb_rx_ok);
-  writer.String("rxfw");
-  writer.Uint(cp_up_pkt_fwd);
-  writer.String("ackr");
-  writer.Double(0);
-  writer.String("dwnb");
-  writer.Uint(0);
-  writer.String("txnb");
-  writer.Uint(0);
-  writer.String("pfrm");
-  writer.String(platform);
-  writer.String("mail");
-  writer.String(email);
-  writer.String("desc");
-  writer.String(description);
+  for (int i = 0; i < METRICS_SF_COUNT; i++) {
+    const SfMetrics& sf_metrics = metrics.sf[i];
+    char sf[8];
+    snprintf(sf, sizeof(sf), "SF%d", METRICS_SF_MIN + i);
+    writer.String(sf);
+    writer.StartObject();
+    WriteCounter(writer, "rx", sf_metrics.rx);
+    WriteCounter(writer, "crc_error", sf_metrics.crc_error);
+    WriteCounter(writer, "no_crc", sf_metrics.no_crc);
+    WriteCounter(writer, "valid_header", sf_metrics.valid_header);
+    writer.EndObject();
+  }
   writer.EndObject();
+
+  writer.String("uplink");
+  writer.StartObject();
+  for (int i = 0; i < UPLINK_CLASSES; i++) {
+    const UplinkClassMetrics& class_metrics = metrics.uplink[i];
+    writer.String(uplink_class_names[i]);
+    writer.StartObject();
+    WriteCounter(writer, "depth", uplink_queue.depth(i));
+    WriteCounter(writer, "sent", class_metrics.sent);
+    WriteCounter(writer, "expired", class_metrics.expired);
+    WriteCounter(writer, "full", class_metrics.full);
+    writer.EndObject();
+  }
   writer.EndObject();
 
-  string json = sb.GetString();
-  //printf("stat update: %s\n", json.c_str());
-  printf("stat update: %s", stat_timestamp);
-  if (cp_nb_rx_ok_tot==0) {
-    printf(" no packet received yet\n");
-  } else {
-    printf(" %u packet%sreceived\n", cp_nb_rx_ok_tot, cp_nb_rx_ok_tot>1?"s ":" ");
+  if (FeedIsOpen()) {
+    WriteCounter(writer, "packet_feed", FeedCount());
   }
 
-  // Build and send message.
-  memcpy(status_report + 12, json.c_str(), json.size());
-  SendUdp(status_report, stat_index + json.size());
+  writer.String("txpk");
+  writer.StartObject();
+  for (int i = 0; i < TX_ERRORS; i++) {
+    WriteCounter(writer, tx_error_names[i], metrics.txpk[i]);
+  }
+  WriteCounter(writer, "invalid", metrics.txpk_invalid);
+  writer.EndObject();
+
+  writer.String("servers");
+  writer.StartArray();
+  for (vector<Server_t>::iterator it = servers.begin(); it != servers.end(); ++it) {
+    const ServerMetrics& server_metrics = metrics.servers[(it - servers.begin()) % METRICS_MAX_SERVERS];
+    writer.StartObject();
+    writer.String("address");
+    writer.String(it->address.c_str());
+    writer.String("port");
+    writer.Uint(it->port);
+    writer.String("backend");
+    writer.String(BackendName(*it));
+    writer.String("enabled");
+    writer.Bool(it->enabled);
+    writer.String("paused");
+    writer.Bool(it->paused);
+    if (it->station != NULL) {
+      writer.String("connected");
+      writer.Bool(it->station->connected());
+    } else if (it->mqtt != NULL) {
+      writer.String("connected");
+      writer.Bool(it->mqtt->connected());
+      WriteCounter(writer, "inflight", it->mqtt->inflight());
+    } else {
+      writer.String("protocol_version");
+      writer.Uint(it->version);
+      writer.String("resolved");
+      if (it->resolved) {
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &it->addr.sin_addr, ip, sizeof(ip));
+        writer.String(ip);
+      } else {
+        writer.Null();
+      }
+    }
+    WriteCounter(writer, "sent", server_metrics.sent);
+    WriteCounter(writer, "send_errors", server_metrics.send_errors);
+    WriteCounter(writer, "filtered", server_metrics.filtered);
+    if (it->station == NULL) {
+      WriteCounter(writer, "acked", server_metrics.acked);
+    }
+    if (it->station != NULL || it->mqtt != NULL) {
+      WriteCounter(writer, "reconnects", server_metrics.reconnects);
+      WriteCounter(writer, "downlinks", server_metrics.downlinks);
+    }
+    writer.EndObject();
+  }
+  writer.EndArray();
+  return NULL;
 }
 
-bool Receivepacket()
+// {"cmd":"registers"}: the registers the watchdog checks, as programmed
+// and as read back from the radio
+static const char* CmdRegisters(const rapidjson::Value& request, FixedWriter& writer)
 {
-  long int SNR;
-  int rssicorr;
-  bool ret = false;
+  writer.String("chip");
+  writer.String(radio->Name());
+  writer.String("registers");
+  writer.StartArray();
+
+  int mismatches = 0;
+  {
+    RadioLock lock;
+    size_t count;
+    const RegSpan* spans = radio->WatchSpans(&count);
+    for (size_t i = 0; i < count; i++) {
+      uint8_t live[SX127X_REG_COUNT];
+      ReadBurst(spans[i].addr, live, spans[i].length);
+      for (uint8_t j = 0; j < spans[i].length; j++) {
+        uint8_t addr = spans[i].addr + j;
+        writer.StartObject();
+        writer.String("addr");
+        writer.Uint(addr);
+        writer.String("shadow");
+        writer.Uint(radio->Shadow(addr));
+        writer.String("live");
+        writer.Uint(live[j]);
+        writer.EndObject();
+        if (live[j] != radio->Shadow(addr)) {
+          mismatches++;
+        }
+      }
+    }
+  }
 
-  if (digitalRead(dio0) == 1) {
-    char message[256];
-    uint8_t length = 0;
-    if (ReceivePkt(message, &length)) {
-      // OK got one
-      ret = true;
+  writer.EndArray();
+  writer.String("mismatches");
+  writer.Int(mismatches);
+  return NULL;
+}
 
-      uint8_t value = ReadRegister(REG_PKT_SNR_VALUE);
-      if (value & 0x80) { // The SNR sign bit is 1
-        // Invert and divide by 4
-        value = ((~value + 1) & 0xFF) >> 2;
-        SNR = -value;
-      } else {
-        // Divide by 4
-        SNR = ( value & 0xFF ) >> 2;
-      }
+// {"cmd":"radio","freq":868300000,"sf":9,"bw":125,"cr":"4/5"}, every key
+// optional: retune the running receiver. With a channel plan the settings
+// apply to the channels that do not set their own, and the frequencies
+// come from the plan. Lasts until the next reload.
+static const char* CmdRadio(const rapidjson::Value& request, FixedWriter& writer)
+{
+  Sx127xConf next = conf.sx127x;
 
-      rssicorr = sx1272 ? 139 : 157;
+  if (request.HasMember("freq") && conf.channel_count != 0) {
+    return "freq: set by the channel plan";
+  }
+  if (request.HasMember("freq")) {
+    const rapidjson::Value& freq = request["freq"];
+    if (!freq.IsUint() || freq.GetUint() < 137000000 || freq.GetUint() > 1020000000) {
+      return "freq: expected an integer 137000000 to 1020000000";
+    }
+    next.freq = freq.GetUint();
+  }
+  if (conf.sx127x.modu == MODU_FSK &&
+      (request.HasMember("sf") || request.HasMember("bw") || request.HasMember("cr"))) {
+    return "sf, bw and cr only apply to LORA";
+  }
+  if (request.HasMember("sf")) {
+    const rapidjson::Value& sf = request["sf"];
+    if (!sf.IsUint() || sf.GetUint() < SF7 || sf.GetUint() > SF12) {
+      return "sf: expected an integer 7 to 12";
+    }
+    next.sf = (SpreadingFactor_t)sf.GetUint();
+  }
+  if (request.HasMember("bw")) {
+    const rapidjson::Value& bw = request["bw"];
+    if (!bw.IsUint() || (bw.GetUint() != BW125 && bw.GetUint() != BW250 && bw.GetUint() != BW500)) {
+      return "bw: expected 125, 250 or 500";
+    }
+    next.bw = (Bandwidth_t)bw.GetUint();
+  }
+  if (request.HasMember("cr")) {
+    const rapidjson::Value& cr = request["cr"];
+    int i = CR4_5;
+    while (cr.IsString() && i <= CR4_8 && strcmp(cr.GetString(), CodingRateName((CodingRate_t)i)) != 0) {
+      i++;
+    }
+    if (!cr.IsString() || i > CR4_8) {
+      return "cr: expected 4/5, 4/6, 4/7 or 4/8";
+    }
+    next.cr = (CodingRate_t)i;
+  }
 
-      printf("Packet RSSI: %d, ", ReadRegister(0x1A) - rssicorr);
-      printf("RSSI: %d, ", ReadRegister(0x1B) - rssicorr);
-      printf("SNR: %li, ", SNR);
-      printf("Length: %hhu Message:'", length);
-      for (int i=0; i<length; i++) {
-        char c = (char) message[i];
-        printf("%c",isprint(c)?c:'.');
-      }
-      printf("'\n");
-
-      char buff_up[TX_BUFF_SIZE]; /* buffer to compose the upstream packet */
-      int buff_index = 0;
-
-      /* gateway <-> MAC protocol variables */
-      //static uint32_t net_mac_h; /* Most Significant Nibble, network order */
-      //static uint32_t net_mac_l; /* Least Significant Nibble, network order */
-
-      /* pre-fill the data buffer with fixed fields */
-      buff_up[0] = PROTOCOL_VERSION;
-      buff_up[3] = PKT_PUSH_DATA;
-
-      /* process some of the configuration variables */
-      //net_mac_h = htonl((uint32_t)(0xFFFFFFFF & (lgwm>>32)));
-      //net_mac_l = htonl((uint32_t)(0xFFFFFFFF &  lgwm  ));
-      //*(uint32_t *)(buff_up + 4) = net_mac_h; 
-      //*(uint32_t *)(buff_up + 8) = net_mac_l;
-
-      buff_up[4] = (uint8_t)ifr.ifr_hwaddr.sa_data[0];
-      buff_up[5] = (uint8_t)ifr.ifr_hwaddr.sa_data[1];
-      buff_up[6] = (uint8_t)ifr.ifr_hwaddr.sa_data[2]; 
-      buff_up[7] = 0xFF;
-      buff_up[8] = 0xFF;
-      buff_up[9] = (uint8_t)ifr.ifr_hwaddr.sa_data[3];
-      buff_up[10] = (uint8_t)ifr.ifr_hwaddr.sa_data[4];
-      buff_up[11] = (uint8_t)ifr.ifr_hwaddr.sa_data[5];
-
-      /* start composing datagram with the header */
-      uint8_t token_h = (uint8_t)rand(); /* random token */
-      uint8_t token_l = (uint8_t)rand(); /* random token */
-      buff_up[1] = token_h;
-      buff_up[2] = token_l;
-      buff_index = 12; /* 12-byte header */
+  int written;
+  Sx127xConf tuned;
+  {
+    RadioLock lock;
+    conf.sx127x = next;
+    channel_plan.Init(conf, millis());
+    written = radio->Reconfigure(*channel_plan.Tuned());
+    tuned = *channel_plan.Tuned();
+  }
+  printf("control: radio retuned, %d registers\n", written);
+
+  writer.String("registers_written");
+  writer.Int(written);
+  writer.String("freq");
+  writer.Uint(tuned.freq);
+  if (tuned.modu == MODU_LORA) {
+    writer.String("sf");
+    writer.Uint(tuned.sf);
+    writer.String("bw");
+    writer.Uint(tuned.bw);
+    writer.String("cr");
+    writer.String(CodingRateName(tuned.cr));
+  }
+  return NULL;
+}
 
-      // TODO: tmst can jump is time is (re)set, not good.
-      struct timeval now;
-      gettimeofday(&now, NULL);
-      uint32_t tmst = (uint32_t)(now.tv_sec * 1000000 + now.tv_usec);
+// "server" of a request: an index, an address or address:port
+static Server_t* FindServer(const rapidjson::Value& request)
+{
+  if (!request.HasMember("server")) {
+    return NULL;
+  }
+  const rapidjson::Value& server = request["server"];
+  if (server.IsUint()) {
+    return server.GetUint() < servers.size() ? &servers[server.GetUint()] : NULL;
+  }
+  if (!server.IsString()) {
+    return NULL;
+  }
+  for (vector<Server_t>::iterator it = servers.begin(); it != servers.end(); ++it) {
+    char name[160];
+    snprintf(name, sizeof(name), "%s:%hu", it->address.c_str(), it->port);
+    if (it->address == server.GetString() || strcmp(name, server.GetString()) == 0) {
+      return &*it;
+    }
+  }
+  return NULL;
+}
 
-      // Encode payload.
-      char b64[BASE64_MAX_LENGTH];
-      bin_to_b64((uint8_t*)message, length, b64, BASE64_MAX_LENGTH);
+static const char* PauseServer(const rapidjson::Value& request, FixedWriter& writer, bool paused)
+{
+  Server_t* server = FindServer(request);
+  if (server == NULL) {
+    return "server: expected the index, address or address:port of a configured server";
+  }
+  server->paused = paused;
+  printf("control: %s:%hu %s\n", server->address.c_str(), server->port, paused ? "paused" : "resumed");
+
+  writer.String("address");
+  writer.String(server->address.c_str());
+  writer.String("port");
+  writer.Uint(server->port);
+  writer.String("paused");
+  writer.Bool(server->paused);
+  return NULL;
+}
 
-      // Build JSON object.
-      StringBuffer sb;
-      Writer<StringBuffer> writer(sb);
-      writer.StartObject();
-      writer.String("rxpk");
-      writer.StartArray();
-      writer.StartObject();
-      writer.String("tmst");
-      writer.Uint(tmst);
-      writer.String("freq");
-      writer.Double((double)freq / 1000000);
-      writer.String("chan");
-      writer.Uint(0);
-      writer.String("rfch");
-      writer.Uint(0);
-      writer.String("stat");
-      writer.Uint(1);
-      writer.String("modu");
-      writer.String("LORA");
-      writer.String("datr");
-      char datr[] = "SFxxBWxxx";
-      snprintf(datr, strlen(datr) + 1, "SF%hhuBW%hu", sf, bw);
-      writer.String(datr);
-      writer.String("codr");
-      writer.String("4/5");
-      writer.String("rssi");
-      writer.Int(ReadRegister(0x1A) - rssicorr);
-      writer.String("lsnr");
-      writer.Double(SNR); // %li.
-      writer.String("size");
-      writer.Uint(length);
-      writer.String("data");
-      writer.String(b64);
-      writer.EndObject();
-      writer.EndArray();
-      writer.EndObject();
+// {"cmd":"pause","server":0}: stop forwarding to a server until resumed
+static const char* CmdPause(const rapidjson::Value& request, FixedWriter& writer)
+{
+  return PauseServer(request, writer, true);
+}
+
+static const char* CmdResume(const rapidjson::Value& request, FixedWriter& writer)
+{
+  return PauseServer(request, writer, false);
+}
+
+// {"cmd":"stat"}: send the stat report now and start a new interval
+static const char* CmdStat(const rapidjson::Value& request, FixedWriter& writer)
+{
+  ReportStat();
+  return NULL;
+}
+
+void OnKeepaliveTimer(int fd, uint32_t events, void* ctx)
+{
+  TimerRead(fd);
+  SendKeepalive();
+}
+
+// Channel plan: retune to the next channel once the dwell time is over,
+// unless a frame is on its way or waiting to be read
+void OnHopTimer(int fd, uint32_t events, void* ctx)
+{
+  TimerRead(fd);
+  uint32_t next;
+  {
+    RadioLock lock;
+    bool busy = radio->Receiving() || digitalRead(conf.pin_dio0) == 1;
+    if (busy && hop_deferrals < HOP_MAX_DEFERRALS) {
+      hop_deferrals++;
+      next = HOP_RETRY_MS;
+    } else {
+      hop_deferrals = 0;
+      CountHeaders(radio->TakeValidHeaders());
+      channel_plan.Hop(millis());
+      radio->Reconfigure(*channel_plan.Tuned());
+      next = channel_plan.Dwell();
+    }
+  }
+  TimerArm(fd, next, false);
+}
+
+// Noise floor: one RSSI sample of the channel the radio is on, between
+// frames. The sample is a single SPI burst under the radio lock, so a
+// frame arriving meanwhile waits at most that long to be read.
+void OnNoiseTimer(int fd, uint32_t events, void* ctx)
+{
+  TimerRead(fd);
+  RadioLock lock;
+  int rssi;
+  if (digitalRead(conf.pin_dio0) == 0 && radio->SampleNoise(&rssi)) {
+    NoiseAdd(&channel_plan.stats(channel_plan.current()).noise, rssi);
+  }
+}
 
-      string json = sb.GetString();
-      printf("rxpk update: %s\n", json.c_str());
+void OnHousekeepingTimer(int fd, uint32_t events, void* ctx)
+{
+  static uint32_t dns_age = 0;
+  TimerRead(fd);
 
-      // Build and send message.
-      memcpy(buff_up + 12, json.c_str(), json.size());
-      SendUdp(buff_up, buff_index + json.size());
+  // Servers moved ? Resolved on the resolver thread, applied when done
+  if (conf.dns_refresh_interval != 0 && ++dns_age >= conf.dns_refresh_interval) {
+    dns_age = 0;
+    ResolverRequest();
+  }
 
-      fflush(stdout);
+  // Radio still configured and receiving ?
+  {
+    RadioLock lock;
+    if (watchdog.Poll(millis())) {
+      Inc(metrics.radio_recoveries);
+    }
+  }
+
+  // FSK: a missed edge, or a frame lost to a FIFO overrun, leaves DIO0 and
+  // DIO1 quiet until the receiver is looked at
+  if (conf.sx127x.modu == MODU_FSK && dio0_event != -1) {
+    DioInterrupt();
+  }
+
+  // Trace capture window over ?
+  TraceCapturePoll();
+}
+
+// Server acknowledgements and downlinks
+void OnUplinkSocket(int fd, uint32_t events, void* ctx)
+{
+  ReceiveDownstream();
+}
+
+// Print and undo changes to settings only read at startup
+static void KeepStartupSetting(const char* key, void* next, const void* running, size_t size)
+{
+  if (memcmp(next, running, size) != 0) {
+    printf("reload: %s needs a restart, ignored\n", key);
+    memcpy(next, running, size);
+  }
+}
+
+#define KEEP_STARTUP_SETTING(key, member) \
+  KeepStartupSetting(key, &next.member, &conf.member, sizeof(conf.member))
+
+// The settings an Mqtt client is made with
+static bool SameMqtt(const ConfigServer& a, const ConfigServer& b)
+{
+  return strcmp(a.topic_up, b.topic_up) == 0 && strcmp(a.topic_down, b.topic_down) == 0 &&
+         strcmp(a.username, b.username) == 0 && strcmp(a.password, b.password) == 0 &&
+         a.payload == b.payload && a.qos == b.qos && a.max_inflight == b.max_inflight &&
+         a.keepalive == b.keepalive;
+}
+
+static bool SameServers(const Config& a, const Config& b)
+{
+  if (a.server_count != b.server_count) {
+    return false;
+  }
+  for (int i = 0; i < a.server_count; i++) {
+    if (strcmp(a.servers[i].address, b.servers[i].address) != 0 ||
+        a.servers[i].port != b.servers[i].port || a.servers[i].enabled != b.servers[i].enabled ||
+        a.servers[i].backend != b.servers[i].backend || !SameMqtt(a.servers[i], b.servers[i]) ||
+        a.servers[i].protocol_version != b.servers[i].protocol_version ||
+        a.servers[i].rule_count != b.servers[i].rule_count ||
+        memcmp(a.servers[i].rules, b.servers[i].rules, a.servers[i].rule_count * sizeof(ConfigRule)) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Apply the configuration files again, without a restart. Only the radio
+// registers that change are rewritten, the server table is swapped between
+// two sends, and frames in the radio FIFO or the queue are kept. On error
+// the running configuration stays.
+void ReloadConfiguration()
+{
+  // Out of the steady state, parsing and resolving allocate
+  AllocGuardDisarm();
+
+  Config next;
+  char error[CONFIG_ERROR_SIZE];
+  if (!ConfigLoadLayered(&next, error, sizeof(error))) {
+    fprintf(stderr, "reload: %s, configuration unchanged\n", error);
+    AllocGuardArm(conf.alloc_guard);
+    return;
+  }
+  AdjustConfiguration(&next);
+
+  KEEP_STARTUP_SETTING("modulation", sx127x.modu);
+  KEEP_STARTUP_SETTING("pin_nss", pin_nss);
+  KEEP_STARTUP_SETTING("pin_dio0", pin_dio0);
+  KEEP_STARTUP_SETTING("pin_dio1", pin_dio1);
+  KEEP_STARTUP_SETTING("pin_rst", pin_rst);
+  KEEP_STARTUP_SETTING("pin_led1", pin_led1);
+  KEEP_STARTUP_SETTING("gateway_ID", gateway_id);
+  KEEP_STARTUP_SETTING("interface", interface_name);
+  KEEP_STARTUP_SETTING("metrics_port", metrics_port);
+  KEEP_STARTUP_SETTING("trace_capture_file", trace_capture_file);
+  KEEP_STARTUP_SETTING("trace_capture_seconds", trace_capture_seconds);
+  KEEP_STARTUP_SETTING("realtime", realtime);
+  KEEP_STARTUP_SETTING("realtime_priority", realtime_priority);
+  KEEP_STARTUP_SETTING("realtime_cpu", realtime_cpu);
+  KEEP_STARTUP_SETTING("rx_queue_depth", rx_queue_depth);
+  KEEP_STARTUP_SETTING("uplink_queue_depth", uplink_queue_depth);
+  KEEP_STARTUP_SETTING("alloc_guard", alloc_guard);
+  KEEP_STARTUP_SETTING("config_watch", config_watch);
+  KEEP_STARTUP_SETTING("control_socket", control_socket);
+  KEEP_STARTUP_SETTING("packet_feed", packet_feed);
+  KEEP_STARTUP_SETTING("packet_feed_slots", packet_feed_slots);
+
+  if (!SameServers(next, conf)) {
+    SetServers(next);
+    ResolveServers();
+    UpdateBackends();
+    printf("reload: %d servers\n", next.server_count);
+  }
+
+  if (next.keepalive_interval != conf.keepalive_interval) {
+    TimerArm(keepalive_timer, next.keepalive_interval * 1000, true);
+  }
+
+  // The radio thread reads conf and the channel plan
+  {
+    RadioLock lock;
+    channel_plan.Init(next, millis());
+    int written = radio->Reconfigure(*channel_plan.Tuned());
+    if (written != 0) {
+      printf("reload: radio reprogrammed, %d registers\n", written);
+    }
+    bool watchdog_changed = next.watchdog_interval != conf.watchdog_interval;
+    conf = next;
+    if (watchdog_changed) {
+      watchdog.Start(radio, channel_plan.Tuned(), conf.watchdog_interval * 1000, millis());
+    }
+  }
+  hop_deferrals = 0;
+  TimerArm(hop_timer, channel_plan.Dwell(), false);
+  TimerArm(noise_timer, conf.noise_scan_interval, true);
+
+  AllocGuardArm(conf.alloc_guard);
+}
+
+void OnConfigWatch(int fd, uint32_t events, void* ctx)
+{
+  char buff[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  bool changed = false;
+  ssize_t length;
+  while ((length = read(fd, buff, sizeof(buff))) > 0) {
+    for (char* p = buff; p < buff + length; ) {
+      struct inotify_event* event = (struct inotify_event*)p;
+      if (event->len != 0 &&
+          (strcmp(event->name, "global_conf.json") == 0 || strcmp(event->name, "local_conf.json") == 0)) {
+        changed = true;
+      }
+      p += sizeof(struct inotify_event) + event->len;
+    }
+  }
+  if (changed) {
+    printf("Configuration changed, reloading\n");
+    ReloadConfiguration();
+  }
+}
+
+void OnSignal(int fd, uint32_t events, void* ctx)
+{
+  struct signalfd_siginfo info;
+  while (read(fd, &info, sizeof(info)) == sizeof(info)) {
+    if (info.ssi_signo == SIGHUP) {
+      printf("SIGHUP, reloading configuration\n");
+      ReloadConfiguration();
+    } else {
+      printf("%s, shutting down\n", info.ssi_signo == SIGINT ? "SIGINT" : "SIGTERM");
+      reactor.Stop();
     }
   }
-  return ret;
 }
 
 int main()
 {
-  struct timeval nowtime;
-  uint32_t lasttime;
-  unsigned int led1_timer;
+  start_time = MicrosNow();
 
-  LoadConfiguration("global_conf.json");
+  LoadConfiguration();
   PrintConfiguration();
 
-  // Init WiringPI
-  wiringPiSetup() ;
-  pinMode(ssPin, OUTPUT);
-  pinMode(dio0, INPUT);
-  pinMode(RST, OUTPUT);
+  // SIGINT/SIGTERM stop, SIGHUP reloads the configuration. Blocked before
+  // any thread starts, they all inherit the mask.
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  sigaddset(&mask, SIGHUP);
+  int signal_fd = SignalCreate(&mask);
+  if (signal_fd == -1) {
+    Die("signalfd");
+  }
+  reactor.Add(signal_fd, EPOLLIN, OnSignal, NULL);
+
+  // Everything sized by the configuration, allocated once
+  size_t uplink_slots = UPLINK_CLASSES * conf.uplink_queue_depth;
+  if (!arena.Init((conf.rx_queue_depth + uplink_slots) * sizeof(RxFrame) + 4096) ||
+      !rx_queue.Init(arena.New<RxFrame>(conf.rx_queue_depth), conf.rx_queue_depth) ||
+      !uplink_queue.Init(arena.New<RxFrame>(uplink_slots), conf.uplink_queue_depth)) {
+    Die("arena");
+  }
 
-  // LED ?
-  if (Led1 != 0xff) {
-    pinMode(Led1, OUTPUT);
+  // Raw frames for readers on this host
+  if (conf.packet_feed[0] != '\0') {
+    char error[256];
+    if (FeedOpen(conf.packet_feed, conf.packet_feed_slots, error, sizeof(error))) {
+      printf("Packet feed in %s, %u slots\n", conf.packet_feed, conf.packet_feed_slots);
+    } else {
+      fprintf(stderr, "packet_feed: %s\n", error);
+    }
+  }
 
-    // Blink to indicate startup
-    for (uint8_t i=0; i<5 ; i++) {
-      digitalWrite(Led1, 1);
-      delay(200);
-      digitalWrite(Led1, 0);
-      delay(200);
+  // Metrics endpoint
+  if (conf.metrics_port != 0) {
+    MetricsAddRenderer(TraceRenderMetrics);
+    MetricsAddRenderer(ChannelRenderMetrics);
+    MetricsAddRenderer(UplinkRenderMetrics);
+    if (MetricsStart(conf.metrics_port)) {
+      printf("Metrics on http://127.0.0.1:%hu/metrics\n", conf.metrics_port);
     }
   }
 
+  // Radio register access is shared with the real-time radio thread
+  pthread_mutexattr_t mutex_attr;
+  pthread_mutexattr_init(&mutex_attr);
+  pthread_mutexattr_setprotocol(&mutex_attr, PTHREAD_PRIO_INHERIT);
+  pthread_mutex_init(&radio_mutex, &mutex_attr);
+  pthread_mutexattr_destroy(&mutex_attr);
+
+  // Init WiringPI
+  wiringPiSetup() ;
+  pinMode(conf.pin_nss, OUTPUT);
+  pinMode(conf.pin_dio0, INPUT);
+  if (conf.pin_dio1 != 0xff) {
+    pinMode(conf.pin_dio1, INPUT);
+  }
+  pinMode(conf.pin_rst, OUTPUT);
+
+  // LED ? Blinks 5 times to indicate startup, from the event loop
+  if (conf.pin_led1 != 0xff) {
+    pinMode(conf.pin_led1, OUTPUT);
+    digitalWrite(conf.pin_led1, 1);
+    led_blinks = 9;
+  }
+
+  // Network side in parallel with the radio reset and detection
+  thread network(SetupNetwork);
+
   // Init SPI
   wiringPiSPISetup(SPI_CHANNEL, 500000);
 
   // Setup LORA
+  uint32_t radio_start = MicrosNow();
   SetupLoRa();
+  uint32_t radio_setup_time = MicrosNow() - radio_start;
 
-  // Prepare Socket connection
-  if ((s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) {
-    Die("socket");
+  network.join();
+
+  if (gateway_eui == 0) {
+    fprintf(stderr, "WARNING: no MAC address found%s%s, set gateway_ID in gateway_conf\n",
+            conf.interface_name[0] != '\0' ? " on " : "", conf.interface_name);
+  }
+  printf("Gateway ID: %.2x:%.2x:%.2x:%.2x:%.2x:%.2x:%.2x:%.2x (%s)\n",
+         (uint8_t)(gateway_eui >> 56), (uint8_t)(gateway_eui >> 48),
+         (uint8_t)(gateway_eui >> 40), (uint8_t)(gateway_eui >> 32),
+         (uint8_t)(gateway_eui >> 24), (uint8_t)(gateway_eui >> 16),
+         (uint8_t)(gateway_eui >> 8), (uint8_t)gateway_eui,
+         gateway_eui_source[0] != '\0' ? gateway_eui_source : "none");
+
+  // Basics Station and MQTT servers identify the gateway by its EUI
+  backends_started = true;
+  UpdateBackends();
+
+  for (int i = 0; i < channel_plan.count(); i++) {
+    const Sx127xConf& channel = channel_plan.Channel(i);
+    if (channel_plan.count() > 1) {
+      printf("Channel %d: ", i);
+    }
+    if (channel.modu == MODU_FSK) {
+      printf("Listening at FSK %u bps on %.6lf Mhz.\n", channel.fsk_bitrate, (double)channel.freq/1000000);
+    } else {
+      printf("Listening at SF%iBW%i CR%s on %.6lf Mhz.\n", channel.sf, channel.bw,
+             CodingRateName(channel.cr), (double)channel.freq/1000000);
+    }
+  }
+  if (channel_plan.count() > 1) {
+    printf("Hopping every %u ms%s\n", conf.hop_dwell, conf.hop_policy == HOP_ADAPTIVE ? " on average, weighted by traffic" : "");
+  }
+  if (conf.noise_scan_interval != 0 && conf.sx127x.modu == MODU_LORA) {
+    printf("Sampling the noise floor every %u ms\n", conf.noise_scan_interval);
+  }
+  printf("-----------------------------------\n");
+
+  if (conf.trace_capture_file[0] != '\0') {
+    TraceCaptureStart(conf.trace_capture_file, conf.trace_capture_seconds);
   }
 
-  memset((char *) &si_other, 0, sizeof(si_other));
-  si_other.sin_family = AF_INET;
+  // Radio: DIO0 rising edge (RxDone, or PayloadReady in FSK) through the
+  // wiringPi interrupt. FSK frames longer than the FIFO are drained while
+  // they arrive, on the FifoLevel edges of DIO1; boards without DIO1 wired
+  // poll the FSK receiver every millisecond instead.
+  if (conf.sx127x.modu == MODU_FSK && conf.pin_dio1 == 0xff) {
+    fprintf(stderr, "WARNING: pin_dio1 not set, polling the FSK receiver every millisecond\n");
+    radio_fd = TimerCreate();
+    TimerArm(radio_fd, 1, true);
+  } else {
+    dio0_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (dio0_event == -1) {
+      Die("eventfd");
+    }
+    radio_fd = dio0_event;
+    if (wiringPiISR(conf.pin_dio0, INT_EDGE_RISING, DioInterrupt) < 0 ||
+        (conf.sx127x.modu == MODU_FSK && wiringPiISR(conf.pin_dio1, INT_EDGE_RISING, DioInterrupt) < 0)) {
+      Die("wiringPiISR");
+    }
+    // Edge before the interrupt was set up
+    DioInterrupt();
+  }
+  if (conf.realtime) {
+    StartRadioThread();
+  } else {
+    reactor.Add(radio_fd, EPOLLIN, OnRadio, NULL);
+  }
 
-  ifr.ifr_addr.sa_family = AF_INET;
-  strncpy(ifr.ifr_name, "eth0", IFNAMSIZ-1);  // can we rely on eth0?
-  ioctl(s, SIOCGIFHWADDR, &ifr);
+  if (conf.pin_led1 != 0xff) {
+    led_timer = TimerCreate();
+    reactor.Add(led_timer, EPOLLIN, OnLedTimer, NULL);
+    TimerArm(led_timer, 200, true);
+  }
 
-  // ID based on MAC Adddress of eth0
-  printf( "Gateway ID: %.2x:%.2x:%.2x:ff:ff:%.2x:%.2x:%.2x\n",
-              (uint8_t)ifr.ifr_hwaddr.sa_data[0],
-              (uint8_t)ifr.ifr_hwaddr.sa_data[1],
-              (uint8_t)ifr.ifr_hwaddr.sa_data[2],
-              (uint8_t)ifr.ifr_hwaddr.sa_data[3],
-              (uint8_t)ifr.ifr_hwaddr.sa_data[4],
-              (uint8_t)ifr.ifr_hwaddr.sa_data[5]
-  );
+  int stat_timer = TimerCreate();
+  TimerArm(stat_timer, 30000, true);
+  reactor.Add(stat_timer, EPOLLIN, OnStatTimer, NULL);
 
-  printf("Listening at SF%i on %.6lf Mhz.\n", sf,(double)freq/1000000);
-  printf("-----------------------------------\n");
+  hop_timer = TimerCreate();
+  reactor.Add(hop_timer, EPOLLIN, OnHopTimer, NULL);
+  TimerArm(hop_timer, channel_plan.Dwell(), false);
 
-  while(1) {
+  noise_timer = TimerCreate();
+  reactor.Add(noise_timer, EPOLLIN, OnNoiseTimer, NULL);
+  TimerArm(noise_timer, conf.noise_scan_interval, true);
 
-    // Packet received ?
-    if (Receivepacket()) {
-      // Led ON
-      if (Led1 != 0xff) {
-        digitalWrite(Led1, 1);
-      }
+  uplink_timer = TimerCreate();
+  reactor.Add(uplink_timer, EPOLLIN, OnUplinkTimer, NULL);
+
+  keepalive_timer = TimerCreate();
+  reactor.Add(keepalive_timer, EPOLLIN, OnKeepaliveTimer, NULL);
+  if (conf.keepalive_interval != 0) {
+    TimerArm(keepalive_timer, conf.keepalive_interval * 1000, true);
+    SendKeepalive();
+  }
 
-      // start our Led blink timer, LED as been lit in Receivepacket
-      led1_timer=millis();
+  // Reload when global_conf.json or local_conf.json is rewritten
+  if (conf.config_watch) {
+    config_watch = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (config_watch == -1 || inotify_add_watch(config_watch, ".", IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+      Die("inotify");
     }
+    reactor.Add(config_watch, EPOLLIN, OnConfigWatch, NULL);
+  }
 
-    gettimeofday(&nowtime, NULL);
-    uint32_t nowseconds = (uint32_t)(nowtime.tv_sec);
-    if (nowseconds - lasttime >= 30) {
-      lasttime = nowseconds;
-      SendStat();
-      cp_nb_rx_rcv = 0;
-      cp_nb_rx_ok = 0;
-      cp_up_pkt_fwd = 0;
+  // Introspection and retuning for fleet tooling
+  if (conf.control_socket[0] != '\0') {
+    ControlAdd("counters", CmdCounters);
+    ControlAdd("registers", CmdRegisters);
+    ControlAdd("radio", CmdRadio);
+    ControlAdd("pause", CmdPause);
+    ControlAdd("resume", CmdResume);
+    ControlAdd("stat", CmdStat);
+    if (ControlStart(reactor, conf.control_socket)) {
+      printf("Control socket on %s\n", conf.control_socket);
     }
+  }
 
-    // Led timer in progress ?
-    if (led1_timer) {
-      // Led timer expiration, Blink duration is 250ms
-      if (millis() - led1_timer >= 250) {
-        // Stop Led timer
-        led1_timer = 0;
+  int housekeeping_timer = TimerCreate();
+  TimerArm(housekeeping_timer, 1000, true);
+  reactor.Add(housekeeping_timer, EPOLLIN, OnHousekeepingTimer, NULL);
+  ResolverStart(reactor);
 
-        // Led OFF
-        if (Led1 != 0xff) {
-          digitalWrite(Led1, 0);
-        }
-      }
-    }
+  reactor.Add(sock_up, EPOLLIN, OnUplinkSocket, NULL);
+
+  SendStat();
+
+  printf("Receiving %.1f ms after start (radio setup %.1f ms, network setup %.1f ms alongside)\n",
+         (MicrosNow() - start_time) / 1000.0, radio_setup_time / 1000.0, network_setup_time / 1000.0);
+  fflush(stdout);
+
+  AllocGuardArm(conf.alloc_guard);
+
+  reactor.Run();
+
+  AllocGuardDisarm();
+  ControlStop();
+  if (conf.alloc_guard != ALLOC_GUARD_OFF) {
+    printf("alloc guard: %llu heap allocations after init\n", (unsigned long long)AllocGuardCount());
+  }
+
+  if (conf.realtime) {
+    StopRadioThread();
+  }
+  ResolverStop();
+  for (vector<Server_t>::iterator it = servers.begin(); it != servers.end(); ++it) {
+    delete it->station;
+    delete it->mqtt;
+  }
+  FeedClose();
 
-    // Let some time to the OS
-    delay(1);
+  // Leave the radio asleep and the LED off
+  WriteRegister(REG_OPMODE, conf.sx127x.modu == MODU_FSK ? SX72_MODE_FSK_SLEEP : SX72_MODE_SLEEP);
+  if (conf.pin_led1 != 0xff) {
+    digitalWrite(conf.pin_led1, 0);
   }
+  close(sock_up);
+  fflush(stdout);
 
   return (0);
 }
 
-void LoadConfiguration(string configurationFile)
-{
-  FILE* p_file = fopen(configurationFile.c_str(), "r");
-  char buffer[65536];
-  FileReadStream fs(p_file, buffer, sizeof(buffer));
-
-  Document document;
-  document.ParseStream(fs);
-
-  for (Value::ConstMemberIterator fileIt = document.MemberBegin(); fileIt != document.MemberEnd(); ++fileIt) {
-    string objectType(fileIt->name.GetString());
-    if (objectType.compare("SX127x_conf") == 0) {
-      const Value& sx127x_conf = fileIt->value;
-      if (sx127x_conf.IsObject()) {
-        for (Value::ConstMemberIterator confIt = sx127x_conf.MemberBegin(); confIt != sx127x_conf.MemberEnd(); ++confIt) {
-          string key(confIt->name.GetString());
-          if (key.compare("freq") == 0) {
-            freq = confIt->value.GetUint();
-          } else if (key.compare("spread_factor") == 0) {
-            sf = (SpreadingFactor_t)confIt->value.GetUint();
-          } else if (key.compare("pin_nss") == 0) {
-            ssPin = confIt->value.GetUint();
-          } else if (key.compare("pin_dio0") == 0) {
-            dio0 = confIt->value.GetUint();
-          } else if (key.compare("pin_rst") == 0) {
-            RST = confIt->value.GetUint();
-          } else if (key.compare("pin_led1") == 0) {
-            Led1 = confIt->value.GetUint();
-          }
-        }
+void LoadConfiguration()
+{
+  char error[CONFIG_ERROR_SIZE];
+  if (!ConfigLoadLayered(&conf, error, sizeof(error))) {
+    fprintf(stderr, "%s\n", error);
+    exit(EXIT_FAILURE);
+  }
+  AdjustConfiguration(&conf);
+  SetServers(conf);
+}
+
+// Settings the running forwarder overrides
+void AdjustConfiguration(Config* next)
+{
+  // The heap is off limits once running, resolver and capture file included
+  if (next->alloc_guard != ALLOC_GUARD_OFF) {
+    if (!AllocGuardAvailable()) {
+      fprintf(stderr, "alloc_guard: not built in, rebuild with make ALLOC_GUARD=1\n");
+      next->alloc_guard = ALLOC_GUARD_OFF;
+    } else {
+      next->dns_refresh_interval = 0;
+      next->trace_capture_file[0] = '\0';
+    }
+  }
+}
+
+// Replace the server table. Servers already known keep their resolved
+// address, or their Basics Station or MQTT connection, new ones wait for
+// ResolveServers() or UpdateBackends(). Connections of removed servers are
+// stopped.
+void SetServers(const Config& next)
+{
+  vector<Server_t> table;
+  vector<string> names;
+  for (int i = 0; i < next.server_count; i++) {
+    const ConfigServer& settings = next.servers[i];
+    Server_t server = Server_t();
+    server.address = settings.address;
+    server.port = settings.port;
+    server.version = settings.protocol_version != 0 ? settings.protocol_version : PROTOCOL_VERSION;
+    server.enabled = settings.enabled;
+    for (vector<Server_t>::iterator it = servers.begin(); it != servers.end(); ++it) {
+      ServerBackend_t backend = it->station != NULL ? BACKEND_STATION : it->mqtt != NULL ? BACKEND_MQTT : BACKEND_SEMTECH;
+      if (it->address == server.address && it->port == server.port && backend == settings.backend &&
+          (it->mqtt == NULL || SameMqtt(it->mqtt->settings(), settings))) {
+        server.paused = it->paused;
+        server.resolved = it->resolved;
+        server.addr = it->addr;
+        server.station = it->station;
+        server.mqtt = it->mqtt;
+        it->station = NULL;
+        it->mqtt = NULL;
+        break;
       }
+    }
+    if (settings.backend == BACKEND_STATION && server.station == NULL) {
+      server.station = new Station(server.address, server.port);
+    }
+    if (settings.backend == BACKEND_MQTT && server.mqtt == NULL) {
+      server.mqtt = new Mqtt(settings);
+    }
+    if (server.station != NULL) {
+      server.station->SetMetrics(&metrics.servers[i % METRICS_MAX_SERVERS]);
+    }
+    if (server.mqtt != NULL) {
+      server.mqtt->SetMetrics(&metrics.servers[i % METRICS_MAX_SERVERS]);
+    }
+    table.push_back(server);
+    names.push_back(server.address + ":" + to_string(server.port));
+  }
+  servers.swap(table);
+  for (vector<Server_t>::iterator it = table.begin(); it != table.end(); ++it) {
+    delete it->station;
+    delete it->mqtt;
+  }
+  RouteCompile(next);
+  MetricsSetServerNames(names);
+}
 
-    } else if (objectType.compare("gateway_conf") == 0) {
-      const Value& gateway_conf = fileIt->value;
-      if (gateway_conf.IsObject()) {
-        for (Value::ConstMemberIterator confIt = gateway_conf.MemberBegin(); confIt != gateway_conf.MemberEnd(); ++confIt) {
-          string memberType(confIt->name.GetString());
-          if (memberType.compare("ref_latitude") == 0) {
-            lat = confIt->value.GetDouble();
-          } else if (memberType.compare("ref_longitude") == 0) {
-            lon = confIt->value.GetDouble();
-          } else if (memberType.compare("ref_altitude") == 0) {
-            alt = confIt->value.GetUint(); 
-
-          } else if (memberType.compare("name") == 0 && confIt->value.IsString()) {
-            string str = confIt->value.GetString();
-            strcpy(platform, str.length()<=24 ? str.c_str() : "name too long");
-          } else if (memberType.compare("email") == 0 && confIt->value.IsString()) {
-            string str = confIt->value.GetString();
-            strcpy(email, str.length()<=40 ? str.c_str() : "email too long");
-          } else if (memberType.compare("desc") == 0 && confIt->value.IsString()) {
-            string str = confIt->value.GetString();
-            strcpy(description, str.length()<=64 ? str.c_str() : "description is too long");
-
-          } else if (memberType.compare("servers") == 0) {
-            const Value& serverConf = confIt->value;
-            if (serverConf.IsObject()) {
-              const Value& serverValue = serverConf;
-              Server_t server;
-              for (Value::ConstMemberIterator srvIt = serverValue.MemberBegin(); srvIt != serverValue.MemberEnd(); ++srvIt) {
-                string key(srvIt->name.GetString());
-                if (key.compare("address") == 0 && srvIt->value.IsString()) {
-                  server.address = srvIt->value.GetString();
-                } else if (key.compare("port") == 0 && srvIt->value.IsUint()) {
-                  server.port = srvIt->value.GetUint();
-                } else if (key.compare("enabled") == 0 && srvIt->value.IsBool()) {
-                  server.enabled = srvIt->value.GetBool();
-                }
-              }
-              servers.push_back(server);
-            }
-            else if (serverConf.IsArray()) {
-              for (SizeType i = 0; i < serverConf.Size(); i++) {
-                const Value& serverValue = serverConf[i];
-                Server_t server;
-                for (Value::ConstMemberIterator srvIt = serverValue.MemberBegin(); srvIt != serverValue.MemberEnd(); ++srvIt) {
-                  string key(srvIt->name.GetString());
-                  if (key.compare("address") == 0 && srvIt->value.IsString()) {
-                    server.address = srvIt->value.GetString();
-                  } else if (key.compare("port") == 0 && srvIt->value.IsUint()) {
-                    server.port = srvIt->value.GetUint();
-                  } else if (key.compare("enabled") == 0 && srvIt->value.IsBool()) {
-                    server.enabled = srvIt->value.GetBool();
-                  }
-                }
-                servers.push_back(server);
-              }
-            }
-          }
-        }
+// Start the Basics Station and MQTT threads of enabled servers, stop the
+// others
+void UpdateBackends()
+{
+  if (!backends_started) {
+    return;
+  }
+  for (vector<Server_t>::iterator it = servers.begin(); it != servers.end(); ++it) {
+    if (it->station != NULL) {
+      if (it->enabled && !it->station->running()) {
+        it->station->Start(gateway_eui);
+      } else if (!it->enabled) {
+        it->station->Stop();
+      }
+    }
+    if (it->mqtt != NULL) {
+      if (it->enabled && !it->mqtt->running()) {
+        it->mqtt->Start(gateway_eui);
+      } else if (!it->enabled) {
+        it->mqtt->Stop();
       }
     }
   }
@@ -846,10 +1865,12 @@ void LoadConfiguration(string configurationFile)
 void PrintConfiguration()
 {
   for (vector<Server_t>::iterator it = servers.begin(); it != servers.end(); ++it) {
-    printf("server: .address = %s; .port = %hu; .enable = %d\n", it->address.c_str(), it->port, it->enabled);
+    printf("server: .address = %s; .port = %hu; .backend = %s; .version = %u; .enable = %d; .rules = %d\n",
+           it->address.c_str(), it->port, BackendName(*it), it->version, it->enabled,
+           conf.servers[it - servers.begin()].rule_count);
   }
   printf("Gateway Configuration\n");
-  printf("  %s (%s)\n  %s\n", platform, email, description);
-  printf("  Latitude=%.8f\n  Longitude=%.8f\n  Altitude=%d\n", lat,lon,alt);
+  printf("  %s (%s)\n  %s\n", conf.name, conf.email, conf.desc);
+  printf("  Latitude=%.8f\n  Longitude=%.8f\n  Altitude=%d\n", conf.ref_latitude, conf.ref_longitude, conf.ref_altitude);
 
 }
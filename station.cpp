@@ -0,0 +1,417 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+#include "station.h"
+
+#include "jsonwriter.h"
+#include "uplink.h"
+#include "websocket.h"
+
+#include <rapidjson/document.h>
+
+#include <poll.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+using namespace rapidjson;
+
+#define STATION_CONNECT_TIMEOUT   3000    // ms, TCP connect and upgrade
+#define STATION_REPLY_TIMEOUT     5000    // ms, router-info and router_config
+#define STATION_PING_INTERVAL     30000   // ms idle before a websocket ping
+#define STATION_PING_TIMEOUT      10000   // ms for anything to come back after it
+#define STATION_MESSAGE_SIZE      1024    // updf of a 255 byte frame in hex is about 800
+
+Station::Station(const std::string& address, uint16_t port)
+  : Backend<StationFrame>("station", address, port, STATION_QUEUE_DEPTH), eui_(0), session_(0), dr_count_(0)
+{
+  ws_ = new WebSocket();
+}
+
+Station::~Station()
+{
+  Stop();
+  delete ws_;
+}
+
+bool Station::Start(uint64_t eui)
+{
+  if (running()) {
+    return false;
+  }
+  eui_ = eui;
+  return StartThread();
+}
+
+// ws://host[:port]/path
+static bool ParseUri(const char* uri, char* host, size_t host_size, uint16_t* port, char* path, size_t path_size)
+{
+  if (strncmp(uri, "ws://", 5) != 0) {
+    return false;
+  }
+  uri += 5;
+  const char* slash = strchr(uri, '/');
+  if (slash == NULL) {
+    slash = uri + strlen(uri);
+  }
+  const char* colon = (const char*)memchr(uri, ':', slash - uri);
+  const char* host_end = colon != NULL ? colon : slash;
+  if (host_end == uri || (size_t)(host_end - uri) >= host_size) {
+    return false;
+  }
+  memcpy(host, uri, host_end - uri);
+  host[host_end - uri] = '\0';
+  *port = 80;
+  if (colon != NULL) {
+    char* end;
+    unsigned long value = strtoul(colon + 1, &end, 10);
+    if (end != slash || value == 0 || value > 65535) {
+      return false;
+    }
+    *port = (uint16_t)value;
+  }
+  snprintf(path, path_size, "%s", *slash != '\0' ? slash : "/");
+  return true;
+}
+
+bool Station::Discover(char* host, size_t host_size, uint16_t* port, char* path, size_t path_size)
+{
+  char error[256];
+  if (!ws_->Connect(address_.c_str(), port_, "/router-info", STATION_CONNECT_TIMEOUT, error, sizeof(error))) {
+    fprintf(stderr, "station: router-info: %s\n", error);
+    return false;
+  }
+
+  // The router as an id6, e.g. "b827:ebff:fe12:3456"
+  char request[64];
+  int length = snprintf(request, sizeof(request), "{\"router\":\"%x:%x:%x:%x\"}",
+                        (unsigned)(eui_ >> 48) & 0xffff, (unsigned)(eui_ >> 32) & 0xffff,
+                        (unsigned)(eui_ >> 16) & 0xffff, (unsigned)eui_ & 0xffff);
+  char* text;
+  size_t text_length;
+  if (!ws_->SendText(request, length) ||
+      ws_->Receive(&text, &text_length, STATION_REPLY_TIMEOUT) != WS_MESSAGE) {
+    fprintf(stderr, "station: router-info: no answer from %s:%hu\n", address_.c_str(), port_);
+    ws_->Close();
+    return false;
+  }
+  ws_->Close();
+
+  Document reply;
+  reply.Parse(text);
+  if (reply.HasParseError() || !reply.IsObject()) {
+    fprintf(stderr, "station: router-info: answer is not a JSON object\n");
+    return false;
+  }
+  Value::ConstMemberIterator member = reply.FindMember("error");
+  if (member != reply.MemberEnd() && member->value.IsString()) {
+    fprintf(stderr, "station: router-info: %s\n", member->value.GetString());
+    return false;
+  }
+  member = reply.FindMember("uri");
+  if (member == reply.MemberEnd() || !member->value.IsString()) {
+    fprintf(stderr, "station: router-info: no uri\n");
+    return false;
+  }
+  const char* uri = member->value.GetString();
+  if (!ParseUri(uri, host, host_size, port, path, path_size)) {
+    fprintf(stderr, "station: router-info: %s: %s\n", uri,
+            strncmp(uri, "wss://", 6) == 0 ? "wss:// needs TLS, not supported" : "not a ws:// URI");
+    return false;
+  }
+  return true;
+}
+
+bool Station::Handshake(int timeout_ms)
+{
+  static const char version[] =
+    "{\"msgtype\":\"version\",\"station\":\"single_chan_pkt_fwd\",\"firmware\":null,"
+    "\"package\":null,\"model\":\"single_chan_pkt_fwd\",\"protocol\":2,\"features\":\"\"}";
+  if (!ws_->SendText(version, sizeof(version) - 1)) {
+    return false;
+  }
+  session_++;
+  dr_count_ = 0;
+  while (ws_->connected() && dr_count_ == 0) {
+    char* text;
+    size_t length;
+    WebSocketResult_t result = ws_->Receive(&text, &length, timeout_ms);
+    if (result != WS_MESSAGE) {
+      return false;
+    }
+    HandleMessage(text);
+  }
+  return dr_count_ != 0;
+}
+
+void Station::HandleMessage(char* text)
+{
+  Document message;
+  message.ParseInsitu(text);
+  if (message.HasParseError() || !message.IsObject()) {
+    fprintf(stderr, "station: %s:%hu: message is not a JSON object\n", address_.c_str(), port_);
+    return;
+  }
+  Value::ConstMemberIterator msgtype = message.FindMember("msgtype");
+  if (msgtype == message.MemberEnd() || !msgtype->value.IsString()) {
+    return;
+  }
+
+  if (strcmp(msgtype->value.GetString(), "router_config") == 0) {
+    Value::ConstMemberIterator drs = message.FindMember("DRs");
+    if (drs == message.MemberEnd() || !drs->value.IsArray()) {
+      fprintf(stderr, "station: router_config without DRs\n");
+      return;
+    }
+    int count = 0;
+    for (SizeType i = 0; i < drs->value.Size() && count < STATION_MAX_DRS; i++) {
+      const Value& dr = drs->value[i];
+      DataRate& rate = drs_[count++];
+      // [sf, bw, dnonly], [-1, 0, 0] for a data rate that is not defined
+      if (!dr.IsArray() || dr.Size() < 3 || !dr[0].IsInt() || !dr[1].IsUint() || !dr[2].IsInt()) {
+        rate.up = false;
+        continue;
+      }
+      rate.sf = dr[0].GetInt() < 0 ? 0xff : (uint8_t)dr[0].GetInt();
+      rate.bw = (uint16_t)dr[1].GetUint();
+      rate.up = dr[0].GetInt() >= 0 && dr[2].GetInt() == 0;
+    }
+    dr_count_ = count;
+    Value::ConstMemberIterator region = message.FindMember("region");
+    printf("station: %s:%hu: router_config%s%s, %d data rates\n", address_.c_str(), port_,
+           region != message.MemberEnd() && region->value.IsString() ? " for " : "",
+           region != message.MemberEnd() && region->value.IsString() ? region->value.GetString() : "", count);
+  } else if (strcmp(msgtype->value.GetString(), "dnmsg") == 0) {
+    Count(&ServerMetrics::downlinks);
+    Value::ConstMemberIterator dev_eui = message.FindMember("DevEui");
+    printf("station: %s:%hu: dnmsg for %s, not sent: no transmit path\n", address_.c_str(), port_,
+           dev_eui != message.MemberEnd() && dev_eui->value.IsString() ? dev_eui->value.GetString() : "?");
+  }
+  // timesync, runcmd and the rest need hardware this gateway does not have
+}
+
+bool Station::Receive()
+{
+  for (;;) {
+    char* text;
+    size_t length;
+    WebSocketResult_t result = ws_->Receive(&text, &length, 0);
+    if (result == WS_NONE) {
+      return true;
+    }
+    if (result == WS_CLOSED) {
+      return false;
+    }
+    HandleMessage(text);
+  }
+}
+
+static uint32_t Le32(const uint8_t* p)
+{
+  return (uint32_t)p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// EUI as "01-23-45-67-89-AB-CD-EF", LoRaWAN sends it least significant byte first
+static void WriteEui(FixedWriter& writer, const uint8_t* p)
+{
+  char eui[24];
+  snprintf(eui, sizeof(eui), "%02X-%02X-%02X-%02X-%02X-%02X-%02X-%02X", p[7], p[6], p[5], p[4], p[3], p[2], p[1], p[0]);
+  writer.String(eui);
+}
+
+static void WriteHex(FixedWriter& writer, const uint8_t* p, int length)
+{
+  char hex[2 * 256 + 1];
+  for (int i = 0; i < length; i++) {
+    snprintf(hex + 2 * i, 3, "%02X", p[i]);
+  }
+  writer.String(hex, 2 * length);
+}
+
+int Station::BuildMessage(const StationFrame& frame, char* out, size_t size)
+{
+  int dr = 0;
+  while (dr < dr_count_ && !(drs_[dr].up && drs_[dr].sf == frame.sf && drs_[dr].bw == frame.bw)) {
+    dr++;
+  }
+  if (dr == dr_count_) {
+    fprintf(stderr, "station: SF%uBW%u is not an uplink data rate of the router_config, frame dropped\n",
+            frame.sf, frame.bw);
+    return -1;
+  }
+
+  char stack[1024];
+  WriterAllocator allocator(stack, sizeof(stack));
+  FixedStream stream(out, (int)size);
+  FixedWriter writer(stream, &allocator);
+
+  const uint8_t* p = frame.payload;
+  uint8_t mtype = frame.size > 0 ? p[0] >> MHDR_MTYPE_SHIFT : 0xff;
+  bool major_r1 = frame.size > 0 && (p[0] & MHDR_MAJOR_MASK) == 0;
+  int fopts_length = frame.size > 5 ? p[5] & 0x0f : 0;
+  writer.StartObject();
+  if (major_r1 && mtype == MTYPE_JOIN_REQUEST && frame.size == JOIN_REQUEST_SIZE) {
+    writer.String("msgtype");
+    writer.String("jreq");
+    writer.String("MHdr");
+    writer.Uint(p[0]);
+    writer.String("JoinEui");
+    WriteEui(writer, p + 1);
+    writer.String("DevEui");
+    WriteEui(writer, p + 9);
+    writer.String("DevNonce");
+    writer.Uint(p[17] | p[18] << 8);
+    writer.String("MIC");
+    writer.Int((int32_t)Le32(p + 19));
+  } else if (major_r1 && (mtype == MTYPE_UNCONFIRMED_UP || mtype == MTYPE_CONFIRMED_UP) &&
+             frame.size >= DATA_UP_MIN_SIZE + fopts_length) {
+    int fhdr_end = 8 + fopts_length;
+    int mic = frame.size - 4;
+    writer.String("msgtype");
+    writer.String("updf");
+    writer.String("MHdr");
+    writer.Uint(p[0]);
+    writer.String("DevAddr");
+    writer.Int((int32_t)Le32(p + 1));
+    writer.String("FCtrl");
+    writer.Uint(p[5]);
+    writer.String("FCnt");
+    writer.Uint(p[6] | p[7] << 8);
+    writer.String("FOpts");
+    WriteHex(writer, p + 8, fopts_length);
+    writer.String("FPort");
+    writer.Int(fhdr_end < mic ? p[fhdr_end] : -1);
+    writer.String("FRMPayload");
+    WriteHex(writer, p + fhdr_end + 1, fhdr_end < mic ? mic - fhdr_end - 1 : 0);
+    writer.String("MIC");
+    writer.Int((int32_t)Le32(p + mic));
+  } else {
+    writer.String("msgtype");
+    writer.String("propdf");
+    writer.String("FRMPayload");
+    WriteHex(writer, p, frame.size);
+  }
+  writer.String("RefTime");
+  writer.Double(0.0);
+  writer.String("DR");
+  writer.Int(dr);
+  writer.String("Freq");
+  writer.Uint(frame.freq);
+  writer.String("upinfo");
+  writer.StartObject();
+  writer.String("rctx");
+  writer.Int(0);
+  writer.String("xtime");
+  writer.Int64((int64_t)session_ << 48 | frame.tmst);
+  writer.String("gpstime");
+  writer.Int(0);
+  writer.String("fts");
+  writer.Int(-1);
+  writer.String("rssi");
+  writer.Int(frame.rssi);
+  writer.String("snr");
+  writer.Int(frame.snr);
+  writer.String("rxtime");
+  writer.Double(frame.rxtime);
+  writer.EndObject();
+  writer.EndObject();
+  return stream.Finish();
+}
+
+bool Station::SendFrames()
+{
+  StationFrame frame;
+  char message[STATION_MESSAGE_SIZE];
+  while (Pop(&frame)) {
+    int length = BuildMessage(frame, message, sizeof(message));
+    if (length < 0) {
+      Count(&ServerMetrics::send_errors);
+      continue;
+    }
+    if (!ws_->SendText(message, length)) {
+      Count(&ServerMetrics::send_errors);
+      return false;
+    }
+    Count(&ServerMetrics::sent);
+  }
+  return true;
+}
+
+void Station::Serve()
+{
+  DropStale();
+  ready_ = true;
+
+  // A muxs gone without a FIN or RST would leave the socket quiet for good
+  int64_t ping_sent = 0;
+  struct pollfd pfds[2] = { { ws_->fd(), POLLIN, 0 }, { wake_, POLLIN, 0 } };
+  while (!stop_ && ws_->connected()) {
+    // A message may already be buffered behind the last one
+    if (!Receive()) {
+      break;
+    }
+    int64_t now = MillisNow();
+    int64_t idle = now - ws_->last_received();
+    if (idle >= STATION_PING_INTERVAL + STATION_PING_TIMEOUT) {
+      fprintf(stderr, "station: %s:%hu: no answer to ping\n", address_.c_str(), port_);
+      break;
+    }
+    if (idle >= STATION_PING_INTERVAL && ping_sent <= ws_->last_received()) {
+      if (!ws_->SendPing()) {
+        break;
+      }
+      ping_sent = now;
+    }
+    int64_t timeout = ws_->last_received() + STATION_PING_INTERVAL - now;
+    if (timeout <= 0) {
+      timeout += STATION_PING_TIMEOUT;
+    }
+    if (poll(pfds, 2, (int)timeout) < 0 && errno != EINTR) {
+      break;
+    }
+    if (pfds[1].revents & POLLIN) {
+      ClearWake();
+      if (!SendFrames()) {
+        break;
+      }
+    }
+  }
+}
+
+void Station::Disconnect()
+{
+  ws_->Close();
+}
+
+bool Station::Connect()
+{
+  char host[128];
+  char path[256];
+  uint16_t port;
+  char error[256];
+  if (!Discover(host, sizeof(host), &port, path, sizeof(path))) {
+    return false;
+  }
+  if (!ws_->Connect(host, port, path, STATION_CONNECT_TIMEOUT, error, sizeof(error))) {
+    fprintf(stderr, "station: muxs: %s\n", error);
+    return false;
+  }
+  if (!Handshake(STATION_REPLY_TIMEOUT)) {
+    fprintf(stderr, "station: %s:%hu%s: no router_config\n", host, port, path);
+    return false;
+  }
+  printf("station: connected to ws://%s:%hu%s\n", host, port, path);
+  fflush(stdout);
+  return true;
+}
@@ -0,0 +1,99 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+// LoRa Basics Station backend: the LNS protocol over a websocket, in place
+// of Semtech UDP for a server with "backend": "station".
+//
+// Each such server gets a Station, a Backend with an I/O thread of its
+// own (see backend.h). The thread asks ws://address:port/router-info for
+// the muxs URI, connects to it, sends the version message and waits for
+// router_config, whose DRs table maps the channel of a frame to a data
+// rate. Uplinks then go out as
+// updf, jreq or propdf messages. A lost connection starts over from the
+// discovery, and a connection that stays silent 10 s past the ping sent
+// after 30 s idle counts as lost. Frames are taken once router_config is
+// in.
+//
+// There is no transmit path, dnmsg downlinks are logged and counted only.
+// Plain ws:// only, wss:// would need TLS.
+
+#ifndef _STATION_H
+#define _STATION_H
+
+#include "backend.h"
+
+#include <stdint.h>
+
+#include <string>
+
+class WebSocket;
+
+#define STATION_QUEUE_DEPTH   64    // frames, a power of two
+#define STATION_MAX_DRS       16    // router_config DRs kept
+
+// A frame as the station messages report it
+struct StationFrame
+{
+    uint32_t tmst;
+    double rxtime;              // UTC seconds
+    uint32_t freq;              // in Hz
+    uint8_t sf;                 // 0 for FSK
+    uint16_t bw;                // in kHz, 0 for FSK
+    int16_t rssi;
+    int8_t snr;
+    uint8_t size;
+    uint8_t payload[256];
+};
+
+class Station : public Backend<StationFrame>
+{
+public:
+    Station(const std::string& address, uint16_t port);
+    ~Station();
+
+    // Start the I/O thread, as router eui. False if it is already running.
+    bool Start(uint64_t eui);
+
+private:
+    // Discovery, muxs connection and router_config
+    bool Connect();
+
+    // Connected and configured: send frames and take messages until the
+    // connection is lost or Stop()
+    void Serve();
+    void Disconnect();
+
+    // router-info: the muxs URI into host, port and path
+    bool Discover(char* host, size_t host_size, uint16_t* port, char* path, size_t path_size);
+
+    // Version message, then up to timeout_ms for router_config
+    bool Handshake(int timeout_ms);
+
+    // Messages from the muxs, false when the connection is gone
+    bool Receive();
+    void HandleMessage(char* text);
+
+    // Drain the queue into updf, jreq or propdf messages
+    bool SendFrames();
+    int BuildMessage(const StationFrame& frame, char* out, size_t size);
+
+    uint64_t eui_;
+    WebSocket* ws_;
+    uint8_t session_;           // top bits of xtime, per connection
+
+    // router_config data rates: spreading factor (0 for FSK) and
+    // bandwidth in kHz, up false for downlink only and undefined ones
+    struct DataRate { uint8_t sf; uint16_t bw; bool up; };
+    DataRate drs_[STATION_MAX_DRS];
+    int dr_count_;
+};
+
+#endif
@@ -0,0 +1,306 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+#include "sx127x.h"
+
+#include <wiringPi.h>
+
+#include <string.h>
+
+constexpr RegSpan Sx1272::init_spans[];
+constexpr RegSpan Sx1272::watch_spans[];
+constexpr RegSpan Sx1276::init_spans[];
+constexpr RegSpan Sx1276::watch_spans[];
+
+// RxBwMant values, RxBw = FXOSC / (mant * 2^(exp + 2))
+static const uint8_t rx_bw_mant[] = { 16, 20, 24 };
+
+const char* CodingRateName(CodingRate_t cr)
+{
+  static const char* names[] = { "4/5", "4/6", "4/7", "4/8" };
+  if (cr < CR4_5 || cr > CR4_8) {
+    return NULL;
+  }
+  return names[cr - CR4_5];
+}
+
+// Narrowest receiver bandwidth (single side) that is at least bw Hz
+static uint8_t FskRxBwReg(uint32_t bw)
+{
+  for (int exp = 7; exp >= 1; exp--) {
+    for (int m = 2; m >= 0; m--) {
+      if (SX127X_XTAL_FREQ / ((uint32_t)rx_bw_mant[m] << (exp + 2)) >= bw) {
+        return (uint8_t)((m << 3) | exp);
+      }
+    }
+  }
+  return 0x01;  // widest setting, 250 kHz
+}
+
+void Sx127x::WriteSpans(const RegSpan* spans, size_t count)
+{
+  for (size_t i = 0; i < count; i++) {
+    WriteBurst(spans[i].addr, &shadow_[spans[i].addr], spans[i].length);
+  }
+}
+
+void Sx127x::ShadowFsk(const Sx127xConf& conf)
+{
+  uint16_t bitrate = FskBitrateReg(conf.fsk_bitrate);
+  uint16_t fdev = FskFdevReg(conf.fsk_fdev);
+  uint32_t frf = FrequencyToFrf(conf.freq);
+
+  shadow_[REG_BITRATE_MSB] = (uint8_t)(bitrate >> 8);
+  shadow_[REG_BITRATE_LSB] = (uint8_t)(bitrate >> 0);
+  shadow_[REG_FDEV_MSB]    = (uint8_t)(fdev >> 8);
+  shadow_[REG_FDEV_LSB]    = (uint8_t)(fdev >> 0);
+  shadow_[REG_FRF_MSB]     = (uint8_t)(frf >> 16);
+  shadow_[REG_FRF_MID]     = (uint8_t)(frf >> 8);
+  shadow_[REG_FRF_LSB]     = (uint8_t)(frf >> 0);
+
+  shadow_[REG_LNA]       = LNA_MAX_GAIN;
+  shadow_[REG_RX_CONFIG] = FSK_RX_CONFIG_AFC_AGC_PREAMBLE;
+
+  // Carson's rule for the channel filter, twice the deviation for AFC
+  shadow_[REG_RX_BW]  = FskRxBwReg(conf.fsk_fdev + conf.fsk_bitrate / 2);
+  shadow_[REG_AFC_BW] = FskRxBwReg(2 * conf.fsk_fdev + conf.fsk_bitrate / 2);
+
+  shadow_[REG_PREAMBLE_DETECT] = FSK_PREAMBLE_DETECT_2B;
+
+  shadow_[REG_SYNC_CONFIG] = FSK_SYNC_CONFIG_AUTO_RESTART | (conf.fsk_sync_word_size - 1);
+  memset(&shadow_[REG_SYNC_VALUE1], 0, FSK_SYNC_WORD_MAX_LENGTH);
+  memcpy(&shadow_[REG_SYNC_VALUE1], conf.fsk_sync_word, conf.fsk_sync_word_size);
+
+  shadow_[REG_PACKET_CONFIG1]     = FSK_PACKET_CONFIG1_VAR_WHITE_CRC;
+  shadow_[REG_PACKET_CONFIG2]     = FSK_PACKET_CONFIG2_PACKET_MODE;
+  shadow_[REG_FSK_PAYLOAD_LENGTH] = FSK_MAX_PAYLOAD_LENGTH;
+  shadow_[REG_FIFO_THRESH]        = FSK_FIFO_THRESH_TX_START | FSK_FIFO_THRESHOLD;
+  shadow_[REG_DIO_MAPPING_1]      = 0x00;  // DIO0 PayloadReady, DIO1 FifoLevel
+
+  fsk_bitrate_ = conf.fsk_bitrate;
+}
+
+void Sx127x::SetupFsk(const Sx127xConf& conf)
+{
+  ShadowFsk(conf);
+
+  // LongRangeMode can only be cleared from LoRa sleep
+  WriteRegister(REG_OPMODE, SX72_MODE_SLEEP);
+  shadow_[REG_OPMODE] = SX72_MODE_FSK_SLEEP;
+  WriteRegister(REG_OPMODE, SX72_MODE_FSK_SLEEP);
+
+  WriteSpans(sx127x_fsk_spans, sizeof(sx127x_fsk_spans) / sizeof(sx127x_fsk_spans[0]));
+  watch_spans_ = sx127x_fsk_watch_spans;
+  watch_count_ = sizeof(sx127x_fsk_watch_spans) / sizeof(sx127x_fsk_watch_spans[0]);
+
+  shadow_[REG_OPMODE] = SX72_MODE_FSK_RX;
+  WriteRegister(REG_OPMODE, SX72_MODE_FSK_RX);
+  fsk_active_ = false;
+}
+
+int Sx127x::Reconfigure(const Sx127xConf& conf)
+{
+  if (conf.modu != modu_) {
+    Setup(conf);
+    return -1;
+  }
+
+  uint8_t previous[SX127X_REG_COUNT];
+  memcpy(previous, shadow_, sizeof(previous));
+  if (conf.modu == MODU_FSK) {
+    ShadowFsk(conf);
+  } else {
+    ShadowLoRa(conf);
+  }
+
+  // Runs of changed registers go out as one burst, e.g. the whole FRF
+  int written = 0;
+  uint8_t rx_mode = shadow_[REG_OPMODE];
+  for (int addr = REG_OPMODE + 1; addr < SX127X_REG_COUNT; addr++) {
+    if (shadow_[addr] == previous[addr]) {
+      continue;
+    }
+    int end = addr + 1;
+    while (end < SX127X_REG_COUNT && shadow_[end] != previous[end]) {
+      end++;
+    }
+    // Frequency and modem settings only take in standby
+    if (written == 0) {
+      if (modu_ == MODU_LORA) {
+        header_carry_ = TakeValidHeaders();
+      }
+      WriteRegister(REG_OPMODE, conf.modu == MODU_FSK ? SX72_MODE_FSK_STANDBY : SX72_MODE_STANDBY);
+    }
+    WriteBurst(addr, &shadow_[addr], end - addr);
+    written += end - addr;
+    addr = end;
+  }
+  if (written != 0) {
+    WriteRegister(REG_OPMODE, rx_mode);
+    // The receiver restarted, a frame being drained is lost
+    fsk_active_ = false;
+    // Whether the modem restarted its count or not
+    if (modu_ == MODU_LORA) {
+      header_count_ = ReadHeaderCount();
+    }
+  }
+  return written;
+}
+
+uint16_t Sx127x::ReadHeaderCount() const
+{
+  uint8_t count[2];
+  ReadBurst(REG_RX_HEADER_CNT_MSB, count, sizeof(count));
+  return (uint16_t)(count[0] << 8 | count[1]);
+}
+
+uint32_t Sx127x::TakeValidHeaders()
+{
+  if (modu_ != MODU_LORA) {
+    return 0;
+  }
+  return TakeValidHeaders(ReadHeaderCount());
+}
+
+uint32_t Sx127x::TakeValidHeaders(uint16_t count)
+{
+  uint32_t headers = header_carry_ + (uint16_t)(count - header_count_);
+  header_count_ = count;
+  header_carry_ = 0;
+  return headers;
+}
+
+bool Sx127x::Receiving() const
+{
+  if (modu_ == MODU_FSK) {
+    return (ReadRegister(REG_IRQ_FLAGS1) & (IRQ1_FSK_PREAMBLE_DETECT | IRQ1_FSK_SYNC_ADDRESS_MATCH)) != 0;
+  }
+  return (ReadRegister(REG_MODEM_STAT) & MODEM_STAT_RECEIVING) != 0;
+}
+
+bool Sx127x::Verify(uint8_t* p_addr, uint8_t* p_value) const
+{
+  uint8_t live[SX127X_REG_COUNT];
+
+  for (size_t i = 0; i < watch_count_; i++) {
+    const RegSpan& span = watch_spans_[i];
+    ReadBurst(span.addr, &live[span.addr], span.length);
+    for (uint8_t addr = span.addr; addr < span.addr + span.length; addr++) {
+      if (live[addr] != shadow_[addr]) {
+        *p_addr = addr;
+        *p_value = live[addr];
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+RxResult_t Sx127x::ReceiveFsk(char* payload, uint8_t* p_length, Sx127xPktStatus* p_status)
+{
+  uint8_t flags[2];
+  ReadBurst(REG_IRQ_FLAGS1, flags, sizeof(flags));
+  if (!fsk_active_) {
+    if ((flags[0] & IRQ1_FSK_SYNC_ADDRESS_MATCH) == 0) {
+      return RX_NONE;
+    }
+    // RSSI is latched once the sync word matched, in -0.5 dBm steps
+    fsk_status_.rssi = -(int)ReadRegister(REG_FSK_RSSI_VALUE) / 2;
+    fsk_status_.current_rssi = fsk_status_.rssi;
+    fsk_status_.snr = 0;
+    fsk_status_.cr = CR4_5;
+    fsk_status_.crc_on = true;
+    fsk_status_.crc_error = false;
+    fsk_length_ = -1;
+    fsk_received_ = 0;
+    fsk_start_ = millis();
+    fsk_active_ = true;
+  }
+
+  // Longest frame on air: preamble, sync, length byte, payload and CRC
+  unsigned int timeout = 1 + (8 * (FSK_MAX_PAYLOAD_LENGTH + 16) * 1000) / fsk_bitrate_;
+
+  uint8_t irqflags = flags[1];
+  while ((irqflags & IRQ2_FSK_FIFO_OVERRUN) == 0 && millis() - fsk_start_ <= timeout) {
+    // Below the threshold: the rest comes with the next FifoLevel or
+    // PayloadReady edge
+    if ((irqflags & (IRQ2_FSK_FIFO_LEVEL | IRQ2_FSK_PAYLOAD_READY)) == 0) {
+      return RX_NONE;
+    }
+
+    // Variable length packets start with their length byte
+    int chunk = FSK_FIFO_THRESHOLD;
+    if (fsk_length_ < 0) {
+      fsk_length_ = ReadRegister(REG_FIFO);
+      chunk--;
+    }
+    if (irqflags & IRQ2_FSK_PAYLOAD_READY || chunk > fsk_length_ - fsk_received_) {
+      chunk = fsk_length_ - fsk_received_;
+    }
+    if (chunk > 0) {
+      ReadBurst(REG_FIFO, fsk_buffer_ + fsk_received_, chunk);
+      fsk_received_ += chunk;
+    }
+
+    if (irqflags & IRQ2_FSK_PAYLOAD_READY) {
+      memcpy(payload, fsk_buffer_, fsk_length_);
+      *p_length = (uint8_t)fsk_length_;
+      *p_status = fsk_status_;
+      p_status->crc_error = (irqflags & IRQ2_FSK_CRC_OK) == 0;
+      fsk_active_ = false;
+      return p_status->crc_error ? RX_CRC_ERROR : RX_OK;
+    }
+    irqflags = ReadRegister(REG_IRQ_FLAGS2);
+  }
+
+  // Lost the frame, flush the FIFO and restart the receiver
+  WriteRegister(REG_IRQ_FLAGS2, IRQ2_FSK_FIFO_OVERRUN);
+  WriteRegister(REG_OPMODE, SX72_MODE_FSK_STANDBY);
+  WriteRegister(REG_OPMODE, SX72_MODE_FSK_RX);
+  fsk_active_ = false;
+  return RX_NONE;
+}
+
+static Sx127xDriver<Sx1272> sx1272_driver;
+static Sx127xDriver<Sx1276> sx1276_driver;
+
+// Pulse the reset line the way Chip expects it and check its version
+// register. The datasheets ask for a pulse of at least 100 us and 5 ms
+// before the chip is used; after that the version register is polled
+// until it answers, for the power-on reset of up to 10 ms.
+template<class Chip>
+static bool Probe(int rst, uint8_t* p_version)
+{
+  digitalWrite(rst, Chip::reset_active);
+  delayMicroseconds(100);
+  digitalWrite(rst, !Chip::reset_active);
+  delay(5);
+
+  unsigned int start = millis();
+  for (;;) {
+    *p_version = ReadRegister(REG_VERSION);
+    if (*p_version == Chip::version || millis() - start >= 10) {
+      return *p_version == Chip::version;
+    }
+    delay(1);
+  }
+}
+
+Sx127x* DetectSx127x(int rst, uint8_t* p_version)
+{
+  if (Probe<Sx1272>(rst, p_version)) {
+    return &sx1272_driver;
+  }
+  if (Probe<Sx1276>(rst, p_version)) {
+    return &sx1276_driver;
+  }
+  return NULL;
+}
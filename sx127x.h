@@ -0,0 +1,594 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+// SX1272 / SX1276 transceiver driver.
+//
+// Everything that differs between the two chip families lives in a traits
+// struct (Sx1272, Sx1276) and is resolved at compile time by instantiating
+// Sx127xDriver<Chip>. The chip is probed once at startup by DetectSx127x(),
+// which hands back the matching instantiation behind the Sx127x interface.
+
+#ifndef _SX127X_H
+#define _SX127X_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// #############################################
+// #############################################
+
+#define REG_FIFO                    0x00
+#define REG_OPMODE                  0x01
+#define REG_FRF_MSB                 0x06
+#define REG_FRF_MID                 0x07
+#define REG_FRF_LSB                 0x08
+#define REG_LNA                     0x0C
+#define REG_FIFO_ADDR_PTR           0x0D
+#define REG_FIFO_TX_BASE_AD         0x0E
+#define REG_FIFO_RX_BASE_AD         0x0F
+#define REG_FIFO_RX_CURRENT_ADDR    0x10
+#define REG_IRQ_FLAGS_MASK          0x11
+#define REG_IRQ_FLAGS               0x12
+#define REG_RX_NB_BYTES             0x13
+#define REG_RX_HEADER_CNT_MSB       0x14
+#define REG_RX_HEADER_CNT_LSB       0x15
+#define REG_MODEM_STAT              0x18
+#define REG_PKT_SNR_VALUE           0x19
+#define REG_PKT_RSSI_VALUE          0x1A
+#define REG_RSSI_VALUE              0x1B
+#define REG_HOP_CHANNEL             0x1C
+#define REG_MODEM_CONFIG            0x1D
+#define REG_MODEM_CONFIG2           0x1E
+#define REG_SYMB_TIMEOUT_LSB        0x1F
+#define REG_PAYLOAD_LENGTH          0x22
+#define REG_MAX_PAYLOAD_LENGTH      0x23
+#define REG_HOP_PERIOD              0x24
+#define REG_MODEM_CONFIG3           0x26
+#define REG_SYNC_WORD               0x39
+#define REG_DIO_MAPPING_1           0x40
+#define REG_DIO_MAPPING_2           0x41
+#define REG_VERSION                 0x42
+
+// FSK/OOK register page (RegOpMode LongRangeMode = 0)
+#define REG_BITRATE_MSB             0x02
+#define REG_BITRATE_LSB             0x03
+#define REG_FDEV_MSB                0x04
+#define REG_FDEV_LSB                0x05
+#define REG_RX_CONFIG               0x0D
+#define REG_FSK_RSSI_VALUE          0x11
+#define REG_RX_BW                   0x12
+#define REG_AFC_BW                  0x13
+#define REG_PREAMBLE_DETECT         0x1F
+#define REG_SYNC_CONFIG             0x27
+#define REG_SYNC_VALUE1             0x28
+#define REG_PACKET_CONFIG1          0x30
+#define REG_PACKET_CONFIG2          0x31
+#define REG_FSK_PAYLOAD_LENGTH      0x32
+#define REG_FIFO_THRESH             0x35
+#define REG_IRQ_FLAGS1              0x3E
+#define REG_IRQ_FLAGS2              0x3F
+
+#define SX127X_REG_COUNT            0x80
+
+#define SX72_MODE_RX_CONTINUOS      0x85
+#define SX72_MODE_TX                0x83
+#define SX72_MODE_SLEEP             0x80
+#define SX72_MODE_STANDBY           0x81
+
+#define SX72_MODE_FSK_SLEEP         0x00
+#define SX72_MODE_FSK_STANDBY       0x01
+#define SX72_MODE_FSK_RX            0x05
+
+// IRQ flags
+#define IRQ_LORA_RXDONE_MASK        0x40
+#define IRQ_LORA_CRCERR_MASK        0x20
+
+#define PAYLOAD_LENGTH              0x40
+#define MAX_PAYLOAD_LENGTH          0x80
+#define HOP_PERIOD_OFF              0xFF
+#define LORAWAN_SYNC_WORD           0x34 // LoRaWAN public sync word
+
+// LOW NOISE AMPLIFIER
+#define LNA_MAX_GAIN                0x23
+#define LNA_OFF_GAIN                0x00
+#define LNA_LOW_GAIN                0x20
+
+#define SX72_MC2_FSK                0x00
+#define SX72_MC2_SF7                0x70
+#define SX72_MC2_SF8                0x80
+#define SX72_MC2_SF9                0x90
+#define SX72_MC2_SF10               0xA0
+#define SX72_MC2_SF11               0xB0
+#define SX72_MC2_SF12               0xC0
+
+// SX1272: RegModemConfig1 = Bw[7:6] | CodingRate[5:3] | ImplicitHeader[2] | RxPayloadCrcOn[1] | LDRO[0]
+#define SX72_MC1_BW_SHIFT           6
+#define SX72_MC1_CR_SHIFT           3
+#define SX72_MC1_RX_PAYLOAD_CRCON   0x02
+#define SX72_MC1_LOW_DATA_RATE_OPTIMIZE  0x01 // mandated when symbols exceed 16 ms
+// SX1272: RegModemConfig2 AgcAutoOn
+#define SX72_MC2_AGC_AUTO_ON        0x04
+
+// SX1276: RegModemConfig1 = Bw[7:4] | CodingRate[3:1] | ImplicitHeader[0]
+#define SX76_MC1_BW_SHIFT           4
+#define SX76_MC1_BW_BASE            7    // BW125 is 7, BW250 8, BW500 9
+#define SX76_MC1_CR_SHIFT           1
+// SX1276: RegModemConfig2 RxPayloadCrcOn
+#define SX76_MC2_RX_PAYLOAD_CRCON   0x04
+// SX1276: RegModemConfig3 AgcAutoOn / LowDataRateOptimize
+#define SX76_MC3_AGC_AUTO_ON        0x04
+#define SX76_MC3_LOW_DATA_RATE_OPTIMIZE  0x08
+
+// RegModemStat RxCodingRate[7:5], coding rate of the last header received
+#define MODEM_STAT_RX_CR_SHIFT      5
+#define MODEM_STAT_RX_CR_MASK       0x07
+// RegModemStat SignalDetected | SignalSynchronized | HeaderInfoValid, a
+// frame is on its way
+#define MODEM_STAT_RECEIVING        0x0B
+// RegHopChannel CrcOnPayload, CRC flag of the last header received
+#define HOP_CHANNEL_CRC_ON_PAYLOAD  0x40
+
+// FSK receiver settings
+#define FSK_RX_CONFIG_AFC_AGC_PREAMBLE   0x1E // AfcAutoOn | AgcAutoOn | RxTrigger on PreambleDetect
+#define FSK_PREAMBLE_DETECT_2B      0xAA // detector on, 2 bytes, 10 chips tolerance
+#define FSK_SYNC_CONFIG_AUTO_RESTART     0x50 // AutoRestartRx without PLL relock | SyncOn
+#define FSK_SYNC_WORD_MAX_LENGTH    8
+#define FSK_PACKET_CONFIG1_VAR_WHITE_CRC 0xD8 // variable length | whitening | CrcOn | CrcAutoClearOff
+#define FSK_PACKET_CONFIG2_PACKET_MODE   0x40
+#define FSK_MAX_PAYLOAD_LENGTH      0xFF
+#define FSK_FIFO_THRESHOLD          0x20 // FifoLevel raised above 32 of the 64 FIFO bytes
+#define FSK_FIFO_THRESH_TX_START    0x80
+
+// RegIrqFlags1 / RegIrqFlags2
+#define IRQ1_FSK_PREAMBLE_DETECT    0x02
+#define IRQ1_FSK_SYNC_ADDRESS_MATCH 0x01
+#define IRQ2_FSK_FIFO_LEVEL         0x20
+#define IRQ2_FSK_FIFO_OVERRUN       0x10
+#define IRQ2_FSK_PAYLOAD_READY      0x04
+#define IRQ2_FSK_CRC_OK             0x02
+
+#define SX127X_XTAL_FREQ            32000000
+
+typedef enum SpreadingFactors
+{
+    SF7 = 7,
+    SF8,
+    SF9,
+    SF10,
+    SF11,
+    SF12
+} SpreadingFactor_t;
+
+typedef enum Bandwidths
+{
+    BW125 = 125,
+    BW250 = 250,
+    BW500 = 500
+} Bandwidth_t;
+
+// Values match the CodingRate register field of both chip families
+typedef enum CodingRates
+{
+    CR4_5 = 1,
+    CR4_6,
+    CR4_7,
+    CR4_8
+} CodingRate_t;
+
+// "4/5" ... "4/8", or NULL for an invalid code
+const char* CodingRateName(CodingRate_t cr);
+
+typedef enum Modulations
+{
+    MODU_LORA,
+    MODU_FSK
+} Modulation_t;
+
+// Receiver settings, as found in the SX127x_conf section
+struct Sx127xConf
+{
+    Modulation_t modu;
+    uint32_t freq;                  // in Hz
+
+    // LoRa
+    SpreadingFactor_t sf;
+    Bandwidth_t bw;
+    CodingRate_t cr;
+
+    // FSK
+    uint32_t fsk_bitrate;           // in bit/s
+    uint32_t fsk_fdev;              // in Hz
+    uint8_t fsk_sync_word[FSK_SYNC_WORD_MAX_LENGTH];
+    uint8_t fsk_sync_word_size;     // 1 to 8 bytes
+};
+
+typedef enum RxResults
+{
+    RX_NONE,
+    RX_OK,
+    RX_CRC_ERROR
+} RxResult_t;
+
+/*******************************************************************************
+ *
+ * SPI access, implemented by the forwarder on top of wiringPi
+ *
+ *******************************************************************************/
+
+uint8_t ReadRegister(uint8_t addr);
+void WriteRegister(uint8_t addr, uint8_t value);
+void ReadBurst(uint8_t addr, uint8_t* data, uint8_t length);
+void WriteBurst(uint8_t addr, const uint8_t* data, uint8_t length);
+
+/*******************************************************************************
+ *
+ * Register values common to both chip families
+ *
+ *******************************************************************************/
+
+// A run of consecutive registers written with a single SPI burst
+struct RegSpan
+{
+    uint8_t addr;
+    uint8_t length;
+};
+
+// A register value that does not depend on the configuration
+struct RegValue
+{
+    uint8_t addr;
+    uint8_t value;
+};
+
+static constexpr RegValue sx127x_fixed_regs[] = {
+    { REG_LNA,                LNA_MAX_GAIN },
+    { REG_PAYLOAD_LENGTH,     PAYLOAD_LENGTH },
+    { REG_MAX_PAYLOAD_LENGTH, MAX_PAYLOAD_LENGTH },
+    { REG_HOP_PERIOD,         HOP_PERIOD_OFF },
+    { REG_SYNC_WORD,          LORAWAN_SYNC_WORD },
+};
+
+// Mandated when the symbol duration exceeds 16 ms
+constexpr bool LowDataRateOptimize(SpreadingFactor_t sf, Bandwidth_t bw)
+{
+    return (bw == BW125 && sf >= SF11) || (bw == BW250 && sf == SF12);
+}
+
+// 0 for BW125, 1 for BW250, 2 for BW500
+constexpr uint8_t BandwidthIndex(Bandwidth_t bw)
+{
+    return bw == BW125 ? 0 : bw == BW250 ? 1 : 2;
+}
+
+constexpr uint8_t SymbTimeout(SpreadingFactor_t sf)
+{
+    return sf >= SF10 ? 0x05 : 0x08;
+}
+
+constexpr uint32_t FrequencyToFrf(uint32_t freq)
+{
+    return (uint32_t)(((uint64_t)freq << 19) / SX127X_XTAL_FREQ);
+}
+
+constexpr uint16_t FskBitrateReg(uint32_t bitrate)
+{
+    return (uint16_t)((SX127X_XTAL_FREQ + bitrate / 2) / bitrate);
+}
+
+// Deviation in steps of FXOSC / 2^19
+constexpr uint16_t FskFdevReg(uint32_t fdev)
+{
+    return (uint16_t)((((uint64_t)fdev << 19) + SX127X_XTAL_FREQ / 2) / SX127X_XTAL_FREQ);
+}
+
+// Register runs programmed for FSK, identical on both chip families
+static constexpr RegSpan sx127x_fsk_spans[] = {
+    { REG_BITRATE_MSB,     7 },  // bitrate, fdev, frf
+    { REG_LNA,             2 },  // LNA, RxConfig
+    { REG_RX_BW,           2 },
+    { REG_PREAMBLE_DETECT, 1 },
+    { REG_SYNC_CONFIG,     1 + FSK_SYNC_WORD_MAX_LENGTH },
+    { REG_PACKET_CONFIG1,  3 },
+    { REG_FIFO_THRESH,     1 },
+    { REG_DIO_MAPPING_1,   1 },  // DIO0 = PayloadReady, DIO1 = FifoLevel
+};
+
+static constexpr RegSpan sx127x_fsk_watch_spans[] = {
+    { REG_OPMODE,          1 },
+    { REG_BITRATE_MSB,     7 },  // bitrate, fdev, frf
+};
+
+/*******************************************************************************
+ *
+ * Chip traits
+ *
+ *******************************************************************************/
+
+struct Sx1272
+{
+    static constexpr const char* name = "SX1272";
+    static constexpr uint8_t version = 0x22;
+    static constexpr int reset_active = 1;  // RST is active high
+    static constexpr int rssi_offset = 139;
+
+    static constexpr uint8_t ModemConfig1(SpreadingFactor_t sf, Bandwidth_t bw, CodingRate_t cr) {
+        return (uint8_t)(BandwidthIndex(bw) << SX72_MC1_BW_SHIFT) | (uint8_t)(cr << SX72_MC1_CR_SHIFT)
+               | SX72_MC1_RX_PAYLOAD_CRCON
+               | (LowDataRateOptimize(sf, bw) ? SX72_MC1_LOW_DATA_RATE_OPTIMIZE : 0);
+    }
+    static constexpr uint8_t ModemConfig2(SpreadingFactor_t sf) {
+        return (uint8_t)(sf << 4) | SX72_MC2_AGC_AUTO_ON;
+    }
+    static constexpr bool has_modem_config3 = false;
+    static constexpr uint8_t ModemConfig3(SpreadingFactor_t, Bandwidth_t) {
+        return 0;
+    }
+
+    static constexpr RegSpan init_spans[] = {
+        { REG_FRF_MSB,        3 },
+        { REG_LNA,            1 },
+        { REG_MODEM_CONFIG,   3 },
+        { REG_PAYLOAD_LENGTH, 3 },
+        { REG_SYNC_WORD,      1 },
+    };
+
+    // Registers read back by the health watchdog
+    static constexpr RegSpan watch_spans[] = {
+        { REG_OPMODE,         1 },
+        { REG_FRF_MSB,        3 },
+        { REG_MODEM_CONFIG,   2 },
+    };
+};
+
+struct Sx1276
+{
+    static constexpr const char* name = "SX1276";
+    static constexpr uint8_t version = 0x12;
+    static constexpr int reset_active = 0;  // RST is active low
+    static constexpr int rssi_offset = 157;
+
+    static constexpr uint8_t ModemConfig1(SpreadingFactor_t, Bandwidth_t bw, CodingRate_t cr) {
+        return (uint8_t)((SX76_MC1_BW_BASE + BandwidthIndex(bw)) << SX76_MC1_BW_SHIFT)
+               | (uint8_t)(cr << SX76_MC1_CR_SHIFT);
+    }
+    static constexpr uint8_t ModemConfig2(SpreadingFactor_t sf) {
+        return (uint8_t)(sf << 4) | SX76_MC2_RX_PAYLOAD_CRCON;
+    }
+    static constexpr bool has_modem_config3 = true;
+    static constexpr uint8_t ModemConfig3(SpreadingFactor_t sf, Bandwidth_t bw) {
+        return SX76_MC3_AGC_AUTO_ON | (LowDataRateOptimize(sf, bw) ? SX76_MC3_LOW_DATA_RATE_OPTIMIZE : 0);
+    }
+
+    static constexpr RegSpan init_spans[] = {
+        { REG_FRF_MSB,        3 },
+        { REG_LNA,            1 },
+        { REG_MODEM_CONFIG,   3 },
+        { REG_PAYLOAD_LENGTH, 3 },
+        { REG_MODEM_CONFIG3,  1 },
+        { REG_SYNC_WORD,      1 },
+    };
+
+    // Registers read back by the health watchdog
+    static constexpr RegSpan watch_spans[] = {
+        { REG_OPMODE,         1 },
+        { REG_FRF_MSB,        3 },
+        { REG_MODEM_CONFIG,   2 },
+        { REG_MODEM_CONFIG3,  1 },
+    };
+};
+
+/*******************************************************************************
+ *
+ * Driver
+ *
+ *******************************************************************************/
+
+// Metadata of the last received packet
+struct Sx127xPktStatus
+{
+    int rssi;           // packet RSSI, in dBm
+    int current_rssi;   // channel RSSI, in dBm
+    int snr;            // in dB
+    CodingRate_t cr;    // coding rate announced in the header
+    bool crc_on;        // header announced a payload CRC
+    bool crc_error;     // and the payload did not match it
+};
+
+class Sx127x
+{
+public:
+    Sx127x()
+      : modu_(MODU_LORA), fsk_bitrate_(0), watch_spans_(NULL), watch_count_(0), header_count_(0), header_carry_(0),
+        fsk_active_(false), fsk_length_(-1), fsk_received_(0), fsk_start_(0)
+    {}
+    virtual ~Sx127x() {}
+
+    virtual const char* Name() const = 0;
+
+    // Program the modem and enter continuous receive
+    void Setup(const Sx127xConf& conf)
+    {
+        modu_ = conf.modu;
+        if (conf.modu == MODU_FSK) {
+            SetupFsk(conf);
+        } else {
+            SetupLoRa(conf);
+        }
+        // Sleep cleared the modem counters
+        header_count_ = 0;
+    }
+
+    // Move a receiving radio to conf: only the registers whose value
+    // changes are written, runs of them in one burst, from standby, and
+    // reception resumes. A frame
+    // waiting in the FIFO survives. A modulation change needs sleep mode
+    // and goes through Setup(). Returns the number of registers written.
+    int Reconfigure(const Sx127xConf& conf);
+
+    // True from preamble detection until the frame is complete, when
+    // retuning would lose it
+    bool Receiving() const;
+
+    // LoRa: valid headers since the last call, frames completed or not, as
+    // counted by the modem in RegRxHeaderCntValue. Reconfigure() carries
+    // the count over the receiver restart. The second form takes the
+    // register as the caller read it, in a burst of its own.
+    uint32_t TakeValidHeaders();
+    uint32_t TakeValidHeaders(uint16_t count);
+
+    // LoRa: read RegModemStat..RegHopChannel in one burst
+    virtual void ReadPktStatus(Sx127xPktStatus* p_status) const = 0;
+
+    // FSK: drain what the FIFO holds of the frame being received and
+    // return at once, RX_NONE until the frame is complete. Call on every
+    // FifoLevel (DIO1) and PayloadReady (DIO0) edge: frames longer than the
+    // 64-byte FIFO are taken a threshold's worth per call. A frame not
+    // complete after its longest airtime is dropped on the next call.
+    RxResult_t ReceiveFsk(char* payload, uint8_t* p_length, Sx127xPktStatus* p_status);
+
+    // Current channel RSSI, in dBm
+    virtual int CurrentRssi() const = 0;
+
+    // LoRa: the channel RSSI, in dBm, for the noise floor. Read in one
+    // burst with RegIrqFlags and RegModemStat, and discarded (false) when
+    // a frame is being received or waits for RxDone to be served.
+    virtual bool SampleNoise(int* p_rssi) const = 0;
+
+    // Last value written to a register by Setup()
+    uint8_t Shadow(uint8_t addr) const { return shadow_[addr]; }
+
+    // Read back the mode, frequency and modem registers and compare them
+    // with the shadow. On mismatch returns false and the first bad register.
+    bool Verify(uint8_t* p_addr, uint8_t* p_value) const;
+
+    // Registers checked by Verify() for the current modulation
+    const RegSpan* WatchSpans(size_t* p_count) const
+    {
+        *p_count = watch_count_;
+        return watch_spans_;
+    }
+
+protected:
+    // Compute the register values of conf into the shadow
+    virtual void ShadowLoRa(const Sx127xConf& conf) = 0;
+    void ShadowFsk(const Sx127xConf& conf);
+
+    virtual void SetupLoRa(const Sx127xConf& conf) = 0;
+    void SetupFsk(const Sx127xConf& conf);
+    void WriteSpans(const RegSpan* spans, size_t count);
+
+    Modulation_t modu_;
+    uint8_t shadow_[SX127X_REG_COUNT];
+    uint32_t fsk_bitrate_;
+
+    // Registers checked by Verify() for the current modulation
+    const RegSpan* watch_spans_;
+    size_t watch_count_;
+
+private:
+    uint16_t ReadHeaderCount() const;
+
+    uint16_t header_count_;         // RegRxHeaderCntValue at the last take
+    uint32_t header_carry_;         // counted before a receiver restart
+
+    // FSK frame between its sync word and PayloadReady
+    bool fsk_active_;
+    int fsk_length_;                // -1 until the length byte is read
+    int fsk_received_;
+    unsigned int fsk_start_;        // millis() at the sync word
+    Sx127xPktStatus fsk_status_;
+    uint8_t fsk_buffer_[FSK_MAX_PAYLOAD_LENGTH];
+};
+
+template<class Chip>
+class Sx127xDriver : public Sx127x
+{
+public:
+    const char* Name() const { return Chip::name; }
+
+    void ReadPktStatus(Sx127xPktStatus* p_status) const
+    {
+        uint8_t regs[REG_HOP_CHANNEL - REG_MODEM_STAT + 1];
+        ReadBurst(REG_MODEM_STAT, regs, sizeof(regs));
+
+        p_status->cr = (CodingRate_t)((regs[0] >> MODEM_STAT_RX_CR_SHIFT) & MODEM_STAT_RX_CR_MASK);
+        // SNR register is two's complement, in 0.25 dB steps
+        p_status->snr = (int8_t)regs[REG_PKT_SNR_VALUE - REG_MODEM_STAT] / 4;
+        p_status->rssi = regs[REG_PKT_RSSI_VALUE - REG_MODEM_STAT] - Chip::rssi_offset;
+        p_status->current_rssi = regs[REG_RSSI_VALUE - REG_MODEM_STAT] - Chip::rssi_offset;
+        p_status->crc_on = (regs[REG_HOP_CHANNEL - REG_MODEM_STAT] & HOP_CHANNEL_CRC_ON_PAYLOAD) != 0;
+        p_status->crc_error = false;
+    }
+
+    int CurrentRssi() const { return ReadRegister(REG_RSSI_VALUE) - Chip::rssi_offset; }
+
+    bool SampleNoise(int* p_rssi) const
+    {
+        if (modu_ != MODU_LORA) {
+            return false;
+        }
+        uint8_t regs[REG_RSSI_VALUE - REG_IRQ_FLAGS + 1];
+        ReadBurst(REG_IRQ_FLAGS, regs, sizeof(regs));
+
+        if ((regs[0] & IRQ_LORA_RXDONE_MASK) != 0 ||
+            (regs[REG_MODEM_STAT - REG_IRQ_FLAGS] & MODEM_STAT_RECEIVING) != 0) {
+            return false;
+        }
+        *p_rssi = regs[REG_RSSI_VALUE - REG_IRQ_FLAGS] - Chip::rssi_offset;
+        return true;
+    }
+
+protected:
+    void ShadowLoRa(const Sx127xConf& conf)
+    {
+        SpreadingFactor_t sf = conf.sf;
+
+        for (size_t i = 0; i < sizeof(sx127x_fixed_regs) / sizeof(sx127x_fixed_regs[0]); i++) {
+            shadow_[sx127x_fixed_regs[i].addr] = sx127x_fixed_regs[i].value;
+        }
+
+        uint32_t frf = FrequencyToFrf(conf.freq);
+        shadow_[REG_FRF_MSB] = (uint8_t)(frf >> 16);
+        shadow_[REG_FRF_MID] = (uint8_t)(frf >> 8);
+        shadow_[REG_FRF_LSB] = (uint8_t)(frf >> 0);
+
+        shadow_[REG_MODEM_CONFIG]     = Chip::ModemConfig1(sf, conf.bw, conf.cr);
+        shadow_[REG_MODEM_CONFIG2]    = Chip::ModemConfig2(sf);
+        shadow_[REG_SYMB_TIMEOUT_LSB] = SymbTimeout(sf);
+        if (Chip::has_modem_config3) {
+            shadow_[REG_MODEM_CONFIG3] = Chip::ModemConfig3(sf, conf.bw);
+        }
+    }
+
+    void SetupLoRa(const Sx127xConf& conf)
+    {
+        ShadowLoRa(conf);
+
+        shadow_[REG_OPMODE] = SX72_MODE_SLEEP;
+        WriteRegister(REG_OPMODE, SX72_MODE_SLEEP);
+
+        WriteSpans(Chip::init_spans, sizeof(Chip::init_spans) / sizeof(Chip::init_spans[0]));
+        watch_spans_ = Chip::watch_spans;
+        watch_count_ = sizeof(Chip::watch_spans) / sizeof(Chip::watch_spans[0]);
+
+        WriteRegister(REG_FIFO_ADDR_PTR, ReadRegister(REG_FIFO_RX_BASE_AD));
+
+        // Set Continous Receive Mode
+        shadow_[REG_OPMODE] = SX72_MODE_RX_CONTINUOS;
+        WriteRegister(REG_OPMODE, SX72_MODE_RX_CONTINUOS);
+    }
+};
+
+// Reset the transceiver through the RST pin and identify it.
+// Returns NULL when neither an SX1272 nor an SX1276 answers.
+Sx127x* DetectSx127x(int rst, uint8_t* p_version);
+
+#endif
@@ -0,0 +1,262 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+#include "trace.h"
+
+#include <rapidjson/filewritestream.h>
+#include <rapidjson/writer.h>
+
+#include <cstdio>
+
+using namespace std;
+using namespace rapidjson;
+
+// Log-linear buckets: values below 64 are exact, above that each power of
+// two is split in 32 sub-buckets.
+#define HDR_SUB_BITS       5
+#define HDR_SUB_COUNT      (1 << HDR_SUB_BITS)
+#define HDR_BUCKETS        ((32 - HDR_SUB_BITS) * HDR_SUB_COUNT + HDR_SUB_COUNT)
+
+#define TRACE_CAPTURE_MAX  4096
+
+struct HdrHistogram
+{
+    Counter counts[HDR_BUCKETS];
+    Counter total;
+};
+
+// Segments between consecutive tracepoints, plus the whole pipeline
+typedef enum TraceSegments
+{
+    SEG_IRQ_FLAGS,      // DIO0 -> IRQ flags
+    SEG_FIFO,           // IRQ flags -> FIFO drained
+    SEG_BASE64,         // FIFO drained -> base64
+    SEG_JSON,           // base64 -> JSON
+    SEG_SEND,           // JSON -> last sendto()
+    SEG_TOTAL,          // DIO0 -> last sendto()
+    SEG_COUNT
+} TraceSegment_t;
+
+static const char* segment_names[SEG_COUNT] = {
+    "irq_flags", "fifo", "base64", "json", "send", "total"
+};
+
+static HdrHistogram segments[SEG_COUNT];
+static uint32_t next_seq = 0;
+
+// Capture window
+static PacketTrace capture[TRACE_CAPTURE_MAX];
+static unsigned int capture_count = 0;
+static bool capturing = false;
+static uint32_t capture_start;
+static uint32_t capture_length;
+static char capture_path[256];
+
+static unsigned int HdrIndex(uint32_t v)
+{
+  if (v < 2 * HDR_SUB_COUNT) {
+    return v;
+  }
+  unsigned int shift = 31 - __builtin_clz(v) - HDR_SUB_BITS;
+  return shift * HDR_SUB_COUNT + (v >> shift);
+}
+
+// Highest value that falls in bucket index
+static uint32_t HdrValue(unsigned int index)
+{
+  if (index < 2 * HDR_SUB_COUNT) {
+    return index;
+  }
+  unsigned int shift = index / HDR_SUB_COUNT - 1;
+  uint32_t sub = index - shift * HDR_SUB_COUNT;
+  return (sub << shift) + ((1u << shift) - 1);
+}
+
+static void HdrRecord(HdrHistogram& histogram, uint32_t v)
+{
+  Inc(histogram.counts[HdrIndex(v)]);
+  Inc(histogram.total);
+}
+
+static uint32_t HdrPercentile(const HdrHistogram& histogram, double percentile)
+{
+  uint64_t total = histogram.total.load(memory_order_relaxed);
+  if (total == 0) {
+    return 0;
+  }
+  uint64_t rank = (uint64_t)(percentile / 100.0 * total + 0.5);
+  if (rank == 0) {
+    rank = 1;
+  }
+  uint64_t seen = 0;
+  for (unsigned int i = 0; i < HDR_BUCKETS; i++) {
+    seen += histogram.counts[i].load(memory_order_relaxed);
+    if (seen >= rank) {
+      return HdrValue(i);
+    }
+  }
+  return HdrValue(HDR_BUCKETS - 1);
+}
+
+static void CaptureWrite()
+{
+  FILE* p_file = fopen(capture_path, "w");
+  if (p_file == NULL) {
+    perror(capture_path);
+    return;
+  }
+
+  char buffer[4096];
+  FileWriteStream fs(p_file, buffer, sizeof(buffer));
+  Writer<FileWriteStream> writer(fs);
+
+  static const char* stage_names[TRACE_STAGES] = { "dio0", "irq_flags", "fifo", "base64", "json" };
+
+  writer.StartObject();
+  writer.String("traceEvents");
+  writer.StartArray();
+  for (unsigned int i = 0; i < capture_count; i++) {
+    const PacketTrace& trace = capture[i];
+
+    // One complete event per stage, on a track per packet sequence
+    for (int stage = TRACE_IRQ_FLAGS; stage < TRACE_STAGES; stage++) {
+      writer.StartObject();
+      writer.String("name");
+      writer.String(stage_names[stage]);
+      writer.String("ph");
+      writer.String("X");
+      writer.String("ts");
+      writer.Uint(trace.t[stage - 1] - capture_start);
+      writer.String("dur");
+      writer.Uint(trace.t[stage] - trace.t[stage - 1]);
+      writer.String("pid");
+      writer.Uint(1);
+      writer.String("tid");
+      writer.Uint(1);
+      writer.String("args");
+      writer.StartObject();
+      writer.String("seq");
+      writer.Uint(trace.seq);
+      writer.EndObject();
+      writer.EndObject();
+    }
+    for (unsigned int server = 0; server < METRICS_MAX_SERVERS; server++) {
+      if (trace.sent_mask & (1 << server)) {
+        writer.StartObject();
+        writer.String("name");
+        writer.String("sendto");
+        writer.String("ph");
+        writer.String("X");
+        writer.String("ts");
+        writer.Uint(trace.t[TRACE_JSON] - capture_start);
+        writer.String("dur");
+        writer.Uint(trace.sent[server] - trace.t[TRACE_JSON]);
+        writer.String("pid");
+        writer.Uint(1);
+        writer.String("tid");
+        writer.Uint(2 + server);
+        writer.String("args");
+        writer.StartObject();
+        writer.String("seq");
+        writer.Uint(trace.seq);
+        writer.String("server");
+        writer.Uint(server);
+        writer.EndObject();
+        writer.EndObject();
+      }
+    }
+  }
+  writer.EndArray();
+  writer.EndObject();
+  fs.Flush();
+  fclose(p_file);
+
+  printf("trace: %u packets written to %s\n", capture_count, capture_path);
+}
+
+void TraceEnd(PacketTrace* trace)
+{
+  trace->seq = next_seq++;
+
+  uint32_t last_sent = trace->t[TRACE_JSON];
+  for (unsigned int server = 0; server < METRICS_MAX_SERVERS; server++) {
+    if (trace->sent_mask & (1 << server)) {
+      last_sent = trace->sent[server];
+    }
+  }
+
+  HdrRecord(segments[SEG_IRQ_FLAGS], trace->t[TRACE_IRQ_FLAGS] - trace->t[TRACE_DIO0]);
+  HdrRecord(segments[SEG_FIFO], trace->t[TRACE_FIFO] - trace->t[TRACE_IRQ_FLAGS]);
+  HdrRecord(segments[SEG_BASE64], trace->t[TRACE_BASE64] - trace->t[TRACE_FIFO]);
+  HdrRecord(segments[SEG_JSON], trace->t[TRACE_JSON] - trace->t[TRACE_BASE64]);
+  HdrRecord(segments[SEG_SEND], last_sent - trace->t[TRACE_JSON]);
+  HdrRecord(segments[SEG_TOTAL], last_sent - trace->t[TRACE_DIO0]);
+
+  metrics.spi_read.Observe(trace->t[TRACE_FIFO] - trace->readout);
+  metrics.json_build.Observe(trace->t[TRACE_JSON] - trace->t[TRACE_FIFO]);
+  metrics.irq_to_send.Observe(last_sent - trace->t[TRACE_DIO0]);
+
+  if (capturing) {
+    if (capture_count < TRACE_CAPTURE_MAX) {
+      capture[capture_count++] = *trace;
+    }
+    if (last_sent - capture_start >= capture_length || capture_count == TRACE_CAPTURE_MAX) {
+      capturing = false;
+      CaptureWrite();
+    }
+  }
+}
+
+void TraceCapturePoll()
+{
+  if (capturing && MicrosNow() - capture_start >= capture_length) {
+    capturing = false;
+    CaptureWrite();
+  }
+}
+
+bool TraceCaptureStart(const char* path, uint32_t seconds)
+{
+  if (capturing) {
+    return false;
+  }
+  snprintf(capture_path, sizeof(capture_path), "%s", path);
+  capture_count = 0;
+  capture_start = MicrosNow();
+  capture_length = seconds * 1000000;
+  capturing = true;
+  return true;
+}
+
+void TracePrintSummary()
+{
+  for (int i = 0; i < SEG_COUNT; i++) {
+    printf("  %-9s n=%llu p50=%uus p99=%uus p999=%uus\n", segment_names[i],
+           (unsigned long long)segments[i].total.load(memory_order_relaxed),
+           HdrPercentile(segments[i], 50), HdrPercentile(segments[i], 99), HdrPercentile(segments[i], 99.9));
+  }
+}
+
+void TraceRenderMetrics(string& out)
+{
+  static const double quantiles[] = { 0.5, 0.99, 0.999 };
+  char line[160];
+
+  out += "# HELP lora_pkt_fwd_stage_latency_seconds Receive pipeline stage latency quantiles\n"
+         "# TYPE lora_pkt_fwd_stage_latency_seconds gauge\n";
+  for (int i = 0; i < SEG_COUNT; i++) {
+    for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+      snprintf(line, sizeof(line), "lora_pkt_fwd_stage_latency_seconds{stage=\"%s\",quantile=\"%g\"} %g\n",
+               segment_names[i], quantiles[q], HdrPercentile(segments[i], quantiles[q] * 100) / 1e6);
+      out += line;
+    }
+  }
+}
@@ -0,0 +1,86 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+// Per-packet pipeline tracepoints.
+//
+// Each uplink carries a PacketTrace through the receive path; every stage
+// stamps it with MicrosNow(). TraceEnd() folds the stage-to-stage deltas
+// into log-linear (HDR-style, ~3% precision) histograms, from which
+// p50/p99/p999 are reported, and optionally keeps the raw records of a
+// capture window to write them out as Chrome trace-event JSON
+// (chrome://tracing or https://ui.perfetto.dev).
+
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include "metrics.h"
+
+#include <stdint.h>
+#include <string>
+
+typedef enum TraceStages
+{
+    TRACE_DIO0,         // DIO0 rising edge, readout start for FSK
+    TRACE_IRQ_FLAGS,    // RegIrqFlags read
+    TRACE_FIFO,         // FIFO drained and packet status read
+    TRACE_BASE64,       // payload encoded
+    TRACE_JSON,         // rxpk built
+    TRACE_STAGES
+} TraceStage_t;
+
+struct PacketTrace
+{
+    uint32_t seq;
+    uint32_t t[TRACE_STAGES];
+    uint32_t readout;                    // radio readout started
+    uint32_t sent[METRICS_MAX_SERVERS];  // sendto() returned, per server index
+    uint8_t  sent_mask;
+};
+
+// edge is the MicrosNow() of the interrupt that announced the frame
+static inline void TraceBegin(PacketTrace* trace, uint32_t edge)
+{
+    trace->readout = MicrosNow();
+    trace->t[TRACE_DIO0] = edge;
+    trace->sent_mask = 0;
+}
+
+static inline void TracePoint(PacketTrace* trace, TraceStage_t stage)
+{
+    if (trace != NULL) {
+        trace->t[stage] = MicrosNow();
+    }
+}
+
+static inline void TraceSent(PacketTrace* trace, unsigned int server)
+{
+    if (trace != NULL && server < METRICS_MAX_SERVERS) {
+        trace->sent[server] = MicrosNow();
+        trace->sent_mask |= 1 << server;
+    }
+}
+
+// Aggregate a completed record, and keep it if a capture is running
+void TraceEnd(PacketTrace* trace);
+
+// Record the next `seconds` of packets, then write them to path
+bool TraceCaptureStart(const char* path, uint32_t seconds);
+
+// Write the capture out once its window is over, even without traffic
+void TraceCapturePoll();
+
+// One line per segment with count, p50, p99 and p999 in microseconds
+void TracePrintSummary();
+
+// Quantiles as Prometheus gauges, registered with the metrics module
+void TraceRenderMetrics(std::string& out);
+
+#endif
@@ -0,0 +1,514 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+#include "uplink.h"
+
+#include "base64.h"
+#include "jsonwriter.h"
+#include "metrics.h"
+
+#include <rapidjson/document.h>
+
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <netdb.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+using namespace std;
+
+using namespace rapidjson;
+
+vector<Server_t> servers;
+
+int sock_up = -1;
+
+const char* const uplink_class_names[UPLINK_CLASSES] = { "join", "confirmed", "unconfirmed", "proprietary" };
+
+const char* const tx_error_names[TX_ERRORS] = {
+  "NONE", "TOO_LATE", "TOO_EARLY", "COLLISION_PACKET", "COLLISION_BEACON", "TX_FREQ", "TX_POWER", "GPS_UNLOCKED"
+};
+
+static_assert(TX_ERRORS == METRICS_TX_ERRORS, "txpk errors and their metrics differ");
+
+static_assert(UPLINK_CLASSES == METRICS_UPLINK_CLASSES, "uplink classes and their metrics differ");
+
+UplinkClass_t ClassifyUplink(const uint8_t* payload, uint8_t size)
+{
+  if (size == 0 || (payload[0] & MHDR_MAJOR_MASK) != 0) {
+    return UPLINK_PROPRIETARY;
+  }
+  switch (payload[0] >> MHDR_MTYPE_SHIFT) {
+    case MTYPE_JOIN_REQUEST:
+      return size == JOIN_REQUEST_SIZE ? UPLINK_JOIN : UPLINK_PROPRIETARY;
+    case MTYPE_REJOIN_REQUEST:
+      return size >= DATA_UP_MIN_SIZE ? UPLINK_JOIN : UPLINK_PROPRIETARY;
+    case MTYPE_CONFIRMED_UP:
+      return size >= DATA_UP_MIN_SIZE ? UPLINK_CONFIRMED : UPLINK_PROPRIETARY;
+    case MTYPE_UNCONFIRMED_UP:
+      return size >= DATA_UP_MIN_SIZE ? UPLINK_UNCONFIRMED : UPLINK_PROPRIETARY;
+    default:
+      return UPLINK_PROPRIETARY;
+  }
+}
+
+// Version and gateway EUI are fixed, the token and type are filled per
+// datagram after copying the whole template
+static uint8_t header_template[HEADER_SIZE] = { PROTOCOL_VERSION };
+
+// Room for the nesting levels of rxpk and stat, and the pool header
+#define WRITER_STACK_SIZE   256
+#define WRITER_LEVEL_DEPTH  4
+
+// Room for the values of a txpk and the parser stack
+#define TXPK_POOL_SIZE      2048
+#define TXPK_STACK_SIZE     1024
+#define TXPK_STACK_CAPACITY 512
+
+// Scheduling bounds of the Semtech just-in-time queue: a downlink needs
+// the TX start delay, a margin and the time to program the radio ahead of
+// tmst, and nothing is queued further than four beacon periods ahead
+#define TXPK_MIN_LEAD       42500       // us
+#define TXPK_MAX_ADVANCE    512000000   // us
+
+// SX127x output power range, PA_BOOST pin
+#define TXPK_POWER_MIN      2           // dBm
+#define TXPK_POWER_MAX      20
+
+typedef GenericDocument<UTF8<>, MemoryPoolAllocator<>, MemoryPoolAllocator<> > TxpkDocument;
+
+int BuildRxpkJson(const RxPkt& pkt, char* out, int max_len, PacketTrace* trace)
+{
+  const Sx127xConf& conf = *pkt.conf;
+
+  // Encode payload.
+  char b64[BASE64_MAX_LENGTH];
+  bin_to_b64(pkt.payload, pkt.size, b64, BASE64_MAX_LENGTH);
+  TracePoint(trace, TRACE_BASE64);
+
+  // Build JSON object.
+  char stack[WRITER_STACK_SIZE];
+  WriterAllocator allocator(stack, sizeof(stack));
+  FixedStream os(out, max_len);
+  FixedWriter writer(os, &allocator, WRITER_LEVEL_DEPTH);
+  writer.StartObject();
+  writer.String("rxpk");
+  writer.StartArray();
+  writer.StartObject();
+  writer.String("tmst");
+  writer.Uint(pkt.tmst);
+  writer.String("freq");
+  writer.Double((double)conf.freq / 1000000);
+  writer.String("chan");
+  writer.Uint(pkt.chan);
+  writer.String("rfch");
+  writer.Uint(0);
+  writer.String("stat");
+  writer.Int(pkt.status.crc_error ? -1 : pkt.status.crc_on ? 1 : 0);
+  writer.String("modu");
+  if (conf.modu == MODU_FSK) {
+    writer.String("FSK");
+    writer.String("datr");
+    writer.Uint(conf.fsk_bitrate);
+  } else {
+    writer.String("LORA");
+    writer.String("datr");
+    char datr[] = "SFxxBWxxx";
+    snprintf(datr, strlen(datr) + 1, "SF%uBW%u", conf.sf, conf.bw);
+    writer.String(datr);
+    writer.String("codr");
+    writer.String(pkt.codr);
+  }
+  writer.String("rssi");
+  writer.Int(pkt.status.rssi);
+  if (conf.modu == MODU_LORA) {
+    writer.String("lsnr");
+    writer.Double(pkt.status.snr);
+  }
+  writer.String("size");
+  writer.Uint(pkt.size);
+  writer.String("data");
+  writer.String(b64);
+  writer.EndObject();
+  writer.EndArray();
+  writer.EndObject();
+
+  int length = os.Finish();
+  TracePoint(trace, TRACE_JSON);
+  return length;
+}
+
+int BuildStatJson(const StatReport& stat, char* out, int max_len)
+{
+  // Build JSON object.
+  char stack[WRITER_STACK_SIZE];
+  WriterAllocator allocator(stack, sizeof(stack));
+  FixedStream os(out, max_len);
+  FixedWriter writer(os, &allocator, WRITER_LEVEL_DEPTH);
+  writer.StartObject();
+  writer.String("stat");
+  writer.StartObject();
+  writer.String("time");
+  writer.String(stat.time);
+  writer.String("lati");
+  writer.Double(stat.lati);
+  writer.String("long");
+  writer.Double(stat.longi);
+  writer.String("alti");
+  writer.Int(stat.alti);
+  writer.String("rxnb");
+  writer.Uint(stat.rxnb);
+  writer.String("rxok");
+  writer.Uint(stat.rxok);
+  writer.String("rxfw");
+  writer.Uint(stat.rxfw);
+  writer.String("ackr");
+  writer.Double(stat.ackr);
+  writer.String("dwnb");
+  writer.Uint(stat.dwnb);
+  writer.String("txnb");
+  writer.Uint(stat.txnb);
+  writer.String("pfrm");
+  writer.String(stat.pfrm);
+  writer.String("mail");
+  writer.String(stat.mail);
+  writer.String("desc");
+  writer.String(stat.desc);
+  writer.EndObject();
+  writer.EndObject();
+
+  return os.Finish();
+}
+
+// MAC address of ifname, if it is Ethernet-like and not all zeros
+static bool InterfaceMac(int sock, const char* ifname, uint8_t mac[6], bool* up)
+{
+  struct ifreq ifr;
+  memset(&ifr, 0, sizeof(ifr));
+  strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+
+  if (ioctl(sock, SIOCGIFFLAGS, &ifr) == -1 || (ifr.ifr_flags & IFF_LOOPBACK) != 0) {
+    return false;
+  }
+  *up = (ifr.ifr_flags & IFF_UP) != 0;
+
+  if (ioctl(sock, SIOCGIFHWADDR, &ifr) == -1 || ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER) {
+    return false;
+  }
+  memcpy(mac, ifr.ifr_hwaddr.sa_data, 6);
+  static const uint8_t zero[6] = { 0 };
+  return memcmp(mac, zero, 6) != 0;
+}
+
+bool InterfaceEui(int sock, const char* ifname, uint64_t* eui, char* found, size_t size)
+{
+  uint8_t mac[6];
+  bool up;
+  bool have_mac = false;
+
+  if (ifname != NULL && ifname[0] != '\0') {
+    have_mac = InterfaceMac(sock, ifname, mac, &up);
+    snprintf(found, size, "%s", ifname);
+  } else {
+    // Wi-Fi only boards and predictable names (enxb827eb..., wlan0) have no eth0
+    struct if_nameindex* names = if_nameindex();
+    if (names == NULL) {
+      return false;
+    }
+    for (struct if_nameindex* it = names; it->if_name != NULL; it++) {
+      uint8_t it_mac[6];
+      if (InterfaceMac(sock, it->if_name, it_mac, &up) && (!have_mac || up)) {
+        memcpy(mac, it_mac, 6);
+        snprintf(found, size, "%s", it->if_name);
+        have_mac = true;
+        if (up) {
+          break;
+        }
+      }
+    }
+    if_freenameindex(names);
+  }
+
+  if (!have_mac) {
+    return false;
+  }
+  *eui = (uint64_t)mac[0] << 56 | (uint64_t)mac[1] << 48 | (uint64_t)mac[2] << 40 |
+         (uint64_t)0xFFFF << 24 |
+         (uint64_t)mac[3] << 16 | (uint64_t)mac[4] << 8 | mac[5];
+  return true;
+}
+
+void SetGatewayEui(uint64_t eui)
+{
+  for (int i = 0; i < 8; i++) {
+    header_template[4 + i] = (uint8_t)(eui >> (56 - 8 * i));
+  }
+}
+
+void WriteHeader(char* buff, uint8_t type)
+{
+  memcpy(buff, header_template, HEADER_SIZE);
+  buff[1] = (uint8_t)rand(); /* random token */
+  buff[2] = (uint8_t)rand(); /* random token */
+  buff[3] = type;
+}
+
+bool SolveHostname(const char* p_hostname, uint16_t port, struct sockaddr_in* p_sin)
+{
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_protocol = IPPROTO_UDP;
+
+  char service[6] = { '\0' };
+  snprintf(service, 6, "%hu", port);
+
+  struct addrinfo* p_result = NULL;
+
+  // Resolve the domain name into a list of addresses
+  int error = getaddrinfo(p_hostname, service, &hints, &p_result);
+  if (error != 0) {
+      fprintf(stderr, "getaddrinfo: %s: %s\n", p_hostname, gai_strerror(error));
+      return false;
+  }
+
+  // Loop over all returned results
+  for (struct addrinfo* p_rp = p_result; p_rp != NULL; p_rp = p_rp->ai_next) {
+    struct sockaddr_in* p_saddr = (struct sockaddr_in*)p_rp->ai_addr;
+    //printf("%s solved to %s\n", p_hostname, inet_ntoa(p_saddr->sin_addr));
+    p_sin->sin_addr = p_saddr->sin_addr;
+  }
+
+  freeaddrinfo(p_result);
+  return true;
+}
+
+void ResolveServers()
+{
+  for (vector<Server_t>::iterator it = servers.begin(); it != servers.end(); ++it) {
+    if (it->enabled && it->station == NULL && it->mqtt == NULL) {
+      struct sockaddr_in si_other;
+      memset(&si_other, 0, sizeof(si_other));
+      si_other.sin_family = AF_INET;
+      si_other.sin_port = htons(it->port);
+
+      uint32_t start = MicrosNow();
+      // Keep the last good address if the resolver is unavailable
+      if (SolveHostname(it->address.c_str(), it->port, &si_other)) {
+        it->addr = si_other;
+        it->resolved = true;
+      }
+      metrics.dns.Observe(MicrosNow() - start);
+    }
+  }
+}
+
+// Send to every enabled server in server_mask that is not paused, returns the number of servers reached.
+// trace, if not NULL, gets a tracepoint per server.
+int SendUdp(char *msg, int length, uint32_t server_mask, PacketTrace* trace)
+{
+  int sent = 0;
+  int full = 0;
+
+  for (vector<Server_t>::iterator it = servers.begin(); it != servers.end(); ++it) {
+    if (it->enabled && !it->paused && it->station == NULL && it->mqtt == NULL) {
+      ServerMetrics& server_metrics = metrics.servers[(it - servers.begin()) % METRICS_MAX_SERVERS];
+      if ((server_mask & 1u << (it - servers.begin())) == 0) {
+        Inc(server_metrics.filtered);
+        continue;
+      }
+      if (!it->resolved) {
+        Inc(server_metrics.send_errors);
+        continue;
+      }
+
+      msg[0] = it->version;
+      if (sendto(sock_up, (char *)msg, length, MSG_DONTWAIT, (struct sockaddr *) &it->addr, sizeof(it->addr))==-1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          full++;
+          continue;
+        }
+        perror("sendto()");
+        Inc(server_metrics.send_errors);
+      } else {
+        Inc(server_metrics.sent);
+        TraceSent(trace, it - servers.begin());
+        sent++;
+      }
+    }
+  }
+  return sent == 0 && full != 0 ? -1 : sent;
+}
+
+uint32_t TmstNow()
+{
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return (uint32_t)(now.tv_sec * 1000000 + now.tv_usec);
+}
+
+// The checks run in the order of the Semtech forwarder, except that the
+// frequency, which no txpk can pass, comes last: the server still learns
+// about a txpk it scheduled too late or too early.
+int CheckTxpk(char* json, uint32_t now)
+{
+  char pool[TXPK_POOL_SIZE];
+  char stack[TXPK_STACK_SIZE];
+  MemoryPoolAllocator<> value_allocator(pool, sizeof(pool));
+  MemoryPoolAllocator<> stack_allocator(stack, sizeof(stack));
+  TxpkDocument document(&value_allocator, TXPK_STACK_CAPACITY, &stack_allocator);
+
+  document.ParseInsitu(json);
+  if (document.HasParseError() || !document.IsObject()) {
+    return -1;
+  }
+  Value::ConstMemberIterator member = document.FindMember("txpk");
+  if (member == document.MemberEnd() || !member->value.IsObject()) {
+    return -1;
+  }
+  const Value& txpk = member->value;
+  member = txpk.FindMember("freq");
+  if (member == txpk.MemberEnd() || !member->value.IsNumber()) {
+    return -1;
+  }
+
+  if (txpk.HasMember("tmms")) {
+    return TX_ERROR_GPS_UNLOCKED;
+  }
+  member = txpk.FindMember("imme");
+  if (member == txpk.MemberEnd() || !member->value.IsBool() || !member->value.GetBool()) {
+    member = txpk.FindMember("tmst");
+    if (member == txpk.MemberEnd() || !member->value.IsUint()) {
+      return -1;
+    }
+    int32_t lead = (int32_t)(member->value.GetUint() - now);
+    if (lead < TXPK_MIN_LEAD) {
+      return TX_ERROR_TOO_LATE;
+    }
+    if (lead > TXPK_MAX_ADVANCE) {
+      return TX_ERROR_TOO_EARLY;
+    }
+  }
+  member = txpk.FindMember("powe");
+  if (member != txpk.MemberEnd() &&
+      (!member->value.IsInt() || member->value.GetInt() < TXPK_POWER_MIN || member->value.GetInt() > TXPK_POWER_MAX)) {
+    return TX_ERROR_TX_POWER;
+  }
+  return TX_ERROR_TX_FREQ;
+}
+
+// Check the txpk of a PULL_RESP, JSON from buff + 4, and answer it with a
+// TX_ACK carrying the same token if server speaks version 2
+static void AnswerPullResp(const Server_t& server, char* buff)
+{
+  int error = CheckTxpk(buff + 4, TmstNow());
+  if (error < 0) {
+    Inc(metrics.txpk_invalid);
+    printf("PULL_RESP from %s:%hu without a valid txpk, dropped\n", server.address.c_str(), server.port);
+    return;
+  }
+  Inc(metrics.txpk[error]);
+  printf("txpk from %s:%hu: %s\n", server.address.c_str(), server.port, tx_error_names[error]);
+  if (server.version < PROTOCOL_VERSION_2) {
+    return;
+  }
+
+  char ack[HEADER_SIZE + 48];
+  WriteHeader(ack, PKT_TX_ACK);
+  ack[0] = server.version;
+  ack[1] = buff[1];
+  ack[2] = buff[2];
+  int length = HEADER_SIZE + snprintf(ack + HEADER_SIZE, sizeof(ack) - HEADER_SIZE,
+                                      "{\"txpk_ack\":{\"error\":\"%s\"}}", tx_error_names[error]);
+  if (sendto(sock_up, ack, length, MSG_DONTWAIT, (const struct sockaddr *) &server.addr, sizeof(server.addr)) == -1) {
+    Inc(metrics.servers[(&server - &servers[0]) % METRICS_MAX_SERVERS].send_errors);
+  }
+}
+
+// Drain what the servers sent without blocking
+void ReceiveDownstream()
+{
+  char buff[BUFLEN];
+  struct sockaddr_in from;
+  socklen_t fromlen = sizeof(from);
+
+  int n;
+  while ((n = recvfrom(sock_up, buff, sizeof(buff) - 1, MSG_DONTWAIT, (struct sockaddr *) &from, &fromlen)) >= 4) {
+    fromlen = sizeof(from);
+    vector<Server_t>::iterator it = servers.begin();
+    while (it != servers.end() &&
+           (it->addr.sin_addr.s_addr != from.sin_addr.s_addr || it->addr.sin_port != from.sin_port)) {
+      ++it;
+    }
+    if (it == servers.end() || buff[0] != it->version) {
+      continue;
+    }
+    if (buff[3] == PKT_PUSH_ACK) {
+      Inc(metrics.servers[(it - servers.begin()) % METRICS_MAX_SERVERS].acked);
+    } else if (buff[3] == PKT_PULL_RESP) {
+      buff[n] = '\0';
+      AnswerPullResp(*it, buff);
+    }
+  }
+}
+
+void UplinkRenderMetrics(string& out)
+{
+  char line[256];
+  out += "# HELP lora_pkt_fwd_uplink_queue_depth Frames waiting for the servers per class\n"
+         "# TYPE lora_pkt_fwd_uplink_queue_depth gauge\n";
+  for (int i = 0; i < UPLINK_CLASSES; i++) {
+    snprintf(line, sizeof(line), "lora_pkt_fwd_uplink_queue_depth{class=\"%s\"} %u\n", uplink_class_names[i],
+             metrics.uplink[i].depth.load(memory_order_relaxed));
+    out += line;
+  }
+
+  out += "# HELP lora_pkt_fwd_uplink_sent_total Frames sent to at least one server per class\n"
+         "# TYPE lora_pkt_fwd_uplink_sent_total counter\n";
+  for (int i = 0; i < UPLINK_CLASSES; i++) {
+    snprintf(line, sizeof(line), "lora_pkt_fwd_uplink_sent_total{class=\"%s\"} %llu\n", uplink_class_names[i],
+             (unsigned long long)metrics.uplink[i].sent.load(memory_order_relaxed));
+    out += line;
+  }
+
+  out += "# HELP lora_pkt_fwd_uplink_shed_total Frames dropped from the uplink queue per class, too old or no room\n"
+         "# TYPE lora_pkt_fwd_uplink_shed_total counter\n";
+  for (int i = 0; i < UPLINK_CLASSES; i++) {
+    snprintf(line, sizeof(line),
+             "lora_pkt_fwd_uplink_shed_total{class=\"%s\",reason=\"expired\"} %llu\n"
+             "lora_pkt_fwd_uplink_shed_total{class=\"%s\",reason=\"full\"} %llu\n",
+             uplink_class_names[i], (unsigned long long)metrics.uplink[i].expired.load(memory_order_relaxed),
+             uplink_class_names[i], (unsigned long long)metrics.uplink[i].full.load(memory_order_relaxed));
+    out += line;
+  }
+
+  out += "# HELP lora_pkt_fwd_txpk_total Downlinks received in PULL_RESPs per txpk_ack error\n"
+         "# TYPE lora_pkt_fwd_txpk_total counter\n";
+  for (int i = 0; i < TX_ERRORS; i++) {
+    snprintf(line, sizeof(line), "lora_pkt_fwd_txpk_total{error=\"%s\"} %llu\n", tx_error_names[i],
+             (unsigned long long)metrics.txpk[i].load(memory_order_relaxed));
+    out += line;
+  }
+  snprintf(line, sizeof(line),
+           "# HELP lora_pkt_fwd_txpk_invalid_total PULL_RESPs without a usable txpk\n"
+           "# TYPE lora_pkt_fwd_txpk_invalid_total counter\n"
+           "lora_pkt_fwd_txpk_invalid_total %llu\n", (unsigned long long)metrics.txpk_invalid.load(memory_order_relaxed));
+  out += line;
+}
@@ -0,0 +1,198 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+// Upstream side of the Semtech UDP protocol: rxpk and stat JSON, server
+// list, name resolution and datagram fan-out. Nothing in here touches the
+// radio, so it also builds into the benchmarks.
+
+#ifndef _UPLINK_H
+#define _UPLINK_H
+
+#include "sx127x.h"
+#include "trace.h"
+
+#include <netinet/in.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#define BASE64_MAX_LENGTH 341
+
+#define BUFLEN 2048  //Max length of buffer
+
+#define PROTOCOL_VERSION  1   // unless a server is set to version 2
+#define PROTOCOL_VERSION_2  2
+#define PKT_PUSH_DATA 0
+#define PKT_PUSH_ACK  1
+#define PKT_PULL_DATA 2
+
+#define PKT_PULL_RESP 3
+#define PKT_PULL_ACK  4
+#define PKT_TX_ACK    5       // version 2
+
+#define HEADER_SIZE   12  // version, token, type, gateway EUI
+
+#define TX_BUFF_SIZE    2048
+#define STATUS_SIZE     1024
+
+class Mqtt;
+class Station;
+
+typedef struct Server
+{
+    std::string address;
+    uint16_t port;
+    uint8_t version;          // protocol version of the datagrams to and from it
+    bool enabled;
+    bool paused;              // skipped by SendUdp(), from the control socket
+    bool resolved;
+    struct sockaddr_in addr;  // last resolved address
+    Station* station;         // Basics Station backend, NULL otherwise
+    Mqtt* mqtt;               // MQTT backend, NULL otherwise
+} Server_t;
+
+// Servers
+extern std::vector<Server_t> servers;
+
+// UDP socket shared by all servers
+extern int sock_up;
+
+// MHDR: MType in the top 3 bits, Major in the low 2
+#define MHDR_MTYPE_SHIFT        5
+#define MHDR_MAJOR_MASK         0x03
+#define MTYPE_JOIN_REQUEST      0
+#define MTYPE_UNCONFIRMED_UP    2
+#define MTYPE_CONFIRMED_UP      4
+#define MTYPE_REJOIN_REQUEST    6
+
+// MHDR, JoinEUI, DevEUI, DevNonce and MIC; MHDR, FHDR and MIC
+#define JOIN_REQUEST_SIZE       23
+#define DATA_UP_MIN_SIZE        12
+// MHDR, type 1, JoinEUI, DevEUI, RJcount1 and MIC
+#define REJOIN_TYPE1_SIZE       24
+
+// Uplink classes by LoRaWAN MHDR, in priority order: the network server
+// has to answer joins and confirmed uplinks within the RX1/RX2 windows
+typedef enum UplinkClasses
+{
+    UPLINK_JOIN,                // JoinRequest and RejoinRequest
+    UPLINK_CONFIRMED,           // ConfirmedDataUp
+    UPLINK_UNCONFIRMED,         // UnconfirmedDataUp
+    UPLINK_PROPRIETARY,         // and anything else, e.g. CRC errors
+    UPLINK_CLASSES
+} UplinkClass_t;
+
+extern const char* const uplink_class_names[UPLINK_CLASSES];
+
+// txpk_ack.error of protocol version 2, as in the Semtech packet forwarder
+typedef enum TxErrors
+{
+    TX_ERROR_NONE,
+    TX_ERROR_TOO_LATE,          // tmst closer than TXPK_MIN_LEAD or past
+    TX_ERROR_TOO_EARLY,         // tmst further than TXPK_MAX_ADVANCE
+    TX_ERROR_COLLISION_PACKET,
+    TX_ERROR_COLLISION_BEACON,
+    TX_ERROR_TX_FREQ,
+    TX_ERROR_TX_POWER,
+    TX_ERROR_GPS_UNLOCKED,      // tmms, there is no GPS
+    TX_ERRORS
+} TxError_t;
+
+extern const char* const tx_error_names[TX_ERRORS];
+
+// Class of a frame from its MHDR, UPLINK_PROPRIETARY for anything that is
+// not a LoRaWAN R1 uplink of a plausible size
+UplinkClass_t ClassifyUplink(const uint8_t* payload, uint8_t size);
+
+// A received frame, as reported in an rxpk object
+struct RxPkt
+{
+    uint32_t tmst;
+    const Sx127xConf* conf;
+    Sx127xPktStatus status;
+    const char* codr;
+    const uint8_t* payload;
+    uint8_t size;
+    uint8_t chan;               // channel of the plan, see channels.h
+};
+
+// Statistics, as reported in a stat object
+struct StatReport
+{
+    const char* time;
+    double lati;
+    double longi;
+    int alti;
+    uint32_t rxnb;
+    uint32_t rxok;
+    uint32_t rxfw;
+    double ackr;
+    uint32_t dwnb;
+    uint32_t txnb;
+    const char* pfrm;
+    const char* mail;
+    const char* desc;
+};
+
+// Write {"rxpk":[...]} to out, returns its length or -1 if it does not fit.
+// trace, if not NULL, gets the base64 and JSON tracepoints.
+int BuildRxpkJson(const RxPkt& pkt, char* out, int max_len, PacketTrace* trace);
+
+// Write {"stat":{...}} to out, returns its length or -1 if it does not fit
+int BuildStatJson(const StatReport& stat, char* out, int max_len);
+
+// EUI of an interface, the MAC address with FFFE in the middle. ifname NULL
+// or empty picks the first interface, by index, that is not a loopback and
+// has an Ethernet-like MAC, preferring the ones that are up. Returns false
+// if there is none, found gets the interface name.
+bool InterfaceEui(int sock, const char* ifname, uint64_t* eui, char* found, size_t size);
+
+// Set the gateway EUI once, WriteHeader() copies it from then on
+void SetGatewayEui(uint64_t eui);
+
+// Write the 12-byte header of a type datagram with a random token into buff
+void WriteHeader(char* buff, uint8_t type);
+
+// Returns false, leaving p_sin alone, if p_hostname does not resolve
+bool SolveHostname(const char* p_hostname, uint16_t port, struct sockaddr_in* p_sin);
+
+// Resolve every enabled Semtech UDP server, SendUdp() only uses the result. Servers that
+// never resolved are skipped, the others keep their last good address.
+void ResolveServers();
+
+// SendUdp() server mask for datagrams every server gets
+#define SERVERS_ALL   0xffffffff
+
+// Send to every enabled Semtech UDP server in server_mask (bit i for servers[i]) that is not paused, returns
+// the number of servers reached, or -1 when the socket buffer was full for all of them: nothing
+// went out, try again later. trace, if not NULL, gets a tracepoint per server.
+int SendUdp(char *msg, int length, uint32_t server_mask, PacketTrace* trace);
+
+// rxpk and txpk tmst: the system time in microseconds, wrapping every
+// 71 minutes
+uint32_t TmstNow();
+
+// Outcome of the txpk object of a PULL_RESP for this gateway, at tmst now,
+// or -1 if it is not a txpk that can be sent at all. There is no transmit
+// path, so a txpk without any other problem gets TX_ERROR_TX_FREQ: no
+// transmitter on its frequency.
+int CheckTxpk(char* json, uint32_t now);
+
+// Drain what the servers sent without blocking: PUSH_ACKs are counted,
+// PULL_RESPs answered with a TX_ACK when the server speaks version 2
+void ReceiveDownstream();
+
+// Prometheus uplink queue depth, sent and shed counts per class and txpk
+// outcomes, for MetricsAddRenderer()
+void UplinkRenderMetrics(std::string& out);
+
+#endif
@@ -0,0 +1,107 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+#include "watchdog.h"
+
+#include <cstdio>
+
+// Silence is abnormal after this many average gaps...
+#define SILENCE_GAP_FACTOR   20
+// ...but never before this long, in ms
+#define SILENCE_MIN          (10 * 60 * 1000)
+// and a quiet site is not reprogrammed more than once in this long
+#define SILENCE_MAX          (24 * 60 * 60 * 1000)
+
+RadioWatchdog::RadioWatchdog()
+  : radio_(NULL), conf_(NULL), check_interval_(0), last_check_(0),
+    last_packet_(0), mean_gap_(0), silence_limit_(SILENCE_MIN),
+    recoveries_(0), register_faults_(0), silence_faults_(0)
+{
+}
+
+void RadioWatchdog::Start(Sx127x* radio, const Sx127xConf* conf, uint32_t check_interval, uint32_t now)
+{
+  radio_ = radio;
+  conf_ = conf;
+  check_interval_ = check_interval;
+  last_check_ = now;
+  last_packet_ = now;
+
+  // No gap to go by before the first frame, a radio deaf from the start is
+  // still reprogrammed once the ceiling is reached
+  if (mean_gap_ == 0) {
+    silence_limit_ = SILENCE_MAX;
+  }
+}
+
+void RadioWatchdog::PacketReceived(uint32_t now)
+{
+  uint32_t gap = now - last_packet_;
+  last_packet_ = now;
+
+  // Exponential moving average, weight 1/8
+  mean_gap_ = mean_gap_ == 0 ? gap : mean_gap_ - mean_gap_ / 8 + gap / 8;
+
+  silence_limit_ = mean_gap_ * SILENCE_GAP_FACTOR;
+  if (silence_limit_ < SILENCE_MIN) {
+    silence_limit_ = SILENCE_MIN;
+  } else if (silence_limit_ > SILENCE_MAX) {
+    silence_limit_ = SILENCE_MAX;
+  }
+}
+
+bool RadioWatchdog::Poll(uint32_t now)
+{
+  if (check_interval_ == 0 || now - last_check_ < check_interval_) {
+    return false;
+  }
+  last_check_ = now;
+
+  uint8_t addr, value;
+  if (!radio_->Verify(&addr, &value)) {
+    printf("Radio watchdog: register 0x%02X reads 0x%02X, expected 0x%02X\n",
+           addr, value, radio_->Shadow(addr));
+    register_faults_++;
+    Recover();
+    return true;
+  }
+
+  if (now - last_packet_ >= silence_limit_) {
+    printf("Radio watchdog: nothing received for %u s\n", (now - last_packet_) / 1000);
+    silence_faults_++;
+    Recover();
+
+    // Back off in case the site is just quiet
+    last_packet_ = now;
+    if (silence_limit_ < SILENCE_MAX / 2) {
+      silence_limit_ *= 2;
+    } else {
+      silence_limit_ = SILENCE_MAX;
+    }
+    return true;
+  }
+
+  return false;
+}
+
+void RadioWatchdog::Recover()
+{
+  radio_->Setup(*conf_);
+  recoveries_++;
+
+  uint8_t addr, value;
+  if (!radio_->Verify(&addr, &value)) {
+    printf("Radio watchdog: reinitialization failed at register 0x%02X\n", addr);
+  } else {
+    printf("Radio watchdog: radio reinitialized (%u recoveries)\n", recoveries_);
+  }
+  fflush(stdout);
+}
@@ -0,0 +1,63 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+// Radio health watchdog.
+//
+// Every check interval the mode, frequency and modem registers are read
+// back and compared with the driver shadow. Independently, a receive
+// silence much longer than the usual gap between frames, or a day without
+// any frame since startup, is treated as a hung receiver. Either way the
+// radio is reprogrammed in place, without the reset pulses of startup and
+// without touching the network side.
+
+#ifndef _WATCHDOG_H
+#define _WATCHDOG_H
+
+#include "sx127x.h"
+
+#include <stdint.h>
+
+class RadioWatchdog
+{
+public:
+    RadioWatchdog();
+
+    // check_interval in ms, 0 disables the watchdog
+    void Start(Sx127x* radio, const Sx127xConf* conf, uint32_t check_interval, uint32_t now);
+
+    // Any frame, even a CRC error, proves the receiver is alive
+    void PacketReceived(uint32_t now);
+
+    // Call from the main loop, returns true when the radio was reinitialized
+    bool Poll(uint32_t now);
+
+    uint32_t recoveries() const { return recoveries_; }
+    uint32_t register_faults() const { return register_faults_; }
+    uint32_t silence_faults() const { return silence_faults_; }
+
+private:
+    void Recover();
+
+    Sx127x* radio_;
+    const Sx127xConf* conf_;
+    uint32_t check_interval_;
+    uint32_t last_check_;
+
+    uint32_t last_packet_;
+    uint32_t mean_gap_;         // moving average of the gap between frames, in ms
+    uint32_t silence_limit_;    // doubled after each silence recovery, SILENCE_MAX before any frame
+
+    uint32_t recoveries_;
+    uint32_t register_faults_;
+    uint32_t silence_faults_;
+};
+
+#endif
@@ -0,0 +1,479 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+#include "websocket.h"
+
+#include "base64.h"
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#define WS_GUID             "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WS_RX_SIZE          (WEBSOCKET_MAX_MESSAGE + 16)
+#define WS_HANDSHAKE_SIZE   1024
+
+#define WS_FIN              0x80
+#define WS_MASKED           0x80
+#define WS_OP_CONTINUATION  0x0
+#define WS_OP_TEXT          0x1
+#define WS_OP_BINARY        0x2
+#define WS_OP_CLOSE         0x8
+#define WS_OP_PING          0x9
+#define WS_OP_PONG          0xA
+
+/*******************************************************************************
+ *
+ * SHA-1 (FIPS 180-4), for Sec-WebSocket-Accept only
+ *
+ *******************************************************************************/
+
+static uint32_t Rol(uint32_t x, int n)
+{
+  return (x << n) | (x >> (32 - n));
+}
+
+static void Sha1Block(uint32_t h[5], const uint8_t block[64])
+{
+  uint32_t w[80];
+  for (int i = 0; i < 16; i++) {
+    w[i] = (uint32_t)block[4 * i] << 24 | block[4 * i + 1] << 16 | block[4 * i + 2] << 8 | block[4 * i + 3];
+  }
+  for (int i = 16; i < 80; i++) {
+    w[i] = Rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+  }
+  uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+  for (int i = 0; i < 80; i++) {
+    uint32_t f, k;
+    if (i < 20) {
+      f = (b & c) | (~b & d);
+      k = 0x5A827999;
+    } else if (i < 40) {
+      f = b ^ c ^ d;
+      k = 0x6ED9EBA1;
+    } else if (i < 60) {
+      f = (b & c) | (b & d) | (c & d);
+      k = 0x8F1BBCDC;
+    } else {
+      f = b ^ c ^ d;
+      k = 0xCA62C1D6;
+    }
+    uint32_t t = Rol(a, 5) + f + e + k + w[i];
+    e = d;
+    d = c;
+    c = Rol(b, 30);
+    b = a;
+    a = t;
+  }
+  h[0] += a;
+  h[1] += b;
+  h[2] += c;
+  h[3] += d;
+  h[4] += e;
+}
+
+static void Sha1(const uint8_t* data, size_t length, uint8_t digest[20])
+{
+  uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+  uint8_t block[64];
+  size_t i = 0;
+  for (; i + 64 <= length; i += 64) {
+    Sha1Block(h, data + i);
+  }
+  // Last bytes, 0x80, zeros and the bit length, in one or two blocks
+  size_t rest = length - i;
+  memset(block, 0, sizeof(block));
+  memcpy(block, data + i, rest);
+  block[rest] = 0x80;
+  if (rest >= 56) {
+    Sha1Block(h, block);
+    memset(block, 0, sizeof(block));
+  }
+  uint64_t bits = (uint64_t)length * 8;
+  for (int j = 0; j < 8; j++) {
+    block[63 - j] = (uint8_t)(bits >> (8 * j));
+  }
+  Sha1Block(h, block);
+  for (int j = 0; j < 20; j++) {
+    digest[j] = (uint8_t)(h[j / 4] >> (24 - 8 * (j % 4)));
+  }
+}
+
+void WebSocketAccept(const char* key, char* out, size_t size)
+{
+  char text[128];
+  int length = snprintf(text, sizeof(text), "%s" WS_GUID, key);
+  uint8_t digest[20];
+  Sha1((const uint8_t*)text, length, digest);
+  bin_to_b64(digest, sizeof(digest), out, (int)size);
+}
+
+/*******************************************************************************
+ *
+ * Client
+ *
+ *******************************************************************************/
+
+WebSocket::WebSocket()
+  : fd_(-1), rx_used_(0), rx_taken_(0), message_length_(0), fragmented_(false), last_rx_(0)
+{
+  rx_ = new uint8_t[WS_RX_SIZE];
+  message_ = new char[WEBSOCKET_MAX_MESSAGE + 1];
+}
+
+WebSocket::~WebSocket()
+{
+  Close();
+  delete[] rx_;
+  delete[] message_;
+}
+
+void WebSocket::Close()
+{
+  if (fd_ != -1) {
+    close(fd_);
+    fd_ = -1;
+  }
+  rx_used_ = 0;
+  rx_taken_ = 0;
+  message_length_ = 0;
+  fragmented_ = false;
+}
+
+int TcpConnect(const char* host, uint16_t port, int timeout_ms, char* error, size_t size)
+{
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  char service[8];
+  snprintf(service, sizeof(service), "%hu", port);
+
+  struct addrinfo* result;
+  int err = getaddrinfo(host, service, &hints, &result);
+  if (err != 0) {
+    snprintf(error, size, "%s: %s", host, gai_strerror(err));
+    return -1;
+  }
+
+  int fd = -1;
+  for (struct addrinfo* rp = result; rp != NULL; rp = rp->ai_next) {
+    fd = socket(rp->ai_family, rp->ai_socktype | SOCK_CLOEXEC, rp->ai_protocol);
+    if (fd == -1) {
+      continue;
+    }
+    int flags = fcntl(fd, F_GETFL);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    int status = connect(fd, rp->ai_addr, rp->ai_addrlen) == 0 ? 0 : errno;
+    if (status == EINPROGRESS) {
+      struct pollfd pfd = { fd, POLLOUT, 0 };
+      socklen_t len = sizeof(status);
+      status = ETIMEDOUT;
+      if (poll(&pfd, 1, timeout_ms) == 1) {
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &status, &len);
+      }
+    }
+    if (status == 0) {
+      fcntl(fd, F_SETFL, flags);
+      break;
+    }
+    snprintf(error, size, "%s:%hu: %s", host, port, strerror(status));
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(result);
+  if (fd != -1) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+  return fd;
+}
+
+bool WebSocket::Connect(const char* host, uint16_t port, const char* path, int timeout_ms, char* error, size_t size)
+{
+  Close();
+  fd_ = TcpConnect(host, port, timeout_ms, error, size);
+  if (fd_ == -1) {
+    return false;
+  }
+
+  uint8_t nonce[16];
+  for (size_t i = 0; i < sizeof(nonce); i++) {
+    nonce[i] = (uint8_t)rand();
+  }
+  char key[32];
+  bin_to_b64(nonce, sizeof(nonce), key, sizeof(key));
+
+  char request[WS_HANDSHAKE_SIZE];
+  int length = snprintf(request, sizeof(request),
+                        "GET %s HTTP/1.1\r\n"
+                        "Host: %s:%hu\r\n"
+                        "Upgrade: websocket\r\n"
+                        "Connection: Upgrade\r\n"
+                        "Sec-WebSocket-Key: %s\r\n"
+                        "Sec-WebSocket-Version: 13\r\n"
+                        "\r\n", path, host, port, key);
+  if (length >= (int)sizeof(request) || !WriteAll(fd_, (const uint8_t*)request, length)) {
+    snprintf(error, size, "%s:%hu: sending the upgrade request failed", host, port);
+    Close();
+    return false;
+  }
+
+  // Read the response headers, frames may follow right behind them
+  char* response = (char*)rx_;
+  char* end = NULL;
+  while (end == NULL) {
+    struct pollfd pfd = { fd_, POLLIN, 0 };
+    ssize_t n = 0;
+    if (rx_used_ < WS_HANDSHAKE_SIZE && poll(&pfd, 1, timeout_ms) == 1) {
+      n = read(fd_, rx_ + rx_used_, WS_HANDSHAKE_SIZE - rx_used_);
+    }
+    if (n <= 0) {
+      snprintf(error, size, "%s:%hu%s: no upgrade response", host, port, path);
+      Close();
+      return false;
+    }
+    rx_used_ += n;
+    rx_[rx_used_] = '\0';
+    end = strstr(response, "\r\n\r\n");
+  }
+  *end = '\0';
+
+  char accept[32];
+  WebSocketAccept(key, accept, sizeof(accept));
+  const char* field = strcasestr(response, "\r\nSec-WebSocket-Accept:");
+  if (strncmp(response, "HTTP/1.1 101", 12) != 0) {
+    char* eol = strstr(response, "\r\n");
+    if (eol != NULL) {
+      *eol = '\0';
+    }
+    snprintf(error, size, "%s:%hu%s: %s", host, port, path, response);
+    Close();
+    return false;
+  }
+  if (field == NULL) {
+    snprintf(error, size, "%s:%hu%s: no Sec-WebSocket-Accept", host, port, path);
+    Close();
+    return false;
+  }
+  field += strlen("\r\nSec-WebSocket-Accept:");
+  field += strspn(field, " \t");
+  if (strncmp(field, accept, strlen(accept)) != 0) {
+    snprintf(error, size, "%s:%hu%s: wrong Sec-WebSocket-Accept", host, port, path);
+    Close();
+    return false;
+  }
+
+  size_t header_length = end + 4 - response;
+  memmove(rx_, rx_ + header_length, rx_used_ - header_length);
+  rx_used_ -= header_length;
+  last_rx_ = MillisNow();
+  return true;
+}
+
+bool WriteAll(int fd, const uint8_t* data, size_t length)
+{
+  while (length > 0) {
+    ssize_t n = send(fd, data, length, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data += n;
+    length -= n;
+  }
+  return true;
+}
+
+// Client frames are masked, the header and the masked payload go out in
+// one write
+bool WebSocket::SendFrame(uint8_t opcode, const uint8_t* payload, size_t length)
+{
+  if (fd_ == -1 || length > WEBSOCKET_MAX_MESSAGE) {
+    return false;
+  }
+  uint8_t frame[14 + WEBSOCKET_MAX_MESSAGE];
+  size_t header = 2;
+  frame[0] = WS_FIN | opcode;
+  if (length < 126) {
+    frame[1] = WS_MASKED | (uint8_t)length;
+  } else {
+    frame[1] = WS_MASKED | 126;
+    frame[2] = (uint8_t)(length >> 8);
+    frame[3] = (uint8_t)length;
+    header = 4;
+  }
+  uint8_t* mask = frame + header;
+  for (int i = 0; i < 4; i++) {
+    mask[i] = (uint8_t)rand();
+  }
+  header += 4;
+  for (size_t i = 0; i < length; i++) {
+    frame[header + i] = payload[i] ^ mask[i % 4];
+  }
+  if (!WriteAll(fd_, frame, header + length)) {
+    Close();
+    return false;
+  }
+  return true;
+}
+
+bool WebSocket::SendText(const char* text, size_t length)
+{
+  return SendFrame(WS_OP_TEXT, (const uint8_t*)text, length);
+}
+
+bool WebSocket::SendPing()
+{
+  return SendFrame(WS_OP_PING, NULL, 0);
+}
+
+WebSocketResult_t WebSocket::ParseFrame(char** p_text, size_t* p_length)
+{
+  if (rx_used_ < 2) {
+    return WS_NONE;
+  }
+  uint8_t opcode = rx_[0] & 0x0F;
+  bool fin = (rx_[0] & WS_FIN) != 0;
+  bool masked = (rx_[1] & WS_MASKED) != 0;
+  uint64_t length = rx_[1] & 0x7F;
+  size_t header = 2;
+  if (length == 126) {
+    if (rx_used_ < 4) {
+      return WS_NONE;
+    }
+    length = (uint64_t)rx_[2] << 8 | rx_[3];
+    header = 4;
+  } else if (length == 127) {
+    if (rx_used_ < 10) {
+      return WS_NONE;
+    }
+    length = 0;
+    for (int i = 0; i < 8; i++) {
+      length = length << 8 | rx_[2 + i];
+    }
+    header = 10;
+  }
+  if (length > WEBSOCKET_MAX_MESSAGE) {
+    fprintf(stderr, "websocket: %llu byte frame, closing\n", (unsigned long long)length);
+    Close();
+    return WS_CLOSED;
+  }
+  const uint8_t* mask = rx_ + header;
+  if (masked) {
+    header += 4;
+  }
+  if (rx_used_ < header + length) {
+    return WS_NONE;
+  }
+  uint8_t* payload = rx_ + header;
+  if (masked) {
+    for (size_t i = 0; i < length; i++) {
+      payload[i] ^= mask[i % 4];
+    }
+  }
+  rx_taken_ = header + length;
+
+  switch (opcode) {
+    case WS_OP_PING:
+      return SendFrame(WS_OP_PONG, payload, length) ? WS_NONE : WS_CLOSED;
+    case WS_OP_CLOSE:
+      SendFrame(WS_OP_CLOSE, payload, length < 2 ? length : 2);
+      Close();
+      return WS_CLOSED;
+    case WS_OP_TEXT:
+    case WS_OP_BINARY:
+      message_length_ = 0;
+      fragmented_ = opcode == WS_OP_TEXT;
+      break;
+    case WS_OP_CONTINUATION:
+      break;
+    default:
+      return WS_NONE;
+  }
+  if (!fragmented_) {
+    return WS_NONE;             // binary messages are not used
+  }
+  if (message_length_ + length > WEBSOCKET_MAX_MESSAGE) {
+    fprintf(stderr, "websocket: message over %d bytes, closing\n", WEBSOCKET_MAX_MESSAGE);
+    Close();
+    return WS_CLOSED;
+  }
+  memcpy(message_ + message_length_, payload, length);
+  message_length_ += length;
+  if (!fin) {
+    return WS_NONE;
+  }
+  fragmented_ = false;
+  message_[message_length_] = '\0';
+  *p_text = message_;
+  *p_length = message_length_;
+  return WS_MESSAGE;
+}
+
+int64_t MillisNow()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+WebSocketResult_t WebSocket::Receive(char** p_text, size_t* p_length, int timeout_ms)
+{
+  int64_t deadline = MillisNow() + timeout_ms;
+  for (;;) {
+    // Drop the frame handed out by the previous call
+    if (rx_taken_ != 0) {
+      memmove(rx_, rx_ + rx_taken_, rx_used_ - rx_taken_);
+      rx_used_ -= rx_taken_;
+      rx_taken_ = 0;
+    }
+    if (fd_ == -1) {
+      return WS_CLOSED;
+    }
+    WebSocketResult_t result = ParseFrame(p_text, p_length);
+    if (result != WS_NONE) {
+      return result;
+    }
+    if (rx_taken_ != 0) {
+      continue;                 // a control frame or fragment, look for more
+    }
+
+    // The rest of a frame may be on its way
+    int64_t left = deadline - MillisNow();
+    struct pollfd pfd = { fd_, POLLIN, 0 };
+    int ready = poll(&pfd, 1, left > 0 ? (int)left : 0);
+    if (ready == 0) {
+      return WS_NONE;
+    }
+    ssize_t n = ready < 0 ? (errno == EINTR ? 0 : -1) : read(fd_, rx_ + rx_used_, WS_RX_SIZE - rx_used_);
+    if (n < 0 || (ready > 0 && n == 0)) {
+      Close();
+      return WS_CLOSED;
+    }
+    rx_used_ += n;
+    if (n > 0) {
+      last_rx_ = MillisNow();
+    }
+  }
+}
@@ -0,0 +1,92 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+// Minimal websocket client (RFC 6455) over plain TCP, for the Basics
+// Station backend: text messages only, fragmented ones reassembled, pings
+// answered. Blocking, for a thread of its own. No TLS, ws:// only.
+
+#ifndef _WEBSOCKET_H
+#define _WEBSOCKET_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define WEBSOCKET_MAX_MESSAGE   32768   // longest text message taken, router_config included
+
+typedef enum WebSocketResults
+{
+    WS_NONE,                    // nothing complete within the timeout
+    WS_MESSAGE,
+    WS_CLOSED                   // by the server, or on an error
+} WebSocketResult_t;
+
+class WebSocket
+{
+public:
+    WebSocket();
+    ~WebSocket();
+
+    // Connect to host:port and upgrade on path, within timeout_ms. Returns
+    // false with the reason in error.
+    bool Connect(const char* host, uint16_t port, const char* path, int timeout_ms, char* error, size_t size);
+
+    void Close();
+    bool connected() const { return fd_ != -1; }
+    int fd() const { return fd_; }
+
+    // Send a text message, blocking while the socket is full. False, and
+    // closed, on error.
+    bool SendText(const char* text, size_t length);
+
+    // Send a ping, the pong shows up in last_received() only
+    bool SendPing();
+
+    // MillisNow() when bytes last came in, or of the upgrade
+    int64_t last_received() const { return last_rx_; }
+
+    // Wait up to timeout_ms for a complete text message. p_text is NUL
+    // terminated and valid until the next call, which may parse it in place.
+    WebSocketResult_t Receive(char** p_text, size_t* p_length, int timeout_ms);
+
+private:
+    bool SendFrame(uint8_t opcode, const uint8_t* payload, size_t length);
+
+    // Take one frame out of rx_, WS_NONE if it is not all there yet
+    WebSocketResult_t ParseFrame(char** p_text, size_t* p_length);
+
+    int fd_;
+    uint8_t* rx_;               // bytes read, not parsed yet
+    size_t rx_used_;
+    size_t rx_taken_;           // of a frame already returned
+    char* message_;             // text being reassembled
+    size_t message_length_;
+    bool fragmented_;
+    int64_t last_rx_;
+};
+
+// TCP connection to host:port within timeout_ms, blocking, with
+// TCP_NODELAY. Returns the socket, or -1 with the reason in error. The MQTT
+// backend connects with it too.
+int TcpConnect(const char* host, uint16_t port, int timeout_ms, char* error, size_t size);
+
+// Write all of data to the socket fd, blocking, without SIGPIPE. False on
+// an error.
+bool WriteAll(int fd, const uint8_t* data, size_t length);
+
+// CLOCK_MONOTONIC in milliseconds
+int64_t MillisNow();
+
+// Upgrade helpers, exposed for the stand-in server of the simulator
+
+// Sec-WebSocket-Accept for key: base64 of SHA-1 of key and the RFC GUID
+void WebSocketAccept(const char* key, char* out, size_t size);
+
+#endif